@@ -28,3 +28,29 @@ pub struct PatchListRecord {
     pub name: String,
     pub status: PatchStatus,
 }
+
+#[derive(Debug, Serialize, Deserialize)]
+pub struct PatchSnapshotRecord {
+    pub uuid: String,
+    pub name: String,
+    pub status: PatchStatus,
+    pub process_num: usize,
+}
+
+/// Cost of a patch operation on one process, as reported by upatch-manage
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct PatchTelemetryRecord {
+    pub seq: u64,
+    pub timestamp: u64, // Seconds since unix epoch
+    pub uuid: String,   // Patches of one operation are joined by ','
+    pub command: String,
+    pub pid: i32,
+    pub result: i32, // 0 on success, errno otherwise
+    pub attach_us: u64,
+    pub freeze_us: u64,
+    pub stopped_us: u64,
+    pub total_us: u64,
+    pub mem_written: u64,
+    pub remote_syscalls: u64,
+    pub retries: u64,
+}
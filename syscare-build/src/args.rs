@@ -28,6 +28,8 @@ const DEFAULT_PATCH_DESCRIPTION: &str = "(none)";
 const DEFAULT_WORK_DIR: &str = "/var/run/syscare";
 const DEFAULT_BUILD_ROOT: &str = ".";
 const DEFAULT_OUTPUT_DIR: &str = ".";
+const DEFAULT_COMPRESS_LEVEL: &str = "3";
+const MAX_COMPRESS_LEVEL: u32 = 19;
 
 lazy_static! {
     static ref DEFAULT_BUILD_JOBS: String = os::cpu::num().to_string();
@@ -89,6 +91,11 @@ pub struct Arguments {
     #[clap(long, default_value = DEFAULT_BUILD_ROOT)]
     pub build_root: PathBuf,
 
+    /// Build cache directory, keeps prepared packages and original builds of user patches.
+    /// Builds run in it instead of the build root
+    #[clap(long)]
+    pub build_cache: Option<PathBuf>,
+
     /// Output directory
     #[clap(short, long, default_value = DEFAULT_OUTPUT_DIR)]
     pub output: PathBuf,
@@ -97,6 +104,14 @@ pub struct Arguments {
     #[clap(short, long, default_value = &DEFAULT_BUILD_JOBS)]
     pub jobs: usize,
 
+    /// Zstd compression level of patch package payload, from 1 to 19
+    #[clap(long, default_value = DEFAULT_COMPRESS_LEVEL)]
+    pub compress_level: u32,
+
+    /// Parallel compression threads of patch package payload
+    #[clap(long, default_value = &DEFAULT_BUILD_JOBS)]
+    pub compress_threads: usize,
+
     /// Skip compiler version check (not recommended)
     #[clap(long)]
     pub skip_compiler_check: bool,
@@ -114,9 +129,12 @@ impl Arguments {
     pub fn new() -> Result<Self> {
         let mut args = Self::parse().normalize_path().and_then(Self::check)?;
 
-        args.build_root = args
-            .build_root
-            .join(format!("syscare-build.{}", os::process::id()));
+        // Cached builds run in a locked build root under the build cache instead
+        if args.build_cache.is_none() {
+            args.build_root = args
+                .build_root
+                .join(format!("syscare-build.{}", os::process::id()));
+        }
 
         Ok(args)
     }
@@ -134,6 +152,9 @@ impl Arguments {
         self.work_dir = fs::normalize(&self.work_dir)?;
         self.build_root = fs::normalize(&self.build_root)?;
         self.output = fs::normalize(&self.output)?;
+        if let Some(build_cache) = &mut self.build_cache {
+            *build_cache = fs::normalize(&build_cache)?;
+        }
 
         Ok(self)
     }
@@ -178,6 +199,17 @@ impl Arguments {
         );
 
         ensure!(self.jobs != 0, "Parallel build job number cannot be zero");
+        ensure!(
+            (1..=MAX_COMPRESS_LEVEL).contains(&self.compress_level),
+            format!(
+                "Compression level should be from 1 to {}",
+                MAX_COMPRESS_LEVEL
+            )
+        );
+        ensure!(
+            self.compress_threads != 0,
+            "Compression thread number cannot be zero"
+        );
 
         Ok(self)
     }
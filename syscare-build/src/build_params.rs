@@ -16,7 +16,10 @@ use std::path::PathBuf;
 
 use syscare_abi::{PackageInfo, PatchFile, PatchType};
 
-use crate::{build_root::BuildRoot, package::PackageBuildRoot};
+use crate::{
+    build_root::BuildRoot,
+    package::{PackageBuildRoot, PayloadCompression},
+};
 
 #[derive(Debug, Clone)]
 pub struct BuildEntry {
@@ -38,7 +41,9 @@ pub struct BuildParameters {
     pub patch_arch: String,
     pub patch_description: String,
     pub patch_files: Vec<PatchFile>,
+    pub build_cache: Option<PathBuf>,
     pub jobs: usize,
+    pub compression: PayloadCompression,
     pub skip_compiler_check: bool,
     pub skip_cleanup: bool,
     pub verbose: bool,
@@ -64,6 +69,8 @@ impl std::fmt::Display for BuildParameters {
             writeln!(f, "kernel_spec:         {}", k.build_spec.display())?;
         }
         writeln!(f, "jobs:                {}", self.jobs)?;
+        writeln!(f, "compress_level:      {}", self.compression.level)?;
+        writeln!(f, "compress_threads:    {}", self.compression.threads)?;
         writeln!(f, "skip_compiler_check: {}", self.skip_compiler_check)?;
         writeln!(f, "skip_cleanup:        {}", self.skip_cleanup)?;
         writeln!(f, "verbose:             {}", self.verbose)?;
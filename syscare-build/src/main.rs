@@ -12,32 +12,41 @@
  * See the Mulan PSL v2 for more details.
  */
 
-use std::{process, sync::Arc};
+use std::{
+    path::{Path, PathBuf},
+    process,
+    sync::Arc,
+};
 
 use anyhow::{bail, ensure, Context, Result};
 use flexi_logger::{
     DeferredNow, Duplicate, FileSpec, LogSpecification, Logger, LoggerHandle, WriteMode,
 };
 use lazy_static::lazy_static;
-use log::{error, info, LevelFilter, Record};
+use log::{debug, error, info, warn, LevelFilter, Record};
 
 use syscare_abi::{PackageInfo, PackageType, PatchInfo, PatchType};
-use syscare_common::{fs, os};
+use syscare_common::{
+    fs::{self, FileLock, FileLockType},
+    os,
+};
 
 mod args;
 mod build_params;
 mod build_root;
 mod package;
 mod patch;
+mod prepare_cache;
 
 use args::Arguments;
 use build_params::{BuildEntry, BuildParameters};
 use build_root::BuildRoot;
 use package::{
     PackageBuildRoot, PackageBuilderFactory, PackageFormat, PackageImpl, PackageSpecBuilderFactory,
-    PackageSpecWriterFactory,
+    PackageSpecWriterFactory, PayloadCompression,
 };
 use patch::{PatchBuilderFactory, PatchHelper, PatchMetadata, PATCH_FILE_EXT};
+use prepare_cache::PrepareCache;
 
 const CLI_NAME: &str = "syscare build";
 const CLI_VERSION: &str = env!("CARGO_PKG_VERSION");
@@ -45,6 +54,8 @@ const CLI_ABOUT: &str = env!("CARGO_PKG_DESCRIPTION");
 const CLI_UMASK: u32 = 0o022;
 
 const LOG_FILE_NAME: &str = "build";
+const CACHED_BUILD_ROOT_PREFIX: &str = "build";
+const CACHED_BUILD_ROOT_NUM: usize = 16;
 const KERNEL_PKG_NAME: &str = "kernel";
 
 lazy_static! {
@@ -55,6 +66,7 @@ struct SyscareBuild {
     args: Arguments,
     logger: LoggerHandle,
     build_root: BuildRoot,
+    _build_root_lock: Option<FileLock>,
 }
 
 /* Initialization */
@@ -67,11 +79,45 @@ impl SyscareBuild {
         write!(w, "{}", &record.args())
     }
 
+    /*
+     * Cached objects refer to the build path, which has to be stable across builds.
+     * Each build holds one of the numbered build roots under the cache by flock,
+     * thus concurrent builds never share a build root, while a lone build always
+     * reuses the same one. The build root itself is not cached, leftovers of the
+     * previous holder are dropped.
+     */
+    fn lock_cached_build_root(cache_root: &Path) -> Result<(PathBuf, Option<FileLock>)> {
+        fs::create_dir_all(cache_root)?;
+
+        for index in 0..CACHED_BUILD_ROOT_NUM {
+            let build_root = cache_root.join(format!("{}.{}", CACHED_BUILD_ROOT_PREFIX, index));
+            let lock_file = cache_root.join(format!("{}.{}.lock", CACHED_BUILD_ROOT_PREFIX, index));
+            if let Ok(lock) = FileLock::new(&lock_file, FileLockType::Exclusive) {
+                if build_root.exists() {
+                    fs::remove_dir_all(&build_root)?;
+                }
+                return Ok((build_root, Some(lock)));
+            }
+        }
+
+        // All build roots are busy, original build would not hit the cache
+        let build_root = cache_root.join(format!("syscare-build.{}", os::process::id()));
+        Ok((build_root, None))
+    }
+
     fn new() -> Result<Self> {
         // Initialize arguments & prepare environments
         os::umask::set_umask(CLI_UMASK);
 
-        let args = Arguments::new()?;
+        let mut args = Arguments::new()?;
+        let build_root_lock = match &args.build_cache {
+            Some(cache_root) => {
+                let (build_root, lock) = Self::lock_cached_build_root(cache_root)?;
+                args.build_root = build_root;
+                lock
+            }
+            None => None,
+        };
         let build_root = BuildRoot::new(&args.build_root)?;
         fs::create_dir_all(&args.output)?;
 
@@ -106,6 +152,7 @@ impl SyscareBuild {
             args,
             logger,
             build_root,
+            _build_root_lock: build_root_lock,
         })
     }
 }
@@ -170,6 +217,7 @@ impl SyscareBuild {
         &self,
         pkg_build_root: &PackageBuildRoot,
         pkg_info_list: Vec<PackageInfo>,
+        is_prepared: bool,
     ) -> Result<Vec<BuildEntry>> {
         let pkg_format = PKG_IMPL.format();
         let pkg_spec_dir = &pkg_build_root.specs;
@@ -182,8 +230,10 @@ impl SyscareBuild {
                 .find_spec_file(pkg_spec_dir, pkg_name)
                 .with_context(|| format!("Cannot find spec file of package {}", pkg_name))?;
 
-            PackageBuilderFactory::get_builder(pkg_format, pkg_build_root)
-                .build_prepare(&spec_file)?;
+            if !is_prepared {
+                PackageBuilderFactory::get_builder(pkg_format, pkg_build_root)
+                    .build_prepare(&spec_file)?;
+            }
 
             let source_dir = PKG_IMPL
                 .find_source_directory(pkg_build_dir, pkg_name)
@@ -199,6 +249,27 @@ impl SyscareBuild {
         Ok(build_entries)
     }
 
+    fn payload_compression(&self) -> PayloadCompression {
+        PayloadCompression {
+            level: self.args.compress_level,
+            threads: self.args.compress_threads,
+        }
+    }
+
+    fn open_prepare_cache(&self) -> Option<PrepareCache> {
+        let cache_root = self.args.build_cache.as_deref()?;
+        match PrepareCache::new(&PKG_IMPL, &self.args, cache_root) {
+            Ok(cache) => {
+                debug!("Prepare cache: {}", cache.key());
+                Some(cache)
+            }
+            Err(e) => {
+                warn!("Warning: Prepare cache is disabled, {:#}", e);
+                None
+            }
+        }
+    }
+
     fn parse_build_entry(
         &self,
         build_entries: &[BuildEntry],
@@ -235,18 +306,31 @@ impl SyscareBuild {
         info!("- Collecting package info");
         let pkg_info_list = self.collect_package_info()?;
 
-        info!("- Extracting source package(s)");
-        for pkg_path in &self.args.source {
-            PKG_IMPL
-                .extract_package(pkg_path, &pkg_root.source)
-                .with_context(|| format!("Failed to extract package {}", pkg_path.display()))?;
-        }
+        let prepare_cache = self.open_prepare_cache();
+        let is_prepared = match &prepare_cache {
+            Some(cache) => cache.load(pkg_root).unwrap_or_else(|e| {
+                warn!("Warning: Failed to load prepare cache, {:#}", e);
+                false
+            }),
+            None => false,
+        };
+
+        if is_prepared {
+            info!("- Using prepared package(s) from cache");
+        } else {
+            info!("- Extracting source package(s)");
+            for pkg_path in &self.args.source {
+                PKG_IMPL
+                    .extract_package(pkg_path, &pkg_root.source)
+                    .with_context(|| format!("Failed to extract package {}", pkg_path.display()))?;
+            }
 
-        info!("- Extracting debuginfo package(s)");
-        for pkg_path in &self.args.debuginfo {
-            PKG_IMPL
-                .extract_package(pkg_path, &pkg_root.debuginfo)
-                .with_context(|| format!("Failed to extract package {}", pkg_path.display()))?;
+            info!("- Extracting debuginfo package(s)");
+            for pkg_path in &self.args.debuginfo {
+                PKG_IMPL
+                    .extract_package(pkg_path, &pkg_root.debuginfo)
+                    .with_context(|| format!("Failed to extract package {}", pkg_path.display()))?;
+            }
         }
 
         info!("- Finding package build root");
@@ -256,9 +340,15 @@ impl SyscareBuild {
 
         info!("- Preparing source code");
         let build_entries = self
-            .prepare_source_code(&pkg_build_root, pkg_info_list)
+            .prepare_source_code(&pkg_build_root, pkg_info_list, is_prepared)
             .context("Failed to prepare source code")?;
 
+        if let (Some(cache), false) = (&prepare_cache, is_prepared) {
+            if let Err(e) = cache.store(pkg_root) {
+                warn!("Warning: Failed to save prepare cache, {:#}", e);
+            }
+        }
+
         info!("- Parsing build entry");
         let (patch_type, mut build_entry, kernel_build_entry) = self
             .parse_build_entry(&build_entries)
@@ -304,7 +394,9 @@ impl SyscareBuild {
             patch_description: self.args.patch_description.to_owned(),
             patch_type,
             patch_files,
+            build_cache: self.args.build_cache.to_owned(),
             jobs: self.args.jobs,
+            compression: self.payload_compression(),
             skip_compiler_check: self.args.skip_compiler_check,
             skip_cleanup: self.args.skip_cleanup,
             verbose: self.args.verbose,
@@ -341,8 +433,11 @@ impl SyscareBuild {
             .context("Failed to generate spec file")?;
 
         info!("- Building package");
-        PackageBuilderFactory::get_builder(PKG_IMPL.format(), pkg_build_root)
-            .build_binary_package(&new_spec_file, &self.args.output)
+        PackageBuilderFactory::get_builder(PKG_IMPL.format(), pkg_build_root).build_binary_package(
+            &new_spec_file,
+            &self.args.output,
+            self.payload_compression(),
+        )
     }
 
     fn build_source_package(&self, build_params: &BuildParameters) -> Result<()> {
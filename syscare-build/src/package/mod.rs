@@ -12,7 +12,10 @@
  * See the Mulan PSL v2 for more details.
  */
 
-use std::path::{Path, PathBuf};
+use std::{
+    ffi::OsString,
+    path::{Path, PathBuf},
+};
 
 use anyhow::Result;
 
@@ -37,6 +40,8 @@ trait Package {
     fn parse_package_info(&self, pkg_path: &Path) -> Result<PackageInfo>;
     fn query_package_files(&self, pkg_path: &Path) -> Result<Vec<PathBuf>>;
     fn extract_package(&self, pkg_path: &Path, output_dir: &Path) -> Result<()>;
+    fn query_build_requires(&self, pkg_path: &Path) -> Result<Vec<OsString>>;
+    fn query_providers(&self, capabilities: &[OsString]) -> Result<Vec<OsString>>;
     fn find_build_root(&self, directory: &Path) -> Result<PackageBuildRoot>;
     fn find_spec_file(&self, directory: &Path, pkg_name: &str) -> Result<PathBuf>;
     fn find_source_directory(&self, directory: &Path, pkg_name: &str) -> Result<PathBuf>;
@@ -83,6 +88,16 @@ impl PackageImpl {
             .extract_package(pkg_path.as_ref(), output_dir.as_ref())
     }
 
+    /// Capability names the source package requires to build
+    pub fn query_build_requires<P: AsRef<Path>>(&self, pkg_path: P) -> Result<Vec<OsString>> {
+        self.inner.query_build_requires(pkg_path.as_ref())
+    }
+
+    /// Installed packages providing the capabilities, one entry per capability
+    pub fn query_providers(&self, capabilities: &[OsString]) -> Result<Vec<OsString>> {
+        self.inner.query_providers(capabilities)
+    }
+
     pub fn find_build_root<P: AsRef<Path>>(&self, directory: P) -> Result<PackageBuildRoot> {
         self.inner.find_build_root(directory.as_ref())
     }
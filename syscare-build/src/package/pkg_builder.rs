@@ -20,6 +20,13 @@ use crate::BuildParameters;
 
 use super::{rpm::RpmPackageBuilder, PackageBuildRoot, PackageFormat};
 
+/// Payload compression of binary packages
+#[derive(Debug, Clone, Copy)]
+pub struct PayloadCompression {
+    pub level: u32,
+    pub threads: usize,
+}
+
 pub trait PackageBuilder {
     fn build_prepare(&self, spec_file: &Path) -> Result<()>;
     fn build_source_package(
@@ -28,7 +35,12 @@ pub trait PackageBuilder {
         spec_file: &Path,
         output_dir: &Path,
     ) -> Result<()>;
-    fn build_binary_package(&self, spec_file: &Path, output_dir: &Path) -> Result<()>;
+    fn build_binary_package(
+        &self,
+        spec_file: &Path,
+        output_dir: &Path,
+        compression: PayloadCompression,
+    ) -> Result<()>;
 }
 
 pub struct PackageBuilderFactory;
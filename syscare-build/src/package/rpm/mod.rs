@@ -142,6 +142,36 @@ impl Package for RpmPackage {
             .exit_ok()
     }
 
+    fn query_build_requires(&self, pkg_path: &Path) -> Result<Vec<OsString>> {
+        let requires = Self::query_package_info(pkg_path, "[%{REQUIRENAME}\\n]")?;
+
+        Ok(requires
+            .split('\n')
+            .filter(|name| !name.is_empty())
+            .map(OsString::from)
+            .collect())
+    }
+
+    fn query_providers(&self, capabilities: &[OsString]) -> Result<Vec<OsString>> {
+        if capabilities.is_empty() {
+            return Ok(Vec::new());
+        }
+
+        // Missing capabilities are reported line by line as well, thus exit code is ignored
+        let output = Command::new(RPM_BIN)
+            .arg("--query")
+            .arg("--whatprovides")
+            .args(capabilities)
+            .run_with_output()?;
+
+        Ok(output
+            .stdout
+            .split('\n')
+            .filter(|line| !line.is_empty())
+            .map(OsString::from)
+            .collect())
+    }
+
     fn find_build_root(&self, directory: &Path) -> Result<PackageBuildRoot> {
         let build_root = fs::find_dir(
             directory,
@@ -21,7 +21,7 @@ use syscare_common::{concat_os, fs, process::Command};
 use super::PKG_FILE_EXT;
 use crate::{
     build_params::BuildParameters,
-    package::{PackageBuildRoot, PackageBuilder},
+    package::{PackageBuildRoot, PackageBuilder, PayloadCompression},
 };
 
 const RPM_BUILD_BIN: &str = "rpmbuild";
@@ -88,11 +88,21 @@ impl PackageBuilder for RpmPackageBuilder<'_> {
         Ok(())
     }
 
-    fn build_binary_package(&self, spec_file: &Path, output_dir: &Path) -> Result<()> {
+    fn build_binary_package(
+        &self,
+        spec_file: &Path,
+        output_dir: &Path,
+        compression: PayloadCompression,
+    ) -> Result<()> {
         Command::new(RPM_BUILD_BIN)
             .arg("--define")
             .arg(concat_os!("_topdir ", self.build_root.as_ref()))
             .arg("--define")
+            .arg(format!(
+                "_binary_payload w{}T{}.zstdio",
+                compression.level, compression.threads
+            ))
+            .arg("--define")
             .arg("debug_package %{nil}")
             .arg("--define")
             .arg("__spec_install_post %{__arch_install_post}")
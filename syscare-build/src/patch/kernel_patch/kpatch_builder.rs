@@ -116,7 +116,11 @@ impl KernelPatchBuilder {
                 self.pkg_impl.format(),
                 &build_params.pkg_build_root,
             )
-            .build_binary_package(&build_entry.build_spec, &patch_build_root)
+            .build_binary_package(
+                &build_entry.build_spec,
+                &patch_build_root,
+                build_params.compression,
+            )
             .context("Failed to build out-of-tree module")?;
         }
 
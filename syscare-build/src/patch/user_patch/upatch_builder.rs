@@ -56,6 +56,7 @@ struct UBuildParameters {
     patch_target: PackageInfo,
     patch_description: String,
     patch_files: Vec<PatchFile>,
+    build_cache: Option<PathBuf>,
     skip_compiler_check: bool,
     verbose: bool,
 }
@@ -181,6 +182,7 @@ impl UserPatchBuilder {
             patch_target: build_params.build_entry.target_pkg.to_owned(),
             patch_description: build_params.patch_description.to_owned(),
             patch_files: build_params.patch_files.to_owned(),
+            build_cache: build_params.build_cache.to_owned(),
             skip_compiler_check: build_params.skip_compiler_check,
             verbose: build_params.verbose,
         };
@@ -220,6 +222,14 @@ impl UserPatchBuilder {
             .arg("--patch")
             .args(ubuild_params.patch_files.iter().map(|patch| &patch.path));
 
+        if let Some(build_cache) = &ubuild_params.build_cache {
+            let target = &ubuild_params.patch_target;
+            cmd_args
+                .arg("--cache-dir")
+                .arg(build_cache)
+                .arg("--cache-key")
+                .arg(format!("{}:{}", target.epoch, target.full_name()));
+        }
         if ubuild_params.skip_compiler_check {
             cmd_args.arg("--skip-compiler-check");
         }
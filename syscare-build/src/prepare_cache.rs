@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscare-build is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    ffi::OsString,
+    path::{Path, PathBuf},
+};
+
+use anyhow::{Context, Result};
+use syscare_common::{fs, os, util::digest};
+
+use crate::{args::Arguments, build_root::PackageRoot, package::PackageImpl};
+
+const CACHE_DIR_NAME: &str = "prepared";
+const SOURCE_DIR_NAME: &str = "source";
+const DEBUGINFO_DIR_NAME: &str = "debuginfo";
+
+/* Packages each build runs with besides of the BuildRequires */
+const TOOLCHAIN_CAPABILITIES: [&str; 4] = ["rpm-build", "gcc", "gcc-c++", "binutils"];
+
+/// Persistent cache of prepared packages.
+///
+/// Each entry holds the extracted source & debuginfo packages after %prep, which are the
+/// same for every patch against one package version. Entries are cloned into the build
+/// root by reflink, thus builds never modify them.
+pub struct PrepareCache {
+    cache_root: PathBuf,
+    key: String,
+}
+
+impl PrepareCache {
+    /// Cache key covers the packages, their build requirements and the toolchain
+    pub fn new(pkg_impl: &PackageImpl, args: &Arguments, cache_root: &Path) -> Result<Self> {
+        let mut items = vec![
+            format!("arch: {}", args.patch_arch),
+            format!("root: {}", args.build_root.display()),
+        ];
+        let mut capabilities = TOOLCHAIN_CAPABILITIES
+            .iter()
+            .map(OsString::from)
+            .collect::<Vec<_>>();
+
+        for pkg_path in &args.source {
+            let pkg_digest = digest::file(pkg_path)
+                .with_context(|| format!("Failed to digest {}", pkg_path.display()))?;
+            items.push(format!("source: {}", pkg_digest));
+            capabilities.extend(pkg_impl.query_build_requires(pkg_path)?);
+        }
+        for pkg_path in &args.debuginfo {
+            let pkg_digest = digest::file(pkg_path)
+                .with_context(|| format!("Failed to digest {}", pkg_path.display()))?;
+            items.push(format!("debuginfo: {}", pkg_digest));
+        }
+
+        capabilities.sort();
+        capabilities.dedup();
+        for provider in pkg_impl
+            .query_providers(&capabilities)
+            .context("Failed to query build requirements")?
+        {
+            items.push(format!("provider: {}", provider.to_string_lossy()));
+        }
+
+        Ok(Self {
+            cache_root: cache_root.join(CACHE_DIR_NAME),
+            key: digest::bytes(items.join("\n")),
+        })
+    }
+
+    pub fn key(&self) -> &str {
+        &self.key
+    }
+
+    /// Clone the cached entry into package root, returns false on miss
+    pub fn load(&self, pkg_root: &PackageRoot) -> Result<bool> {
+        let cache_dir = self.cache_root.join(&self.key);
+        if !cache_dir.is_dir() {
+            return Ok(false);
+        }
+
+        let result = Self::clone_dirs(&cache_dir, &pkg_root.source, &pkg_root.debuginfo);
+        if result.is_err() {
+            // Leave empty directories for a fresh preparation
+            for dir in [&pkg_root.source, &pkg_root.debuginfo] {
+                fs::remove_dir_all(dir).ok();
+                fs::create_dir_all(dir).ok();
+            }
+        }
+        result?;
+
+        Ok(true)
+    }
+
+    /// Save prepared packages, the entry is published atomically once complete
+    pub fn store(&self, pkg_root: &PackageRoot) -> Result<()> {
+        let cache_dir = self.cache_root.join(&self.key);
+        if cache_dir.exists() {
+            return Ok(());
+        }
+
+        let temp_dir = self
+            .cache_root
+            .join(format!(".{}.{}", self.key, os::process::id()));
+        fs::create_dir_all(&temp_dir)?;
+
+        let result = Self::store_dirs(&temp_dir, pkg_root)
+            .and_then(|_| fs::rename(&temp_dir, &cache_dir).map_err(Into::into));
+        if temp_dir.exists() {
+            fs::remove_dir_all(&temp_dir).ok();
+        }
+
+        // Someone else may have published the same entry meanwhile
+        match cache_dir.exists() {
+            true => Ok(()),
+            false => result,
+        }
+    }
+}
+
+impl PrepareCache {
+    fn clone_dirs(cache_dir: &Path, source_dir: &Path, debuginfo_dir: &Path) -> Result<()> {
+        fs::reflink_copy_dir(cache_dir.join(SOURCE_DIR_NAME), source_dir)?;
+        fs::reflink_copy_dir(cache_dir.join(DEBUGINFO_DIR_NAME), debuginfo_dir)?;
+
+        Ok(())
+    }
+
+    fn store_dirs(temp_dir: &Path, pkg_root: &PackageRoot) -> Result<()> {
+        fs::reflink_copy_dir(&pkg_root.source, temp_dir.join(SOURCE_DIR_NAME))?;
+        fs::reflink_copy_dir(&pkg_root.debuginfo, temp_dir.join(DEBUGINFO_DIR_NAME))?;
+
+        Ok(())
+    }
+}
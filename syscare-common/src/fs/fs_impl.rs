@@ -17,7 +17,10 @@ use std::{
     ffi::{CStr, OsStr, OsString},
     fs::{File, FileType, Metadata, Permissions, ReadDir},
     io,
-    os::{raw::c_void, unix::fs::PermissionsExt},
+    os::{
+        raw::c_void,
+        unix::{fs::PermissionsExt, io::AsRawFd},
+    },
     path::{Component, Path, PathBuf},
     ptr::null_mut,
 };
@@ -182,6 +185,42 @@ pub fn open_file<P: AsRef<Path>>(path: P) -> io::Result<File> {
     File::open(&path).rewrite_err(format!("Cannot open file {}", path.as_ref().display()))
 }
 
+/// Copy a file by sharing its extents (reflink) if the filesystem supports it.
+///
+/// The destination shares all blocks with the source until either of them is changed,
+/// thus a large file which only got few modifications costs no extra space or io.
+/// Falls back to a normal copy across filesystems, or when reflink is not supported.
+pub fn reflink_copy<P: AsRef<Path>, Q: AsRef<Path>>(from: P, to: Q) -> io::Result<u64> {
+    /* _IOW(0x94, 9, int), linux/fs.h */
+    const FICLONE: u32 = 0x40049409;
+
+    let src_file = File::open(&from).rewrite_err(format!(
+        "Cannot copy {} to {}",
+        from.as_ref().display(),
+        to.as_ref().display()
+    ))?;
+    let metadata = src_file.metadata()?;
+    let dst_file = File::create(&to).rewrite_err(format!(
+        "Cannot copy {} to {}",
+        from.as_ref().display(),
+        to.as_ref().display()
+    ))?;
+
+    /*
+     * SAFETY:
+     * This libc function is marked 'unsafe' as it takes raw file descriptors.
+     * Both of the descriptors are owned by opened files, which live across the call.
+     */
+    let ret = unsafe { nix::libc::ioctl(dst_file.as_raw_fd(), FICLONE as _, src_file.as_raw_fd()) };
+    if ret == -1 {
+        drop(dst_file);
+        return self::copy(from, to);
+    }
+    dst_file.set_permissions(metadata.permissions())?;
+
+    Ok(metadata.len())
+}
+
 pub fn file_name<P: AsRef<Path>>(path: P) -> OsString {
     path.as_ref()
         .file_name()
@@ -562,6 +601,33 @@ pub fn copy_dir_contents<P: AsRef<Path>, Q: AsRef<Path>>(src_dir: P, dst_dir: Q)
     Ok(())
 }
 
+/// Copy a directory recursively, files are copied by reflink if the filesystem supports it.
+///
+/// Symlinks are copied as they are, thus links pointing inside of the directory are kept.
+pub fn reflink_copy_dir<P: AsRef<Path>, Q: AsRef<Path>>(src_dir: P, dst_dir: Q) -> io::Result<()> {
+    let src_dir = src_dir.as_ref();
+    let dst_dir = dst_dir.as_ref();
+
+    create_dir_all(dst_dir)?;
+    for dir_entry in read_dir(src_dir)? {
+        let dir_entry = dir_entry?;
+        let file_type = dir_entry.file_type()?;
+        let src_path = dir_entry.path();
+        let dst_path = dst_dir.join(dir_entry.file_name());
+
+        if file_type.is_dir() {
+            reflink_copy_dir(&src_path, &dst_path)?;
+        } else if file_type.is_symlink() {
+            soft_link(read_link(&src_path)?, &dst_path)?;
+        } else {
+            reflink_copy(&src_path, &dst_path)?;
+        }
+    }
+
+    // Read-only directories are restored after their contents
+    set_permissions(dst_dir, metadata(src_dir)?.permissions())
+}
+
 pub fn sync() {
     nix::unistd::sync()
 }
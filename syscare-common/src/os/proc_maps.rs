@@ -12,7 +12,13 @@
  * See the Mulan PSL v2 for more details.
  */
 
-use std::{convert::TryFrom, ffi::OsString, fs::File, io::BufReader};
+use std::{
+    convert::TryFrom,
+    ffi::{OsStr, OsString},
+    fs::File,
+    io::BufReader,
+    os::unix::ffi::OsStrExt as StdOsStrExt,
+};
 
 use anyhow::{ensure, Result};
 
@@ -55,6 +61,121 @@ impl TryFrom<OsString> for ProcMap {
     }
 }
 
+/// Process mapping borrowed from content of the maps file, path name is empty if anonymous
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ProcMapRef<'a> {
+    pub address: &'a OsStr,
+    pub permission: &'a OsStr,
+    pub offset: &'a OsStr,
+    pub dev: &'a OsStr,
+    pub inode: &'a OsStr,
+    pub path_name: &'a OsStr,
+}
+
+impl ProcMapRef<'_> {
+    /// Inode of the mapped file, 0 if anonymous
+    pub fn inode_num(&self) -> Option<u64> {
+        parse_decimal(self.inode.as_bytes())
+    }
+}
+
+impl From<ProcMapRef<'_>> for ProcMap {
+    fn from(map: ProcMapRef<'_>) -> Self {
+        Self {
+            address: map.address.to_os_string(),
+            permission: map.permission.to_os_string(),
+            offset: map.offset.to_os_string(),
+            dev: map.dev.to_os_string(),
+            inode: map.inode.to_os_string(),
+            path_name: map.path_name.to_os_string(),
+        }
+    }
+}
+
+fn parse_decimal(bytes: &[u8]) -> Option<u64> {
+    if bytes.is_empty() {
+        return None;
+    }
+    bytes.iter().try_fold(0u64, |value, byte| {
+        if !byte.is_ascii_digit() {
+            return None;
+        }
+        value.checked_mul(10)?.checked_add(u64::from(byte - b'0'))
+    })
+}
+
+/// Iterates mappings of a maps file content without copying, malformed lines are skipped
+pub struct ProcMapsIter<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> ProcMapsIter<'a> {
+    pub fn new(data: &'a [u8]) -> Self {
+        Self { data }
+    }
+
+    fn next_field(line: &mut &'a [u8]) -> Option<&'a [u8]> {
+        let start = line.iter().position(|c| *c != b' ')?;
+        let rest = &line[start..];
+        let end = rest.iter().position(|c| *c == b' ').unwrap_or(rest.len());
+
+        *line = &rest[end..];
+        Some(&rest[..end])
+    }
+
+    fn parse_line(mut line: &'a [u8]) -> Option<ProcMapRef<'a>> {
+        let address = Self::next_field(&mut line)?;
+        let permission = Self::next_field(&mut line)?;
+        let offset = Self::next_field(&mut line)?;
+        let dev = Self::next_field(&mut line)?;
+        let inode = Self::next_field(&mut line)?;
+
+        // Path name may contain spaces, the padding before it does not belong to it
+        let path_start = line.iter().position(|c| *c != b' ').unwrap_or(line.len());
+
+        Some(ProcMapRef {
+            address: OsStr::from_bytes(address),
+            permission: OsStr::from_bytes(permission),
+            offset: OsStr::from_bytes(offset),
+            dev: OsStr::from_bytes(dev),
+            inode: OsStr::from_bytes(inode),
+            path_name: OsStr::from_bytes(&line[path_start..]),
+        })
+    }
+}
+
+impl<'a> Iterator for ProcMapsIter<'a> {
+    type Item = ProcMapRef<'a>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        while !self.data.is_empty() {
+            let (line, rest) = match self.data.iter().position(|c| *c == b'\n') {
+                Some(index) => (&self.data[..index], &self.data[index + 1..]),
+                None => (self.data, &self.data[self.data.len()..]),
+            };
+            self.data = rest;
+
+            if let Some(map) = Self::parse_line(line) {
+                return Some(map);
+            }
+        }
+        None
+    }
+}
+
+/// Reads the maps file of a process at once, mappings are iterated by `ProcMapsIter`
+pub fn read_proc_maps(pid: i32) -> Result<Vec<u8>> {
+    Ok(fs::read(format!("/proc/{}/maps", pid))?)
+}
+
+/// Checks whether the process maps the file of the inode, stops at the first match
+pub fn maps_inode(pid: i32, inode: u64) -> Result<bool> {
+    let maps = read_proc_maps(pid)?;
+    let found = ProcMapsIter::new(&maps).any(|map| map.inode_num() == Some(inode));
+
+    Ok(found)
+}
+
 pub struct ProcMaps {
     lines: OsLines<BufReader<File>>,
 }
@@ -72,11 +193,12 @@ impl Iterator for ProcMaps {
     type Item = ProcMap;
 
     fn next(&mut self) -> Option<Self::Item> {
-        self.lines
-            .next()
-            .and_then(Result::ok)
-            .map(ProcMap::try_from)
-            .and_then(Result::ok)
+        loop {
+            let line = self.lines.next()?.ok()?;
+            if let Some(map) = ProcMapsIter::parse_line(line.as_bytes()) {
+                return Some(ProcMap::from(map));
+            }
+        }
     }
 }
 
@@ -88,3 +210,24 @@ fn test() {
         println!("{:#?}", map);
     }
 }
+
+#[test]
+fn test_iter() {
+    const MAPS: &[u8] = b"\
+00400000-00452000 r-xp 00000000 08:02 173521      /usr/bin/dbus-daemon
+00e03000-00e24000 rw-p 00000000 00:00 0           [heap]
+7f2c8a1f0000-7f2c8a1f1000 rw-p 00000000 00:00 0
+7f2c8a200000-7f2c8a300000 r--p 00001000 fd:00 42  /tmp/file with spaces
+malformed
+";
+
+    let maps = ProcMapsIter::new(MAPS).collect::<Vec<_>>();
+    assert_eq!(maps.len(), 4);
+    assert_eq!(maps[0].path_name, "/usr/bin/dbus-daemon");
+    assert_eq!(maps[0].inode_num(), Some(173521));
+    assert_eq!(maps[1].path_name, "[heap]");
+    assert_eq!(maps[2].path_name, "");
+    assert_eq!(maps[2].inode_num(), Some(0));
+    assert_eq!(maps[3].path_name, "/tmp/file with spaces");
+    assert_eq!(maps[3].offset, "00001000");
+}
@@ -77,6 +77,12 @@ pub enum SubCommand {
     },
     /// List all patches
     List,
+    /// Show telemetry of recent patch operations on processes
+    Telemetry {
+        /// Only show records after this sequence number
+        #[clap(long, default_value = "0")]
+        since: u64,
+    },
     /// Check a patch
     Check {
         /// Patch identifier
@@ -113,6 +119,16 @@ pub enum SubCommand {
         #[clap(required = true)]
         identifiers: Vec<String>,
     },
+    /// Replace an actived patch by another one at once
+    Replace {
+        /// Actived patch identifier
+        old_identifier: String,
+        /// New patch identifier
+        new_identifier: String,
+        /// Force to replace a patch
+        #[clap(short, long)]
+        force: bool,
+    },
     /// Accept a patch
     Accept {
         /// Patch identifier
@@ -17,7 +17,9 @@ use std::{fmt::Write, path::PathBuf};
 use anyhow::{anyhow, Error, Result};
 use log::info;
 
-use syscare_abi::{PackageInfo, PatchInfo, PatchListRecord, PatchStateRecord};
+use syscare_abi::{
+    PackageInfo, PatchInfo, PatchSnapshotRecord, PatchStateRecord, PatchTelemetryRecord,
+};
 use syscare_common::fs::{FileLock, FileLockType};
 
 use crate::{args::SubCommand, rpc::RpcProxy};
@@ -78,7 +80,7 @@ impl PatchCommandExecutor {
         }
     }
 
-    fn show_patch_list(patch_list: impl IntoIterator<Item = PatchListRecord>) {
+    fn show_patch_list(patch_list: impl IntoIterator<Item = PatchSnapshotRecord>) {
         info!("{:<40} {:<60} {:<12}", "Uuid", "Name", "Status");
         for record in patch_list {
             info!(
@@ -87,6 +89,42 @@ impl PatchCommandExecutor {
             )
         }
     }
+
+    fn show_patch_telemetry(records: impl IntoIterator<Item = PatchTelemetryRecord>) {
+        info!(
+            "{:<8} {:<12} {:<8} {:<8} {:<6} {:>10} {:>10} {:>10} {:>10} {:>10} {:>8} {:>7}  Uuid",
+            "Seq",
+            "Time",
+            "Command",
+            "Pid",
+            "Result",
+            "Attach(us)",
+            "Freeze(us)",
+            "Stopped(us)",
+            "Total(us)",
+            "Written(B)",
+            "Syscalls",
+            "Retries"
+        );
+        for record in records {
+            info!(
+                "{:<8} {:<12} {:<8} {:<8} {:<6} {:>10} {:>10} {:>10} {:>10} {:>10} {:>8} {:>7}  {}",
+                record.seq,
+                record.timestamp,
+                record.command,
+                record.pid,
+                record.result,
+                record.attach_us,
+                record.freeze_us,
+                record.stopped_us,
+                record.total_us,
+                record.mem_written,
+                record.remote_syscalls,
+                record.retries,
+                record.uuid
+            )
+        }
+    }
 }
 
 impl CommandExecutor for PatchCommandExecutor {
@@ -140,7 +178,11 @@ impl CommandExecutor for PatchCommandExecutor {
                 return Ok(Some(0));
             }
             SubCommand::List => {
-                Self::show_patch_list(self.proxy.get_patch_list()?);
+                Self::show_patch_list(self.proxy.get_all_patch_state()?);
+                return Ok(Some(0));
+            }
+            SubCommand::Telemetry { since } => {
+                Self::show_patch_telemetry(self.proxy.get_patch_telemetry(*since)?);
                 return Ok(Some(0));
             }
             SubCommand::Check { identifiers } => {
@@ -220,6 +262,20 @@ impl CommandExecutor for PatchCommandExecutor {
 
                 return Ok(Some(0));
             }
+            SubCommand::Replace {
+                old_identifier,
+                new_identifier,
+                force,
+            } => {
+                let _file_lock = FileLock::new(&self.lock_file, FileLockType::Exclusive)?;
+
+                let status_list =
+                    self.proxy
+                        .replace_patch(old_identifier, new_identifier, *force)?;
+                Self::show_patch_status(status_list);
+
+                return Ok(Some(0));
+            }
             SubCommand::Accept { identifiers } => {
                 let _file_lock = FileLock::new(&self.lock_file, FileLockType::Exclusive)?;
 
@@ -17,7 +17,9 @@ use std::rc::Rc;
 use anyhow::Result;
 use function_name::named;
 
-use syscare_abi::{PackageInfo, PatchInfo, PatchListRecord, PatchStateRecord};
+use syscare_abi::{
+    PackageInfo, PatchInfo, PatchSnapshotRecord, PatchStateRecord, PatchTelemetryRecord,
+};
 
 use super::{args::RpcArguments, remote::RpcRemote};
 
@@ -64,6 +66,22 @@ impl RpcProxy {
             .call_with_args(function_name!(), RpcArguments::new().arg(identifier))
     }
 
+    #[named]
+    pub fn replace_patch(
+        &self,
+        old_identifier: &str,
+        new_identifier: &str,
+        force: bool,
+    ) -> Result<Vec<PatchStateRecord>> {
+        self.remote.call_with_args(
+            function_name!(),
+            RpcArguments::new()
+                .arg(old_identifier)
+                .arg(new_identifier)
+                .arg(force),
+        )
+    }
+
     #[named]
     pub fn accept_patch(&self, identifier: &str) -> Result<Vec<PatchStateRecord>> {
         self.remote
@@ -71,7 +89,7 @@ impl RpcProxy {
     }
 
     #[named]
-    pub fn get_patch_list(&self) -> Result<Vec<PatchListRecord>> {
+    pub fn get_all_patch_state(&self) -> Result<Vec<PatchSnapshotRecord>> {
         self.remote.call(function_name!())
     }
 
@@ -81,6 +99,12 @@ impl RpcProxy {
             .call_with_args(function_name!(), RpcArguments::new().arg(identifier))
     }
 
+    #[named]
+    pub fn get_patch_telemetry(&self, since: u64) -> Result<Vec<PatchTelemetryRecord>> {
+        self.remote
+            .call_with_args(function_name!(), RpcArguments::new().arg(since))
+    }
+
     #[named]
     pub fn get_patch_info(&self, identifier: &str) -> Result<PatchInfo> {
         self.remote
@@ -0,0 +1,504 @@
+#!/bin/bash
+# SPDX-License-Identifier: Mulan PSL v2
+#
+# syscared activation benchmark
+#
+# Builds a synthetic target package and its patch by syscare-build, keeps the
+# requested number of target processes running with the requested threads &
+# mappings, then applies and removes the patch through an isolated syscared,
+# once for each activation mode. Reports wall time of 'syscare apply', time
+# each process is stopped (from the debug log of syscared), cpu time of
+# syscared and its children, and optionally syscalls made during one apply.
+
+set -e
+
+PROCESSES=64
+THREADS=16
+MAPPINGS=1024
+FUNCS=16
+ROUNDS=10
+PARALLEL=4
+MODES="serial parallel batched"
+WORK_DIR="$(pwd)/syscared-bench"
+OUTPUT=""
+SYSCARED="syscared"
+SYSCARE="syscare"
+SYSCARE_BUILD="/usr/libexec/syscare/syscare-build"
+SYSCARED_ARGS=""
+COUNT_SYSCALLS=0
+CC="${CC:-gcc}"
+
+PKG_NAME="syscare-bench-target"
+PKG_VERSION="1.0"
+PKG_RELEASE="1"
+PATCH_NAME="bench"
+
+usage() {
+    cat <<EOF
+Usage: $(basename "$0") [options]
+
+Options:
+  --processes <num>     Target processes [default: ${PROCESSES}]
+  --threads <num>       Threads of each target process [default: ${THREADS}]
+  --mappings <num>      Extra memory mappings of each target process [default: ${MAPPINGS}]
+  --funcs <num>         Patched functions [default: ${FUNCS}]
+  --rounds <num>        Rounds of apply & remove of each mode [default: ${ROUNDS}]
+  --parallel <num>      Workers of parallel mode [default: ${PARALLEL}]
+  --modes <modes>       Activation modes to compare [default: ${MODES}]
+                          serial:   one upatch-manage request per process, one worker
+                          parallel: processes are split over '--parallel' workers
+                          batched:  one upatch-manage request for all processes
+  --work-dir <dir>      Directory of generated files [default: ${WORK_DIR}]
+  --output <file>       Append results to a csv file, eg. to compare commits
+  --syscared <bin>      Path of syscared [default: ${SYSCARED}]
+  --syscare <bin>       Path of syscare [default: ${SYSCARE}]
+  --syscare-build <bin> Path of syscare-build [default: ${SYSCARE_BUILD}]
+  --syscared-args <args> Extra arguments of syscared, eg. '--rollout-idle-first'
+  --syscalls            Count syscalls of syscared and its children in an extra apply, needs strace
+
+syscared runs patches by the installed upatch-manage, it has to be root.
+EOF
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    --processes) PROCESSES="$2"; shift ;;
+    --threads) THREADS="$2"; shift ;;
+    --mappings) MAPPINGS="$2"; shift ;;
+    --funcs) FUNCS="$2"; shift ;;
+    --rounds) ROUNDS="$2"; shift ;;
+    --parallel) PARALLEL="$2"; shift ;;
+    --modes) MODES="$2"; shift ;;
+    --work-dir) WORK_DIR="$2"; shift ;;
+    --output) OUTPUT="$2"; shift ;;
+    --syscared) SYSCARED="$2"; shift ;;
+    --syscare) SYSCARE="$2"; shift ;;
+    --syscare-build) SYSCARE_BUILD="$2"; shift ;;
+    --syscared-args) SYSCARED_ARGS="$2"; shift ;;
+    --syscalls) COUNT_SYSCALLS=1 ;;
+    *) usage ;;
+    esac
+    shift
+done
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Benchmark has to be run as root" >&2
+    exit 1
+fi
+if [ "${FUNCS}" -lt 1 ] || [ "${PROCESSES}" -lt 1 ]; then
+    echo "At least one patched function and one process are required" >&2
+    exit 1
+fi
+if [ "${COUNT_SYSCALLS}" -eq 1 ] && ! command -v strace > /dev/null; then
+    echo "Cannot find strace, which is required by '--syscalls'" >&2
+    exit 1
+fi
+
+SOURCE_DIR="${WORK_DIR}/source"
+RPMBUILD_DIR="${WORK_DIR}/rpmbuild"
+PATCH_DIR="${WORK_DIR}/patch"
+RESULT_DIR="${WORK_DIR}/result"
+# Target is installed into the work directory, thus nothing is installed into the system
+TARGET_DIR="${WORK_DIR}/target"
+TARGET="${TARGET_DIR}/bench-target"
+DAEMON_DIR="${WORK_DIR}/daemon"
+PATCH_ID="${PKG_NAME}-${PKG_VERSION}-${PKG_RELEASE}/${PATCH_NAME}"
+CLK_TCK="$(getconf CLK_TCK)"
+TARGET_PIDS=()
+SYSCARED_PID=""
+
+stop_syscared() {
+    if [ -n "${SYSCARED_PID}" ]; then
+        kill "${SYSCARED_PID}" 2>/dev/null || true
+        wait "${SYSCARED_PID}" 2>/dev/null || true
+        SYSCARED_PID=""
+    fi
+}
+
+cleanup() {
+    stop_syscared
+    for pid in "${TARGET_PIDS[@]}"; do
+        kill "${pid}" 2>/dev/null || true
+    done
+    for pid in "${TARGET_PIDS[@]}"; do
+        wait "${pid}" 2>/dev/null || true
+    done
+}
+trap cleanup EXIT
+
+# Each function is changed by 'delta' of the patch
+gen_funcs() {
+    local file="$1"
+    local delta="$2"
+
+    : > "${file}"
+    for ((i = 0; i < FUNCS; i++)); do
+        echo "__attribute__((noinline)) int bench_func_${i}(int v)" >> "${file}"
+        echo "{" >> "${file}"
+        echo "    return v * 3 + ${i} + ${delta};" >> "${file}"
+        echo "}" >> "${file}"
+    done
+
+    echo "int (*bench_funcs[])(int) = {" >> "${file}"
+    for ((i = 0; i < FUNCS; i++)); do
+        echo "    bench_func_${i}," >> "${file}"
+    done
+    echo "};" >> "${file}"
+    echo "int bench_func_num = ${FUNCS};" >> "${file}"
+}
+
+gen_main() {
+    cat > "$1" <<EOF
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+extern int (*bench_funcs[])(int);
+extern int bench_func_num;
+
+static void *bench_thread(void *arg)
+{
+    struct timespec ts = { 0, 1000000 };
+    int index = (int)(long)arg % bench_func_num;
+    volatile int v = 0;
+
+    for (;;) {
+        v = bench_funcs[index](v);
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = (argc > 1) ? atoi(argv[1]) : 0;
+    int mappings = (argc > 2) ? atoi(argv[2]) : 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    /* Alternate protections, thus adjacent mappings are never merged */
+    for (int i = 0; i < mappings; i++) {
+        int prot = (i % 2) ? PROT_READ : PROT_NONE;
+        if (mmap(NULL, page_size, prot, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0) == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+    }
+
+    for (long i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, bench_thread, (void *)i) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    printf("ready\n");
+    fflush(stdout);
+    for (;;) {
+        pause();
+    }
+    return 0;
+}
+EOF
+}
+
+gen_spec() {
+    cat > "$1" <<EOF
+Name:           ${PKG_NAME}
+Version:        ${PKG_VERSION}
+Release:        ${PKG_RELEASE}
+Summary:        Target of syscared benchmark
+License:        MulanPSL-2.0
+Source0:        %{name}-%{version}.tar.gz
+BuildRequires:  gcc make
+
+%description
+Target of syscared benchmark.
+
+%prep
+%setup -q
+
+%build
+make %{?_smp_mflags} CC=${CC}
+
+%install
+install -D -m 0755 bench-target %{buildroot}${TARGET}
+
+%files
+${TARGET}
+EOF
+}
+
+gen_package() {
+    local pkg_dir="${SOURCE_DIR}/${PKG_NAME}-${PKG_VERSION}"
+
+    rm -rf "${SOURCE_DIR}" "${RPMBUILD_DIR}"
+    mkdir -p "${pkg_dir}" "${RPMBUILD_DIR}/SOURCES" "${RPMBUILD_DIR}/SPECS"
+
+    gen_funcs "${pkg_dir}/bench-funcs.c" 0
+    gen_main "${pkg_dir}/bench-main.c"
+    cat > "${pkg_dir}/Makefile" <<EOF
+bench-target: bench-main.c bench-funcs.c
+	\$(CC) -g -O2 -fPIE -pie -o \$@ \$^ -lpthread
+EOF
+    tar -czf "${RPMBUILD_DIR}/SOURCES/${PKG_NAME}-${PKG_VERSION}.tar.gz" \
+        -C "${SOURCE_DIR}" "${PKG_NAME}-${PKG_VERSION}"
+    gen_spec "${RPMBUILD_DIR}/SPECS/${PKG_NAME}.spec"
+
+    rpmbuild --define "_topdir ${RPMBUILD_DIR}" -ba "${RPMBUILD_DIR}/SPECS/${PKG_NAME}.spec" \
+        > "${WORK_DIR}/rpmbuild.log" 2>&1 || {
+        echo "Failed to build target package, see ${WORK_DIR}/rpmbuild.log" >&2
+        exit 1
+    }
+
+    # Patch changes every function, thus all of them are replaced
+    local patched_dir="${WORK_DIR}/patched"
+    rm -rf "${patched_dir}"
+    mkdir -p "${patched_dir}"
+    gen_funcs "${patched_dir}/bench-funcs.c" 1
+    (cd "${WORK_DIR}" && diff -u "source/${PKG_NAME}-${PKG_VERSION}/bench-funcs.c" \
+        "patched/bench-funcs.c" > "${WORK_DIR}/bench.patch") || true
+    sed -i -e '1s|^--- source/[^/]*/|--- a/|' -e '2s|^+++ patched/|+++ b/|' \
+        "${WORK_DIR}/bench.patch"
+}
+
+# Unpack a package into a directory, without touching the rpm database
+unpack_rpm() {
+    mkdir -p "$2"
+    (cd "$2" && rpm2cpio "$1" | cpio -idm --quiet)
+}
+
+build_patch() {
+    local src_rpm debuginfo_rpm target_rpm patch_rpm patch_info
+
+    src_rpm="$(ls "${RPMBUILD_DIR}"/SRPMS/${PKG_NAME}-*.src.rpm)"
+    debuginfo_rpm="$(ls "${RPMBUILD_DIR}"/RPMS/*/${PKG_NAME}-debuginfo-*.rpm)"
+    target_rpm="$(ls "${RPMBUILD_DIR}"/RPMS/*/${PKG_NAME}-${PKG_VERSION}-*.rpm)"
+
+    rm -rf "${PATCH_DIR}"
+    mkdir -p "${PATCH_DIR}/output"
+    "${SYSCARE_BUILD}" \
+        --patch-name "${PATCH_NAME}" \
+        --source "${src_rpm}" \
+        --debuginfo "${debuginfo_rpm}" \
+        --patch "${WORK_DIR}/bench.patch" \
+        --build-root "${PATCH_DIR}" \
+        --output "${PATCH_DIR}/output" \
+        --skip-compiler-check > "${WORK_DIR}/syscare-build.log" 2>&1 || {
+        echo "Failed to build patch, see ${WORK_DIR}/syscare-build.log" >&2
+        exit 1
+    }
+
+    # Target lands in the work directory, patch lands in data directory of the daemon
+    rm -rf "${TARGET_DIR}" "${DAEMON_DIR}"
+    unpack_rpm "${target_rpm}" /
+    patch_rpm="$(ls "${PATCH_DIR}"/output/patch-*.rpm | grep -v '\.src\.rpm$' | head -n 1)"
+    unpack_rpm "${patch_rpm}" "${PATCH_DIR}/unpacked"
+    patch_info="$(find "${PATCH_DIR}/unpacked" -name patch_info | head -n 1)"
+    if [ -z "${patch_info}" ]; then
+        echo "Cannot find patch info in ${patch_rpm}" >&2
+        exit 1
+    fi
+    mkdir -p "${DAEMON_DIR}/data/patches"
+    cp -a "$(dirname "${patch_info}")" "${DAEMON_DIR}/data/patches/"
+}
+
+start_targets() {
+    local fifo="${WORK_DIR}/target.fifo"
+
+    for ((i = 0; i < PROCESSES; i++)); do
+        rm -f "${fifo}"
+        mkfifo "${fifo}"
+        "${TARGET}" "${THREADS}" "${MAPPINGS}" > "${fifo}" &
+        TARGET_PIDS+=($!)
+        read -r _ < "${fifo}"
+    done
+    rm -f "${fifo}"
+}
+
+mode_args() {
+    case "$1" in
+    # Slightest pacing makes each process a request of its own
+    serial) echo "--max-parallel 1 --rollout-stopped-ratio 99" ;;
+    parallel) echo "--max-parallel ${PARALLEL}" ;;
+    batched) echo "--max-parallel 1" ;;
+    *)
+        echo "Unknown mode '$1'" >&2
+        exit 1
+        ;;
+    esac
+}
+
+start_syscared() {
+    local mode="$1"
+    local args
+
+    args="$(mode_args "${mode}")"
+    rm -rf "${DAEMON_DIR}/work" "${DAEMON_DIR}/log"
+    # shellcheck disable=SC2086
+    "${SYSCARED}" ${args} ${SYSCARED_ARGS} \
+        --data-dir "${DAEMON_DIR}/data" \
+        --work-dir "${DAEMON_DIR}/work" \
+        --log-dir "${DAEMON_DIR}/log" \
+        --log-level debug > "${RESULT_DIR}/${mode}.log" 2>&1 &
+    SYSCARED_PID=$!
+
+    for ((i = 0; i < 100; i++)); do
+        if syscare_cmd list > /dev/null 2>&1; then
+            return
+        fi
+        sleep 0.1
+    done
+    echo "Failed to start syscared, see ${RESULT_DIR}/${mode}.log" >&2
+    exit 1
+}
+
+syscare_cmd() {
+    "${SYSCARE}" --work-dir "${DAEMON_DIR}/work" "$@"
+}
+
+# Cpu ticks of a process and its descendants, reaped children are counted by their parent
+cpu_ticks() {
+    local total=0
+
+    for pid in $1 $(descendants "$1"); do
+        local stat
+        stat="$(sed 's/^.*) //' "/proc/${pid}/stat" 2>/dev/null)" || continue
+        total=$((total + $(echo "${stat}" | awk '{ print $12 + $13 + $14 + $15 }')))
+    done
+    echo "${total}"
+}
+
+descendants() {
+    for child in $(pgrep -P "$1"); do
+        echo "${child}"
+        descendants "${child}"
+    done
+}
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+run_apply() {
+    local mode="$1"
+    local log="${RESULT_DIR}/${mode}.log"
+    local start_line start_ticks start_us end_us
+
+    start_line="$(wc -l < "${log}")"
+    start_ticks="$(cpu_ticks "${SYSCARED_PID}")"
+    start_us="$(now_us)"
+    syscare_cmd apply "${PATCH_ID}" > "${RESULT_DIR}/apply.out" 2>&1 || {
+        echo "Failed to apply patch in ${mode} mode, see ${log}" >&2
+        exit 1
+    }
+    end_us="$(now_us)"
+
+    echo $((end_us - start_us)) >> "${RESULT_DIR}/${mode}.total"
+    echo $((($(cpu_ticks "${SYSCARED_PID}") - start_ticks) * 1000000 / CLK_TCK)) \
+        >> "${RESULT_DIR}/${mode}.cpu"
+    tail -n +"$((start_line + 1))" "${log}" |
+        sed -n 's/.*Upatch: Process [0-9]* timing (us):.*stopped=\([0-9]*\).*/\1/p' \
+        >> "${RESULT_DIR}/${mode}.stopped"
+}
+
+run_remove() {
+    syscare_cmd remove "${PATCH_ID}" > "${RESULT_DIR}/remove.out" 2>&1 || {
+        echo "Failed to remove patch in $1 mode, see ${RESULT_DIR}/$1.log" >&2
+        exit 1
+    }
+}
+
+# Syscalls of one more apply, traced apart from the timed rounds
+count_syscalls() {
+    local mode="$1"
+    local trace="${RESULT_DIR}/${mode}.strace"
+    local strace_pid
+
+    strace -f -qq -o "${trace}" -p "${SYSCARED_PID}" &
+    strace_pid=$!
+    sleep 1
+    syscare_cmd apply "${PATCH_ID}" > /dev/null 2>&1 || true
+    kill -INT "${strace_pid}" 2>/dev/null || true
+    wait "${strace_pid}" 2>/dev/null || true
+    run_remove "${mode}"
+
+    # Interrupted calls are logged twice, the resumed half is not counted
+    grep -vc 'resumed>' "${trace}" || true
+}
+
+# Nearest-rank percentile of a file of numbers
+percentile() {
+    sort -n "$1" | awk -v p="$2" '
+        { v[NR] = $1 }
+        END {
+            if (NR == 0) { print 0; exit }
+            i = int((NR * p + 99) / 100)
+            print v[(i < 1) ? 1 : i]
+        }'
+}
+
+average() {
+    awk '{ s += $1 } END { print (NR == 0) ? 0 : int(s / NR) }' "$1"
+}
+
+report() {
+    local version
+    version="$("${SYSCARED}" --version 2>/dev/null | head -n 1 | awk '{print $2}')"
+
+    printf "%-9s %12s %12s %12s %12s %12s %12s %12s\n" "mode" "total_p50" "total_p99" \
+        "stopped_p50" "stopped_p99" "stopped_max" "cpu_avg" "syscalls"
+    for mode in ${MODES}; do
+        local values=(
+            "$(percentile "${RESULT_DIR}/${mode}.total" 50)"
+            "$(percentile "${RESULT_DIR}/${mode}.total" 99)"
+            "$(percentile "${RESULT_DIR}/${mode}.stopped" 50)"
+            "$(percentile "${RESULT_DIR}/${mode}.stopped" 99)"
+            "$(percentile "${RESULT_DIR}/${mode}.stopped" 100)"
+            "$(average "${RESULT_DIR}/${mode}.cpu")"
+            "$(cat "${RESULT_DIR}/${mode}.syscalls" 2>/dev/null || echo "-")"
+        )
+        printf "%-9s %12s %12s %12s %12s %12s %12s %12s\n" "${mode}" "${values[@]}"
+
+        if [ -n "${OUTPUT}" ]; then
+            if [ ! -s "${OUTPUT}" ]; then
+                echo "version,mode,processes,threads,mappings,funcs,rounds,parallel,total_p50,total_p99,stopped_p50,stopped_p99,stopped_max,cpu_avg,syscalls" > "${OUTPUT}"
+            fi
+            echo "${version},${mode},${PROCESSES},${THREADS},${MAPPINGS},${FUNCS},${ROUNDS},${PARALLEL},$(IFS=,; echo "${values[*]}")" >> "${OUTPUT}"
+        fi
+    done
+    echo "(microseconds per apply, stopped is per process, cpu is of syscared & its children)"
+    echo "(processes=${PROCESSES}, threads=${THREADS}, mappings=${MAPPINGS}, funcs=${FUNCS}, rounds=${ROUNDS}, parallel=${PARALLEL})"
+}
+
+mkdir -p "${WORK_DIR}"
+gen_package
+build_patch
+
+rm -rf "${RESULT_DIR}"
+mkdir -p "${RESULT_DIR}"
+
+start_targets
+for mode in ${MODES}; do
+    mode_args "${mode}" > /dev/null
+    : > "${RESULT_DIR}/${mode}.total"
+    : > "${RESULT_DIR}/${mode}.stopped"
+    : > "${RESULT_DIR}/${mode}.cpu"
+
+    start_syscared "${mode}"
+    for ((round = 0; round < ROUNDS; round++)); do
+        run_apply "${mode}"
+        run_remove "${mode}"
+    done
+    if [ "${COUNT_SYSCALLS}" -eq 1 ]; then
+        count_syscalls "${mode}" > "${RESULT_DIR}/${mode}.syscalls"
+    fi
+    stop_syscared
+done
+
+report
@@ -26,6 +26,9 @@ const DEFAULT_DATA_ROOT: &str = "/usr/lib/syscare";
 const DEFAULT_WORK_DIR: &str = "/var/run/syscare";
 const DEFAULT_LOG_DIR: &str = "/var/log/syscare";
 const DEFAULT_LOG_LEVEL: &str = "info";
+const DEFAULT_MAX_PARALLEL: &str = "4";
+const DEFAULT_ROLLOUT_CGROUP_LIMIT: &str = "0";
+const DEFAULT_ROLLOUT_STOPPED_RATIO: &str = "100";
 
 #[derive(Debug, Clone, Parser)]
 #[clap(
@@ -57,6 +60,54 @@ pub struct Arguments {
     /// Set the logging level ("trace"|"debug"|"info"|"warn"|"error")
     #[clap(short, long, default_value = DEFAULT_LOG_LEVEL)]
     pub log_level: LevelFilter,
+
+    /// Maximum number of workers patching user processes in parallel
+    #[clap(long, default_value = DEFAULT_MAX_PARALLEL)]
+    pub max_parallel: usize,
+
+    /// Maximum number of processes of one cgroup stopped at the same time, 0 means no limit
+    #[clap(long, default_value = DEFAULT_ROLLOUT_CGROUP_LIMIT)]
+    pub rollout_cgroup_limit: usize,
+
+    /// Percentage of time a worker may keep processes stopped, lower values pace activations
+    #[clap(long, default_value = DEFAULT_ROLLOUT_STOPPED_RATIO)]
+    pub rollout_stopped_ratio: u64,
+
+    /// Patch processes using the least cpu first
+    #[clap(long)]
+    pub rollout_idle_first: bool,
+
+    /// Patch new processes at exec, before they run any user code
+    #[clap(long)]
+    pub patch_on_exec: bool,
+
+    /// Map patch text shared by processes of identical layout, rather than a copy for each
+    #[clap(long)]
+    pub share_patch_text: bool,
+
+    /// Stop a process by freezing its cgroup v2 instead of ptrace, if the cgroup holds nothing else
+    #[clap(long)]
+    pub freeze_cgroup: bool,
+
+    /// Call bound external functions directly from user patch code, instead of through the plt
+    #[clap(long)]
+    pub direct_bind: bool,
+
+    /// Apply or remove user patch only while no thread runs, or would return to, patched code
+    #[clap(long)]
+    pub stack_check: bool,
+
+    /// With stack check, also check parked coroutines of the runtimes, separated by ',' ("guarded")
+    #[clap(long)]
+    pub coro_runtime: Option<String>,
+
+    /// Rescan only written pages of coroutine stacks, clears soft-dirty bits, not for CRIU users
+    #[clap(long)]
+    pub coro_soft_dirty: bool,
+
+    /// Place user patch text on 2MiB boundary and advise huge pages for it
+    #[clap(long)]
+    pub huge_text: bool,
 }
 
 impl Arguments {
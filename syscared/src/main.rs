@@ -24,8 +24,9 @@ use jsonrpc_core::IoHandler;
 use jsonrpc_ipc_server::{Server, ServerBuilder};
 use log::{error, info, LevelFilter, Record};
 use parking_lot::RwLock;
-use patch::manager::PatchManager;
+use patch::{driver::UserPatchDriver, manager::PatchManager};
 use signal_hook::{consts::TERM_SIGNALS, iterator::Signals, low_level::signal_name};
+use tokio::runtime::{self, Runtime};
 
 use syscare_common::{fs, os};
 
@@ -50,6 +51,11 @@ const DAEMON_UMASK: u32 = 0o077;
 const WORK_DIR_PERMISSION: u32 = 0o755;
 const PID_FILE_NAME: &str = "syscared.pid";
 const SOCKET_FILE_NAME: &str = "syscared.sock";
+const UPATCH_SHARE_DIR_NAME: &str = "upatch_share";
+
+/* Read-only calls are served from the patch snapshot, they never wait for an operation */
+const RPC_WORKER_NAME: &str = "rpc_worker";
+const RPC_WORKER_NUM: usize = 4;
 
 const MAIN_THREAD_NAME: &str = "main";
 const UNNAMED_THREAD_NAME: &str = "<unnamed>";
@@ -164,9 +170,10 @@ impl SyscareDaemon {
         Ok(io_handler)
     }
 
-    fn start_rpc_server(&self, io_handler: IoHandler) -> Result<Server> {
+    fn start_rpc_server(&self, io_handler: IoHandler, runtime: &Runtime) -> Result<Server> {
         let socket_file = self.args.work_dir.join(SOCKET_FILE_NAME);
         let server = ServerBuilder::new(io_handler)
+            .event_loop_executor(runtime.handle().clone())
             .set_client_buffer_size(1)
             .start(
                 socket_file
@@ -185,6 +192,26 @@ impl SyscareDaemon {
         self.daemonize()?;
 
         info!("Initializing patch manager...");
+        UserPatchDriver::set_max_parallel(self.args.max_parallel);
+        UserPatchDriver::set_rollout_policy(
+            self.args.rollout_cgroup_limit,
+            self.args.rollout_stopped_ratio,
+            self.args.rollout_idle_first,
+        );
+        UserPatchDriver::set_patch_on_exec(self.args.patch_on_exec);
+        UserPatchDriver::set_share_dir(
+            self.args
+                .share_patch_text
+                .then(|| self.args.work_dir.join(UPATCH_SHARE_DIR_NAME)),
+        );
+        UserPatchDriver::set_freeze(self.args.freeze_cgroup);
+        UserPatchDriver::set_direct_bind(self.args.direct_bind);
+        UserPatchDriver::set_stack_check(self.args.stack_check);
+        UserPatchDriver::set_coro_runtime(
+            self.args.coro_runtime.clone(),
+            self.args.coro_soft_dirty,
+        );
+        UserPatchDriver::set_huge_text(self.args.huge_text);
         let patch_root = &self.args.data_dir;
         let patch_manager = Arc::new(RwLock::new(
             PatchManager::new(patch_root).context("Failed to initialize patch manager")?,
@@ -200,8 +227,14 @@ impl SyscareDaemon {
             .context("Failed to initialize skeleton")?;
 
         info!("Starting remote procedure call server...");
+        let rpc_runtime = runtime::Builder::new_multi_thread()
+            .worker_threads(RPC_WORKER_NUM)
+            .thread_name(RPC_WORKER_NAME)
+            .enable_all()
+            .build()
+            .context("Failed to create remote procedure call workers")?;
         let server = self
-            .start_rpc_server(io_handler)
+            .start_rpc_server(io_handler, &rpc_runtime)
             .context("Failed to create remote procedure call server")?;
 
         info!("Daemon is running...");
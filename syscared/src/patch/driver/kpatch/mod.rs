@@ -26,19 +26,23 @@ use syscare_common::{concat_os, os, util::digest};
 
 use crate::patch::entity::{KernelPatch, KernelPatchFunction};
 
+mod state;
 mod sys;
 mod target;
 
+use state::KernelStateCache;
 use target::PatchTarget;
 
 pub struct KernelPatchDriver {
     target_map: IndexMap<OsString, PatchTarget>,
+    state: KernelStateCache,
 }
 
 impl KernelPatchDriver {
     pub fn new() -> Result<Self> {
         Ok(Self {
             target_map: IndexMap::new(),
+            state: KernelStateCache::new()?,
         })
     }
 }
@@ -135,17 +139,17 @@ impl KernelPatchDriver {
         Ok(())
     }
 
-    fn check_dependency(patch: &KernelPatch) -> Result<()> {
+    fn check_dependency(&self, patch: &KernelPatch) -> Result<()> {
         const VMLINUX_MODULE_NAME: &str = "vmlinux";
 
         let mut non_exist_kmod = IndexSet::new();
 
-        let kmod_list = sys::list_kernel_modules()?;
+        let kmod_list = self.state.list_kernel_modules()?;
         for kmod_name in Self::group_patch_targets(patch) {
             if kmod_name == VMLINUX_MODULE_NAME {
                 continue;
             }
-            if kmod_list.iter().any(|name| name == kmod_name) {
+            if kmod_list.contains(kmod_name) {
                 continue;
             }
             non_exist_kmod.insert(kmod_name);
@@ -232,11 +236,20 @@ impl KernelPatchDriver {
     pub fn check(&self, patch: &KernelPatch) -> Result<()> {
         Self::check_consistency(patch)?;
         Self::check_compatiblity(patch)?;
-        Self::check_dependency(patch)?;
+        self.check_dependency(patch)?;
 
         Ok(())
     }
 
+    /// Kernel state which is not told by uevents is kept until the transaction ends
+    pub fn begin_transaction(&self) {
+        self.state.begin_transaction()
+    }
+
+    pub fn end_transaction(&self) {
+        self.state.end_transaction()
+    }
+
     pub fn apply(&mut self, patch: &KernelPatch) -> Result<()> {
         info!(
             "Applying patch '{}' ({})",
@@ -244,7 +257,7 @@ impl KernelPatchDriver {
             patch.patch_file.display()
         );
 
-        sys::selinux_relable_patch(patch)?;
+        sys::selinux_relable_patch(patch, self.state.selinux_status()?)?;
         sys::apply_patch(patch)?;
         self.add_patch_target(patch);
 
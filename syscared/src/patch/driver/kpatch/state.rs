@@ -0,0 +1,310 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    ffi::{OsStr, OsString},
+    io, mem,
+    os::unix::{ffi::OsStrExt, io::RawFd},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    thread,
+};
+
+use anyhow::{Context, Result};
+use indexmap::IndexSet;
+use log::{debug, warn};
+use nix::libc;
+use parking_lot::Mutex;
+
+use syscare_common::os::selinux;
+
+use super::sys;
+
+const STATE_THREAD_NAME: &str = "kpatch_state";
+const STATE_RECV_TIMEOUT: i64 = 1; // seconds
+const STATE_MSG_BUFFER_SIZE: usize = 8192;
+
+/* Kernel uevents are sent to the first multicast group of NETLINK_KOBJECT_UEVENT */
+const UEVENT_GROUP_KERNEL: u32 = 1;
+const UEVENT_SUBSYSTEM_MODULE: &[u8] = b"SUBSYSTEM=module";
+const UEVENT_DEVPATH_PREFIX: &[u8] = b"/module/";
+
+#[derive(Default)]
+struct KernelState {
+    modules: Option<IndexSet<OsString>>,
+    generation: u64, // Bumped on every module change
+    listening: bool,
+    selinux_status: Option<selinux::Status>,
+    in_transaction: bool,
+}
+
+impl KernelState {
+    fn invalidate(&mut self) {
+        self.modules = None;
+        self.generation += 1;
+    }
+
+    /* "<action>@<devpath>\0KEY=VALUE\0...", module uevents are sent on load & unload */
+    fn handle_message(&mut self, msg: &[u8]) {
+        let mut fields = msg.split(|c| *c == 0);
+        let module_name = fields
+            .next()
+            .and_then(|header| {
+                header
+                    .iter()
+                    .position(|c| *c == b'@')
+                    .map(|i| &header[i + 1..])
+            })
+            .and_then(|devpath| devpath.strip_prefix(UEVENT_DEVPATH_PREFIX));
+
+        if let Some(name) = module_name {
+            if fields.any(|field| field == UEVENT_SUBSYSTEM_MODULE) {
+                debug!(
+                    "Kpatch: Module '{}' changed",
+                    OsStr::from_bytes(name).to_string_lossy()
+                );
+                self.invalidate();
+            }
+        }
+    }
+}
+
+/// Kernel state cache fed by module uevents.
+/// Loaded modules are read from sysfs once, then served from memory until a module
+/// is loaded or unloaded. Without the event stream, sysfs is always read.
+/// Selinux status is read once per transaction.
+/// Patch status is not cached, writing sysfs 'enabled' sends no uevent.
+pub(super) struct KernelStateCache {
+    state: Arc<Mutex<KernelState>>,
+    running: Arc<AtomicBool>,
+    listen_thread: Option<thread::JoinHandle<()>>,
+}
+
+impl KernelStateCache {
+    pub fn new() -> Result<Self> {
+        let state = Arc::new(Mutex::new(KernelState::default()));
+        let running = Arc::new(AtomicBool::new(true));
+
+        let listen_thread = match Self::open_socket() {
+            Ok(socket) => Some(Self::spawn_thread(socket, state.clone(), running.clone())?),
+            Err(e) => {
+                warn!(
+                    "Kpatch: Module event is unavailable, {}",
+                    e.to_string().to_lowercase()
+                );
+                None
+            }
+        };
+        state.lock().listening = listen_thread.is_some();
+
+        Ok(Self {
+            state,
+            running,
+            listen_thread,
+        })
+    }
+
+    pub fn list_kernel_modules(&self) -> Result<IndexSet<OsString>> {
+        let generation = {
+            let state = self.state.lock();
+            if let Some(modules) = &state.modules {
+                return Ok(modules.clone());
+            }
+            state.generation
+        };
+
+        let modules = sys::list_kernel_modules()?
+            .into_iter()
+            .collect::<IndexSet<_>>();
+
+        // Modules changed meanwhile, the list may be stale already
+        let mut state = self.state.lock();
+        if state.listening && (state.generation == generation) {
+            state.modules = Some(modules.clone());
+        }
+
+        Ok(modules)
+    }
+
+    pub fn selinux_status(&self) -> Result<selinux::Status> {
+        let mut state = self.state.lock();
+        if let Some(status) = state.selinux_status {
+            return Ok(status);
+        }
+
+        let status = selinux::get_status()?;
+        if state.in_transaction {
+            state.selinux_status = Some(status);
+        }
+
+        Ok(status)
+    }
+
+    pub fn begin_transaction(&self) {
+        let mut state = self.state.lock();
+
+        state.in_transaction = true;
+        state.selinux_status = None;
+    }
+
+    pub fn end_transaction(&self) {
+        let mut state = self.state.lock();
+
+        state.in_transaction = false;
+        state.selinux_status = None;
+    }
+}
+
+impl KernelStateCache {
+    fn last_error() -> io::Error {
+        io::Error::last_os_error()
+    }
+
+    fn open_socket() -> io::Result<RawFd> {
+        let socket = unsafe {
+            libc::socket(
+                libc::AF_NETLINK,
+                libc::SOCK_DGRAM | libc::SOCK_CLOEXEC,
+                libc::NETLINK_KOBJECT_UEVENT,
+            )
+        };
+        if socket < 0 {
+            return Err(Self::last_error());
+        }
+
+        let result = Self::setup_socket(socket);
+        if result.is_err() {
+            unsafe { libc::close(socket) };
+        }
+        result.map(|_| socket)
+    }
+
+    fn setup_socket(socket: RawFd) -> io::Result<()> {
+        let mut addr: libc::sockaddr_nl = unsafe { mem::zeroed() };
+        addr.nl_family = libc::AF_NETLINK as libc::sa_family_t;
+        addr.nl_groups = UEVENT_GROUP_KERNEL;
+
+        let ret = unsafe {
+            libc::bind(
+                socket,
+                &addr as *const libc::sockaddr_nl as *const libc::sockaddr,
+                mem::size_of::<libc::sockaddr_nl>() as libc::socklen_t,
+            )
+        };
+        if ret < 0 {
+            return Err(Self::last_error());
+        }
+
+        let timeout = libc::timeval {
+            tv_sec: STATE_RECV_TIMEOUT as libc::time_t,
+            tv_usec: 0,
+        };
+        let ret = unsafe {
+            libc::setsockopt(
+                socket,
+                libc::SOL_SOCKET,
+                libc::SO_RCVTIMEO,
+                &timeout as *const libc::timeval as *const libc::c_void,
+                mem::size_of::<libc::timeval>() as libc::socklen_t,
+            )
+        };
+        if ret < 0 {
+            return Err(Self::last_error());
+        }
+
+        Ok(())
+    }
+
+    fn spawn_thread(
+        socket: RawFd,
+        state: Arc<Mutex<KernelState>>,
+        running: Arc<AtomicBool>,
+    ) -> Result<thread::JoinHandle<()>> {
+        let thread = thread::Builder::new()
+            .name(STATE_THREAD_NAME.to_string())
+            .spawn(move || Self::thread_main(socket, state, running));
+        if thread.is_err() {
+            unsafe { libc::close(socket) };
+        }
+        thread.with_context(|| format!("Failed to create thread '{}'", STATE_THREAD_NAME))
+    }
+
+    fn thread_main(socket: RawFd, state: Arc<Mutex<KernelState>>, running: Arc<AtomicBool>) {
+        let mut buffer = [0u8; STATE_MSG_BUFFER_SIZE];
+
+        while running.load(Ordering::Relaxed) {
+            let len = unsafe {
+                libc::recv(
+                    socket,
+                    buffer.as_mut_ptr() as *mut libc::c_void,
+                    buffer.len(),
+                    0,
+                )
+            };
+            if len >= 0 {
+                state.lock().handle_message(&buffer[..len as usize]);
+                continue;
+            }
+
+            let e = Self::last_error();
+            match e.raw_os_error() {
+                Some(libc::EAGAIN) | Some(libc::EINTR) => {}
+                Some(libc::ENOBUFS) => {
+                    debug!("Kpatch: Module events lost, state is outdated");
+                    state.lock().invalidate();
+                }
+                _ => {
+                    warn!(
+                        "Kpatch: Failed to receive module event, {}",
+                        e.to_string().to_lowercase()
+                    );
+                    let mut state = state.lock();
+                    state.invalidate();
+                    state.listening = false;
+                    break;
+                }
+            }
+        }
+
+        unsafe { libc::close(socket) };
+    }
+}
+
+impl Drop for KernelStateCache {
+    fn drop(&mut self) {
+        self.running.store(false, Ordering::Relaxed);
+        if let Some(thread) = self.listen_thread.take() {
+            thread.join().ok();
+        }
+    }
+}
+
+#[test]
+fn test_handle_message() {
+    let mut state = KernelState {
+        modules: Some(IndexSet::new()),
+        listening: true,
+        ..Default::default()
+    };
+
+    state.handle_message(b"add@/devices/virtual/net/lo\0SUBSYSTEM=net\0");
+    assert!(state.modules.is_some());
+    assert_eq!(state.generation, 0);
+
+    state.handle_message(b"remove@/module/klp_test\0ACTION=remove\0SUBSYSTEM=module\0SEQNUM=1\0");
+    assert!(state.modules.is_none());
+    assert_eq!(state.generation, 1);
+}
@@ -36,10 +36,13 @@ pub fn list_kernel_modules() -> Result<Vec<OsString>> {
     Ok(module_names)
 }
 
-pub fn selinux_relable_patch(patch: &KernelPatch) -> Result<()> {
+pub fn selinux_relable_patch(
+    patch: &KernelPatch,
+    selinux_status: os::selinux::Status,
+) -> Result<()> {
     const KPATCH_PATCH_SEC_TYPE: &str = "modules_object_t";
 
-    if os::selinux::get_status()? != os::selinux::Status::Enforcing {
+    if selinux_status != os::selinux::Status::Enforcing {
         return Ok(());
     }
 
@@ -12,7 +12,7 @@
  * See the Mulan PSL v2 for more details.
  */
 
-use anyhow::{Context, Result};
+use anyhow::{bail, Context, Result};
 
 use log::info;
 use syscare_abi::PatchStatus;
@@ -68,6 +68,11 @@ impl PatchDriver {
         })
     }
 
+    /// Processes patched by user patches, which are changed in background as well.
+    pub fn patched_processes(&self) -> PatchedProcesses {
+        self.upatch.patched_processes()
+    }
+
     /// Fetch and return the patch status.
     pub fn patch_status(&self, patch: &Patch) -> Result<PatchStatus> {
         match patch {
@@ -77,6 +82,16 @@ impl PatchDriver {
         .with_context(|| format!("Failed to get patch '{}' status", patch))
     }
 
+    /// Start a transaction, state read by drivers may be kept until it ends.
+    pub fn begin_transaction(&self) {
+        self.kpatch.begin_transaction()
+    }
+
+    /// End a transaction, state kept by drivers is read again afterwards.
+    pub fn end_transaction(&self) {
+        self.kpatch.end_transaction()
+    }
+
     /// Perform patch file intergrity & consistency check. </br>
     /// Should be used before patch application.
     pub fn check_patch(&self, patch: &Patch, flag: PatchOpFlag) -> Result<()> {
@@ -133,6 +148,30 @@ impl PatchDriver {
         .with_context(|| format!("Failed to active patch '{}'", patch))
     }
 
+    /// Start activating a user patch in background. </br>
+    /// Patches of different targets could be actived concurrently,
+    /// `finish_active_patch()` must be called to complete it.
+    pub fn start_active_patch(&self, patch: &Patch, flag: PatchOpFlag) -> Result<PendingActive> {
+        if flag != PatchOpFlag::Force {
+            self.check_conflict_functions(patch)?;
+        }
+        match patch {
+            Patch::KernelPatch(_) => bail!("Kernel patch cannot be actived in background"),
+            Patch::UserPatch(patch) => self.upatch.start_active(patch),
+        }
+        .with_context(|| format!("Failed to active patch '{}'", patch))
+    }
+
+    /// Complete a background activation. </br>
+    /// After this action, the patch status would be changed to 'ACTIVED'.
+    pub fn finish_active_patch(&mut self, patch: &Patch, pending: PendingActive) -> Result<()> {
+        match patch {
+            Patch::KernelPatch(_) => bail!("Kernel patch cannot be actived in background"),
+            Patch::UserPatch(patch) => self.upatch.finish_active(patch, pending),
+        }
+        .with_context(|| format!("Failed to active patch '{}'", patch))
+    }
+
     /// Deactive a patch. </br>
     /// After this action, the patch status would be changed to 'DEACTIVED'.
     pub fn deactive_patch(&mut self, patch: &Patch, flag: PatchOpFlag) -> Result<()> {
@@ -145,4 +184,19 @@ impl PatchDriver {
         }
         .with_context(|| format!("Failed to deactive patch '{}'", patch))
     }
+    /// Replace an actived patch by another one of the same target at once. </br>
+    /// After this action, the old patch status would be changed to 'DEACTIVED',
+    /// the new patch status would be changed to 'ACTIVED'.
+    pub fn replace_patch(&mut self, old: &Patch, new: &Patch, flag: PatchOpFlag) -> Result<()> {
+        match (old, new) {
+            (Patch::UserPatch(old_patch), Patch::UserPatch(new_patch)) => {
+                if flag != PatchOpFlag::Force {
+                    self.upatch.check_replace_functions(old_patch, new_patch)?;
+                }
+                self.upatch.replace(old_patch, new_patch)
+            }
+            _ => bail!("Kernel patch cannot be replaced"),
+        }
+        .with_context(|| format!("Failed to replace patch '{}' by '{}'", old, new))
+    }
 }
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{convert::TryInto, fs::File, io, os::unix::fs::FileExt};
+
+use indexmap::IndexSet;
+use uuid::Uuid;
+
+use syscare_common::fs;
+
+/* upatch-manage/upatch-process.h */
+const ARENA_MAGIC: &[u8] = b"UPATCH_ARENA\0";
+const ARENA_HEADER_SIZE: usize = 4064;
+const ARENA_NUM_PATCHES_OFFSET: usize = 24;
+const ARENA_PATCHES_OFFSET: usize = 32;
+const ARENA_PATCH_SIZE: usize = 64;
+const ARENA_PATCH_ID_LEN: usize = 41;
+const ARENA_MAX_PATCH: usize = 63;
+
+fn parse_arena_patches(header: &[u8]) -> Option<IndexSet<Uuid>> {
+    if !header.starts_with(ARENA_MAGIC) {
+        return None;
+    }
+    let num_patches = header
+        .get(ARENA_NUM_PATCHES_OFFSET..ARENA_NUM_PATCHES_OFFSET + 4)
+        .and_then(|bytes| bytes.try_into().ok())
+        .map(u32::from_ne_bytes)? as usize;
+
+    let patches = (0..num_patches.min(ARENA_MAX_PATCH))
+        .filter_map(|index| {
+            let offset = ARENA_PATCHES_OFFSET + index * ARENA_PATCH_SIZE;
+            let id = header.get(offset..offset + ARENA_PATCH_ID_LEN)?;
+            let len = id.iter().position(|c| *c == 0).unwrap_or(id.len());
+            Uuid::parse_str(std::str::from_utf8(&id[..len]).ok()?).ok()
+        })
+        .collect();
+
+    Some(patches)
+}
+
+/// Patches listed by arenas of the process, each arena takes a single read.
+///
+/// Forked processes share arenas with their parent, thus patches they inherited
+/// are found without parsing their maps. Addresses not being an arena are skipped.
+pub fn read_patches(pid: i32, arenas: &IndexSet<u64>) -> IndexSet<Uuid> {
+    let mut patches = IndexSet::new();
+    let file = match File::open(format!("/proc/{}/mem", pid)) {
+        Ok(file) => file,
+        Err(_) => return patches,
+    };
+
+    let mut header = vec![0; ARENA_HEADER_SIZE];
+    for addr in arenas {
+        if file.read_exact_at(&mut header, *addr).is_err() {
+            continue;
+        }
+        if let Some(arena_patches) = self::parse_arena_patches(&header) {
+            patches.extend(arena_patches);
+        }
+    }
+
+    patches
+}
+
+/// Find arenas of the process, which are anonymous read-only mappings starting with magic
+pub fn find_arenas(pid: i32) -> io::Result<IndexSet<u64>> {
+    const PERMS_FIELD_INDEX: usize = 1;
+    const INODE_FIELD_INDEX: usize = 4;
+
+    let maps = fs::read(format!("/proc/{}/maps", pid))?;
+    let file = File::open(format!("/proc/{}/mem", pid))?;
+
+    let mut magic = vec![0; ARENA_MAGIC.len()];
+    let arenas = maps
+        .split(|c| *c == b'\n')
+        .filter_map(|line| {
+            let fields = line
+                .split(|c| c.is_ascii_whitespace())
+                .filter(|field| !field.is_empty())
+                .collect::<Vec<_>>();
+            if (fields.len() != INODE_FIELD_INDEX + 1)
+                || (fields[PERMS_FIELD_INDEX] != b"r--p")
+                || (fields[INODE_FIELD_INDEX] != b"0")
+            {
+                return None;
+            }
+            let start = std::str::from_utf8(fields[0]).ok()?.split('-').next()?;
+            u64::from_str_radix(start, 16).ok()
+        })
+        .filter(|addr| {
+            file.read_exact_at(&mut magic, *addr).is_ok() && (magic.as_slice() == ARENA_MAGIC)
+        })
+        .collect();
+
+    Ok(arenas)
+}
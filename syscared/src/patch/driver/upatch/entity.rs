@@ -14,21 +14,21 @@
 
 use std::path::PathBuf;
 
-use indexmap::{indexset, IndexSet};
+use super::pid_set::PidSet;
 
 #[derive(Debug)]
 pub struct PatchEntity {
     pub patch_file: PathBuf,
-    process_list: IndexSet<i32>,
-    ignored_list: IndexSet<i32>,
+    process_list: PidSet,
+    ignored_list: PidSet,
 }
 
 impl PatchEntity {
     pub fn new(patch_file: PathBuf) -> Self {
         Self {
             patch_file,
-            process_list: indexset! {},
-            ignored_list: indexset! {},
+            process_list: PidSet::default(),
+            ignored_list: PidSet::default(),
         }
     }
 }
@@ -39,36 +39,33 @@ impl PatchEntity {
     }
 
     pub fn remove_process(&mut self, pid: i32) {
-        self.process_list.remove(&pid);
+        self.process_list.remove(pid);
     }
 
-    pub fn ignore_process(&mut self, pid: i32) {
-        self.ignored_list.insert(pid);
+    pub fn process_num(&self) -> usize {
+        self.process_list.len()
     }
 
-    pub fn clean_dead_process(&mut self, process_list: &IndexSet<i32>) {
-        self.process_list.retain(|pid| process_list.contains(pid));
-        self.ignored_list.retain(|pid| process_list.contains(pid));
+    pub fn ignore_process(&mut self, pid: i32) {
+        self.ignored_list.insert(pid);
     }
 
-    pub fn need_ignored(&self, process_list: &IndexSet<i32>) -> IndexSet<i32> {
-        process_list
-            .intersection(&self.ignored_list)
-            .copied()
-            .collect()
+    pub fn clean_dead_process(&mut self, process_list: &PidSet) {
+        self.process_list.retain_in(process_list);
+        self.ignored_list.retain_in(process_list);
     }
 
-    pub fn need_actived(&self, process_list: &IndexSet<i32>) -> IndexSet<i32> {
+    /// Processes lacking the patch, except the ones failed before
+    pub fn need_actived<'a>(&'a self, process_list: &'a PidSet) -> impl Iterator<Item = i32> + 'a {
         process_list
             .difference(&self.process_list)
-            .copied()
-            .collect()
+            .filter(move |pid| !self.ignored_list.contains(*pid))
     }
 
-    pub fn need_deactived(&self, process_list: &IndexSet<i32>) -> IndexSet<i32> {
-        process_list
-            .intersection(&self.process_list)
-            .copied()
-            .collect()
+    pub fn need_deactived<'a>(
+        &'a self,
+        process_list: &'a PidSet,
+    ) -> impl Iterator<Item = i32> + 'a {
+        process_list.intersection(&self.process_list)
     }
 }
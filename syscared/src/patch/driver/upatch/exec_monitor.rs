@@ -0,0 +1,411 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    ffi::CString,
+    io, mem,
+    os::unix::{ffi::OsStrExt, fs::MetadataExt, io::RawFd},
+    path::{Path, PathBuf},
+    ptr,
+    sync::{mpsc, Arc},
+    thread,
+};
+
+use anyhow::{Context, Result};
+use indexmap::IndexMap;
+use log::{debug, info};
+use nix::libc;
+use parking_lot::{Mutex, RwLock};
+
+use super::{registry::ProcessRegistry, target::PatchTarget, tracer::Tracee, waker::Waker};
+
+const MONITOR_THREAD_NAME: &str = "upatch_exec";
+const TRACER_THREAD_NAME: &str = "upatch_tracer";
+const TRACER_THREAD_NUM: usize = 4;
+const MONITOR_EVENT_BUFFER_SIZE: usize = 4096;
+
+/* linux/fanotify.h */
+const FAN_CLOEXEC: libc::c_uint = 0x00000001;
+const FAN_NONBLOCK: libc::c_uint = 0x00000002;
+const FAN_CLASS_CONTENT: libc::c_uint = 0x00000004;
+const FAN_MARK_ADD: libc::c_uint = 0x00000001;
+const FAN_MARK_REMOVE: libc::c_uint = 0x00000002;
+const FAN_OPEN_EXEC_PERM: u64 = 0x00040000;
+const FAN_ALLOW: u32 = 0x01;
+const FANOTIFY_METADATA_VERSION: u8 = 3;
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct FanotifyEventMetadata {
+    event_len: u32,
+    vers: u8,
+    _reserved: u8,
+    _metadata_len: u16,
+    mask: u64,
+    fd: i32,
+    pid: i32,
+}
+
+#[repr(C)]
+struct FanotifyResponse {
+    fd: i32,
+    response: u32,
+}
+
+struct Fanotify {
+    fd: RawFd,
+}
+
+impl Fanotify {
+    fn new() -> io::Result<Self> {
+        let fd = unsafe {
+            libc::syscall(
+                libc::SYS_fanotify_init,
+                FAN_CLASS_CONTENT | FAN_CLOEXEC | FAN_NONBLOCK,
+                (libc::O_RDONLY | libc::O_CLOEXEC | libc::O_LARGEFILE) as libc::c_uint,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self { fd: fd as RawFd })
+    }
+
+    fn mark(&self, flags: libc::c_uint, file_path: &Path) -> io::Result<()> {
+        let path = CString::new(file_path.as_os_str().as_bytes())
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidInput, e))?;
+        let ret = unsafe {
+            libc::syscall(
+                libc::SYS_fanotify_mark,
+                self.fd,
+                flags,
+                FAN_OPEN_EXEC_PERM,
+                libc::AT_FDCWD,
+                path.as_ptr(),
+            )
+        };
+        if ret < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    fn read(&self, buffer: &mut [u8]) -> io::Result<usize> {
+        let len = unsafe {
+            libc::read(
+                self.fd,
+                buffer.as_mut_ptr() as *mut libc::c_void,
+                buffer.len(),
+            )
+        };
+        if len < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(len as usize)
+    }
+
+    fn allow(&self, event_fd: RawFd) {
+        let response = FanotifyResponse {
+            fd: event_fd,
+            response: FAN_ALLOW,
+        };
+        unsafe {
+            libc::write(
+                self.fd,
+                &response as *const FanotifyResponse as *const libc::c_void,
+                mem::size_of::<FanotifyResponse>(),
+            )
+        };
+    }
+}
+
+impl Drop for Fanotify {
+    fn drop(&mut self) {
+        // Pending permission events are allowed by kernel once the group is gone
+        unsafe { libc::close(self.fd) };
+    }
+}
+
+/// Exec of the process is blocked until this is dropped
+struct ExecEvent {
+    fanotify: Arc<Fanotify>,
+    fd: RawFd,
+    pid: i32,
+}
+
+impl Drop for ExecEvent {
+    fn drop(&mut self) {
+        self.fanotify.allow(self.fd);
+        unsafe { libc::close(self.fd) };
+    }
+}
+
+/// Catches exec of watched files with fanotify permission events.
+///
+/// While exec is blocked, the process gets traced, thus it could be stopped right at entry
+/// of the new image, after all libraries are mapped and before any user code runs.
+/// Processes are traced by a fixed number of tracer threads, an exec happens while all of
+/// them are busy goes on untraced, which is patched later by the inotify path.
+pub(super) struct ExecMonitor {
+    fanotify: Arc<Fanotify>,
+    watch_file_map: Arc<RwLock<IndexMap<(u64, u64), PathBuf>>>, // (Device, Inode) -> File
+    waker: Arc<Waker>,
+    monitor_thread: Option<thread::JoinHandle<()>>,
+    tracer_threads: Vec<thread::JoinHandle<()>>,
+}
+
+impl ExecMonitor {
+    pub fn new<F>(
+        registry: Arc<ProcessRegistry>,
+        patch_target_map: Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>,
+        callback: F,
+    ) -> Result<Self>
+    where
+        F: Fn(Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>, &Path) + Send + Sync + 'static,
+    {
+        let fanotify = Arc::new(Fanotify::new().context("Failed to initialize fanotify")?);
+        let watch_file_map = Arc::new(RwLock::new(IndexMap::new()));
+        let waker = Arc::new(Waker::new().context("Failed to initialize waker")?);
+
+        // Rendezvous channel, an event is sent only if there is an idle tracer
+        let (tracer_sender, tracer_receiver) = mpsc::sync_channel(0);
+        let tracer_receiver = Arc::new(Mutex::new(tracer_receiver));
+        let callback = Arc::new(callback);
+        let mut tracer_threads = Vec::with_capacity(TRACER_THREAD_NUM);
+        for _ in 0..TRACER_THREAD_NUM {
+            let tracer_thread = TracerThread {
+                receiver: tracer_receiver.clone(),
+                registry: registry.clone(),
+                patch_target_map: patch_target_map.clone(),
+                callback: callback.clone(),
+            }
+            .run()?;
+            tracer_threads.push(tracer_thread);
+        }
+
+        let monitor_thread = MonitorThread {
+            fanotify: fanotify.clone(),
+            watch_file_map: watch_file_map.clone(),
+            waker: waker.clone(),
+            tracer_sender,
+        }
+        .run()?;
+
+        Ok(Self {
+            fanotify,
+            watch_file_map,
+            waker,
+            monitor_thread: Some(monitor_thread),
+            tracer_threads,
+        })
+    }
+}
+
+impl ExecMonitor {
+    pub fn watch_file<P: AsRef<Path>>(&self, file_path: P) -> Result<()> {
+        let watch_file = file_path.as_ref();
+        let metadata = watch_file
+            .metadata()
+            .with_context(|| format!("Failed to read metadata of {}", watch_file.display()))?;
+        let file_key = (metadata.dev(), metadata.ino());
+
+        let mut watch_file_map = self.watch_file_map.write();
+        if watch_file_map.contains_key(&file_key) {
+            return Ok(());
+        }
+
+        self.fanotify
+            .mark(FAN_MARK_ADD, watch_file)
+            .with_context(|| format!("Failed to watch exec of {}", watch_file.display()))?;
+        watch_file_map.insert(file_key, watch_file.to_owned());
+        info!("Start watching exec of {}", watch_file.display());
+
+        Ok(())
+    }
+
+    pub fn ignore_file<P: AsRef<Path>>(&self, file_path: P) -> Result<()> {
+        let ignore_file = file_path.as_ref();
+
+        let mut watch_file_map = self.watch_file_map.write();
+        let old_len = watch_file_map.len();
+        watch_file_map.retain(|_, watch_file| watch_file != ignore_file);
+        if watch_file_map.len() == old_len {
+            return Ok(());
+        }
+
+        // Exec of an unknown file is allowed anyway, a mark left on a removed file is harmless
+        match self.fanotify.mark(FAN_MARK_REMOVE, ignore_file) {
+            Err(e) if e.raw_os_error() != Some(libc::ENOENT) => {
+                return Err(e).with_context(|| {
+                    format!("Failed to stop watch exec of {}", ignore_file.display())
+                });
+            }
+            _ => info!("Stop watching exec of {}", ignore_file.display()),
+        }
+
+        Ok(())
+    }
+}
+
+struct TracerThread<F> {
+    receiver: Arc<Mutex<mpsc::Receiver<(ExecEvent, PathBuf)>>>,
+    registry: Arc<ProcessRegistry>,
+    patch_target_map: Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>,
+    callback: Arc<F>,
+}
+
+impl<F> TracerThread<F>
+where
+    F: Fn(Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>, &Path) + Send + Sync + 'static,
+{
+    fn run(self) -> Result<thread::JoinHandle<()>> {
+        thread::Builder::new()
+            .name(TRACER_THREAD_NAME.to_string())
+            .spawn(move || self.thread_main())
+            .with_context(|| format!("Failed to create thread '{}'", TRACER_THREAD_NAME))
+    }
+
+    /// Trace the process from its exec, then patch it at entry
+    fn trace_process(&self, event: ExecEvent, target_elf: &Path) {
+        let pid = event.pid;
+
+        // Process must not be patched in the middle of dynamic linking
+        self.registry.hold_process(pid);
+        let tracee = Tracee::seize_exec(pid);
+        drop(event);
+
+        let result = tracee.and_then(Tracee::park_at_entry);
+        self.registry.release_process(pid);
+
+        // Patch anyway, the process is still caught much earlier than by inotify
+        if let Err(e) = &result {
+            debug!(
+                "Upatch: Failed to stop process {} at entry, {}",
+                pid,
+                e.to_string().to_lowercase()
+            );
+        }
+        (self.callback)(self.patch_target_map.clone(), target_elf);
+
+        if let Ok(Some(parked)) = result {
+            if let Err(e) = parked.resume() {
+                debug!(
+                    "Upatch: Failed to resume process {}, {}",
+                    pid,
+                    e.to_string().to_lowercase()
+                );
+            }
+        }
+    }
+
+    fn thread_main(self) {
+        loop {
+            let job = self.receiver.lock().recv();
+            match job {
+                Ok((event, target_elf)) => self.trace_process(event, &target_elf),
+                Err(_) => break,
+            }
+        }
+    }
+}
+
+struct MonitorThread {
+    fanotify: Arc<Fanotify>,
+    watch_file_map: Arc<RwLock<IndexMap<(u64, u64), PathBuf>>>,
+    waker: Arc<Waker>,
+    tracer_sender: mpsc::SyncSender<(ExecEvent, PathBuf)>,
+}
+
+impl MonitorThread {
+    fn run(self) -> Result<thread::JoinHandle<()>> {
+        thread::Builder::new()
+            .name(MONITOR_THREAD_NAME.to_string())
+            .spawn(move || self.thread_main())
+            .with_context(|| format!("Failed to create thread '{}'", MONITOR_THREAD_NAME))
+    }
+
+    fn find_exec_file(&self, event_fd: RawFd) -> Option<PathBuf> {
+        let mut stat: libc::stat = unsafe { mem::zeroed() };
+        if unsafe { libc::fstat(event_fd, &mut stat) } != 0 {
+            return None;
+        }
+        self.watch_file_map
+            .read()
+            .get(&(stat.st_dev, stat.st_ino))
+            .cloned()
+    }
+
+    fn handle_event(&self, metadata: &FanotifyEventMetadata) {
+        let event = ExecEvent {
+            fanotify: self.fanotify.clone(),
+            fd: metadata.fd,
+            pid: metadata.pid,
+        };
+        if (metadata.mask & FAN_OPEN_EXEC_PERM) == 0 {
+            return;
+        }
+        let target_elf = match self.find_exec_file(event.fd) {
+            Some(file) => file,
+            None => return,
+        };
+
+        // Event is dropped if all tracers are busy, which lets the exec go on
+        if self.tracer_sender.try_send((event, target_elf)).is_err() {
+            debug!(
+                "Upatch: All tracers are busy, process {} is not traced",
+                metadata.pid
+            );
+        }
+    }
+
+    fn thread_main(self) {
+        let mut buffer = [0; MONITOR_EVENT_BUFFER_SIZE];
+        let metadata_size = mem::size_of::<FanotifyEventMetadata>();
+
+        while let Ok(true) = self.waker.wait(self.fanotify.fd) {
+            let len = match self.fanotify.read(&mut buffer) {
+                Ok(len) => len,
+                Err(_) => continue,
+            };
+
+            let mut offset = 0;
+            while offset + metadata_size <= len {
+                let metadata = unsafe {
+                    ptr::read_unaligned(buffer[offset..].as_ptr() as *const FanotifyEventMetadata)
+                };
+                if (metadata.event_len as usize) < metadata_size {
+                    break;
+                }
+                offset += metadata.event_len as usize;
+
+                if (metadata.vers == FANOTIFY_METADATA_VERSION) && (metadata.fd >= 0) {
+                    self.handle_event(&metadata);
+                }
+            }
+        }
+    }
+}
+
+impl Drop for ExecMonitor {
+    fn drop(&mut self) {
+        self.waker.wake();
+        if let Some(thread) = self.monitor_thread.take() {
+            thread.join().ok();
+        }
+        // Tracers exit once the monitor thread dropped the sender
+        for thread in self.tracer_threads.drain(..) {
+            thread.join().ok();
+        }
+    }
+}
@@ -13,51 +13,189 @@
  */
 
 use std::{
-    ffi::OsStr,
     fmt::Write,
     os::linux::fs::MetadataExt,
     path::{Path, PathBuf},
-    sync::Arc,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    thread,
 };
 
-use anyhow::{bail, ensure, Context, Result};
+use anyhow::{anyhow, bail, ensure, Context, Result};
 use indexmap::{indexset, IndexMap, IndexSet};
 use log::{debug, info, warn};
-use parking_lot::RwLock;
+use parking_lot::{Mutex, RwLock};
 use uuid::Uuid;
 
-use syscare_abi::PatchStatus;
-use syscare_common::{fs, util::digest};
+use syscare_abi::{PatchStatus, PatchTelemetryRecord};
+use syscare_common::util::digest;
 
 use crate::patch::{driver::upatch::entity::PatchEntity, entity::UserPatch};
 
+mod arena;
 mod entity;
+mod exec_monitor;
 mod monitor;
+mod pid_set;
+mod registry;
+mod rollout;
 mod sys;
 mod target;
+mod telemetry;
+mod tracer;
+mod waker;
+mod worker;
 
+use exec_monitor::ExecMonitor;
 use monitor::UserPatchMonitor;
-use target::PatchTarget;
+use pid_set::PidSet;
+use registry::ProcessRegistry;
+use target::{PatchTarget, ProcessGuard};
+use worker::NewProcessWorker;
+
+const ACTIVE_THREAD_NAME: &str = "upatch_active";
+
+static PATCH_ON_EXEC: AtomicBool = AtomicBool::new(false);
+
+/// Patch activation running in background, see `UserPatchDriver::start_active()`
+///
+/// The target is held by its process lock until the activation is finished or dropped.
+pub struct PendingActive {
+    patch_entity: PatchEntity,
+    worker: thread::JoinHandle<Vec<(i32, Result<()>)>>,
+    process_guard: ProcessGuard,
+}
+
+/// Processes patched by user patches, could be read without the patch manager
+#[derive(Clone)]
+pub struct PatchedProcesses(Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>);
+
+impl PatchedProcesses {
+    pub fn process_num(&self, target_elf: &Path, uuid: &Uuid) -> usize {
+        self.0
+            .read()
+            .get(target_elf)
+            .map(|target| target.process_num(uuid))
+            .unwrap_or_default()
+    }
+}
 
 pub struct UserPatchDriver {
     status_map: IndexMap<Uuid, PatchStatus>,
     target_map: Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>,
+    registry: Arc<ProcessRegistry>,
     monitor: UserPatchMonitor,
+    exec_monitor: Option<ExecMonitor>,
+    _worker: NewProcessWorker,
 }
 
 impl UserPatchDriver {
     pub fn new() -> Result<Self> {
         let status_map = IndexMap::new();
         let target_map = Arc::new(RwLock::new(IndexMap::new()));
-        let monitor = UserPatchMonitor::new(target_map.clone(), Self::patch_new_process)?;
+        let registry = Arc::new(ProcessRegistry::new()?);
+        let worker_registry = registry.clone();
+        let worker_target_map = target_map.clone();
+        let worker = NewProcessWorker::new(move |target_elf| {
+            Self::patch_new_process(&worker_registry, worker_target_map.clone(), target_elf)
+        })?;
+        let monitor_queue = worker.queue();
+        let monitor = UserPatchMonitor::new(move |target_elf| monitor_queue.push(target_elf))?;
+        let exec_monitor = match PATCH_ON_EXEC.load(Ordering::Relaxed) {
+            true => Self::start_exec_monitor(&registry, &target_map),
+            false => None,
+        };
         let instance = Self {
             status_map,
             target_map,
+            registry,
             monitor,
+            exec_monitor,
+            _worker: worker,
         };
 
         Ok(instance)
     }
+
+    pub fn set_max_parallel(value: usize) {
+        sys::set_max_parallel(value)
+    }
+
+    /// Share patch text of processes with identical layout through image files in the directory
+    pub fn set_share_dir(value: Option<PathBuf>) {
+        sys::set_share_dir(value)
+    }
+
+    /// Stop a process by freezing its cgroup v2 if the cgroup holds nothing else, see `upatch-manage`
+    pub fn set_freeze(value: bool) {
+        sys::set_freeze(value)
+    }
+
+    /// Call bound external functions directly from patch code if they are in range, see `upatch-manage`
+    pub fn set_direct_bind(value: bool) {
+        sys::set_direct_bind(value)
+    }
+
+    /// Change jumpers only while no thread runs patched code, see `upatch-manage`
+    pub fn set_stack_check(value: bool) {
+        sys::set_stack_check(value)
+    }
+
+    /// Check stacks of parked coroutines of the runtimes as well, see `upatch-manage`
+    pub fn set_coro_runtime(value: Option<String>, soft_dirty: bool) {
+        sys::set_coro_runtime(value, soft_dirty)
+    }
+
+    /// Place patch text on 2MiB boundary and advise huge pages for it, see `upatch-manage`
+    pub fn set_huge_text(value: bool) {
+        sys::set_huge_text(value)
+    }
+
+    /// Bound the impact of activations to services, see `rollout`
+    pub fn set_rollout_policy(cgroup_limit: usize, stopped_ratio: u64, idle_first: bool) {
+        rollout::set_cgroup_limit(cgroup_limit);
+        rollout::set_stopped_ratio(stopped_ratio);
+        rollout::set_idle_first(idle_first);
+    }
+
+    /// Telemetry of recent operations after sequence number `since`
+    pub fn telemetry(since: u64) -> Vec<PatchTelemetryRecord> {
+        telemetry::records(since)
+    }
+
+    pub fn set_patch_on_exec(value: bool) {
+        PATCH_ON_EXEC.store(value, Ordering::Relaxed)
+    }
+
+    pub fn patched_processes(&self) -> PatchedProcesses {
+        PatchedProcesses(self.target_map.clone())
+    }
+
+    fn start_exec_monitor(
+        registry: &Arc<ProcessRegistry>,
+        target_map: &Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>,
+    ) -> Option<ExecMonitor> {
+        let monitor_registry = registry.clone();
+        let result = ExecMonitor::new(
+            registry.clone(),
+            target_map.clone(),
+            move |target_map, target_elf| {
+                Self::patch_new_process(&monitor_registry, target_map, target_elf)
+            },
+        );
+        match result {
+            Ok(exec_monitor) => Some(exec_monitor),
+            Err(e) => {
+                warn!(
+                    "Upatch: Exec monitor is unavailable, {}",
+                    e.to_string().to_lowercase()
+                );
+                None
+            }
+        }
+    }
 }
 
 impl UserPatchDriver {
@@ -166,105 +304,191 @@ impl UserPatchDriver {
 
         Ok(())
     }
+
+    /// New patch takes the place of the old one, thus the old one is not a conflict
+    pub fn check_replace_functions(&self, old: &UserPatch, new: &UserPatch) -> Result<()> {
+        ensure!(
+            old.target_elf == new.target_elf,
+            "Upatch: Patches are not of the same target"
+        );
+        self.check_override_functions(old)?;
+
+        let conflict_patches = match self.target_map.read().get(&new.target_elf) {
+            Some(target) => target
+                .get_conflicts(&new.functions)
+                .into_iter()
+                .map(|record| record.uuid)
+                .filter(|uuid| *uuid != old.uuid)
+                .collect(),
+            None => indexset! {},
+        };
+
+        ensure!(conflict_patches.is_empty(), {
+            let mut err_msg = String::new();
+
+            writeln!(&mut err_msg, "Upatch: Patch is conflicted with")?;
+            for uuid in conflict_patches.into_iter() {
+                writeln!(&mut err_msg, "* Patch '{}'", uuid)?;
+            }
+            err_msg.pop();
+
+            err_msg
+        });
+        Ok(())
+    }
 }
 
 impl UserPatchDriver {
-    #[inline]
-    fn parse_process_id(proc_path: &Path) -> Option<i32> {
-        proc_path
-            .file_name()
-            .and_then(OsStr::to_str)
-            .map(str::parse)
-            .and_then(Result::ok)
-    }
-
-    fn find_target_process<P: AsRef<Path>>(target_elf: P) -> Result<IndexSet<i32>> {
-        let mut target_pids = IndexSet::new();
-        let target_path = target_elf.as_ref();
-        let target_inode = target_path.metadata()?.st_ino();
-
-        for proc_path in fs::list_dirs("/proc", fs::TraverseOptions { recursive: false })? {
-            let pid = match Self::parse_process_id(&proc_path) {
-                Some(pid) => pid,
-                None => continue,
-            };
-            let exec_path = match fs::read_link(format!("/proc/{}/exe", pid)) {
-                Ok(file_path) => file_path,
-                Err(_) => continue,
-            };
-            // Try to match binary path
-            if exec_path == target_path {
-                target_pids.insert(pid);
-                continue;
-            }
-            // Try to match mapped files
-            let map_files = fs::list_symlinks(
-                format!("/proc/{}/map_files", pid),
-                fs::TraverseOptions { recursive: false },
-            )?;
-            for mapped_file in map_files {
-                if let Ok(mapped_inode) = mapped_file
-                    .read_link()
-                    .and_then(|file_path| Ok(file_path.metadata()?.st_ino()))
-                {
-                    if mapped_inode == target_inode {
-                        target_pids.insert(pid);
-                        break;
-                    }
-                };
-            }
-        }
+    fn find_target_process<P: AsRef<Path>>(
+        registry: &ProcessRegistry,
+        target_elf: P,
+    ) -> Result<PidSet> {
+        let target_inode = target_elf.as_ref().metadata()?.st_ino();
 
-        Ok(target_pids)
+        Ok(registry.find_process(target_inode))
+    }
+
+    fn target_process_lock(
+        target_map: &RwLock<IndexMap<PathBuf, PatchTarget>>,
+        target_elf: &Path,
+    ) -> Option<Arc<Mutex<()>>> {
+        target_map
+            .read()
+            .get(target_elf)
+            .map(PatchTarget::process_lock)
     }
 
+    /// Active all patches of the target for its new processes.
+    ///
+    /// Target map is locked only to find the work and to record results,
+    /// the target is held by its process lock meanwhile.
     fn patch_new_process(
+        registry: &ProcessRegistry,
         target_map: Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>,
         target_elf: &Path,
     ) {
-        let process_list = match Self::find_target_process(target_elf) {
+        let process_lock = match Self::target_process_lock(&target_map, target_elf) {
+            Some(lock) => lock,
+            None => return,
+        };
+        let _process_guard = process_lock.lock();
+
+        let process_list = match Self::find_target_process(registry, target_elf) {
             Ok(pids) => pids,
             Err(_) => return,
         };
 
-        let mut target_map = target_map.write();
-        let patch_target = match target_map.get_mut(target_elf) {
-            Some(target) => target,
-            None => return,
+        // Every patch a process lacks is actived in one stop, in order of the target
+        let mut process_patches: IndexMap<i32, Vec<(Uuid, PathBuf)>> = IndexMap::new();
+        let arenas = {
+            let mut target_map = target_map.write();
+            let patch_target = match target_map.get_mut(target_elf) {
+                Some(target) => target,
+                None => return,
+            };
+
+            for (patch_uuid, patch_entity) in patch_target.all_patches() {
+                patch_entity.clean_dead_process(&process_list);
+
+                let need_actived = patch_entity.need_actived(&process_list).collect::<Vec<_>>();
+                if !need_actived.is_empty() {
+                    debug!(
+                        "Activating patch '{}' ({}) for process {:?}",
+                        patch_uuid,
+                        target_elf.display(),
+                        need_actived,
+                    );
+                }
+                for pid in need_actived {
+                    process_patches
+                        .entry(pid)
+                        .or_default()
+                        .push((*patch_uuid, patch_entity.patch_file.clone()));
+                }
+            }
+            patch_target.arenas().clone()
         };
+        if process_patches.is_empty() {
+            return;
+        }
 
-        for (patch_uuid, patch_entity) in patch_target.all_patches() {
-            patch_entity.clean_dead_process(&process_list);
+        // Forked processes inherit patches along with arenas, reading their headers is enough
+        let mut inherited = Vec::new();
+        if !arenas.is_empty() {
+            process_patches.retain(|pid, patches| {
+                let applied = arena::read_patches(*pid, &arenas);
+                patches.retain(|(patch_uuid, _)| {
+                    if !applied.contains(patch_uuid) {
+                        return true;
+                    }
+                    debug!(
+                        "Patch '{}' ({}) is inherited by process {}",
+                        patch_uuid,
+                        target_elf.display(),
+                        pid
+                    );
+                    inherited.push((*patch_uuid, *pid));
+                    false
+                });
+                !patches.is_empty()
+            });
+        }
 
-            // Active patch
-            let need_ignored = patch_entity.need_ignored(&process_list);
+        // Processes lacking the same patches share one request
+        let mut patch_groups: IndexMap<Vec<(Uuid, PathBuf)>, Vec<i32>> = IndexMap::new();
+        for (pid, patches) in process_patches {
+            patch_groups.entry(patches).or_default().push(pid);
+        }
 
-            let mut need_actived = patch_entity.need_actived(&process_list);
-            need_actived.retain(|pid| !need_ignored.contains(pid));
-            if !need_actived.is_empty() {
-                debug!(
-                    "Activating patch '{}' ({}) for process {:?}",
-                    patch_uuid,
-                    target_elf.display(),
-                    need_actived,
-                );
+        let mut new_arenas = Vec::new();
+        let mut group_results = Vec::with_capacity(patch_groups.len());
+        for (patches, pids) in patch_groups {
+            let results = sys::active_patches(&patches, &pids, target_elf);
+            if let Some((pid, _)) = results.iter().find(|(_, result)| result.is_ok()) {
+                if let Ok(arenas) = arena::find_arenas(*pid) {
+                    new_arenas.extend(arenas);
+                }
+            }
+            for (pid, result) in &results {
+                if let Err(e) = result {
+                    warn!(
+                        "Upatch: Failed to active patch {} for process {}, {}",
+                        patches
+                            .iter()
+                            .map(|(uuid, _)| format!("'{}'", uuid))
+                            .collect::<Vec<_>>()
+                            .join(", "),
+                        pid,
+                        e.to_string().to_lowercase(),
+                    );
+                }
             }
+            group_results.push((patches, results));
+        }
 
-            for pid in need_actived {
-                match sys::active_patch(patch_uuid, pid, target_elf, &patch_entity.patch_file) {
-                    Ok(_) => patch_entity.add_process(pid),
-                    Err(e) => {
-                        warn!(
-                            "Upatch: Failed to active patch '{}' for process {}, {}",
-                            patch_uuid,
-                            pid,
-                            e.to_string().to_lowercase(),
-                        );
-                        patch_entity.ignore_process(pid)
+        let mut target_map = target_map.write();
+        let patch_target = match target_map.get_mut(target_elf) {
+            Some(target) => target,
+            None => return,
+        };
+        for (patch_uuid, pid) in inherited {
+            if let Some(patch_entity) = patch_target.get_patch(&patch_uuid) {
+                patch_entity.add_process(pid);
+            }
+        }
+        for (patches, results) in group_results {
+            for (pid, result) in results {
+                for (patch_uuid, _) in &patches {
+                    if let Some(patch_entity) = patch_target.get_patch(patch_uuid) {
+                        match result {
+                            Ok(_) => patch_entity.add_process(pid),
+                            Err(_) => patch_entity.ignore_process(pid),
+                        }
                     }
                 }
             }
         }
+        patch_target.add_arenas(new_arenas);
     }
 }
 
@@ -306,38 +530,56 @@ impl UserPatchDriver {
         Ok(())
     }
 
-    pub fn active(&mut self, patch: &UserPatch) -> Result<()> {
+    /// Find processes lacking the patch, the patch is not added to its target yet.
+    ///
+    /// The returned guard holds the target process lock until the activation is committed.
+    fn prepare_active(&self, patch: &UserPatch) -> Result<(PatchEntity, Vec<i32>, ProcessGuard)> {
         let patch_uuid = &patch.uuid;
         let patch_file = patch.patch_file.as_path();
-        let patch_functions = patch.functions.as_slice();
         let target_elf = patch.target_elf.as_path();
 
-        let process_list = Self::find_target_process(target_elf)?;
+        let process_guard = Self::target_process_lock(&self.target_map, target_elf)
+            .context("Upatch: Cannot find patch target")?
+            .lock_arc();
+
+        let process_list = Self::find_target_process(&self.registry, target_elf)?;
 
         let mut target_map = self.target_map.write();
         let patch_target = target_map
             .get_mut(target_elf)
             .context("Upatch: Cannot find patch target")?;
-        let mut patch_entity = match patch_target.get_patch(patch_uuid) {
+        let patch_entity = match patch_target.get_patch(patch_uuid) {
             Some(_) => bail!("Upatch: Patch is already exist"),
             None => PatchEntity::new(patch_file.to_path_buf()),
         };
 
-        // Active patch
         info!(
             "Activating patch '{}' ({}) for {}",
             patch_uuid,
             patch_file.display(),
             target_elf.display(),
         );
-        let mut results = Vec::new();
-        for pid in patch_entity.need_actived(&process_list) {
-            let result = sys::active_patch(patch_uuid, pid, target_elf, patch_file);
+        let need_actived = patch_entity.need_actived(&process_list).collect::<Vec<_>>();
+
+        Ok((patch_entity, need_actived, process_guard))
+    }
+
+    fn commit_active(
+        &mut self,
+        patch: &UserPatch,
+        mut patch_entity: PatchEntity,
+        results: &[(i32, Result<()>)],
+        process_guard: ProcessGuard,
+    ) -> Result<()> {
+        let patch_uuid = &patch.uuid;
+        let patch_functions = patch.functions.as_slice();
+        let target_elf = patch.target_elf.as_path();
+
+        for (pid, result) in results {
             match result {
-                Ok(_) => patch_entity.add_process(pid),
-                Err(_) => patch_entity.ignore_process(pid),
+                Ok(_) => patch_entity.add_process(*pid),
+                Err(_) => patch_entity.ignore_process(*pid),
             }
-            results.push((pid, result));
         }
 
         // Check results, return error if all process fails
@@ -345,7 +587,7 @@ impl UserPatchDriver {
             let mut err_msg = String::new();
 
             writeln!(err_msg, "Upatch: Failed to active patch")?;
-            for (pid, result) in &results {
+            for (pid, result) in results {
                 if let Err(e) = result {
                     writeln!(err_msg, "* Process {}: {}", pid, e)?;
                 }
@@ -355,7 +597,7 @@ impl UserPatchDriver {
         }
 
         // Print failure results
-        for (pid, result) in &results {
+        for (pid, result) in results {
             if let Err(e) = result {
                 warn!(
                     "Upatch: Failed to active patch '{}' for process {}, {}",
@@ -366,6 +608,11 @@ impl UserPatchDriver {
             }
         }
 
+        let mut target_map = self.target_map.write();
+        let patch_target = target_map
+            .get_mut(target_elf)
+            .context("Upatch: Cannot find patch target")?;
+
         // If target is no patched before, start watching it
         let need_start_watch = !patch_target.is_patched();
 
@@ -373,24 +620,78 @@ impl UserPatchDriver {
         patch_target.add_patch(*patch_uuid, patch_entity);
         patch_target.add_functions(*patch_uuid, patch_functions);
 
-        // Drop the lock
+        // Drop the locks
         drop(target_map);
+        drop(process_guard);
 
         if need_start_watch {
             self.monitor.watch_file(target_elf)?;
+            if let Some(exec_monitor) = &self.exec_monitor {
+                exec_monitor.watch_file(target_elf)?;
+            }
         }
         self.set_patch_status(patch_uuid, PatchStatus::Actived);
 
+        // Processes started while the patch was being actived are not covered yet
+        Self::patch_new_process(&self.registry, self.target_map.clone(), target_elf);
+
         Ok(())
     }
 
+    pub fn active(&mut self, patch: &UserPatch) -> Result<()> {
+        let (patch_entity, need_actived, process_guard) = self.prepare_active(patch)?;
+        let results = sys::active_patch(
+            &patch.uuid,
+            &need_actived,
+            &patch.target_elf,
+            &patch.patch_file,
+        );
+
+        self.commit_active(patch, patch_entity, &results, process_guard)
+    }
+
+    /// Start activating the patch in background, `finish_active()` completes it.
+    ///
+    /// Patches of different targets could be actived concurrently this way,
+    /// patches of one target must be actived one after another.
+    pub fn start_active(&self, patch: &UserPatch) -> Result<PendingActive> {
+        let (patch_entity, need_actived, process_guard) = self.prepare_active(patch)?;
+
+        let patch_uuid = patch.uuid;
+        let target_elf = patch.target_elf.clone();
+        let patch_file = patch.patch_file.clone();
+        let worker = thread::Builder::new()
+            .name(ACTIVE_THREAD_NAME.to_string())
+            .spawn(move || sys::active_patch(&patch_uuid, &need_actived, &target_elf, &patch_file))
+            .with_context(|| format!("Failed to create thread '{}'", ACTIVE_THREAD_NAME))?;
+
+        Ok(PendingActive {
+            patch_entity,
+            worker,
+            process_guard,
+        })
+    }
+
+    pub fn finish_active(&mut self, patch: &UserPatch, pending: PendingActive) -> Result<()> {
+        let results = pending
+            .worker
+            .join()
+            .map_err(|_| anyhow!("Upatch: Thread '{}' panicked", ACTIVE_THREAD_NAME))?;
+
+        self.commit_active(patch, pending.patch_entity, &results, pending.process_guard)
+    }
+
     pub fn deactive(&mut self, patch: &UserPatch) -> Result<()> {
         let patch_uuid = &patch.uuid;
         let patch_file = patch.patch_file.as_path();
         let patch_functions = patch.functions.as_slice();
         let target_elf = patch.target_elf.as_path();
 
-        let process_list = Self::find_target_process(target_elf)?;
+        let process_lock = Self::target_process_lock(&self.target_map, target_elf)
+            .context("Upatch: Cannot find patch target")?;
+        let _process_guard = process_lock.lock();
+
+        let process_list = Self::find_target_process(&self.registry, target_elf)?;
 
         let mut target_map = self.target_map.write();
         let patch_target = target_map
@@ -411,18 +712,14 @@ impl UserPatchDriver {
             target_elf.display(),
         );
 
-        let need_ignored = patch_entity.need_ignored(&process_list);
-
-        let mut need_deactived = patch_entity.need_deactived(&process_list);
-        need_deactived.retain(|pid| need_ignored.contains(pid));
-
-        let mut results = Vec::new();
-        for pid in patch_entity.need_deactived(&process_list) {
-            let result = sys::deactive_patch(patch_uuid, pid, target_elf, patch_file);
+        let need_deactived = patch_entity
+            .need_deactived(&process_list)
+            .collect::<Vec<_>>();
+        let results = sys::deactive_patch(patch_uuid, &need_deactived, target_elf, patch_file);
+        for (pid, result) in &results {
             if result.is_ok() {
-                patch_entity.remove_process(pid)
+                patch_entity.remove_process(*pid)
             }
-            results.push((pid, result));
         }
 
         // Check results, return error if any process failes
@@ -462,9 +759,127 @@ impl UserPatchDriver {
 
         if need_stop_watch {
             self.monitor.ignore_file(target_elf)?;
+            if let Some(exec_monitor) = &self.exec_monitor {
+                exec_monitor.ignore_file(target_elf)?;
+            }
         }
         self.set_patch_status(patch_uuid, PatchStatus::Deactived);
 
+        Ok(())
+    }
+    /// Replace the actived patch by the new one, each process is switched within one stop.
+    ///
+    /// Processes failed to switch keep the old patch, which stays actived for them.
+    pub fn replace(&mut self, old: &UserPatch, new: &UserPatch) -> Result<()> {
+        let target_elf = old.target_elf.as_path();
+
+        let process_lock = Self::target_process_lock(&self.target_map, target_elf)
+            .context("Upatch: Cannot find patch target")?;
+        let process_guard = process_lock.lock();
+
+        let process_list = Self::find_target_process(&self.registry, target_elf)?;
+
+        let mut target_map = self.target_map.write();
+        let patch_target = target_map
+            .get_mut(target_elf)
+            .context("Upatch: Cannot find patch target")?;
+        if patch_target.get_patch(&new.uuid).is_some() {
+            bail!("Upatch: Patch is already exist");
+        }
+        let old_entity = patch_target
+            .get_patch(&old.uuid)
+            .context("Upatch: Cannot find patch entity")?;
+
+        // Remove dead process
+        old_entity.clean_dead_process(&process_list);
+        let need_replaced = old_entity.need_deactived(&process_list).collect::<Vec<_>>();
+
+        // Processes are held by the process lock, the target map is not
+        drop(target_map);
+
+        info!(
+            "Replacing patch '{}' by '{}' ({}) for {}",
+            old.uuid,
+            new.uuid,
+            new.patch_file.display(),
+            target_elf.display(),
+        );
+        let results = sys::replace_patch(
+            &old.uuid,
+            &old.patch_file,
+            &new.uuid,
+            &new.patch_file,
+            &need_replaced,
+            target_elf,
+        );
+
+        // Check results, return error if all process fails
+        if !results.is_empty() && results.iter().all(|(_, result)| result.is_err()) {
+            let mut err_msg = String::new();
+
+            writeln!(err_msg, "Upatch: Failed to replace patch")?;
+            for (pid, result) in &results {
+                if let Err(e) = result {
+                    writeln!(err_msg, "* Process {}: {}", pid, e)?;
+                }
+            }
+            err_msg.pop();
+            bail!(err_msg);
+        }
+
+        // Print failure results
+        for (pid, result) in &results {
+            if let Err(e) = result {
+                warn!(
+                    "Upatch: Failed to replace patch '{}' for process {}, {}",
+                    old.uuid,
+                    pid,
+                    e.to_string().to_lowercase(),
+                );
+            }
+        }
+
+        let mut target_map = self.target_map.write();
+        let patch_target = target_map
+            .get_mut(target_elf)
+            .context("Upatch: Cannot find patch target")?;
+        let old_entity = patch_target
+            .get_patch(&old.uuid)
+            .context("Upatch: Cannot find patch entity")?;
+
+        let mut new_entity = PatchEntity::new(new.patch_file.clone());
+        for (pid, result) in &results {
+            if result.is_ok() {
+                old_entity.remove_process(*pid);
+                new_entity.add_process(*pid);
+            }
+        }
+        let old_retired = old_entity.process_num() == 0;
+
+        // Functions of the new patch are on top of the old ones, if they are left
+        if old_retired {
+            patch_target.remove_patch(&old.uuid);
+            patch_target.remove_functions(&old.uuid, &old.functions);
+        }
+        patch_target.add_patch(new.uuid, new_entity);
+        patch_target.add_functions(new.uuid, &new.functions);
+
+        drop(target_map);
+        drop(process_guard);
+
+        if old_retired {
+            self.set_patch_status(&old.uuid, PatchStatus::Deactived);
+        } else {
+            warn!(
+                "Upatch: Patch '{}' is still actived for some process(es)",
+                old.uuid
+            );
+        }
+        self.set_patch_status(&new.uuid, PatchStatus::Actived);
+
+        // Processes started while the patch was being replaced are not covered yet
+        Self::patch_new_process(&self.registry, self.target_map.clone(), target_elf);
+
         Ok(())
     }
 }
@@ -14,10 +14,10 @@
 
 use std::{
     ops::DerefMut,
+    os::unix::io::AsRawFd,
     path::{Path, PathBuf},
     sync::Arc,
     thread,
-    time::Duration,
 };
 
 use anyhow::{bail, Context, Result};
@@ -27,36 +27,34 @@ use log::info;
 use parking_lot::{Mutex, RwLock};
 use syscare_common::ffi::OsStrExt;
 
-use super::target::PatchTarget;
+use super::waker::Waker;
 
 const MONITOR_THREAD_NAME: &str = "upatch_monitor";
-const MONITOR_CHECK_PERIOD: u64 = 100;
 const MONITOR_EVENT_BUFFER_CAPACITY: usize = 16 * 64; // inotify event size: 16
 
 pub(super) struct UserPatchMonitor {
     inotify: Arc<Mutex<Option<Inotify>>>,
     watch_wd_map: Arc<Mutex<IndexMap<PathBuf, WatchDescriptor>>>,
     watch_file_map: Arc<RwLock<IndexMap<WatchDescriptor, PathBuf>>>,
+    waker: Arc<Waker>,
     monitor_thread: Option<thread::JoinHandle<()>>,
 }
 
 impl UserPatchMonitor {
-    pub fn new<F>(
-        patch_target_map: Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>,
-        callback: F,
-    ) -> Result<Self>
+    pub fn new<F>(callback: F) -> Result<Self>
     where
-        F: Fn(Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>, &Path) + Send + Sync + 'static,
+        F: Fn(&Path) + Send + Sync + 'static,
     {
         let inotify = Arc::new(Mutex::new(Some(
             Inotify::init().context("Failed to initialize inotify")?,
         )));
         let watch_wd_map = Arc::new(Mutex::new(IndexMap::new()));
         let watch_file_map = Arc::new(RwLock::new(IndexMap::new()));
+        let waker = Arc::new(Waker::new().context("Failed to initialize waker")?);
         let monitor_thread = MonitorThread {
             inotify: inotify.clone(),
             watch_file_map: watch_file_map.clone(),
-            patch_target_map,
+            waker: waker.clone(),
             callback,
         }
         .run()?;
@@ -65,6 +63,7 @@ impl UserPatchMonitor {
             inotify,
             watch_wd_map,
             watch_file_map,
+            waker,
             monitor_thread: Some(monitor_thread),
         })
     }
@@ -119,13 +118,13 @@ impl UserPatchMonitor {
 struct MonitorThread<F> {
     inotify: Arc<Mutex<Option<Inotify>>>,
     watch_file_map: Arc<RwLock<IndexMap<WatchDescriptor, PathBuf>>>,
-    patch_target_map: Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>,
+    waker: Arc<Waker>,
     callback: F,
 }
 
 impl<F> MonitorThread<F>
 where
-    F: Fn(Arc<RwLock<IndexMap<PathBuf, PatchTarget>>>, &Path) + Send + Sync + 'static,
+    F: Fn(&Path) + Send + Sync + 'static,
 {
     fn run(self) -> Result<thread::JoinHandle<()>> {
         thread::Builder::new()
@@ -147,32 +146,46 @@ where
     }
 
     fn thread_main(self) {
-        while let Some(inotify) = self.inotify.lock().as_mut() {
+        let inotify_fd = match self.inotify.lock().as_ref() {
+            Some(inotify) => inotify.as_raw_fd(),
+            None => return,
+        };
+
+        // Block on inotify until events arrive, or until the monitor is dropped
+        while let Ok(true) = self.waker.wait(inotify_fd) {
             let mut buffer = [0; MONITOR_EVENT_BUFFER_CAPACITY];
 
-            if let Ok(events) = inotify.read_events(&mut buffer) {
-                let watch_file_map = self.watch_file_map.read();
-                let target_elfs = events
-                    .filter_map(|event| watch_file_map.get(&event.wd))
-                    .filter(|path| Self::filter_blacklist_path(path))
-                    .collect::<IndexSet<_>>();
-                for target_elf in target_elfs {
-                    (self.callback)(self.patch_target_map.clone(), target_elf);
-                }
+            let target_elfs = match self.inotify.lock().as_mut() {
+                Some(inotify) => match inotify.read_events(&mut buffer) {
+                    Ok(events) => {
+                        let watch_file_map = self.watch_file_map.read();
+                        events
+                            .filter_map(|event| watch_file_map.get(&event.wd))
+                            .filter(|path| Self::filter_blacklist_path(path))
+                            .cloned()
+                            .collect::<IndexSet<_>>()
+                    }
+                    Err(_) => continue,
+                },
+                None => break,
+            };
+
+            // Inotify should not be locked meanwhile
+            for target_elf in target_elfs {
+                (self.callback)(&target_elf);
             }
-
-            thread::park_timeout(Duration::from_millis(MONITOR_CHECK_PERIOD))
         }
     }
 }
 
 impl Drop for UserPatchMonitor {
     fn drop(&mut self) {
-        if let Some(inotify) = self.inotify.lock().deref_mut().take() {
-            inotify.close().ok();
-        }
+        self.waker.wake();
         if let Some(thread) = self.monitor_thread.take() {
             thread.join().ok();
         }
+        if let Some(inotify) = self.inotify.lock().deref_mut().take() {
+            inotify.close().ok();
+        }
     }
 }
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::iter::FromIterator;
+
+/// Set of process ids, stored as a sorted vector.
+///
+/// Sets are compared by walking both of them at once, which neither hashes
+/// nor allocates, thus it is cheap to diff against a snapshot of processes.
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct PidSet(Vec<i32>);
+
+impl PidSet {
+    pub fn len(&self) -> usize {
+        self.0.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.0.is_empty()
+    }
+
+    pub fn contains(&self, pid: i32) -> bool {
+        self.0.binary_search(&pid).is_ok()
+    }
+
+    pub fn insert(&mut self, pid: i32) -> bool {
+        match self.0.binary_search(&pid) {
+            Ok(_) => false,
+            Err(index) => {
+                self.0.insert(index, pid);
+                true
+            }
+        }
+    }
+
+    pub fn remove(&mut self, pid: i32) -> bool {
+        match self.0.binary_search(&pid) {
+            Ok(index) => {
+                self.0.remove(index);
+                true
+            }
+            Err(_) => false,
+        }
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = i32> + '_ {
+        self.0.iter().copied()
+    }
+
+    /// Keep only processes which are also in the other set, in place
+    pub fn retain_in(&mut self, other: &PidSet) {
+        let mut rest = other.0.as_slice();
+
+        self.0.retain(|pid| {
+            let index = rest.partition_point(|other_pid| other_pid < pid);
+            rest = &rest[index..];
+            rest.first() == Some(pid)
+        });
+    }
+
+    /// Processes of this set which are not in the other set
+    pub fn difference<'a>(&'a self, other: &'a PidSet) -> MergeIter<'a> {
+        MergeIter::new(&self.0, &other.0, false)
+    }
+
+    /// Processes of this set which are also in the other set
+    pub fn intersection<'a>(&'a self, other: &'a PidSet) -> MergeIter<'a> {
+        MergeIter::new(&self.0, &other.0, true)
+    }
+}
+
+impl FromIterator<i32> for PidSet {
+    fn from_iter<I: IntoIterator<Item = i32>>(iter: I) -> Self {
+        let mut pids = iter.into_iter().collect::<Vec<_>>();
+        pids.sort_unstable();
+        pids.dedup();
+
+        Self(pids)
+    }
+}
+
+/// Walks two sorted sets at once, yields items of the left one by their presence in the right one
+pub struct MergeIter<'a> {
+    left: &'a [i32],
+    right: &'a [i32],
+    common: bool,
+}
+
+impl<'a> MergeIter<'a> {
+    fn new(left: &'a [i32], right: &'a [i32], common: bool) -> Self {
+        Self {
+            left,
+            right,
+            common,
+        }
+    }
+}
+
+impl Iterator for MergeIter<'_> {
+    type Item = i32;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        while let Some((&pid, left)) = self.left.split_first() {
+            self.left = left;
+
+            let index = self.right.partition_point(|other_pid| *other_pid < pid);
+            self.right = &self.right[index..];
+            if (self.right.first() == Some(&pid)) == self.common {
+                return Some(pid);
+            }
+        }
+        None
+    }
+}
@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    convert::TryInto,
+    ffi::OsStr,
+    io, mem,
+    os::unix::io::RawFd,
+    path::Path,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+use anyhow::{Context, Result};
+use indexmap::{IndexMap, IndexSet};
+use log::{debug, warn};
+use nix::libc;
+use parking_lot::Mutex;
+
+use syscare_common::{fs, os::proc_maps::ProcMapsIter};
+
+use super::pid_set::PidSet;
+
+const REGISTRY_THREAD_NAME: &str = "upatch_registry";
+const REGISTRY_RECV_TIMEOUT: i64 = 1; // seconds
+const REGISTRY_RECV_BUFFER_SIZE: libc::c_int = 4 * 1024 * 1024;
+const REGISTRY_MSG_BUFFER_SIZE: usize = 4096;
+
+/* Dynamic loader maps libraries shortly after exec, keep rescanning new processes for a while */
+const PROCESS_SETTLE_TIME: Duration = Duration::from_secs(1);
+/* Lookups rescan processes whose address space changed, but not more often than this */
+const PROCESS_REMAP_INTERVAL: Duration = Duration::from_secs(1);
+
+/* linux/netlink.h, linux/connector.h & linux/cn_proc.h */
+const NLMSG_HDR_LEN: usize = 16;
+const NLMSG_DONE: u16 = 3;
+const CN_MSG_LEN: usize = 20;
+const CN_IDX_PROC: u32 = 1;
+const CN_VAL_PROC: u32 = 1;
+const PROC_CN_MCAST_LISTEN: u32 = 1;
+const PROC_EVENT_DATA_OFFSET: usize = 16;
+const PROC_EVENT_FORK: u32 = 0x00000001;
+const PROC_EVENT_EXEC: u32 = 0x00000002;
+const PROC_EVENT_EXIT: u32 = 0x80000000;
+
+#[inline]
+fn read_u32(data: &[u8], offset: usize) -> Option<u32> {
+    data.get(offset..offset + 4)
+        .and_then(|bytes| bytes.try_into().ok())
+        .map(u32::from_ne_bytes)
+}
+
+#[inline]
+fn read_pid(data: &[u8], offset: usize) -> Option<i32> {
+    read_u32(data, offset).map(|value| value as i32)
+}
+
+#[derive(Default)]
+struct ProcessIndex {
+    process_map: IndexMap<i32, IndexSet<u64>>, // Process -> Mapped file inodes
+    vm_size_map: IndexMap<i32, u64>,           // Process -> Address space size of the last scan
+    inode_map: IndexMap<u64, PidSet>,          // Mapped file inode -> Processes
+    pending_map: IndexMap<i32, Instant>,       // Process -> Fork / exec time
+    held_set: PidSet,                          // Processes not ready for patching yet
+    remap_time: Option<Instant>,               // Last time changed processes were rescanned
+    listening: bool,
+    outdated: bool,
+}
+
+impl ProcessIndex {
+    fn parse_process_id(proc_path: &Path) -> Option<i32> {
+        proc_path
+            .file_name()
+            .and_then(OsStr::to_str)
+            .map(str::parse)
+            .and_then(Result::ok)
+    }
+
+    /// Address space size in pages, it grows once a library is mapped
+    fn read_vm_size(pid: i32) -> io::Result<u64> {
+        let statm = fs::read_to_string(format!("/proc/{}/statm", pid))?;
+
+        statm
+            .split_whitespace()
+            .next()
+            .and_then(|size| size.parse().ok())
+            .ok_or_else(|| io::Error::from(io::ErrorKind::InvalidData))
+    }
+
+    fn read_mapped_inodes(pid: i32) -> io::Result<IndexSet<u64>> {
+        let maps = fs::read(format!("/proc/{}/maps", pid))?;
+        let inodes = ProcMapsIter::new(&maps)
+            .filter_map(|map| map.inode_num())
+            .filter(|inode| *inode != 0)
+            .collect();
+
+        Ok(inodes)
+    }
+
+    fn remove_process(&mut self, pid: i32) {
+        if let Some(inodes) = self.process_map.remove(&pid) {
+            for inode in inodes {
+                if let Some(pids) = self.inode_map.get_mut(&inode) {
+                    pids.remove(pid);
+                    if pids.is_empty() {
+                        self.inode_map.remove(&inode);
+                    }
+                }
+            }
+        }
+        self.vm_size_map.remove(&pid);
+        self.pending_map.remove(&pid);
+    }
+
+    fn update_process(&mut self, pid: i32) {
+        // Size is read first, a library mapped meanwhile changes it again
+        let (vm_size, inodes) = match Self::read_vm_size(pid)
+            .and_then(|vm_size| Ok((vm_size, Self::read_mapped_inodes(pid)?)))
+        {
+            Ok(result) => result,
+            Err(_) => {
+                self.remove_process(pid);
+                return;
+            }
+        };
+
+        if let Some(old_inodes) = self.process_map.get(&pid) {
+            for inode in old_inodes.difference(&inodes) {
+                if let Some(pids) = self.inode_map.get_mut(inode) {
+                    pids.remove(pid);
+                    if pids.is_empty() {
+                        self.inode_map.remove(inode);
+                    }
+                }
+            }
+        }
+        for inode in &inodes {
+            self.inode_map.entry(*inode).or_default().insert(pid);
+        }
+        self.process_map.insert(pid, inodes);
+        self.vm_size_map.insert(pid, vm_size);
+    }
+
+    fn rescan(&mut self) {
+        let proc_dirs =
+            fs::list_dirs("/proc", fs::TraverseOptions { recursive: false }).unwrap_or_default();
+
+        self.process_map.clear();
+        self.vm_size_map.clear();
+        self.inode_map.clear();
+        self.pending_map.clear();
+        for pid in proc_dirs
+            .iter()
+            .filter_map(|dir| Self::parse_process_id(dir))
+        {
+            self.update_process(pid);
+        }
+        self.remap_time = Some(Instant::now());
+        self.outdated = false;
+
+        debug!("Upatch: Indexed {} processes", self.process_map.len());
+    }
+
+    /// Rescan mappings of processes whose address space size changed, no event tells about dlopen()
+    fn remap(&mut self) {
+        let known = self.vm_size_map.len();
+        let changed_pids = self
+            .vm_size_map
+            .iter()
+            .filter(|(pid, vm_size)| Self::read_vm_size(**pid).ok() != Some(**vm_size))
+            .map(|(pid, _)| *pid)
+            .collect::<Vec<_>>();
+        for pid in &changed_pids {
+            self.update_process(*pid);
+        }
+        self.remap_time = Some(Instant::now());
+
+        debug!(
+            "Upatch: Rescanned {} of {} processes",
+            changed_pids.len(),
+            known
+        );
+    }
+
+    fn remapped_within(&self, interval: Duration) -> bool {
+        self.remap_time
+            .map(|remap_time| remap_time.elapsed() < interval)
+            .unwrap_or(false)
+    }
+
+    fn lookup(&self, inode: u64) -> PidSet {
+        self.inode_map
+            .get(&inode)
+            .map(|pids| pids.difference(&self.held_set).collect())
+            .unwrap_or_default()
+    }
+
+    fn refresh(&mut self) {
+        if !self.listening || self.outdated {
+            self.rescan();
+            return;
+        }
+
+        let now = Instant::now();
+        let pending_pids = self.pending_map.keys().copied().collect::<Vec<_>>();
+        for pid in pending_pids {
+            self.update_process(pid);
+        }
+        self.pending_map
+            .retain(|_, start_time| now.duration_since(*start_time) < PROCESS_SETTLE_TIME);
+    }
+
+    fn handle_event(&mut self, event: &[u8]) {
+        let data = PROC_EVENT_DATA_OFFSET;
+
+        match read_u32(event, 0) {
+            Some(PROC_EVENT_FORK) => {
+                // Ignore thread creation
+                if let (Some(pid), Some(tgid)) =
+                    (read_pid(event, data + 8), read_pid(event, data + 12))
+                {
+                    if pid == tgid {
+                        self.pending_map.insert(tgid, Instant::now());
+                    }
+                }
+            }
+            Some(PROC_EVENT_EXEC) => {
+                if let Some(tgid) = read_pid(event, data + 4) {
+                    self.pending_map.insert(tgid, Instant::now());
+                }
+            }
+            Some(PROC_EVENT_EXIT) => {
+                // Ignore thread exit
+                if let (Some(pid), Some(tgid)) = (read_pid(event, data), read_pid(event, data + 4))
+                {
+                    if pid == tgid {
+                        self.remove_process(tgid);
+                    }
+                }
+            }
+            _ => {}
+        }
+    }
+
+    fn handle_messages(&mut self, buffer: &[u8]) {
+        let mut offset = 0;
+
+        while offset + NLMSG_HDR_LEN <= buffer.len() {
+            let msg_len = read_u32(buffer, offset).unwrap_or_default() as usize;
+            if msg_len < NLMSG_HDR_LEN || offset + msg_len > buffer.len() {
+                break;
+            }
+
+            let msg = &buffer[offset + NLMSG_HDR_LEN..offset + msg_len];
+            if (read_u32(msg, 0), read_u32(msg, 4)) == (Some(CN_IDX_PROC), Some(CN_VAL_PROC)) {
+                if let Some(event) = msg.get(CN_MSG_LEN..) {
+                    self.handle_event(event);
+                }
+            }
+            offset += (msg_len + 3) & !3;
+        }
+    }
+}
+
+/// Process index fed by proc connector, which tracks process fork / exec / exit events.
+/// Processes are only scanned once they change, a full scan happens at startup,
+/// or if the event stream is unavailable or has lost events.
+/// Libraries loaded later are found by lookups, which rescan only processes whose
+/// address space size changed since their last scan.
+pub(super) struct ProcessRegistry {
+    index: Arc<Mutex<ProcessIndex>>,
+    running: Arc<AtomicBool>,
+    listen_thread: Option<thread::JoinHandle<()>>,
+}
+
+impl ProcessRegistry {
+    pub fn new() -> Result<Self> {
+        let index = Arc::new(Mutex::new(ProcessIndex::default()));
+        let running = Arc::new(AtomicBool::new(true));
+
+        let listen_thread = match Self::open_socket() {
+            Ok(socket) => {
+                let thread_index = index.clone();
+                let thread_running = running.clone();
+                let thread = thread::Builder::new()
+                    .name(REGISTRY_THREAD_NAME.to_string())
+                    .spawn(move || Self::thread_main(socket, thread_index, thread_running));
+                if thread.is_err() {
+                    unsafe { libc::close(socket) };
+                }
+                Some(thread.with_context(|| {
+                    format!("Failed to create thread '{}'", REGISTRY_THREAD_NAME)
+                })?)
+            }
+            Err(e) => {
+                warn!(
+                    "Upatch: Process event is unavailable, {}",
+                    e.to_string().to_lowercase()
+                );
+                None
+            }
+        };
+
+        // Listen before scanning, so that no process would be missed
+        let mut process_index = index.lock();
+        process_index.listening = listen_thread.is_some();
+        process_index.rescan();
+        drop(process_index);
+
+        Ok(Self {
+            index,
+            running,
+            listen_thread,
+        })
+    }
+
+    /// Find all processes which mapped the file
+    pub fn find_process(&self, inode: u64) -> PidSet {
+        let mut index = self.index.lock();
+
+        index.refresh();
+        if !index.remapped_within(PROCESS_REMAP_INTERVAL) {
+            index.remap();
+        }
+        index.lookup(inode)
+    }
+
+    /// Hide a process from lookups until it is released
+    pub fn hold_process(&self, pid: i32) {
+        self.index.lock().held_set.insert(pid);
+    }
+
+    /// Make a held process visible again, its mappings are rescanned at once
+    pub fn release_process(&self, pid: i32) {
+        let mut index = self.index.lock();
+
+        index.held_set.remove(pid);
+        index.update_process(pid);
+    }
+}
+
+impl ProcessRegistry {
+    fn last_error() -> io::Error {
+        io::Error::last_os_error()
+    }
+
+    fn open_socket() -> io::Result<RawFd> {
+        let socket = unsafe {
+            libc::socket(
+                libc::AF_NETLINK,
+                libc::SOCK_DGRAM | libc::SOCK_CLOEXEC,
+                libc::NETLINK_CONNECTOR,
+            )
+        };
+        if socket < 0 {
+            return Err(Self::last_error());
+        }
+
+        let result = Self::setup_socket(socket);
+        if result.is_err() {
+            unsafe { libc::close(socket) };
+        }
+        result.map(|_| socket)
+    }
+
+    fn setup_socket(socket: RawFd) -> io::Result<()> {
+        let mut addr: libc::sockaddr_nl = unsafe { mem::zeroed() };
+        addr.nl_family = libc::AF_NETLINK as libc::sa_family_t;
+        addr.nl_groups = CN_IDX_PROC;
+
+        let ret = unsafe {
+            libc::bind(
+                socket,
+                &addr as *const libc::sockaddr_nl as *const libc::sockaddr,
+                mem::size_of::<libc::sockaddr_nl>() as libc::socklen_t,
+            )
+        };
+        if ret < 0 {
+            return Err(Self::last_error());
+        }
+
+        let timeout = libc::timeval {
+            tv_sec: REGISTRY_RECV_TIMEOUT as libc::time_t,
+            tv_usec: 0,
+        };
+        let ret = unsafe {
+            libc::setsockopt(
+                socket,
+                libc::SOL_SOCKET,
+                libc::SO_RCVTIMEO,
+                &timeout as *const libc::timeval as *const libc::c_void,
+                mem::size_of::<libc::timeval>() as libc::socklen_t,
+            )
+        };
+        if ret < 0 {
+            return Err(Self::last_error());
+        }
+
+        // Larger buffer reduces event loss on bursts, failure is not fatal
+        let buffer_size = REGISTRY_RECV_BUFFER_SIZE;
+        unsafe {
+            libc::setsockopt(
+                socket,
+                libc::SOL_SOCKET,
+                libc::SO_RCVBUF,
+                &buffer_size as *const libc::c_int as *const libc::c_void,
+                mem::size_of::<libc::c_int>() as libc::socklen_t,
+            )
+        };
+
+        let mut msg = Vec::with_capacity(NLMSG_HDR_LEN + CN_MSG_LEN + 4);
+        msg.extend_from_slice(&((NLMSG_HDR_LEN + CN_MSG_LEN + 4) as u32).to_ne_bytes());
+        msg.extend_from_slice(&NLMSG_DONE.to_ne_bytes());
+        msg.extend_from_slice(&0u16.to_ne_bytes()); // nlmsg_flags
+        msg.extend_from_slice(&0u32.to_ne_bytes()); // nlmsg_seq
+        msg.extend_from_slice(&0u32.to_ne_bytes()); // nlmsg_pid
+        msg.extend_from_slice(&CN_IDX_PROC.to_ne_bytes());
+        msg.extend_from_slice(&CN_VAL_PROC.to_ne_bytes());
+        msg.extend_from_slice(&0u32.to_ne_bytes()); // seq
+        msg.extend_from_slice(&0u32.to_ne_bytes()); // ack
+        msg.extend_from_slice(&4u16.to_ne_bytes()); // len
+        msg.extend_from_slice(&0u16.to_ne_bytes()); // flags
+        msg.extend_from_slice(&PROC_CN_MCAST_LISTEN.to_ne_bytes());
+
+        let ret = unsafe { libc::send(socket, msg.as_ptr() as *const libc::c_void, msg.len(), 0) };
+        if ret < 0 {
+            return Err(Self::last_error());
+        }
+
+        Ok(())
+    }
+
+    fn thread_main(socket: RawFd, index: Arc<Mutex<ProcessIndex>>, running: Arc<AtomicBool>) {
+        let mut buffer = [0u8; REGISTRY_MSG_BUFFER_SIZE];
+
+        while running.load(Ordering::Relaxed) {
+            let len = unsafe {
+                libc::recv(
+                    socket,
+                    buffer.as_mut_ptr() as *mut libc::c_void,
+                    buffer.len(),
+                    0,
+                )
+            };
+            if len >= 0 {
+                index.lock().handle_messages(&buffer[..len as usize]);
+                continue;
+            }
+
+            let e = Self::last_error();
+            match e.raw_os_error() {
+                Some(libc::EAGAIN) | Some(libc::EINTR) => {}
+                Some(libc::ENOBUFS) => {
+                    debug!("Upatch: Process events lost, index is outdated");
+                    index.lock().outdated = true;
+                }
+                _ => {
+                    warn!(
+                        "Upatch: Failed to receive process event, {}",
+                        e.to_string().to_lowercase()
+                    );
+                    index.lock().listening = false;
+                    break;
+                }
+            }
+        }
+
+        unsafe { libc::close(socket) };
+    }
+}
+
+impl Drop for ProcessRegistry {
+    fn drop(&mut self) {
+        self.running.store(false, Ordering::Relaxed);
+        if let Some(thread) = self.listen_thread.take() {
+            thread.join().ok();
+        }
+    }
+}
@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering},
+    thread,
+    time::Duration,
+};
+
+use indexmap::IndexMap;
+use log::debug;
+
+use syscare_common::fs;
+
+/* Idle processes are told by their cpu time over this interval */
+const IDLE_SAMPLE_INTERVAL: Duration = Duration::from_millis(100);
+
+/* Fields after the command of /proc/<pid>/stat, utime & stime are the 14th & 15th */
+const STAT_UTIME_INDEX: usize = 11;
+
+static CGROUP_LIMIT: AtomicUsize = AtomicUsize::new(0);
+static STOPPED_RATIO: AtomicU64 = AtomicU64::new(100);
+static IDLE_FIRST: AtomicBool = AtomicBool::new(false);
+
+/// Limit processes of one cgroup stopped at the same time, 0 means no limit
+pub fn set_cgroup_limit(value: usize) {
+    CGROUP_LIMIT.store(value, Ordering::Relaxed);
+}
+
+/// Percentage of time a worker may keep processes stopped, 100 means no pacing
+pub fn set_stopped_ratio(value: u64) {
+    STOPPED_RATIO.store(value.clamp(1, 100), Ordering::Relaxed);
+}
+
+/// Operate processes using the least cpu first
+pub fn set_idle_first(value: bool) {
+    IDLE_FIRST.store(value, Ordering::Relaxed);
+}
+
+pub fn is_paced() -> bool {
+    STOPPED_RATIO.load(Ordering::Relaxed) < 100
+}
+
+fn process_cpu_time(pid: i32) -> Option<u64> {
+    let stat = fs::read_to_string(format!("/proc/{}/stat", pid)).ok()?;
+    let fields = stat.get(stat.rfind(')')? + 1..)?;
+    let mut fields = fields.split_whitespace().skip(STAT_UTIME_INDEX);
+
+    let utime = fields.next()?.parse::<u64>().ok()?;
+    let stime = fields.next()?.parse::<u64>().ok()?;
+
+    Some(utime + stime)
+}
+
+fn process_cgroup(pid: i32) -> String {
+    fs::read_to_string(format!("/proc/{}/cgroup", pid)).unwrap_or_default()
+}
+
+/// Processes in the order to operate, the busiest ones are left to the end
+pub fn order(pids: &[i32]) -> Vec<i32> {
+    let mut pids = pids.to_vec();
+    if !IDLE_FIRST.load(Ordering::Relaxed) || (pids.len() < 2) {
+        return pids;
+    }
+
+    let start_times = pids
+        .iter()
+        .map(|pid| process_cpu_time(*pid))
+        .collect::<Vec<_>>();
+    thread::sleep(IDLE_SAMPLE_INTERVAL);
+
+    // Exited processes fail anyway, they go first
+    let mut cpu_deltas = IndexMap::with_capacity(pids.len());
+    for (pid, start_time) in pids.iter().zip(start_times) {
+        let delta = start_time
+            .zip(process_cpu_time(*pid))
+            .map(|(start, end)| end.saturating_sub(start))
+            .unwrap_or_default();
+        cpu_deltas.insert(*pid, delta);
+    }
+    pids.sort_by_key(|pid| cpu_deltas.get(pid).copied().unwrap_or_default());
+    debug!("Upatch: Process cpu time (ticks): {:?}", cpu_deltas);
+
+    pids
+}
+
+/// Split processes into batches, each batch is operated one process after another.
+///
+/// Processes of one cgroup are spread over at most `cgroup_limit` batches, thus no more
+/// of them are stopped at the same time. Cgroups start from different batches, so that
+/// small cgroups do not pile up on the first one.
+pub fn split_batches(pids: &[i32], batch_num: usize) -> Vec<Vec<i32>> {
+    self::split_by_cgroup(
+        pids,
+        batch_num,
+        CGROUP_LIMIT.load(Ordering::Relaxed),
+        process_cgroup,
+    )
+}
+
+fn split_by_cgroup<F>(pids: &[i32], batch_num: usize, limit: usize, cgroup_of: F) -> Vec<Vec<i32>>
+where
+    F: Fn(i32) -> String,
+{
+    let mut batches = vec![Vec::new(); batch_num];
+    let cgroup_limit = match limit {
+        0 => batch_num,
+        limit => limit.min(batch_num),
+    };
+    if cgroup_limit == batch_num {
+        for (index, pid) in pids.iter().enumerate() {
+            batches[index % batch_num].push(*pid);
+        }
+        return batches;
+    }
+
+    let mut cgroups: IndexMap<String, Vec<i32>> = IndexMap::new();
+    for pid in pids {
+        cgroups.entry(cgroup_of(*pid)).or_default().push(*pid);
+    }
+
+    // Processes are interleaved over cgroups, the order is kept inside each batch
+    let mut slots = Vec::with_capacity(pids.len());
+    for (cgroup_index, cgroup_pids) in cgroups.values().enumerate() {
+        let first_batch = cgroup_index * cgroup_limit;
+        for (index, pid) in cgroup_pids.iter().enumerate() {
+            slots.push((
+                index,
+                (first_batch + index % cgroup_limit) % batch_num,
+                *pid,
+            ));
+        }
+    }
+    slots.sort_by_key(|(index, _, _)| *index);
+    for (_, batch, pid) in slots {
+        batches[batch].push(pid);
+    }
+
+    batches
+}
+
+/// Wait after a process was stopped for a while, which keeps the stopped ratio of the worker
+pub fn pace(stopped_us: u64) {
+    let ratio = STOPPED_RATIO.load(Ordering::Relaxed);
+    if (ratio >= 100) || (stopped_us == 0) {
+        return;
+    }
+    thread::sleep(Duration::from_micros(stopped_us * (100 - ratio) / ratio));
+}
+
+#[test]
+fn test_split_batches() {
+    let pids = (1..=8).collect::<Vec<_>>();
+    let cgroup_of = |pid: i32| format!("cgroup{}", pid % 2);
+
+    let batches = split_by_cgroup(&pids, 3, 0, cgroup_of);
+    assert_eq!(batches, vec![vec![1, 4, 7], vec![2, 5, 8], vec![3, 6]]);
+
+    // Odd ones take batch 0, even ones take batch 1
+    let batches = split_by_cgroup(&pids, 3, 1, cgroup_of);
+    assert_eq!(batches, vec![vec![1, 3, 5, 7], vec![2, 4, 6, 8], vec![]]);
+
+    let batches = split_by_cgroup(&pids, 4, 2, cgroup_of);
+    assert_eq!(
+        batches,
+        vec![vec![1, 5], vec![3, 7], vec![2, 6], vec![4, 8]]
+    );
+
+    let batches = split_by_cgroup(&pids, 1, 1, cgroup_of);
+    assert_eq!(batches, vec![pids]);
+}
@@ -1,51 +1,747 @@
-use std::path::Path;
+use std::{
+    ffi::{OsStr, OsString},
+    io::{BufRead, BufReader, Write},
+    os::unix::ffi::OsStrExt as StdOsStrExt,
+    path::{Path, PathBuf},
+    process::{Child, ChildStdin, ChildStdout, Stdio},
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc,
+    },
+    thread,
+};
 
-use anyhow::{bail, Result};
-use log::Level;
+use anyhow::{anyhow, bail, Context, Result};
+use indexmap::{IndexMap, IndexSet};
+use jsonrpc_core::serde_json::{self, Value};
+use lazy_static::lazy_static;
+use log::{debug, error, info, Level};
+use parking_lot::Mutex;
 use uuid::Uuid;
 
+use syscare_abi::PatchTelemetryRecord;
 use syscare_common::process::Command;
 
+use super::{rollout, telemetry};
+
 const UPATCH_MANAGE_BIN: &str = "/usr/libexec/syscare/upatch-manage";
+const UPATCH_MANAGE_STDERR_THREAD_NAME: &str = "upatch_manage_stderr";
+const UPATCH_MANAGE_PID_SEPARATOR: &str = ",";
+const UPATCH_MANAGE_RESULT_PREFIX: &str = "UPATCH_RESULT";
+const UPATCH_MANAGE_DONE_PREFIX: &str = "UPATCH_DONE";
+const UPATCH_MANAGE_TIMING_PREFIX: &str = "UPATCH_TIMING";
+const UPATCH_MANAGE_TIMING_ARG: &str = "--timing";
+const UPATCH_MANAGE_SHARE_DIR_ARG: &str = "--share-dir";
+const UPATCH_MANAGE_FREEZE_ARG: &str = "--freeze";
+const UPATCH_MANAGE_DIRECT_BIND_ARG: &str = "--direct-bind";
+const UPATCH_MANAGE_STACK_CHECK_ARG: &str = "--stack-check";
+const UPATCH_MANAGE_CORO_RUNTIME_ARG: &str = "--coro-runtime";
+const UPATCH_MANAGE_CORO_SOFT_DIRTY_ARG: &str = "--coro-soft-dirty";
+const UPATCH_MANAGE_HUGE_TEXT_ARG: &str = "--huge-text";
+const UPATCH_MANAGE_ATTACH_PHASE: &str = "attach";
+const UPATCH_MANAGE_FREEZE_PHASE: &str = "freeze";
+const UPATCH_MANAGE_STOPPED_PHASE: &str = "stopped";
+const UPATCH_MANAGE_TOTAL_PHASE: &str = "total";
+const UPATCH_MANAGE_MEM_WRITTEN_COUNTER: &str = "mem_written";
+const UPATCH_MANAGE_REMOTE_SYSCALL_COUNTER: &str = "remote_syscalls";
+const UPATCH_MANAGE_RETRY_COUNTER: &str = "retries";
+const UPATCH_MANAGE_FIELD_SEPARATOR: &[u8] = b"\t";
+const UPATCH_MANAGE_LIST_SEPARATOR: &[u8] = b"\x1f";
 
-pub fn active_patch(uuid: &Uuid, pid: i32, target_elf: &Path, patch_file: &Path) -> Result<()> {
-    let exit_code = Command::new(UPATCH_MANAGE_BIN)
-        .arg("patch")
-        .arg("--uuid")
-        .arg(uuid.to_string())
-        .arg("--pid")
-        .arg(pid.to_string())
-        .arg("--binary")
-        .arg(target_elf)
-        .arg("--upatch")
-        .arg(patch_file)
-        .stdout(Level::Debug)
-        .run_with_output()?
-        .exit_code();
+/* Kept below ELF_CACHE_MAX_ENTRY of upatch-manage, thus recent targets are still parsed */
+const UPATCH_MANAGE_SERVER_TARGET_NUM: usize = 16;
+
+static UPATCH_MANAGE_MAX_PARALLEL: AtomicUsize = AtomicUsize::new(1);
+
+lazy_static! {
+    /// Idle server instances, each worker takes one at a time
+    static ref UPATCH_MANAGE_SERVERS: Mutex<Vec<ManageServer>> = Mutex::new(Vec::new());
+    /// Options of every upatch-manage instance, set before any patch is operated
+    static ref UPATCH_MANAGE_OPTIONS: Mutex<ManageOptions> = Mutex::new(ManageOptions::default());
+}
+
+#[derive(Debug, Default)]
+struct ManageOptions {
+    share_dir: Option<PathBuf>,
+    freeze: bool,
+    direct_bind: bool,
+    stack_check: bool,
+    coro_runtime: Option<String>,
+    coro_soft_dirty: bool,
+    huge_text: bool,
+}
+
+impl ManageOptions {
+    fn args(&self) -> Vec<OsString> {
+        let mut args = Vec::new();
+        if let Some(share_dir) = &self.share_dir {
+            args.push(OsString::from(UPATCH_MANAGE_SHARE_DIR_ARG));
+            args.push(share_dir.as_os_str().to_os_string());
+        }
+        if self.freeze {
+            args.push(OsString::from(UPATCH_MANAGE_FREEZE_ARG));
+        }
+        if self.direct_bind {
+            args.push(OsString::from(UPATCH_MANAGE_DIRECT_BIND_ARG));
+        }
+        if self.stack_check {
+            args.push(OsString::from(UPATCH_MANAGE_STACK_CHECK_ARG));
+        }
+        if let Some(coro_runtime) = &self.coro_runtime {
+            args.push(OsString::from(UPATCH_MANAGE_CORO_RUNTIME_ARG));
+            args.push(OsString::from(coro_runtime));
+        }
+        if self.coro_soft_dirty {
+            args.push(OsString::from(UPATCH_MANAGE_CORO_SOFT_DIRTY_ARG));
+        }
+        if self.huge_text {
+            args.push(OsString::from(UPATCH_MANAGE_HUGE_TEXT_ARG));
+        }
+        args
+    }
+}
+
+fn parse_process_results(stdout: &OsStr) -> IndexMap<i32, i32> {
+    let mut results = IndexMap::new();
+
+    for line in stdout.to_string_lossy().lines() {
+        let mut items = line.split_whitespace();
+        if items.next() != Some(UPATCH_MANAGE_RESULT_PREFIX) {
+            continue;
+        }
+
+        let mut pid = None;
+        let mut ret = None;
+        for item in items {
+            match item.split_once('=') {
+                Some(("pid", value)) => pid = value.parse::<i32>().ok(),
+                Some(("ret", value)) => ret = value.parse::<i32>().ok(),
+                _ => {}
+            }
+        }
+        if let (Some(pid), Some(ret)) = (pid, ret) {
+            results.insert(pid, ret);
+        }
+    }
+
+    results
+}
+
+/// Timing & counters of one process reported by upatch-manage
+struct ProcessTiming {
+    pid: i32,
+    phases: Vec<(String, u64)>, // Phase -> Microseconds
+    counters: IndexMap<String, u64>,
+}
+
+impl ProcessTiming {
+    fn phase(&self, name: &str) -> u64 {
+        self.phases
+            .iter()
+            .filter(|(phase, _)| phase == name)
+            .map(|(_, us)| *us)
+            .sum()
+    }
+
+    fn counter(&self, name: &str) -> u64 {
+        self.counters.get(name).copied().unwrap_or_default()
+    }
+}
+
+fn parse_json_u64(value: &Value) -> Vec<(String, u64)> {
+    value
+        .as_object()
+        .map(|object| {
+            object
+                .iter()
+                .filter_map(|(key, value)| value.as_u64().map(|num| (key.clone(), num)))
+                .collect::<Vec<_>>()
+        })
+        .unwrap_or_default()
+}
+
+/// Parse per phase timing & counters of each process, timing is in microseconds
+fn parse_process_timings(stdout: &OsStr) -> Vec<ProcessTiming> {
+    let mut timings = Vec::new();
+
+    for line in stdout.to_string_lossy().lines() {
+        let json = match line.strip_prefix(UPATCH_MANAGE_TIMING_PREFIX) {
+            Some(json) => json.trim(),
+            None => continue,
+        };
+        let timing = match serde_json::from_str::<Value>(json) {
+            Ok(timing) => timing,
+            Err(_) => continue,
+        };
+
+        let pid = match timing["pid"].as_i64() {
+            Some(pid) => pid as i32,
+            None => continue,
+        };
+        timings.push(ProcessTiming {
+            pid,
+            phases: self::parse_json_u64(&timing["phases"]),
+            counters: self::parse_json_u64(&timing["counters"])
+                .into_iter()
+                .collect(),
+        });
+    }
+
+    timings
+}
+
+/// Phase timing of a patch operation, aggregated over all processes
+#[derive(Default)]
+struct PatchTiming {
+    process_num: usize,
+    phases: IndexMap<String, (u64, u64, u64)>, // Phase -> (Count, Total, Max)
+}
+
+impl PatchTiming {
+    fn add(&mut self, pid: i32, phases: &[(String, u64)]) {
+        debug!(
+            "Upatch: Process {} timing (us): {}",
+            pid,
+            phases
+                .iter()
+                .map(|(phase, us)| format!("{}={}", phase, us))
+                .collect::<Vec<_>>()
+                .join(", ")
+        );
+
+        self.process_num += 1;
+        for (phase, us) in phases {
+            let entry = self.phases.entry(phase.clone()).or_default();
+            entry.0 += 1;
+            entry.1 += us;
+            entry.2 = entry.2.max(*us);
+        }
+    }
+
+    fn summary(&self) -> String {
+        self.phases
+            .iter()
+            .map(|(phase, (count, total, max))| {
+                format!("{}={}/{}", phase, total / (*count).max(1), max)
+            })
+            .collect::<Vec<_>>()
+            .join(", ")
+    }
+}
+
+/// Long-running upatch-manage instance, which keeps parsed elf files across requests
+struct ManageServer {
+    child: Child,
+    stdin: ChildStdin,
+    stdout: BufReader<ChildStdout>,
+    targets: IndexSet<PathBuf>, // recently requested targets, most recent at the end
+}
+
+impl ManageServer {
+    fn start() -> Result<Self> {
+        let options = UPATCH_MANAGE_OPTIONS.lock().args();
+        let mut child = std::process::Command::new(UPATCH_MANAGE_BIN)
+            .arg("server")
+            .arg(UPATCH_MANAGE_TIMING_ARG)
+            .args(options)
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .stderr(Stdio::piped())
+            .spawn()
+            .with_context(|| format!("Failed to start {}", UPATCH_MANAGE_BIN))?;
+        let stdin = child.stdin.take().context("Failed to open server stdin")?;
+        let stdout = child
+            .stdout
+            .take()
+            .context("Failed to open server stdout")?;
+        let stderr = child
+            .stderr
+            .take()
+            .context("Failed to open server stderr")?;
+
+        let server = Self {
+            child,
+            stdin,
+            stdout: BufReader::new(stdout),
+            targets: IndexSet::new(),
+        };
+
+        // Logged as the stderr of a command would be, the thread ends along with the server
+        thread::Builder::new()
+            .name(UPATCH_MANAGE_STDERR_THREAD_NAME.to_string())
+            .spawn(move || {
+                for line in BufReader::new(stderr).lines().flatten() {
+                    error!("{}", line);
+                }
+            })
+            .with_context(|| {
+                format!(
+                    "Failed to create thread '{}'",
+                    UPATCH_MANAGE_STDERR_THREAD_NAME
+                )
+            })?;
+
+        Ok(server)
+    }
+
+    fn add_target(&mut self, target_elf: &Path) {
+        self.targets.shift_remove(target_elf);
+        self.targets.insert(target_elf.to_path_buf());
+        while self.targets.len() > UPATCH_MANAGE_SERVER_TARGET_NUM {
+            self.targets.shift_remove_index(0);
+        }
+    }
+
+    /// Output read so far is returned even if the request fails
+    fn request(
+        &mut self,
+        command: &str,
+        patches: &[(Uuid, PathBuf)],
+        pid_list: &str,
+        target_elf: &Path,
+    ) -> (OsString, Result<i32>) {
+        let mut output = String::new();
+        let result = self.do_request(command, patches, pid_list, target_elf, &mut output);
+
+        (OsString::from(output), result)
+    }
+
+    fn do_request(
+        &mut self,
+        command: &str,
+        patches: &[(Uuid, PathBuf)],
+        pid_list: &str,
+        target_elf: &Path,
+        output: &mut String,
+    ) -> Result<i32> {
+        let mut uuid_list = Vec::new();
+        let mut patch_list = Vec::new();
+        for (uuid, patch_file) in patches {
+            if !uuid_list.is_empty() {
+                uuid_list.extend_from_slice(UPATCH_MANAGE_LIST_SEPARATOR);
+                patch_list.extend_from_slice(UPATCH_MANAGE_LIST_SEPARATOR);
+            }
+            uuid_list.extend_from_slice(uuid.to_string().as_bytes());
+            patch_list.extend_from_slice(StdOsStrExt::as_bytes(patch_file.as_os_str()));
+        }
+
+        let mut request = Vec::new();
+        for field in [
+            command.as_bytes(),
+            &uuid_list,
+            StdOsStrExt::as_bytes(target_elf.as_os_str()),
+            &patch_list,
+            pid_list.as_bytes(),
+        ] {
+            if !request.is_empty() {
+                request.extend_from_slice(UPATCH_MANAGE_FIELD_SEPARATOR);
+            }
+            request.extend_from_slice(field);
+        }
+        request.push(b'\n');
+        self.stdin.write_all(&request)?;
+        self.stdin.flush()?;
+
+        loop {
+            let mut line = String::new();
+            if self.stdout.read_line(&mut line)? == 0 {
+                bail!("Server exited unexpectedly");
+            }
+            if let Some(ret) = line.trim_end().strip_prefix(UPATCH_MANAGE_DONE_PREFIX) {
+                return ret
+                    .trim()
+                    .strip_prefix("ret=")
+                    .and_then(|value| value.parse::<i32>().ok())
+                    .context("Invalid server response");
+            }
+            debug!("{}", line.trim_end());
+            output.push_str(&line);
+        }
+    }
+}
+
+impl Drop for ManageServer {
+    fn drop(&mut self) {
+        self.child.kill().ok();
+        self.child.wait().ok();
+    }
+}
+
+fn server_request(
+    command: &str,
+    patches: &[(Uuid, PathBuf)],
+    pid_list: &str,
+    target_elf: &Path,
+) -> (OsString, Result<i32>) {
+    // Prefer the server which has parsed the target, other servers would parse it again
+    let idle_server = {
+        let mut servers = UPATCH_MANAGE_SERVERS.lock();
+        servers
+            .iter()
+            .rposition(|server| server.targets.contains(target_elf))
+            .or_else(|| servers.len().checked_sub(1))
+            .map(|index| servers.remove(index))
+    };
+    let mut server = match idle_server.map_or_else(ManageServer::start, Ok) {
+        Ok(server) => server,
+        Err(e) => return (OsString::new(), Err(e)),
+    };
 
-    match exit_code {
-        0 => Ok(()),
-        _ => bail!(std::io::Error::from_raw_os_error(exit_code)),
+    // Broken server is dropped here, a new one would start on demand
+    let (output, result) = server.request(command, patches, pid_list, target_elf);
+    if result.is_ok() {
+        server.add_target(target_elf);
+        UPATCH_MANAGE_SERVERS.lock().push(server);
     }
+
+    (output, result)
 }
 
-pub fn deactive_patch(uuid: &Uuid, pid: i32, target_elf: &Path, patch_file: &Path) -> Result<()> {
-    let exit_code = Command::new(UPATCH_MANAGE_BIN)
-        .arg("unpatch")
-        .arg("--uuid")
-        .arg(uuid.to_string())
+fn command_request(
+    command: &str,
+    patches: &[(Uuid, PathBuf)],
+    pid_list: &str,
+    target_elf: &Path,
+) -> Result<(OsString, i32)> {
+    let options = UPATCH_MANAGE_OPTIONS.lock().args();
+    let mut manage = Command::new(UPATCH_MANAGE_BIN);
+    manage
+        .arg(command)
+        .arg(UPATCH_MANAGE_TIMING_ARG)
+        .args(options)
         .arg("--pid")
-        .arg(pid.to_string())
+        .arg(pid_list)
         .arg("--binary")
-        .arg(target_elf)
-        .arg("--upatch")
-        .arg(patch_file)
-        .stdout(Level::Debug)
-        .run_with_output()?
-        .exit_code();
+        .arg(target_elf);
+    for (uuid, patch_file) in patches {
+        manage
+            .arg("--uuid")
+            .arg(uuid.to_string())
+            .arg("--upatch")
+            .arg(patch_file);
+    }
+    let output = manage.stdout(Level::Debug).run_with_output()?;
+
+    let exit_code = output.exit_code();
+    Ok((output.stdout, exit_code))
+}
+
+fn join_pids(pids: &[i32]) -> String {
+    pids.iter()
+        .map(i32::to_string)
+        .collect::<Vec<_>>()
+        .join(UPATCH_MANAGE_PID_SEPARATOR)
+}
+
+/// Operate processes by a server, processes it did not report are retried by a command.
+///
+/// Output of both is returned, the exit code applies to processes without a result.
+fn manage_request(
+    command: &str,
+    patches: &[(Uuid, PathBuf)],
+    pids: &[i32],
+    target_elf: &Path,
+) -> (OsString, Result<i32>) {
+    let (mut output, result) =
+        self::server_request(command, patches, &self::join_pids(pids), target_elf);
+    let e = match result {
+        Ok(exit_code) => return (output, Ok(exit_code)),
+        Err(e) => e,
+    };
+    debug!("upatch-manage server is unavailable, {:#}", e);
+
+    let reported = self::parse_process_results(&output);
+    let retry_pids = pids
+        .iter()
+        .copied()
+        .filter(|pid| !reported.contains_key(pid))
+        .collect::<Vec<_>>();
+    if retry_pids.is_empty() {
+        return (output, Ok(0));
+    }
+
+    match self::command_request(command, patches, &self::join_pids(&retry_pids), target_elf) {
+        Ok((retry_output, exit_code)) => {
+            output.push(retry_output);
+            (output, Ok(exit_code))
+        }
+        Err(e) => (output, Err(e)),
+    }
+}
 
-    match exit_code {
-        0 => Ok(()),
-        _ => bail!(std::io::Error::from_raw_os_error(exit_code)),
+/// Operate processes by one request, stopped time of them is returned along with the results
+fn upatch_manage_batch(
+    command: &str,
+    patches: &[(Uuid, PathBuf)],
+    pids: &[i32],
+    target_elf: &Path,
+    timing: &Mutex<PatchTiming>,
+) -> (Vec<(i32, Result<()>)>, u64) {
+    if pids.is_empty() {
+        return (vec![], 0);
     }
+
+    let (stdout, exit_code) = self::manage_request(command, patches, pids, target_elf);
+
+    let process_results = self::parse_process_results(&stdout);
+    let process_timings = self::parse_process_timings(&stdout);
+    let mut stopped_us = 0;
+    let mut timing = timing.lock();
+    for process_timing in &process_timings {
+        stopped_us += process_timing.phase(UPATCH_MANAGE_STOPPED_PHASE);
+        timing.add(process_timing.pid, &process_timing.phases);
+    }
+    drop(timing);
+
+    // Processes without a reported result share the exit code, or the request error
+    let process_ret = |pid: i32| match process_results.get(&pid) {
+        Some(ret) => Ok(*ret),
+        None => match &exit_code {
+            Ok(ret) => Ok(*ret),
+            Err(e) => Err(anyhow!("{:#}", e)),
+        },
+    };
+    let uuids = patches
+        .iter()
+        .map(|(uuid, _)| uuid.to_string())
+        .collect::<Vec<_>>()
+        .join(",");
+    telemetry::record(
+        process_timings
+            .iter()
+            .map(|process_timing| PatchTelemetryRecord {
+                seq: 0,
+                timestamp: 0,
+                uuid: uuids.clone(),
+                command: command.to_string(),
+                pid: process_timing.pid,
+                result: process_ret(process_timing.pid).unwrap_or(-1),
+                attach_us: process_timing.phase(UPATCH_MANAGE_ATTACH_PHASE),
+                freeze_us: process_timing.phase(UPATCH_MANAGE_FREEZE_PHASE),
+                stopped_us: process_timing.phase(UPATCH_MANAGE_STOPPED_PHASE),
+                total_us: process_timing.phase(UPATCH_MANAGE_TOTAL_PHASE),
+                mem_written: process_timing.counter(UPATCH_MANAGE_MEM_WRITTEN_COUNTER),
+                remote_syscalls: process_timing.counter(UPATCH_MANAGE_REMOTE_SYSCALL_COUNTER),
+                retries: process_timing.counter(UPATCH_MANAGE_RETRY_COUNTER),
+            }),
+    );
+
+    let results = pids
+        .iter()
+        .map(|pid| {
+            let result = match process_ret(*pid) {
+                Ok(0) => Ok(()),
+                Ok(ret) => Err(anyhow!(std::io::Error::from_raw_os_error(ret))),
+                Err(e) => Err(e),
+            };
+            (*pid, result)
+        })
+        .collect();
+
+    (results, stopped_us)
+}
+
+/// Operate processes of a batch one after another.
+///
+/// If the rollout is paced, each process has its own request, then the worker waits
+/// in proportion to how long the process was stopped, before the next one is stopped.
+fn upatch_manage_worker(
+    command: &str,
+    patches: &[(Uuid, PathBuf)],
+    pids: &[i32],
+    target_elf: &Path,
+    timing: &Mutex<PatchTiming>,
+) -> Vec<(i32, Result<()>)> {
+    if !rollout::is_paced() {
+        return self::upatch_manage_batch(command, patches, pids, target_elf, timing).0;
+    }
+
+    let mut results = Vec::with_capacity(pids.len());
+    for (index, pid) in pids.iter().enumerate() {
+        let (pid_results, stopped_us) =
+            self::upatch_manage_batch(command, patches, &[*pid], target_elf, timing);
+        results.extend(pid_results);
+        if index + 1 < pids.len() {
+            rollout::pace(stopped_us);
+        }
+    }
+
+    results
+}
+
+/// Operate all processes, phase timing is aggregated over them and logged per request
+fn upatch_manage(
+    command: &'static str,
+    patches: &[(Uuid, PathBuf)],
+    pids: &[i32],
+    target_elf: &Path,
+) -> Vec<(i32, Result<()>)> {
+    let timing = Arc::new(Mutex::new(PatchTiming::default()));
+    let results = self::upatch_manage_parallel(command, patches, pids, target_elf, &timing);
+
+    let timing = timing.lock();
+    if timing.process_num != 0 {
+        info!(
+            "Upatch: {} {} on {} process(es), phase time (avg/max us): {}",
+            command,
+            patches
+                .iter()
+                .map(|(uuid, _)| format!("'{}'", uuid))
+                .collect::<Vec<_>>()
+                .join(", "),
+            timing.process_num,
+            timing.summary()
+        );
+    }
+
+    results
+}
+
+/// Split processes into at most `max_parallel` batches, each batch is handled by its own worker
+fn upatch_manage_parallel(
+    command: &'static str,
+    patches: &[(Uuid, PathBuf)],
+    pids: &[i32],
+    target_elf: &Path,
+    timing: &Arc<Mutex<PatchTiming>>,
+) -> Vec<(i32, Result<()>)> {
+    let max_parallel = UPATCH_MANAGE_MAX_PARALLEL.load(Ordering::Relaxed).max(1);
+    let batch_num = max_parallel.min(pids.len());
+    let ordered_pids = rollout::order(pids);
+    if batch_num <= 1 {
+        let results =
+            self::upatch_manage_worker(command, patches, &ordered_pids, target_elf, timing);
+        return self::sort_results(pids, results);
+    }
+    let batches = rollout::split_batches(&ordered_pids, batch_num);
+
+    let workers = batches
+        .into_iter()
+        .filter(|batch| !batch.is_empty())
+        .map(|batch| {
+            let patches = patches.to_vec();
+            let pids = batch.clone();
+            let target_elf = target_elf.to_path_buf();
+            let timing = timing.clone();
+            let worker = std::thread::Builder::new()
+                .name(format!("upatch-{}", command))
+                .spawn(move || {
+                    self::upatch_manage_worker(command, &patches, &pids, &target_elf, &timing)
+                });
+            (batch, worker)
+        })
+        .collect::<Vec<_>>();
+
+    let mut results = Vec::with_capacity(pids.len());
+    for (batch, worker) in workers {
+        let worker_results = worker
+            .map_err(|e| anyhow!("Failed to start worker, {}", e))
+            .and_then(|handle| handle.join().map_err(|_| anyhow!("Worker panicked")));
+        match worker_results {
+            Ok(batch_results) => results.extend(batch_results),
+            Err(e) => {
+                for pid in batch {
+                    results.push((pid, Err(anyhow!("{:#}", e))));
+                }
+            }
+        }
+    }
+
+    self::sort_results(pids, results)
+}
+
+/// Results in the order of requested processes
+fn sort_results(pids: &[i32], results: Vec<(i32, Result<()>)>) -> Vec<(i32, Result<()>)> {
+    let mut results = results.into_iter().collect::<IndexMap<_, _>>();
+
+    pids.iter()
+        .filter_map(|pid| results.remove(pid).map(|result| (*pid, result)))
+        .collect()
+}
+
+pub fn set_max_parallel(value: usize) {
+    UPATCH_MANAGE_MAX_PARALLEL.store(value, Ordering::Relaxed);
+}
+
+pub fn set_share_dir(value: Option<PathBuf>) {
+    UPATCH_MANAGE_OPTIONS.lock().share_dir = value;
+}
+
+pub fn set_freeze(value: bool) {
+    UPATCH_MANAGE_OPTIONS.lock().freeze = value;
+}
+
+pub fn set_direct_bind(value: bool) {
+    UPATCH_MANAGE_OPTIONS.lock().direct_bind = value;
+}
+
+pub fn set_stack_check(value: bool) {
+    UPATCH_MANAGE_OPTIONS.lock().stack_check = value;
+}
+
+pub fn set_coro_runtime(value: Option<String>, soft_dirty: bool) {
+    let mut options = UPATCH_MANAGE_OPTIONS.lock();
+    options.coro_runtime = value;
+    options.coro_soft_dirty = soft_dirty;
+}
+
+pub fn set_huge_text(value: bool) {
+    UPATCH_MANAGE_OPTIONS.lock().huge_text = value;
+}
+
+pub fn active_patch(
+    uuid: &Uuid,
+    pids: &[i32],
+    target_elf: &Path,
+    patch_file: &Path,
+) -> Vec<(i32, Result<()>)> {
+    self::upatch_manage(
+        "patch",
+        &[(*uuid, patch_file.to_path_buf())],
+        pids,
+        target_elf,
+    )
+}
+
+/// Active patches in order within one stop of each process, a process gets all of them or none
+pub fn active_patches(
+    patches: &[(Uuid, PathBuf)],
+    pids: &[i32],
+    target_elf: &Path,
+) -> Vec<(i32, Result<()>)> {
+    self::upatch_manage("patch", patches, pids, target_elf)
+}
+
+pub fn deactive_patch(
+    uuid: &Uuid,
+    pids: &[i32],
+    target_elf: &Path,
+    patch_file: &Path,
+) -> Vec<(i32, Result<()>)> {
+    self::upatch_manage(
+        "unpatch",
+        &[(*uuid, patch_file.to_path_buf())],
+        pids,
+        target_elf,
+    )
+}
+
+/// Replace the applied patch by the new one within one stop of each process
+pub fn replace_patch(
+    old_uuid: &Uuid,
+    old_patch_file: &Path,
+    new_uuid: &Uuid,
+    new_patch_file: &Path,
+    pids: &[i32],
+    target_elf: &Path,
+) -> Vec<(i32, Result<()>)> {
+    self::upatch_manage(
+        "replace",
+        &[
+            (*old_uuid, old_patch_file.to_path_buf()),
+            (*new_uuid, new_patch_file.to_path_buf()),
+        ],
+        pids,
+        target_elf,
+    )
 }
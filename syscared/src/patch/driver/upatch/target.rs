@@ -12,15 +12,19 @@
  * See the Mulan PSL v2 for more details.
  */
 
-use std::ffi::OsString;
+use std::{collections::BTreeMap, ffi::OsString, sync::Arc};
 
-use indexmap::IndexMap;
+use indexmap::{IndexMap, IndexSet};
+use parking_lot::{lock_api::ArcMutexGuard, Mutex, RawMutex};
 use uuid::Uuid;
 
 use crate::patch::entity::UserPatchFunction;
 
 use super::entity::PatchEntity;
 
+/// Owned guard of a target process lock, could be kept across calls
+pub type ProcessGuard = ArcMutexGuard<RawMutex, ()>;
+
 #[derive(Debug)]
 pub struct PatchFunction {
     pub uuid: Uuid,
@@ -42,10 +46,25 @@ impl PatchFunction {
     }
 }
 
+/// Patched range of a target function, the last function of the collision list is in effect
+#[derive(Debug, Default)]
+struct FunctionRecord {
+    size: u64,
+    collision_list: Vec<PatchFunction>,
+}
+
+impl FunctionRecord {
+    fn end(addr: u64, size: u64) -> u64 {
+        addr.saturating_add(size.max(1))
+    }
+}
+
 #[derive(Debug, Default)]
 pub struct PatchTarget {
     patch_map: IndexMap<Uuid, PatchEntity>, // patched file data
-    function_map: IndexMap<u64, Vec<PatchFunction>>, // function addr -> function collision list
+    function_map: BTreeMap<u64, FunctionRecord>, // function addr -> function record, sorted
+    arenas: IndexSet<u64>, // known patch arena addresses, shared by forked processes
+    process_lock: Arc<Mutex<()>>, // serializes process operations of the target
 }
 
 impl PatchTarget {
@@ -61,6 +80,19 @@ impl PatchTarget {
         self.patch_map.remove(uuid);
     }
 
+    /// Process operations of the target hold this lock instead of the whole target map,
+    /// it must be taken before the target map is locked
+    pub fn process_lock(&self) -> Arc<Mutex<()>> {
+        self.process_lock.clone()
+    }
+
+    pub fn process_num(&self, uuid: &Uuid) -> usize {
+        self.patch_map
+            .get(uuid)
+            .map(PatchEntity::process_num)
+            .unwrap_or_default()
+    }
+
     pub fn get_patch(&mut self, uuid: &Uuid) -> Option<&mut PatchEntity> {
         self.patch_map.get_mut(uuid)
     }
@@ -70,15 +102,38 @@ impl PatchTarget {
     }
 }
 
+impl PatchTarget {
+    pub fn arenas(&self) -> &IndexSet<u64> {
+        &self.arenas
+    }
+
+    /// Arenas are not tracked when their processes are gone, the least recent ones are dropped
+    pub fn add_arenas<I>(&mut self, arenas: I)
+    where
+        I: IntoIterator<Item = u64>,
+    {
+        const MAX_ARENA_NUM: usize = 16;
+
+        for arena in arenas {
+            self.arenas.shift_remove(&arena);
+            self.arenas.insert(arena);
+        }
+        while self.arenas.len() > MAX_ARENA_NUM {
+            self.arenas.shift_remove_index(0);
+        }
+    }
+}
+
 impl PatchTarget {
     pub fn add_functions<'a, I>(&mut self, uuid: Uuid, functions: I)
     where
         I: IntoIterator<Item = &'a UserPatchFunction>,
     {
         for function in functions {
-            self.function_map
-                .entry(function.old_addr)
-                .or_default()
+            let record = self.function_map.entry(function.old_addr).or_default();
+            record.size = record.size.max(function.old_size);
+            record
+                .collision_list
                 .push(PatchFunction::new(uuid, function));
         }
     }
@@ -88,7 +143,8 @@ impl PatchTarget {
         I: IntoIterator<Item = &'a UserPatchFunction>,
     {
         for function in functions {
-            if let Some(collision_list) = self.function_map.get_mut(&function.old_addr) {
+            if let Some(record) = self.function_map.get_mut(&function.old_addr) {
+                let collision_list = &mut record.collision_list;
                 if let Some(index) = collision_list
                     .iter()
                     .position(|patch_function| patch_function.is_same_function(uuid, function))
@@ -104,6 +160,29 @@ impl PatchTarget {
 }
 
 impl PatchTarget {
+    /*
+     * Functions of one target never overlap each other, thus the records overlapping
+     * a range are the last one starting before it, and those starting inside it.
+     */
+    fn find_functions<'a>(
+        &'a self,
+        function: &UserPatchFunction,
+    ) -> impl Iterator<Item = &'a PatchFunction> {
+        let start = function.old_addr;
+        let end = FunctionRecord::end(start, function.old_size);
+
+        let prev_record = self
+            .function_map
+            .range(..start)
+            .next_back()
+            .filter(|(addr, record)| FunctionRecord::end(**addr, record.size) > start);
+
+        prev_record
+            .into_iter()
+            .chain(self.function_map.range(start..end))
+            .filter_map(|(_, record)| record.collision_list.last())
+    }
+
     pub fn get_conflicts<'a, I>(
         &'a self,
         functions: I,
@@ -111,11 +190,9 @@ impl PatchTarget {
     where
         I: IntoIterator<Item = &'a UserPatchFunction>,
     {
-        functions.into_iter().filter_map(move |function| {
-            self.function_map
-                .get(&function.old_addr)
-                .and_then(|list| list.last())
-        })
+        functions
+            .into_iter()
+            .flat_map(move |function| self.find_functions(function))
     }
 
     pub fn get_overrides<'a, I>(
@@ -126,11 +203,9 @@ impl PatchTarget {
     where
         I: IntoIterator<Item = &'a UserPatchFunction>,
     {
-        functions.into_iter().filter_map(move |function| {
-            self.function_map
-                .get(&function.old_addr)
-                .and_then(|list| list.last())
-                .filter(|patch_function| !patch_function.is_same_function(uuid, function))
+        functions.into_iter().flat_map(move |function| {
+            self.find_functions(function)
+                .filter(move |patch_function| !patch_function.is_same_function(uuid, function))
         })
     }
 }
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    collections::VecDeque,
+    time::{SystemTime, UNIX_EPOCH},
+};
+
+use lazy_static::lazy_static;
+use parking_lot::Mutex;
+
+use syscare_abi::PatchTelemetryRecord;
+
+/* Records of recent operations, the oldest ones are dropped first */
+const TELEMETRY_CAPACITY: usize = 4096;
+
+lazy_static! {
+    static ref TELEMETRY: Mutex<Telemetry> = Mutex::new(Telemetry::default());
+}
+
+#[derive(Default)]
+struct Telemetry {
+    records: VecDeque<PatchTelemetryRecord>,
+    last_seq: u64,
+}
+
+/// Keep records of an operation, sequence number & timestamp are assigned here
+pub fn record<I>(records: I)
+where
+    I: IntoIterator<Item = PatchTelemetryRecord>,
+{
+    let timestamp = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map(|time| time.as_secs())
+        .unwrap_or_default();
+
+    let mut telemetry = TELEMETRY.lock();
+    for mut record in records {
+        telemetry.last_seq += 1;
+        record.seq = telemetry.last_seq;
+        record.timestamp = timestamp;
+
+        if telemetry.records.len() == TELEMETRY_CAPACITY {
+            telemetry.records.pop_front();
+        }
+        telemetry.records.push_back(record);
+    }
+}
+
+/// Records after sequence number `since`, thus a scraper only fetches new ones
+pub fn records(since: u64) -> Vec<PatchTelemetryRecord> {
+    let telemetry = TELEMETRY.lock();
+    let start = telemetry
+        .records
+        .partition_point(|record| record.seq <= since);
+
+    telemetry.records.range(start..).cloned().collect()
+}
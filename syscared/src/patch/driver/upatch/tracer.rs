@@ -0,0 +1,430 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{convert::TryInto, io, mem};
+
+use anyhow::{bail, Context, Result};
+use nix::libc;
+
+use syscare_common::fs;
+
+/* linux/ptrace.h */
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+const PTRACE_O_TRACEEXEC: u64 = 0x10;
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+const PTRACE_EVENT_EXEC: libc::c_int = 4;
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+const PTRACE_EVENT_STOP: libc::c_int = 128;
+
+#[cfg(target_arch = "x86_64")]
+mod arch {
+    pub const BREAKPOINT_INSN: u64 = 0xcc; // int3
+    pub const BREAKPOINT_MASK: u64 = 0xff;
+    pub const BREAKPOINT_PC_OFFSET: u64 = 1; // pc stops after int3
+    pub const SYSCALL_INSN: u64 = 0x050f; // syscall
+    pub const SYSCALL_MASK: u64 = 0xffff;
+
+    pub fn get_pc(regs: &super::libc::user_regs_struct) -> u64 {
+        regs.rip
+    }
+
+    pub fn set_pc(regs: &mut super::libc::user_regs_struct, pc: u64) {
+        regs.rip = pc;
+    }
+
+    pub fn set_syscall(regs: &mut super::libc::user_regs_struct, nr: i64, args: [u64; 5]) {
+        regs.rax = nr as u64;
+        regs.rdi = args[0];
+        regs.rsi = args[1];
+        regs.rdx = args[2];
+        regs.r10 = args[3];
+        regs.r8 = args[4];
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+mod arch {
+    pub const BREAKPOINT_INSN: u64 = 0xd4200000; // brk #0
+    pub const BREAKPOINT_MASK: u64 = 0xffffffff;
+    pub const BREAKPOINT_PC_OFFSET: u64 = 0; // pc stops at brk
+    pub const SYSCALL_INSN: u64 = 0xd4000001; // svc #0
+    pub const SYSCALL_MASK: u64 = 0xffffffff;
+
+    pub fn get_pc(regs: &super::libc::user_regs_struct) -> u64 {
+        regs.pc
+    }
+
+    pub fn set_pc(regs: &mut super::libc::user_regs_struct, pc: u64) {
+        regs.pc = pc;
+    }
+
+    pub fn set_syscall(regs: &mut super::libc::user_regs_struct, nr: i64, args: [u64; 5]) {
+        regs.regs[8] = nr as u64;
+        regs.regs[..5].copy_from_slice(&args);
+    }
+}
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+fn last_error() -> io::Error {
+    io::Error::last_os_error()
+}
+
+/// Read an auxiliary vector entry of the process
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+fn read_auxv(pid: i32, key: libc::c_ulong) -> Result<u64> {
+    const AUXV_ENTRY_SIZE: usize = 2 * mem::size_of::<u64>();
+
+    let auxv = fs::read(format!("/proc/{}/auxv", pid))?;
+    for entry in auxv.chunks_exact(AUXV_ENTRY_SIZE) {
+        let entry_key = u64::from_ne_bytes(entry[..8].try_into()?);
+        let entry_value = u64::from_ne_bytes(entry[8..].try_into()?);
+        if entry_key == key as u64 {
+            return Ok(entry_value);
+        }
+    }
+    bail!("Cannot find auxv entry {}", key)
+}
+
+/// Process traced from right before its exec
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+pub struct Tracee {
+    pid: i32,
+}
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+impl Tracee {
+    fn request(&self, request: libc::c_uint, addr: u64, data: u64) -> libc::c_long {
+        unsafe {
+            libc::ptrace(
+                request,
+                self.pid,
+                addr as *mut libc::c_void,
+                data as *mut libc::c_void,
+            )
+        }
+    }
+
+    fn wait(&self) -> io::Result<libc::c_int> {
+        let mut status = 0;
+        loop {
+            let ret = unsafe { libc::waitpid(self.pid, &mut status, libc::__WALL) };
+            if ret >= 0 {
+                return Ok(status);
+            }
+            let e = last_error();
+            if e.raw_os_error() != Some(libc::EINTR) {
+                return Err(e);
+            }
+        }
+    }
+
+    fn cont(&self, signal: libc::c_int) -> io::Result<()> {
+        if self.request(libc::PTRACE_CONT, 0, signal as u64) < 0 {
+            return Err(last_error());
+        }
+        Ok(())
+    }
+
+    fn peek(&self, addr: u64) -> io::Result<u64> {
+        // PEEKDATA returns the word itself, errno is the only way to tell failures
+        unsafe { *libc::__errno_location() = 0 };
+        let value = self.request(libc::PTRACE_PEEKDATA, addr, 0);
+        if value == -1 && unsafe { *libc::__errno_location() } != 0 {
+            return Err(last_error());
+        }
+        Ok(value as u64)
+    }
+
+    fn poke(&self, addr: u64, value: u64) -> io::Result<()> {
+        if self.request(libc::PTRACE_POKEDATA, addr, value) < 0 {
+            return Err(last_error());
+        }
+        Ok(())
+    }
+
+    fn regs_request(
+        &self,
+        request: libc::c_uint,
+        regs: &mut libc::user_regs_struct,
+    ) -> io::Result<()> {
+        let mut iov = libc::iovec {
+            iov_base: regs as *mut libc::user_regs_struct as *mut libc::c_void,
+            iov_len: mem::size_of::<libc::user_regs_struct>(),
+        };
+        let ret = unsafe {
+            libc::ptrace(
+                request,
+                self.pid,
+                libc::NT_PRSTATUS as usize as *mut libc::c_void,
+                &mut iov as *mut libc::iovec as *mut libc::c_void,
+            )
+        };
+        if ret < 0 {
+            return Err(last_error());
+        }
+        Ok(())
+    }
+
+    fn get_regs(&self) -> io::Result<libc::user_regs_struct> {
+        let mut regs: libc::user_regs_struct = unsafe { mem::zeroed() };
+        self.regs_request(libc::PTRACE_GETREGSET, &mut regs)?;
+        Ok(regs)
+    }
+
+    fn set_regs(&self, regs: &mut libc::user_regs_struct) -> io::Result<()> {
+        self.regs_request(libc::PTRACE_SETREGSET, regs)
+    }
+
+    fn detach(&self, signal: libc::c_int) -> io::Result<()> {
+        if self.request(libc::PTRACE_DETACH, 0, signal as u64) < 0 {
+            return Err(last_error());
+        }
+        Ok(())
+    }
+
+    fn wait_exec(&self) -> Result<bool> {
+        const EXEC_STOP_STATUS: libc::c_int = libc::SIGTRAP | (PTRACE_EVENT_EXEC << 8);
+
+        loop {
+            let status = self.wait()?;
+            if libc::WIFEXITED(status) || libc::WIFSIGNALED(status) {
+                return Ok(false);
+            }
+            if !libc::WIFSTOPPED(status) {
+                continue;
+            }
+            if (status >> 8) == EXEC_STOP_STATUS {
+                return Ok(true);
+            }
+
+            let signal = match status >> 16 {
+                PTRACE_EVENT_STOP => 0,
+                _ => libc::WSTOPSIG(status),
+            };
+            self.cont(signal)?;
+        }
+    }
+
+    /// Returns registers at entry, or None if process exited
+    fn run_to(&self, entry: u64) -> Result<Option<libc::user_regs_struct>> {
+        let orig_insn = self.peek(entry).context("Failed to read entry")?;
+        let bp_insn = (orig_insn & !arch::BREAKPOINT_MASK) | arch::BREAKPOINT_INSN;
+        self.poke(entry, bp_insn)
+            .context("Failed to insert breakpoint")?;
+
+        let result = self.wait_breakpoint(entry);
+        // Restore entry anyway, unless the process is gone
+        if !matches!(result, Ok(None)) {
+            self.poke(entry, orig_insn)
+                .context("Failed to remove breakpoint")?;
+        }
+
+        Ok(result?.map(|mut regs| {
+            arch::set_pc(&mut regs, entry);
+            regs
+        }))
+    }
+
+    /// Let the process block in ppoll() at entry, which only a signal would end
+    fn park(&self, entry: u64, regs: &libc::user_regs_struct) -> Result<u64> {
+        let orig_insn = self.peek(entry).context("Failed to read entry")?;
+        let syscall_insn = (orig_insn & !arch::SYSCALL_MASK) | arch::SYSCALL_INSN;
+        let mut park_regs = *regs;
+        arch::set_syscall(&mut park_regs, libc::SYS_ppoll, [0, 0, 0, 0, 8]);
+
+        self.poke(entry, syscall_insn)
+            .context("Failed to insert syscall")?;
+        if let Err(e) = self.set_regs(&mut park_regs) {
+            self.poke(entry, orig_insn).ok();
+            return Err(e).context("Failed to set registers");
+        }
+        Ok(orig_insn)
+    }
+
+    /// Stop the process again, which has no tracer now, returns a signal arrived meanwhile
+    fn interrupt(&self) -> Result<Option<libc::c_int>> {
+        if self.request(libc::PTRACE_INTERRUPT, 0, 0) < 0 {
+            return Err(last_error()).context("Failed to interrupt process");
+        }
+        loop {
+            let status = self.wait()?;
+            if libc::WIFEXITED(status) || libc::WIFSIGNALED(status) {
+                return Ok(None);
+            }
+            if !libc::WIFSTOPPED(status) {
+                continue;
+            }
+            return match status >> 16 {
+                PTRACE_EVENT_STOP => Ok(Some(0)),
+                _ => Ok(Some(libc::WSTOPSIG(status))),
+            };
+        }
+    }
+
+    /// Continue until the breakpoint at entry, returns None if process exited
+    fn wait_breakpoint(&self, entry: u64) -> Result<Option<libc::user_regs_struct>> {
+        let mut signal = 0;
+        loop {
+            self.cont(signal)?;
+
+            let status = self.wait()?;
+            if libc::WIFEXITED(status) || libc::WIFSIGNALED(status) {
+                return Ok(None);
+            }
+            if !libc::WIFSTOPPED(status) {
+                continue;
+            }
+
+            signal = libc::WSTOPSIG(status);
+            if (status >> 16) == PTRACE_EVENT_STOP {
+                // Group stop or interrupt, nothing to deliver
+                signal = 0;
+                continue;
+            }
+            if signal == libc::SIGTRAP {
+                let regs = self.get_regs()?;
+                if arch::get_pc(&regs) == entry + arch::BREAKPOINT_PC_OFFSET {
+                    return Ok(Some(regs));
+                }
+            }
+        }
+    }
+}
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+impl Tracee {
+    /// Start tracing a process which is blocked in exec, the exec must not be resumed before
+    pub fn seize_exec(pid: i32) -> Result<Self> {
+        let tracee = Self { pid };
+        if tracee.request(libc::PTRACE_SEIZE, 0, PTRACE_O_TRACEEXEC) < 0 {
+            return Err(last_error()).context("Failed to seize process");
+        }
+        Ok(tracee)
+    }
+
+    /// Run the new image until its entry point, which is after the dynamic loader mapped
+    /// all libraries and before any code of the executable runs.
+    /// On success, the process is left untraced, blocked in a syscall at entry, thus
+    /// it could be patched, then it has to be resumed by `ParkedTracee::resume()`.
+    /// No signal is involved, the parent never sees the process stop.
+    /// Returns None if the process exited meanwhile.
+    pub fn park_at_entry(self) -> Result<Option<ParkedTracee>> {
+        let result = (|| -> Result<Option<(u64, libc::user_regs_struct)>> {
+            if !self.wait_exec()? {
+                return Ok(None);
+            }
+            let entry = read_auxv(self.pid, libc::AT_ENTRY).context("Failed to read entry")?;
+            Ok(self.run_to(entry)?.map(|regs| (entry, regs)))
+        })();
+
+        let (entry, mut regs) = match result {
+            Ok(Some(state)) => state,
+            Ok(None) => return Ok(None),
+            Err(e) => {
+                self.detach(0).ok();
+                return Err(e);
+            }
+        };
+        match self.park(entry, &regs) {
+            Ok(orig_insn) => {
+                self.detach(0)?;
+                Ok(Some(ParkedTracee {
+                    tracee: self,
+                    entry,
+                    orig_insn,
+                    regs,
+                }))
+            }
+            Err(e) => {
+                self.set_regs(&mut regs).ok();
+                self.detach(0).ok();
+                Err(e)
+            }
+        }
+    }
+}
+
+/// Process blocked at its entry point, see `Tracee::park_at_entry()`
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+pub struct ParkedTracee {
+    tracee: Tracee,
+    entry: u64,
+    orig_insn: u64,
+    regs: libc::user_regs_struct,
+}
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+impl ParkedTracee {
+    /// Trace the process again, put entry & registers back, then let it run from entry
+    pub fn resume(self) -> Result<()> {
+        let Self {
+            tracee,
+            entry,
+            orig_insn,
+            mut regs,
+        } = self;
+        if tracee.request(libc::PTRACE_SEIZE, 0, 0) < 0 {
+            let e = last_error();
+            if e.raw_os_error() == Some(libc::ESRCH) {
+                return Ok(());
+            }
+            return Err(e).context("Failed to seize process");
+        }
+
+        let signal = match tracee.interrupt() {
+            Ok(Some(signal)) => signal,
+            Ok(None) => return Ok(()),
+            Err(e) => {
+                tracee.detach(0).ok();
+                return Err(e);
+            }
+        };
+        let result = tracee
+            .poke(entry, orig_insn)
+            .context("Failed to restore entry")
+            .and_then(|_| {
+                tracee
+                    .set_regs(&mut regs)
+                    .context("Failed to restore registers")
+            });
+
+        // A signal arrived while the process was stopped is delivered at entry
+        tracee.detach(signal)?;
+        result
+    }
+}
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+pub struct Tracee;
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+impl Tracee {
+    pub fn seize_exec(_pid: i32) -> Result<Self> {
+        bail!("Unsupported architecture")
+    }
+
+    pub fn park_at_entry(self) -> Result<Option<ParkedTracee>> {
+        Ok(None)
+    }
+}
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+pub struct ParkedTracee;
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+impl ParkedTracee {
+    pub fn resume(self) -> Result<()> {
+        Ok(())
+    }
+}
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    path::{Path, PathBuf},
+    sync::{mpsc, Arc},
+    thread,
+};
+
+use anyhow::{Context, Result};
+use indexmap::IndexSet;
+use parking_lot::Mutex;
+
+const WORKER_THREAD_NAME: &str = "upatch_process";
+
+/// Sending end of the worker queue, does nothing once the worker is dropped
+#[derive(Clone)]
+pub(super) struct NewProcessQueue(Arc<Mutex<Option<mpsc::Sender<PathBuf>>>>);
+
+impl NewProcessQueue {
+    pub fn push(&self, target_elf: &Path) {
+        if let Some(sender) = self.0.lock().as_ref() {
+            sender.send(target_elf.to_path_buf()).ok();
+        }
+    }
+}
+
+/// Patches new processes of queued targets in background.
+///
+/// Monitors only queue the target, thus they never wait for an activation.
+/// Targets queued while the worker is busy are merged, processes of each
+/// target are looked up when it is handled.
+pub(super) struct NewProcessWorker {
+    queue: NewProcessQueue,
+    worker_thread: Option<thread::JoinHandle<()>>,
+}
+
+impl NewProcessWorker {
+    pub fn new<F>(handler: F) -> Result<Self>
+    where
+        F: Fn(&Path) + Send + 'static,
+    {
+        let (sender, receiver) = mpsc::channel::<PathBuf>();
+        let worker_thread = thread::Builder::new()
+            .name(WORKER_THREAD_NAME.to_string())
+            .spawn(move || {
+                while let Ok(target_elf) = receiver.recv() {
+                    let mut target_elfs = IndexSet::new();
+                    target_elfs.insert(target_elf);
+                    target_elfs.extend(receiver.try_iter());
+
+                    for target_elf in target_elfs {
+                        handler(&target_elf);
+                    }
+                }
+            })
+            .with_context(|| format!("Failed to create thread '{}'", WORKER_THREAD_NAME))?;
+
+        Ok(Self {
+            queue: NewProcessQueue(Arc::new(Mutex::new(Some(sender)))),
+            worker_thread: Some(worker_thread),
+        })
+    }
+
+    pub fn queue(&self) -> NewProcessQueue {
+        self.queue.clone()
+    }
+}
+
+impl Drop for NewProcessWorker {
+    fn drop(&mut self) {
+        // Closing the channel stops the worker after queued targets are handled
+        self.queue.0.lock().take();
+        if let Some(thread) = self.worker_thread.take() {
+            thread.join().ok();
+        }
+    }
+}
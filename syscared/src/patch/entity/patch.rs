@@ -17,6 +17,8 @@ use std::ffi::OsStr;
 use syscare_abi::PatchInfo;
 use uuid::Uuid;
 
+use syscare_common::{concat_os, ffi::OsStrExt};
+
 use super::{KernelPatch, UserPatch};
 
 /// Patch definition
@@ -54,6 +56,22 @@ impl Patch {
             Patch::UserPatch(patch) => patch.info.as_ref(),
         }
     }
+
+    /// Patch could be named by its entity name, patch name or package name
+    pub fn is_named(&self, identifier: &str) -> bool {
+        let entity_name = self.name();
+        if identifier == entity_name {
+            return true;
+        }
+
+        let fields = entity_name.split('/').collect::<Vec<_>>();
+        let patch_name = concat_os!(fields[0], "/", fields[1]);
+        if identifier == patch_name {
+            return true;
+        }
+
+        identifier == self.pkg_name()
+    }
 }
 
 impl std::cmp::PartialEq for Patch {
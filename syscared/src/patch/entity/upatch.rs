@@ -14,11 +14,12 @@
 
 use std::{ffi::OsString, path::PathBuf, sync::Arc};
 
+use serde::{Deserialize, Serialize};
 use syscare_abi::{PatchInfo, PatchType};
 use uuid::Uuid;
 
 /// User patch function definition
-#[derive(Clone)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct UserPatchFunction {
     pub name: OsString,
     pub old_addr: u64,
@@ -14,7 +14,7 @@
 
 use std::{
     cmp::Ordering,
-    collections::HashMap,
+    collections::{HashMap, VecDeque},
     path::{Path, PathBuf},
     str::FromStr,
     sync::Arc,
@@ -27,14 +27,17 @@ use log::{debug, error, info, trace, warn};
 use uuid::Uuid;
 
 use syscare_abi::PatchStatus;
-use syscare_common::{concat_os, ffi::OsStrExt, fs, util::serde};
+use syscare_common::{fs, util::serde};
 
-use crate::patch::resolver::PatchResolver;
+use crate::patch::{
+    resolver::{PatchCache, PatchResolver},
+    snapshot::PatchSnapshot,
+};
 
 use super::{
-    driver::{PatchDriver, PatchOpFlag},
+    driver::{PatchDriver, PatchOpFlag, PendingActive},
     entity::Patch,
-    PATCH_INSTALL_DIR, PATCH_STATUS_FILE_NAME,
+    PATCH_CACHE_FILE_NAME, PATCH_INSTALL_DIR, PATCH_STATUS_FILE_NAME,
 };
 
 type Transition = (PatchStatus, PatchStatus);
@@ -71,8 +74,10 @@ pub struct PatchManager {
     driver: PatchDriver,
     patch_install_dir: PathBuf,
     patch_status_file: PathBuf,
+    patch_cache: PatchCache,
     patch_map: IndexMap<Uuid, Arc<Patch>>,
     status_map: IndexMap<Uuid, PatchStatus>,
+    patch_snapshot: Arc<PatchSnapshot>,
 }
 
 impl PatchManager {
@@ -80,17 +85,22 @@ impl PatchManager {
         let driver = PatchDriver::new()?;
         let patch_install_dir = patch_root.as_ref().join(PATCH_INSTALL_DIR);
         let patch_status_file = patch_root.as_ref().join(PATCH_STATUS_FILE_NAME);
-        let patch_map = Self::scan_patches(&patch_install_dir)?;
+        let mut patch_cache = PatchCache::load(patch_root.as_ref().join(PATCH_CACHE_FILE_NAME));
+        let patch_map = Self::scan_patches(&patch_install_dir, &mut patch_cache)?;
         let status_map = IndexMap::new();
+        let patch_snapshot = Arc::new(PatchSnapshot::new(driver.patched_processes()));
 
         let mut instance = Self {
             driver,
             patch_install_dir,
             patch_status_file,
+            patch_cache,
             patch_map,
             status_map,
+            patch_snapshot,
         };
         instance.restore_patch_status(PATCH_INIT_RESTORE_ACCEPTED_ONLY)?;
+        instance.reset_snapshot();
 
         Ok(instance)
     }
@@ -126,6 +136,10 @@ impl PatchManager {
         self.patch_map.values().cloned().collect()
     }
 
+    pub fn get_patch_snapshot(&self) -> Arc<PatchSnapshot> {
+        self.patch_snapshot.clone()
+    }
+
     pub fn get_patch_status(&mut self, patch: &Patch) -> Result<PatchStatus> {
         let mut status = self
             .status_map
@@ -217,6 +231,41 @@ impl PatchManager {
         self.do_status_transition(patch, PatchStatus::Accepted, flag)
     }
 
+    /// Replace an actived patch by another one, statuses of both are returned
+    pub fn replace_patch(
+        &mut self,
+        old: &Patch,
+        new: &Patch,
+        flag: PatchOpFlag,
+    ) -> Result<(PatchStatus, PatchStatus)> {
+        info!("Replace patch '{}' by '{}'", old, new);
+        if self.get_patch_status(old)? != PatchStatus::Actived {
+            bail!("Patch '{}' is not actived", old);
+        }
+
+        // Not-Applied -> Deactived
+        let new_status = self.get_patch_status(new)?;
+        if new_status > PatchStatus::Deactived {
+            bail!("Patch '{}' is already actived", new);
+        }
+        self.do_status_transition(new, PatchStatus::Deactived, flag)?;
+
+        // Actived -> Deactived, Deactived -> Actived
+        let result = self.driver.replace_patch(old, new, flag);
+        for patch in [old, new] {
+            let status = self.driver_patch_status(patch, flag)?;
+            self.set_patch_status(patch, status)?;
+        }
+        if let Err(e) = result {
+            if new_status == PatchStatus::NotApplied {
+                self.do_status_transition(new, PatchStatus::NotApplied, flag)?;
+            }
+            return Err(e);
+        }
+
+        Ok((self.get_patch_status(old)?, self.get_patch_status(new)?))
+    }
+
     pub fn save_patch_status(&mut self) -> Result<()> {
         info!("Saving all patch status...");
 
@@ -287,19 +336,14 @@ impl PatchManager {
             }
         });
 
-        for (patch, target_status) in restore_list {
-            debug!("Restore patch '{}' status to '{}'", patch, target_status);
-            if let Err(e) = self.do_status_transition(&patch, target_status, PatchOpFlag::Force) {
-                error!("{}", e);
-            }
-        }
+        self.restore_patches(restore_list);
         info!("All patch status were restored");
 
         Ok(())
     }
 
     pub fn rescan_patches(&mut self) -> Result<()> {
-        self.patch_map = Self::scan_patches(&self.patch_install_dir)?;
+        self.patch_map = Self::scan_patches(&self.patch_install_dir, &mut self.patch_cache)?;
 
         let status_keys = self.status_map.keys().cloned().collect::<Vec<_>>();
         for patch_uuid in status_keys {
@@ -308,6 +352,7 @@ impl PatchManager {
                 self.status_map.remove(&patch_uuid);
             }
         }
+        self.reset_snapshot();
 
         Ok(())
     }
@@ -355,15 +400,137 @@ impl PatchManager {
     }
 }
 
+/// Patches of one target must be operated in order
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+enum PatchTarget {
+    Kernel,
+    User(PathBuf),
+}
+
+impl PatchTarget {
+    fn of(patch: &Patch) -> Self {
+        match patch {
+            Patch::KernelPatch(_) => PatchTarget::Kernel,
+            Patch::UserPatch(patch) => PatchTarget::User(patch.target_elf.clone()),
+        }
+    }
+}
+
+/// Split patches into rounds, each round takes the next patch of every target
+pub(super) fn split_rounds<T>(patch_list: Vec<(Arc<Patch>, T)>) -> Vec<Vec<(Arc<Patch>, T)>> {
+    let mut target_map: IndexMap<PatchTarget, VecDeque<(Arc<Patch>, T)>> = IndexMap::new();
+    for (patch, value) in patch_list {
+        target_map
+            .entry(PatchTarget::of(&patch))
+            .or_default()
+            .push_back((patch, value));
+    }
+
+    let mut rounds = Vec::new();
+    loop {
+        let round = target_map
+            .values_mut()
+            .filter_map(VecDeque::pop_front)
+            .collect::<Vec<_>>();
+        if round.is_empty() {
+            break;
+        }
+        rounds.push(round);
+    }
+
+    rounds
+}
+
 impl PatchManager {
-    fn scan_patches<P: AsRef<Path>>(directory: P) -> Result<IndexMap<Uuid, Arc<Patch>>> {
+    /*
+     * Patches are restored in rounds, each round takes the next patch of every target.
+     * Activations of user patches in a round run concurrently, the others run in place,
+     * thus patches of one target keep their order, while different targets do not wait
+     * for each other's processes.
+     */
+    fn restore_patches(&mut self, restore_list: Vec<(Arc<Patch>, PatchStatus)>) {
+        for restore_round in self::split_rounds(restore_list) {
+            let mut pending_list = Vec::new();
+            for (patch, target_status) in restore_round {
+                debug!("Restore patch '{}' status to '{}'", patch, target_status);
+                match self.start_pending_active(&patch, target_status, PatchOpFlag::Force) {
+                    Ok(Some(pending)) => pending_list.push((patch, target_status, pending)),
+                    Ok(None) => {
+                        if let Err(e) =
+                            self.do_status_transition(&patch, target_status, PatchOpFlag::Force)
+                        {
+                            error!("{}", e);
+                        }
+                    }
+                    Err(e) => error!("{}", e),
+                }
+            }
+            for (patch, target_status, pending) in pending_list {
+                if let Err(e) = self.finish_pending_active(&patch, pending).and_then(|_| {
+                    self.do_status_transition(&patch, target_status, PatchOpFlag::Force)
+                }) {
+                    error!("{}", e);
+                }
+            }
+        }
+    }
+
+    /// Bring a user patch up to activation, then start activating it in background. </br>
+    /// Returns `None` if the patch should be operated in place.
+    pub(super) fn begin_transaction(&self) {
+        self.driver.begin_transaction()
+    }
+
+    pub(super) fn end_transaction(&self) {
+        self.driver.end_transaction()
+    }
+
+    pub(super) fn start_pending_active(
+        &mut self,
+        patch: &Patch,
+        status: PatchStatus,
+        flag: PatchOpFlag,
+    ) -> Result<Option<PendingActive>> {
+        if !matches!(patch, Patch::UserPatch(_))
+            || !matches!(status, PatchStatus::Actived | PatchStatus::Accepted)
+        {
+            return Ok(None);
+        }
+        if !matches!(
+            self.get_patch_status(patch)?,
+            PatchStatus::NotApplied | PatchStatus::Deactived
+        ) {
+            return Ok(None);
+        }
+
+        self.do_status_transition(patch, PatchStatus::Deactived, flag)?;
+        let pending = self.driver.start_active_patch(patch, flag)?;
+
+        Ok(Some(pending))
+    }
+
+    pub(super) fn finish_pending_active(
+        &mut self,
+        patch: &Patch,
+        pending: PendingActive,
+    ) -> Result<()> {
+        self.driver.finish_active_patch(patch, pending)?;
+        self.set_patch_status(patch, PatchStatus::Actived)
+    }
+}
+
+impl PatchManager {
+    fn scan_patches<P: AsRef<Path>>(
+        directory: P,
+        patch_cache: &mut PatchCache,
+    ) -> Result<IndexMap<Uuid, Arc<Patch>>> {
         const TRAVERSE_OPTION: fs::TraverseOptions = fs::TraverseOptions { recursive: false };
 
         let mut patch_map = IndexMap::new();
 
         info!("Scanning patches from {}...", directory.as_ref().display());
         for patch_root in fs::list_dirs(directory, TRAVERSE_OPTION)? {
-            let resolve_result = PatchResolver::resolve_patch(&patch_root)
+            let resolve_result = PatchResolver::resolve_patch(&patch_root, patch_cache)
                 .with_context(|| format!("Failed to resolve patch from {}", patch_root.display()));
             match resolve_result {
                 Ok(patches) => {
@@ -379,6 +546,10 @@ impl PatchManager {
         patch_map.sort_by(|_, lhs, _, rhs| lhs.cmp(rhs));
         info!("Found {} patch(es)", patch_map.len());
 
+        if let Err(e) = patch_cache.save() {
+            warn!("{:?}", e);
+        }
+
         Ok(patch_map)
     }
 
@@ -393,25 +564,7 @@ impl PatchManager {
         let match_result = self
             .patch_map
             .values()
-            .filter(|patch| {
-                let entity_name = patch.name();
-                if identifier == entity_name {
-                    return true;
-                }
-
-                let fields = entity_name.split('/').collect::<Vec<_>>();
-                let patch_name = concat_os!(fields[0], "/", fields[1]);
-                if identifier == patch_name {
-                    return true;
-                }
-
-                let pkg_name = patch.pkg_name();
-                if identifier == pkg_name {
-                    return true;
-                }
-
-                false
-            })
+            .filter(|patch| patch.is_named(identifier))
             .cloned()
             .collect::<Vec<_>>();
 
@@ -435,9 +588,21 @@ impl PatchManager {
                 status_map.insert(*patch.uuid(), value);
             }
         }
+        if let Some(patch) = self.patch_map.get(patch.uuid()) {
+            self.patch_snapshot.update(patch, value);
+        }
 
         Ok(())
     }
+
+    fn reset_snapshot(&mut self) {
+        let mut patch_list = Vec::with_capacity(self.patch_map.len());
+        for patch in self.get_patch_list() {
+            let status = self.get_patch_status(&patch).unwrap_or_default();
+            patch_list.push((patch, status));
+        }
+        self.patch_snapshot.reset(patch_list);
+    }
 }
 
 impl PatchManager {
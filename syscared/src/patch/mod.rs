@@ -17,8 +17,10 @@ pub mod entity;
 pub mod manager;
 pub mod monitor;
 pub mod resolver;
+pub mod snapshot;
 pub mod transaction;
 
+const PATCH_CACHE_FILE_NAME: &str = "patch_cache";
 const PATCH_INFO_FILE_NAME: &str = "patch_info";
 const PATCH_INSTALL_DIR: &str = "patches";
 const PATCH_STATUS_FILE_NAME: &str = "patch_status";
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    collections::{HashMap, HashSet},
+    os::unix::fs::MetadataExt,
+    path::{Path, PathBuf},
+};
+
+use ::serde::{Deserialize, Serialize};
+use anyhow::{Context, Result};
+use log::{debug, warn};
+
+use syscare_abi::PatchInfo;
+use syscare_common::{fs, util::serde};
+
+use crate::patch::entity::{KernelPatchFunction, UserPatchFunction};
+
+const PATCH_CACHE_MAGIC: &str = "SYSCARE_PATCH_CACHE_V1";
+
+/// Metadata resolved from a patch file
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub enum PatchMetadata {
+    PatchInfo(PatchInfo),
+    UserPatch(Vec<UserPatchFunction>),
+    KernelPatch(Vec<KernelPatchFunction>),
+}
+
+#[derive(Debug, PartialEq, Eq, Clone, Copy, Serialize, Deserialize)]
+struct FileStamp {
+    size: u64,
+    mtime: i64,
+    mtime_nsec: i64,
+}
+
+impl FileStamp {
+    fn of(file: &Path) -> Result<Self> {
+        let metadata = fs::metadata(file)?;
+        Ok(Self {
+            size: metadata.size(),
+            mtime: metadata.mtime(),
+            mtime_nsec: metadata.mtime_nsec(),
+        })
+    }
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+struct CacheEntry {
+    stamp: FileStamp,
+    metadata: PatchMetadata,
+}
+
+/// On-disk cache of resolved patch metadata, keyed by file path, size and mtime.
+///
+/// Only files that are new or changed since the last scan are parsed again,
+/// entries of files not seen by a scan are dropped when the cache is saved.
+pub struct PatchCache {
+    cache_file: PathBuf,
+    entries: HashMap<PathBuf, CacheEntry>,
+    visited: HashSet<PathBuf>,
+    modified: bool,
+}
+
+impl PatchCache {
+    pub fn load<P: AsRef<Path>>(cache_file: P) -> Self {
+        let cache_file = cache_file.as_ref().to_path_buf();
+        let entries = match serde::deserialize_with_magic(&cache_file, PATCH_CACHE_MAGIC) {
+            Ok(entries) => entries,
+            Err(e) => {
+                if cache_file.exists() {
+                    warn!("Failed to read patch cache, {}", e);
+                }
+                HashMap::new()
+            }
+        };
+
+        Self {
+            cache_file,
+            entries,
+            visited: HashSet::new(),
+            modified: false,
+        }
+    }
+
+    /// Returns cached metadata of the file, or resolves & caches it if the file was changed
+    pub fn resolve<F>(&mut self, file: &Path, resolve_fn: F) -> Result<PatchMetadata>
+    where
+        F: FnOnce(&Path) -> Result<PatchMetadata>,
+    {
+        let stamp = FileStamp::of(file)?;
+        self.visited.insert(file.to_path_buf());
+
+        if let Some(entry) = self.entries.get(file) {
+            if entry.stamp == stamp {
+                return Ok(entry.metadata.clone());
+            }
+        }
+
+        debug!("Resolving {}...", file.display());
+        let metadata = resolve_fn(file)?;
+        self.entries.insert(
+            file.to_path_buf(),
+            CacheEntry {
+                stamp,
+                metadata: metadata.clone(),
+            },
+        );
+        self.modified = true;
+
+        Ok(metadata)
+    }
+
+    /// Drop entries not visited since last save, then write the cache if it was changed
+    pub fn save(&mut self) -> Result<()> {
+        let visited = std::mem::take(&mut self.visited);
+        let num_entries = self.entries.len();
+
+        self.entries.retain(|file, _| visited.contains(file));
+        if !self.modified && (self.entries.len() == num_entries) {
+            return Ok(());
+        }
+
+        debug!("Writing patch cache file");
+        serde::serialize_with_magic(&self.entries, &self.cache_file, PATCH_CACHE_MAGIC)
+            .context("Failed to write patch cache file")?;
+        self.modified = false;
+
+        Ok(())
+    }
+}
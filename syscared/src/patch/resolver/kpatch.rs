@@ -18,7 +18,7 @@ use std::{
     sync::Arc,
 };
 
-use anyhow::{anyhow, Context, Result};
+use anyhow::{anyhow, bail, Context, Result};
 use object::{NativeFile, Object, ObjectSection};
 
 use syscare_abi::{PatchEntity, PatchInfo, PatchType};
@@ -28,7 +28,7 @@ use syscare_common::{
     fs,
 };
 
-use super::PatchResolverImpl;
+use super::{PatchCache, PatchMetadata, PatchResolverImpl};
 use crate::patch::entity::{KernelPatch, KernelPatchFunction, Patch};
 
 const KPATCH_SUFFIX: &str = ".ko";
@@ -109,9 +109,8 @@ pub struct KpatchResolverImpl;
 
 impl KpatchResolverImpl {
     #[inline]
-    fn resolve_patch_file(patch: &mut KernelPatch) -> Result<()> {
-        let patch_file =
-            fs::MappedFile::open(&patch.patch_file).context("Failed to map patch file")?;
+    fn resolve_patch_file(patch_file: &Path) -> Result<Vec<KernelPatchFunction>> {
+        let patch_file = fs::MappedFile::open(patch_file).context("Failed to map patch file")?;
         let patch_elf = NativeFile::parse(patch_file.as_bytes()).context("Invalid patch format")?;
 
         // Read sections
@@ -129,7 +128,7 @@ impl KpatchResolverImpl {
             .with_context(|| format!("Failed to read section '{}'", KPATCH_FUNCS_SECTION))?;
 
         // Resolve patch functions
-        let patch_functions = &mut patch.functions;
+        let mut patch_functions = Vec::new();
         let kpatch_function_slice = object::slice_from_bytes::<KpatchFunction>(
             function_data,
             function_data.len() / KPATCH_FUNCTION_SIZE,
@@ -181,7 +180,7 @@ impl KpatchResolverImpl {
             object_function.object = object_string;
         }
 
-        Ok(())
+        Ok(patch_functions)
     }
 }
 
@@ -191,6 +190,7 @@ impl PatchResolverImpl for KpatchResolverImpl {
         patch_root: &Path,
         patch_info: Arc<PatchInfo>,
         patch_entity: &PatchEntity,
+        patch_cache: &mut PatchCache,
     ) -> Result<Patch> {
         let module_name = patch_entity.patch_name.replace(['-', '.'], "_");
         let patch_file = patch_root.join(concat_os!(&patch_entity.patch_name, KPATCH_SUFFIX));
@@ -216,7 +216,15 @@ impl PatchResolverImpl for KpatchResolverImpl {
             functions: Vec::new(),
             checksum: patch_entity.checksum.clone(),
         };
-        Self::resolve_patch_file(&mut patch).context("Failed to resolve patch")?;
+        let metadata = patch_cache
+            .resolve(&patch.patch_file, |file| {
+                Ok(PatchMetadata::KernelPatch(Self::resolve_patch_file(file)?))
+            })
+            .context("Failed to resolve patch")?;
+        patch.functions = match metadata {
+            PatchMetadata::KernelPatch(functions) => functions,
+            _ => bail!("Invalid patch metadata"),
+        };
 
         Ok(Patch::KernelPatch(patch))
     }
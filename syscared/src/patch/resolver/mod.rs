@@ -16,13 +16,16 @@ use std::{path::Path, sync::Arc};
 
 use super::{entity::Patch, PATCH_INFO_FILE_NAME};
 
-use anyhow::{Context, Result};
+use anyhow::{bail, Context, Result};
 use syscare_abi::{PatchEntity, PatchInfo, PatchType, PATCH_INFO_MAGIC};
 use syscare_common::util::serde;
 
+mod cache;
 mod kpatch;
 mod upatch;
 
+pub use cache::*;
+
 use kpatch::KpatchResolverImpl;
 use upatch::UpatchResolverImpl;
 
@@ -32,21 +35,28 @@ pub trait PatchResolverImpl {
         patch_root: &Path,
         patch_info: Arc<PatchInfo>,
         patch_entity: &PatchEntity,
+        patch_cache: &mut PatchCache,
     ) -> Result<Patch>;
 }
 
 pub struct PatchResolver;
 
 impl PatchResolver {
-    pub fn resolve_patch<P: AsRef<Path>>(patch_root: P) -> Result<Vec<Patch>> {
+    pub fn resolve_patch<P: AsRef<Path>>(
+        patch_root: P,
+        patch_cache: &mut PatchCache,
+    ) -> Result<Vec<Patch>> {
         let patch_root = patch_root.as_ref();
-        let patch_info = Arc::new(
-            serde::deserialize_with_magic::<PatchInfo, _, _>(
-                patch_root.join(PATCH_INFO_FILE_NAME),
-                PATCH_INFO_MAGIC,
-            )
-            .context("Failed to resolve patch metadata")?,
-        );
+        let metadata = patch_cache
+            .resolve(&patch_root.join(PATCH_INFO_FILE_NAME), |file| {
+                let patch_info = serde::deserialize_with_magic(file, PATCH_INFO_MAGIC)?;
+                Ok(PatchMetadata::PatchInfo(patch_info))
+            })
+            .context("Failed to resolve patch metadata")?;
+        let patch_info = match metadata {
+            PatchMetadata::PatchInfo(patch_info) => Arc::new(patch_info),
+            _ => bail!("Invalid patch metadata"),
+        };
         let resolver = match patch_info.kind {
             PatchType::UserPatch => &UpatchResolverImpl as &dyn PatchResolverImpl,
             PatchType::KernelPatch => &KpatchResolverImpl as &dyn PatchResolverImpl,
@@ -54,7 +64,12 @@ impl PatchResolver {
 
         let mut patch_list = Vec::with_capacity(patch_info.entities.len());
         for patch_entity in &patch_info.entities {
-            let patch = resolver.resolve_patch(patch_root, patch_info.clone(), patch_entity)?;
+            let patch = resolver.resolve_patch(
+                patch_root,
+                patch_info.clone(),
+                patch_entity,
+                patch_cache,
+            )?;
             patch_list.push(patch);
         }
 
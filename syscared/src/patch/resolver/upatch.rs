@@ -18,13 +18,13 @@ use std::{
     sync::Arc,
 };
 
-use anyhow::{anyhow, Context, Result};
+use anyhow::{anyhow, bail, Context, Result};
 use object::{NativeFile, Object, ObjectSection};
 
 use syscare_abi::{PatchEntity, PatchInfo, PatchType};
 use syscare_common::{concat_os, ffi::CStrExt, fs};
 
-use super::PatchResolverImpl;
+use super::{PatchCache, PatchMetadata, PatchResolverImpl};
 use crate::patch::entity::{Patch, UserPatch, UserPatchFunction};
 
 mod ffi {
@@ -93,10 +93,14 @@ const UPATCH_STRINGS_SECTION: &str = ".upatch.strings";
 pub struct UpatchResolverImpl;
 
 impl UpatchResolverImpl {
+    /*
+     * Functions are kept by the patch cache, the elf is walked again only once the
+     * patch file changes. Upatch-manage takes function addresses from the relocated
+     * patch image, which cannot be derived ahead, thus the table is not shared with it.
+     */
     #[inline]
-    fn resolve_patch_elf(patch: &mut UserPatch) -> Result<()> {
-        let patch_file =
-            fs::MappedFile::open(&patch.patch_file).context("Failed to map patch file")?;
+    fn resolve_patch_elf(patch_file: &Path) -> Result<Vec<UserPatchFunction>> {
+        let patch_file = fs::MappedFile::open(patch_file).context("Failed to map patch file")?;
         let patch_elf = NativeFile::parse(patch_file.as_bytes()).context("Invalid patch format")?;
 
         // Read sections
@@ -114,7 +118,7 @@ impl UpatchResolverImpl {
             .with_context(|| format!("Failed to read section '{}'", UPATCH_FUNCS_SECTION))?;
 
         // Resolve patch functions
-        let patch_functions = &mut patch.functions;
+        let mut patch_functions = Vec::new();
         let upatch_function_slice = object::slice_from_bytes::<UpatchFunction>(
             function_data,
             function_data.len() / UPATCH_FUNCTION_SIZE,
@@ -150,7 +154,7 @@ impl UpatchResolverImpl {
             name_function.name = name_string;
         }
 
-        Ok(())
+        Ok(patch_functions)
     }
 }
 
@@ -160,6 +164,7 @@ impl PatchResolverImpl for UpatchResolverImpl {
         patch_root: &Path,
         patch_info: Arc<PatchInfo>,
         patch_entity: &PatchEntity,
+        patch_cache: &mut PatchCache,
     ) -> Result<Patch> {
         let mut patch = UserPatch {
             uuid: patch_entity.uuid,
@@ -178,7 +183,15 @@ impl PatchResolverImpl for UpatchResolverImpl {
             functions: Vec::new(),
             checksum: patch_entity.checksum.clone(),
         };
-        Self::resolve_patch_elf(&mut patch).context("Failed to resolve patch")?;
+        let metadata = patch_cache
+            .resolve(&patch.patch_file, |file| {
+                Ok(PatchMetadata::UserPatch(Self::resolve_patch_elf(file)?))
+            })
+            .context("Failed to resolve patch")?;
+        patch.functions = match metadata {
+            PatchMetadata::UserPatch(functions) => functions,
+            _ => bail!("Invalid patch metadata"),
+        };
 
         Ok(Patch::UserPatch(patch))
     }
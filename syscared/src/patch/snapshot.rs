@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * syscared is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{str::FromStr, sync::Arc};
+
+use anyhow::{bail, Result};
+use indexmap::IndexMap;
+use parking_lot::RwLock;
+use uuid::Uuid;
+
+use syscare_abi::{PatchSnapshotRecord, PatchStatus};
+
+use super::{driver::PatchedProcesses, entity::Patch};
+
+#[derive(Clone)]
+struct SnapshotRecord {
+    patch: Arc<Patch>,
+    status: PatchStatus,
+}
+
+type RecordMap = IndexMap<Uuid, SnapshotRecord>;
+
+/// State of all patches, updated by the patch manager on every status change.
+///
+/// Records are immutable, every change swaps in a new map, thus readers take neither
+/// the patch manager lock nor any per-process work, and never wait for an operation.
+/// Patched processes are counted from the user patch driver on each read.
+pub struct PatchSnapshot {
+    record_map: RwLock<Arc<RecordMap>>,
+    processes: PatchedProcesses,
+}
+
+impl PatchSnapshot {
+    pub fn new(processes: PatchedProcesses) -> Self {
+        Self {
+            record_map: RwLock::new(Arc::new(IndexMap::new())),
+            processes,
+        }
+    }
+
+    fn load(&self) -> Arc<RecordMap> {
+        self.record_map.read().clone()
+    }
+
+    /// Replace all records, keeping the order of the patches
+    pub fn reset<I>(&self, patches: I)
+    where
+        I: IntoIterator<Item = (Arc<Patch>, PatchStatus)>,
+    {
+        let record_map = patches
+            .into_iter()
+            .map(|(patch, status)| (*patch.uuid(), SnapshotRecord { patch, status }))
+            .collect();
+
+        *self.record_map.write() = Arc::new(record_map);
+    }
+
+    /// Records shared with readers are copied, the others are changed in place
+    pub fn update(&self, patch: &Arc<Patch>, status: PatchStatus) {
+        let mut record_map = self.record_map.write();
+        let records = Arc::make_mut(&mut record_map);
+        match records.get_mut(patch.uuid()) {
+            Some(record) => record.status = status,
+            None => {
+                records.insert(
+                    *patch.uuid(),
+                    SnapshotRecord {
+                        patch: patch.clone(),
+                        status,
+                    },
+                );
+            }
+        }
+    }
+
+    pub fn patch_list(&self) -> Vec<(Arc<Patch>, PatchStatus)> {
+        self.load()
+            .values()
+            .map(|record| (record.patch.clone(), record.status))
+            .collect()
+    }
+
+    /// Same as `PatchManager::match_patch()`, statuses are taken along with the patches
+    pub fn match_patch(&self, identifier: &str) -> Result<Vec<(Arc<Patch>, PatchStatus)>> {
+        let record_map = self.load();
+        if let Ok(uuid) = Uuid::from_str(identifier) {
+            if let Some(record) = record_map.get(&uuid) {
+                return Ok(vec![(record.patch.clone(), record.status)]);
+            }
+        }
+
+        let patch_list = record_map
+            .values()
+            .filter(|record| record.patch.is_named(identifier))
+            .map(|record| (record.patch.clone(), record.status))
+            .collect::<Vec<_>>();
+        if patch_list.is_empty() {
+            bail!("Cannot match any patch named '{}'", identifier);
+        }
+
+        Ok(patch_list)
+    }
+
+    pub fn records(&self) -> Vec<PatchSnapshotRecord> {
+        self.load()
+            .iter()
+            .map(|(uuid, record)| PatchSnapshotRecord {
+                uuid: uuid.to_string(),
+                name: record.patch.to_string(),
+                status: record.status,
+                process_num: match record.patch.as_ref() {
+                    Patch::KernelPatch(_) => 0,
+                    Patch::UserPatch(patch) => self.processes.process_num(&patch.target_elf, uuid),
+                },
+            })
+            .collect()
+    }
+}
@@ -20,7 +20,11 @@ use log::{debug, warn};
 use parking_lot::RwLock;
 use syscare_abi::{PatchStateRecord, PatchStatus};
 
-use super::{driver::PatchOpFlag, entity::Patch, manager::PatchManager};
+use super::{
+    driver::PatchOpFlag,
+    entity::Patch,
+    manager::{self, PatchManager},
+};
 
 type TransationRecord = (Arc<Patch>, PatchStatus);
 
@@ -30,6 +34,7 @@ pub struct PatchTransaction<F> {
     action: F,
     identifier: String,
     flag: PatchOpFlag,
+    background_status: &'static [PatchStatus],
     finish_list: Vec<TransationRecord>,
 }
 
@@ -50,31 +55,94 @@ where
             action,
             identifier,
             flag,
+            background_status: &[],
             finish_list: Vec::new(),
         }
     }
+
+    /// User patches in these statuses are actived in background by the action,
+    /// thus patches of different targets and kernel patches are operated concurrently.
+    pub fn active_in_background(mut self, status_list: &'static [PatchStatus]) -> Self {
+        self.background_status = status_list;
+        self
+    }
 }
 
 impl<F> PatchTransaction<F>
 where
     F: Fn(&mut PatchManager, &Patch, PatchOpFlag) -> Result<PatchStatus>,
 {
+    /*
+     * Patches are operated in rounds, each round takes the next patch of every target.
+     * Background activations of a round are started first, then the other patches are
+     * operated in place meanwhile, thus patches of one target keep their order.
+     */
     fn start(&mut self) -> Result<Vec<PatchStateRecord>> {
-        let mut patch_manager = self.patch_manager.write();
+        let patch_manager = self.patch_manager.clone();
+        let mut patch_manager = patch_manager.write();
 
-        let mut patch_list = patch_manager.match_patch(&self.identifier)?;
+        let match_list = patch_manager.match_patch(&self.identifier)?;
+        let mut patch_list = Vec::with_capacity(match_list.len());
+        for patch in match_list.into_iter().rev() {
+            let status = patch_manager.get_patch_status(&patch)?;
+            patch_list.push((patch, status));
+        }
         let mut records = Vec::with_capacity(patch_list.len());
 
-        while let Some(patch) = patch_list.pop() {
-            let old_status = patch_manager.get_patch_status(&patch)?;
-            let new_status = (self.action)(&mut patch_manager, &patch, self.flag)?;
+        for round in manager::split_rounds(patch_list) {
+            let mut result = Ok(());
+            let mut pending_list = Vec::new();
+            let mut inplace_list = Vec::new();
+
+            for (patch, old_status) in round {
+                if !self.background_status.contains(&old_status) {
+                    inplace_list.push((patch, old_status));
+                    continue;
+                }
+                match patch_manager.start_pending_active(&patch, PatchStatus::Actived, self.flag) {
+                    Ok(Some(pending)) => pending_list.push((patch, old_status, pending)),
+                    Ok(None) => inplace_list.push((patch, old_status)),
+                    Err(e) => {
+                        result = Err(e);
+                        break;
+                    }
+                }
+            }
+            if result.is_ok() {
+                for (patch, old_status) in inplace_list {
+                    match (self.action)(&mut patch_manager, &patch, self.flag) {
+                        Ok(new_status) => {
+                            records.push(PatchStateRecord {
+                                name: patch.to_string(),
+                                status: new_status,
+                            });
+                            self.finish_list.push((patch, old_status));
+                        }
+                        Err(e) => {
+                            result = Err(e);
+                            break;
+                        }
+                    }
+                }
+            }
 
-            records.push(PatchStateRecord {
-                name: patch.to_string(),
-                status: new_status,
-            });
-            self.finish_list.push((patch, old_status));
+            // Started activations are always waited, they are rolled back on failure
+            for (patch, old_status, pending) in pending_list {
+                let finish_result = patch_manager
+                    .finish_pending_active(&patch, pending)
+                    .and_then(|_| (self.action)(&mut patch_manager, &patch, self.flag));
+                match finish_result {
+                    Ok(new_status) => records.push(PatchStateRecord {
+                        name: patch.to_string(),
+                        status: new_status,
+                    }),
+                    Err(e) => result = result.and(Err(e)),
+                }
+                self.finish_list.push((patch, old_status));
+            }
+            result?;
         }
+
         Ok(records)
     }
 
@@ -86,7 +154,16 @@ where
         Ok(())
     }
 
-    pub fn invoke(mut self) -> Result<Vec<PatchStateRecord>> {
+    pub fn invoke(self) -> Result<Vec<PatchStateRecord>> {
+        self.patch_manager.read().begin_transaction();
+        let patch_manager = self.patch_manager.clone();
+        let result = self.run();
+        patch_manager.read().end_transaction();
+
+        result
+    }
+
+    fn run(mut self) -> Result<Vec<PatchStateRecord>> {
         debug!("{} started...", self);
         match self.start() {
             Ok(result) => {
@@ -12,7 +12,10 @@
  * See the Mulan PSL v2 for more details.
  */
 
-use syscare_abi::{PackageInfo, PatchInfo, PatchListRecord, PatchStateRecord};
+use syscare_abi::{
+    PackageInfo, PatchInfo, PatchListRecord, PatchSnapshotRecord, PatchStateRecord,
+    PatchTelemetryRecord,
+};
 
 use super::function::{rpc, RpcResult};
 
@@ -36,12 +39,26 @@ pub trait PatchSkeleton {
     #[rpc(name = "accept_patch")]
     fn accept_patch(&self, identifier: String) -> RpcResult<Vec<PatchStateRecord>>;
 
+    #[rpc(name = "replace_patch")]
+    fn replace_patch(
+        &self,
+        old_identifier: String,
+        new_identifier: String,
+        force: bool,
+    ) -> RpcResult<Vec<PatchStateRecord>>;
+
     #[rpc(name = "get_patch_list")]
     fn get_patch_list(&self) -> RpcResult<Vec<PatchListRecord>>;
 
     #[rpc(name = "get_patch_status")]
     fn get_patch_status(&self, identifier: String) -> RpcResult<Vec<PatchStateRecord>>;
 
+    #[rpc(name = "get_all_patch_state")]
+    fn get_all_patch_state(&self) -> RpcResult<Vec<PatchSnapshotRecord>>;
+
+    #[rpc(name = "get_patch_telemetry")]
+    fn get_patch_telemetry(&self, since: u64) -> RpcResult<Vec<PatchTelemetryRecord>>;
+
     #[rpc(name = "get_patch_info")]
     fn get_patch_info(&self, identifier: String) -> RpcResult<PatchInfo>;
 
@@ -14,13 +14,20 @@
 
 use std::sync::Arc;
 
-use anyhow::{Context, Result};
+use anyhow::{bail, Context, Result};
 
 use parking_lot::RwLock;
-use syscare_abi::{PackageInfo, PatchInfo, PatchListRecord, PatchStateRecord};
+use syscare_abi::{
+    PackageInfo, PatchInfo, PatchListRecord, PatchSnapshotRecord, PatchStateRecord, PatchStatus,
+    PatchTelemetryRecord,
+};
 
 use crate::patch::{
-    driver::PatchOpFlag, entity::Patch, manager::PatchManager, transaction::PatchTransaction,
+    driver::{PatchOpFlag, UserPatchDriver},
+    entity::Patch,
+    manager::PatchManager,
+    snapshot::PatchSnapshot,
+    transaction::PatchTransaction,
 };
 
 use super::{
@@ -30,11 +37,16 @@ use super::{
 
 pub struct PatchSkeletonImpl {
     patch_manager: Arc<RwLock<PatchManager>>,
+    patch_snapshot: Arc<PatchSnapshot>,
 }
 
 impl PatchSkeletonImpl {
     pub fn new(patch_manager: Arc<RwLock<PatchManager>>) -> Self {
-        Self { patch_manager }
+        let patch_snapshot = patch_manager.read().get_patch_snapshot();
+        Self {
+            patch_manager,
+            patch_snapshot,
+        }
     }
 }
 
@@ -45,34 +57,19 @@ impl PatchSkeletonImpl {
         }
     }
 
-    fn parse_state_record(&self, patch: Arc<Patch>) -> Result<PatchStateRecord> {
-        let patch_name = patch.to_string();
-        let patch_status = self
-            .patch_manager
-            .write()
-            .get_patch_status(&patch)
-            .unwrap_or_default();
-
-        Ok(PatchStateRecord {
-            name: patch_name,
-            status: patch_status,
-        })
+    fn parse_state_record(patch: &Patch, status: PatchStatus) -> PatchStateRecord {
+        PatchStateRecord {
+            name: patch.to_string(),
+            status,
+        }
     }
 
-    fn parse_list_record(&self, patch: Arc<Patch>) -> Result<PatchListRecord> {
-        let patch_uuid = patch.uuid().to_string();
-        let patch_name = patch.to_string();
-        let patch_status = self
-            .patch_manager
-            .write()
-            .get_patch_status(&patch)
-            .unwrap_or_default();
-
-        Ok(PatchListRecord {
-            uuid: patch_uuid,
-            name: patch_name,
-            status: patch_status,
-        })
+    fn parse_list_record(patch: &Patch, status: PatchStatus) -> PatchListRecord {
+        PatchListRecord {
+            uuid: patch.uuid().to_string(),
+            name: patch.to_string(),
+            status,
+        }
     }
 }
 
@@ -102,6 +99,7 @@ impl PatchSkeleton for PatchSkeletonImpl {
                 },
                 identifier,
             )
+            .active_in_background(&[PatchStatus::NotApplied, PatchStatus::Deactived])
             .invoke()
         })
     }
@@ -137,6 +135,7 @@ impl PatchSkeleton for PatchSkeletonImpl {
                 },
                 identifier,
             )
+            .active_in_background(&[PatchStatus::Deactived])
             .invoke()
         })
     }
@@ -169,37 +168,87 @@ impl PatchSkeleton for PatchSkeletonImpl {
         })
     }
 
+    fn replace_patch(
+        &self,
+        mut old_identifier: String,
+        mut new_identifier: String,
+        force: bool,
+    ) -> RpcResult<Vec<PatchStateRecord>> {
+        Self::normalize_identifier(&mut old_identifier);
+        Self::normalize_identifier(&mut new_identifier);
+        RpcFunction::call(move || -> Result<Vec<PatchStateRecord>> {
+            let mut patch_manager = self.patch_manager.write();
+            let mut patch_list = Vec::with_capacity(2);
+            for identifier in [&old_identifier, &new_identifier] {
+                let match_list = patch_manager.match_patch(identifier)?;
+                if match_list.len() != 1 {
+                    bail!("Patch '{}' should match exactly one patch", identifier);
+                }
+                patch_list.extend(match_list);
+            }
+
+            let (old_status, new_status) = patch_manager.replace_patch(
+                &patch_list[0],
+                &patch_list[1],
+                match force {
+                    false => PatchOpFlag::Normal,
+                    true => PatchOpFlag::Force,
+                },
+            )?;
+
+            Ok(vec![
+                PatchStateRecord {
+                    name: patch_list[0].to_string(),
+                    status: old_status,
+                },
+                PatchStateRecord {
+                    name: patch_list[1].to_string(),
+                    status: new_status,
+                },
+            ])
+        })
+    }
+
     fn get_patch_list(&self) -> RpcResult<Vec<PatchListRecord>> {
         RpcFunction::call(move || -> Result<Vec<PatchListRecord>> {
-            let patch_list: Vec<Arc<Patch>> = self.patch_manager.read().get_patch_list();
+            let patch_list = self.patch_snapshot.patch_list();
 
-            let mut result = Vec::new();
-            for patch in patch_list {
-                result.push(self.parse_list_record(patch)?);
-            }
-
-            Ok(result)
+            Ok(patch_list
+                .iter()
+                .map(|(patch, status)| Self::parse_list_record(patch, *status))
+                .collect())
         })
     }
 
     fn get_patch_status(&self, mut identifier: String) -> RpcResult<Vec<PatchStateRecord>> {
         Self::normalize_identifier(&mut identifier);
         RpcFunction::call(move || -> Result<Vec<PatchStateRecord>> {
-            let patch_list = self.patch_manager.read().match_patch(&identifier)?;
+            let patch_list = self.patch_snapshot.match_patch(&identifier)?;
 
-            let mut result = Vec::new();
-            for patch in patch_list {
-                result.push(self.parse_state_record(patch)?);
-            }
-            Ok(result)
+            Ok(patch_list
+                .iter()
+                .map(|(patch, status)| Self::parse_state_record(patch, *status))
+                .collect())
+        })
+    }
+
+    fn get_all_patch_state(&self) -> RpcResult<Vec<PatchSnapshotRecord>> {
+        RpcFunction::call(move || -> Result<Vec<PatchSnapshotRecord>> {
+            Ok(self.patch_snapshot.records())
+        })
+    }
+
+    fn get_patch_telemetry(&self, since: u64) -> RpcResult<Vec<PatchTelemetryRecord>> {
+        RpcFunction::call(move || -> Result<Vec<PatchTelemetryRecord>> {
+            Ok(UserPatchDriver::telemetry(since))
         })
     }
 
     fn get_patch_info(&self, mut identifier: String) -> RpcResult<PatchInfo> {
         Self::normalize_identifier(&mut identifier);
         RpcFunction::call(move || -> Result<PatchInfo> {
-            let patch_list = self.patch_manager.read().match_patch(&identifier)?;
-            let patch = patch_list.first().context("No patch matched")?;
+            let patch_list = self.patch_snapshot.match_patch(&identifier)?;
+            let (patch, _) = patch_list.first().context("No patch matched")?;
 
             Ok(patch.info().clone())
         })
@@ -208,8 +257,8 @@ impl PatchSkeleton for PatchSkeletonImpl {
     fn get_patch_target(&self, mut identifier: String) -> RpcResult<PackageInfo> {
         Self::normalize_identifier(&mut identifier);
         RpcFunction::call(move || -> Result<PackageInfo> {
-            let patch_list = self.patch_manager.read().match_patch(&identifier)?;
-            let patch = patch_list.first().context("No patch matched")?;
+            let patch_list = self.patch_snapshot.match_patch(&identifier)?;
+            let (patch, _) = patch_list.first().context("No patch matched")?;
 
             Ok(patch.info().target.clone())
         })
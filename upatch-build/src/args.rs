@@ -86,6 +86,22 @@ pub struct Arguments {
     #[clap(short, long, default_value = DEFAULT_OUTPUT_DIR, hide_default_value = true)]
     pub output_dir: PathBuf,
 
+    /// Specify original build cache directory
+    #[clap(long)]
+    pub cache_dir: Option<PathBuf>,
+
+    /// Specify original build cache identity, eg. package nevra
+    #[clap(long, default_value = "", hide_default_value = true)]
+    pub cache_key: String,
+
+    /// Specify the number of parallel diff jobs [default: <CPU_NUM>]
+    #[clap(short, long, default_value = "0", hide_default_value = true)]
+    pub jobs: usize,
+
+    /// Record objects into an index file instead of linking each of them
+    #[clap(long)]
+    pub capture_objects: bool,
+
     /// Skip compiler version check (not recommended)
     #[clap(long)]
     pub skip_compiler_check: bool,
@@ -116,6 +132,12 @@ impl Arguments {
             *elf_path = args.elf_dir.join(&elf_path);
         }
 
+        if args.jobs == 0 {
+            args.jobs = std::thread::available_parallelism()
+                .map(|n| n.get())
+                .unwrap_or(1);
+        }
+
         Ok(args)
     }
 
@@ -125,6 +147,9 @@ impl Arguments {
         self.source_dir = fs::normalize(&self.source_dir)?;
         self.elf_dir = fs::normalize(&self.elf_dir)?;
         self.output_dir = fs::normalize(&self.output_dir)?;
+        if let Some(cache_dir) = &mut self.cache_dir {
+            *cache_dir = fs::normalize(&cache_dir)?;
+        }
 
         for debuginfo in &mut self.debuginfo {
             *debuginfo = fs::normalize(&debuginfo)?;
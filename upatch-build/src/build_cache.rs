@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: Mulan PSL v2
+/*
+ * Copyright (c) 2024 Huawei Technologies Co., Ltd.
+ * upatch-build is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *         http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ * See the Mulan PSL v2 for more details.
+ */
+
+use std::{
+    ffi::OsString,
+    path::{Path, PathBuf},
+};
+
+use anyhow::{Context, Result};
+use indexmap::IndexMap;
+use serde::{Deserialize, Serialize};
+use syscare_common::{
+    fs, os,
+    util::{
+        digest,
+        serde::{deserialize_with_magic, serialize_with_magic},
+    },
+};
+
+use crate::{args::Arguments, compiler::Compiler};
+
+const CACHE_INDEX_NAME: &str = "index";
+const CACHE_INDEX_MAGIC: &str = "UPATCH_BUILD_CACHE";
+
+#[derive(Serialize, Deserialize)]
+struct CacheIndex {
+    objects: Vec<(PathBuf, OsString)>, // Source file -> Original object name
+}
+
+/// Persistent cache of the original (unpatched) build.
+///
+/// Each entry holds the original objects of the target binaries and their source files,
+/// which is everything the patched build needs from the original one.
+pub struct BuildCache {
+    cache_root: PathBuf,
+    key: String,
+}
+
+impl BuildCache {
+    /// Cache key covers everything the original objects depend on,
+    /// thus the sources have to be prepared before calling this.
+    pub fn new(args: &Arguments, compilers: &[Compiler], cache_root: &Path) -> Result<Self> {
+        let mut items = vec![
+            format!("key: {}", args.cache_key),
+            format!("prepare: {}", args.prepare_cmd),
+            format!("build: {}", args.build_cmd),
+            format!("source: {}", args.source_dir.display()),
+        ];
+        for compiler in compilers {
+            items.push(format!("compiler: {}", compiler));
+            for version in &compiler.versions {
+                items.push(format!("version: {}", version.to_string_lossy()));
+            }
+        }
+        for elf in &args.elf {
+            items.push(format!("elf: {}", elf.display()));
+        }
+        items.push(format!(
+            "digest: {}",
+            Self::source_digest(&args.source_dir).context("Failed to digest sources")?
+        ));
+
+        Ok(Self {
+            cache_root: cache_root.to_path_buf(),
+            key: digest::bytes(items.join("\n")),
+        })
+    }
+
+    pub fn key(&self) -> &str {
+        &self.key
+    }
+
+    /// Restore cached objects into `object_dir`, returns the source to object map on hit
+    pub fn load(&self, object_dir: &Path) -> Result<Option<IndexMap<PathBuf, PathBuf>>> {
+        let cache_dir = self.cache_root.join(&self.key);
+        let index_file = cache_dir.join(CACHE_INDEX_NAME);
+        if !index_file.is_file() {
+            return Ok(None);
+        }
+
+        let index: CacheIndex = deserialize_with_magic(&index_file, CACHE_INDEX_MAGIC)
+            .context("Failed to read cache index")?;
+
+        let mut objects = IndexMap::with_capacity(index.objects.len());
+        for (source_file, object_name) in index.objects {
+            let object_file = object_dir.join(&object_name);
+            fs::copy(cache_dir.join(&object_name), &object_file)?;
+            objects.insert(source_file, object_file);
+        }
+
+        Ok(Some(objects))
+    }
+
+    /// Save original objects, the entry is published atomically once complete
+    pub fn store<'a, I>(&self, objects: I) -> Result<()>
+    where
+        I: IntoIterator<Item = (&'a Path, &'a Path)>,
+    {
+        let cache_dir = self.cache_root.join(&self.key);
+        if cache_dir.exists() {
+            return Ok(());
+        }
+
+        let temp_dir = self
+            .cache_root
+            .join(format!(".{}.{}", self.key, os::process::id()));
+        fs::create_dir_all(&temp_dir)?;
+
+        let result = Self::store_objects(&temp_dir, objects)
+            .and_then(|_| fs::rename(&temp_dir, &cache_dir).map_err(Into::into));
+        if temp_dir.exists() {
+            fs::remove_dir_all(&temp_dir).ok();
+        }
+
+        // Someone else may have published the same entry meanwhile
+        match cache_dir.exists() {
+            true => Ok(()),
+            false => result,
+        }
+    }
+}
+
+impl BuildCache {
+    fn source_digest(source_dir: &Path) -> Result<String> {
+        let mut source_files = fs::list_files(source_dir, fs::TraverseOptions { recursive: true })?;
+        // Directory order is unspecified, keep digest stable
+        source_files.sort();
+
+        let mut file_digests = Vec::with_capacity(source_files.len());
+        for source_file in &source_files {
+            let file_path = source_file
+                .strip_prefix(source_dir)
+                .unwrap_or(source_file.as_path());
+            file_digests.push(format!(
+                "{} {}",
+                file_path.display(),
+                digest::file(source_file)?
+            ));
+        }
+
+        Ok(digest::bytes(file_digests.join("\n")))
+    }
+
+    fn store_objects<'a, I>(cache_dir: &Path, objects: I) -> Result<()>
+    where
+        I: IntoIterator<Item = (&'a Path, &'a Path)>,
+    {
+        let mut index = CacheIndex {
+            objects: Vec::new(),
+        };
+        for (source_file, object_file) in objects {
+            let object_name = object_file.file_name().with_context(|| {
+                format!("Failed to parse object name of {}", object_file.display())
+            })?;
+            fs::copy(object_file, cache_dir.join(object_name))?;
+            index
+                .objects
+                .push((source_file.to_path_buf(), object_name.to_os_string()));
+        }
+
+        serialize_with_magic(&index, cache_dir.join(CACHE_INDEX_NAME), CACHE_INDEX_MAGIC)
+            .context("Failed to write cache index")
+    }
+}
@@ -34,7 +34,7 @@ use object::{
 };
 use typed_arena::Arena;
 
-use syscare_common::ffi::OsStrExt;
+use syscare_common::{ffi::OsStrExt, fs};
 
 use relocate::Relocate;
 
@@ -46,16 +46,25 @@ pub struct CompileUnit {
     pub file_name: PathBuf,   // DW_AT_name
 }
 
+/*
+ * Only root DIEs of compile units are read, thus only sections they refer to
+ * are loaded. Others (line programs, locations, ranges...) of a large debuginfo
+ * are neither decompressed nor relocated.
+ */
+const LOADED_SECTIONS: &[SectionId] = &[
+    SectionId::DebugInfo,
+    SectionId::DebugAbbrev,
+    SectionId::DebugStr,
+    SectionId::DebugLineStr,
+];
+
 pub struct Dwarf;
 
 impl Dwarf {
     pub fn parse<P: AsRef<Path>>(elf: P) -> Result<Vec<CompileUnit>> {
-        // use mmap here, but depend on some devices
-        let elf = elf.as_ref();
-        let file = std::fs::File::open(elf)?;
-        let mmap = unsafe { memmap2::Mmap::map(&file)? };
+        let mmap = fs::MappedFile::open(elf)?;
 
-        let object = File::parse(&*mmap)?;
+        let object = File::parse(mmap.as_bytes())?;
         let endian = if object.is_little_endian() {
             gimli::RunTimeEndian::Little
         } else {
@@ -157,7 +166,7 @@ impl Dwarf {
         arena_relocations: &'arena Arena<IndexMap<usize, Relocation>>,
     ) -> Result<Relocate<'arena, EndianSlice<'arena, Endian>>> {
         let mut relocations = IndexMap::new();
-        let name = Some(id.name());
+        let name = Some(id.name()).filter(|_| LOADED_SECTIONS.contains(&id));
         let data = match name.and_then(|name| file.section_by_name(name)) {
             Some(ref section) => {
                 // DWO sections never have relocations, so don't bother.
@@ -196,11 +205,12 @@ impl Dwarf {
         let mut result = Vec::new();
         let mut iter = dwarf.units();
         while let Some(header) = iter.next()? {
-            let unit = dwarf.unit(header)?;
-            let mut entries = unit.entries();
-            while let Some((_, entry)) = entries.next_dfs()? {
+            // Decode the root DIE only, the unit itself (line program, etc.) is never built
+            let abbreviations = header.abbreviations(&dwarf.debug_abbrev)?;
+            let mut entries = header.entries(&abbreviations);
+            if let Some((_, entry)) = entries.next_dfs()? {
                 if entry.tag() != constants::DW_TAG_compile_unit {
-                    break;
+                    continue;
                 }
                 // Iterate over the attributes in the DIE.
                 let mut attrs = entry.attrs();
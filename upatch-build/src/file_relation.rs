@@ -13,12 +13,16 @@
  */
 
 use std::ffi::{OsStr, OsString};
+use std::os::unix::ffi::OsStrExt as StdOsStrExt;
 use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::thread;
+use std::time::SystemTime;
 
-use anyhow::{bail, ensure, Context, Result};
+use anyhow::{anyhow, bail, ensure, Context, Result};
 
 use indexmap::{IndexMap, IndexSet};
-use syscare_common::{ffi::OsStrExt, fs};
+use syscare_common::{ffi::OsStrExt, fs, util::digest};
 
 use super::{
     dwarf::Dwarf,
@@ -28,22 +32,30 @@ use super::{
 
 const UPATCH_SYM_PREFIX: &str = ".upatch_";
 const OBJECT_EXTENSION: &str = "o";
+pub const OBJECT_INDEX_NAME: &str = "objects.index";
+const PARSE_THREAD_NAME: &str = "parse_source";
+
+type FileStamp = (u64, SystemTime); // File size, modification time
 
 #[derive(Debug)]
 pub struct FileRelation {
+    jobs: usize,
     binary_debug_map: IndexMap<PathBuf, PathBuf>, // Binary -> Debuginfo
     source_origin_map: IndexMap<PathBuf, PathBuf>, // Source file -> Original object
     binary_patched_map: IndexMap<PathBuf, IndexSet<PathBuf>>, // Binary -> Patched objects
     patched_original_map: IndexMap<PathBuf, PathBuf>, // Patched object -> Original object
+    upatch_id_map: IndexMap<PathBuf, (FileStamp, IndexSet<OsString>)>, // Binary -> Upatch ids
 }
 
 impl FileRelation {
-    pub fn new() -> Self {
+    pub fn new(jobs: usize) -> Self {
         Self {
+            jobs: jobs.max(1),
             binary_debug_map: IndexMap::new(),
             binary_patched_map: IndexMap::new(),
             source_origin_map: IndexMap::new(),
             patched_original_map: IndexMap::new(),
+            upatch_id_map: IndexMap::new(),
         }
     }
 
@@ -68,62 +80,47 @@ impl FileRelation {
     }
 
     pub fn collect_original_build<P: AsRef<Path>>(&mut self, object_dir: P) -> Result<()> {
-        for (binary, _) in &self.binary_debug_map {
-            let upatch_ids = Self::parse_upatch_ids(binary)
-                .with_context(|| format!("Failed to parse upatch id of {}", binary.display()))?;
-
-            for upatch_id in upatch_ids {
-                let original_object = Self::find_object_file(&object_dir, &upatch_id)
-                    .with_context(|| {
-                        format!("Failed to find object of {}", upatch_id.to_string_lossy())
-                    })?;
-                let source_file =
-                    Dwarf::parse_source_file(&original_object).with_context(|| {
-                        format!(
-                            "Failed to parse source file of {}",
-                            original_object.display()
-                        )
-                    })?;
+        let binary_objects = self.find_binary_objects(object_dir.as_ref())?;
+        let original_objects = binary_objects
+            .into_iter()
+            .flat_map(|(_, objects)| objects)
+            .collect::<IndexSet<_>>();
 
-                self.source_origin_map.insert(source_file, original_object);
-            }
+        let source_files = self.parse_source_files(&original_objects)?;
+        for (original_object, source_file) in original_objects.into_iter().zip(source_files) {
+            self.source_origin_map.insert(source_file, original_object);
         }
 
         Ok(())
     }
 
-    pub fn collect_patched_build<P: AsRef<Path>>(&mut self, object_dir: P) -> Result<()> {
-        for (binary, _) in &self.binary_debug_map {
-            let upatch_ids = Self::parse_upatch_ids(binary)
-                .with_context(|| format!("Failed to parse upatch id of {}", binary.display()))?;
+    /// Restore original build from cached source to object map
+    pub fn restore_original_build(&mut self, source_origin_map: IndexMap<PathBuf, PathBuf>) {
+        self.source_origin_map = source_origin_map;
+    }
 
-            let mut patched_objects = IndexSet::new();
-            for upatch_id in upatch_ids {
-                let patched_object =
-                    Self::find_object_file(&object_dir, &upatch_id).with_context(|| {
-                        format!("Failed to find object of {}", upatch_id.to_string_lossy())
-                    })?;
-                let source_file = Dwarf::parse_source_file(&patched_object).with_context(|| {
-                    format!(
-                        "Failed to parse source file of {}",
-                        patched_object.display()
-                    )
-                })?;
-                let original_object =
-                    self.source_origin_map.get(&source_file).with_context(|| {
-                        format!(
-                            "Failed to find original object of {}",
-                            patched_object.display()
-                        )
-                    })?;
+    pub fn collect_patched_build<P: AsRef<Path>>(&mut self, object_dir: P) -> Result<()> {
+        let binary_objects = self.find_binary_objects(object_dir.as_ref())?;
+        let patched_objects = binary_objects
+            .iter()
+            .flat_map(|(_, objects)| objects)
+            .cloned()
+            .collect::<IndexSet<_>>();
 
-                patched_objects.insert(patched_object.clone());
-                self.patched_original_map
-                    .insert(patched_object, original_object.to_path_buf());
-            }
+        let source_files = self.parse_source_files(&patched_objects)?;
+        for (patched_object, source_file) in patched_objects.iter().zip(source_files) {
+            let original_object = self.source_origin_map.get(&source_file).with_context(|| {
+                format!(
+                    "Failed to find original object of {}",
+                    patched_object.display()
+                )
+            })?;
 
-            self.binary_patched_map
-                .insert(binary.to_path_buf(), patched_objects);
+            self.patched_original_map
+                .insert(patched_object.clone(), original_object.to_path_buf());
+        }
+        for (binary, objects) in binary_objects {
+            self.binary_patched_map.insert(binary, objects);
         }
 
         Ok(())
@@ -135,6 +132,12 @@ impl FileRelation {
             .map(|(binary, debuginfo)| (binary.as_path(), debuginfo.as_path()))
     }
 
+    pub fn get_original_build(&self) -> impl IntoIterator<Item = (&Path, &Path)> {
+        self.source_origin_map
+            .iter()
+            .map(|(source, object)| (source.as_path(), object.as_path()))
+    }
+
     pub fn get_patched_objects<P: AsRef<Path>>(&self, binary: P) -> Option<&IndexSet<PathBuf>> {
         self.binary_patched_map.get(binary.as_ref())
     }
@@ -166,6 +169,146 @@ impl FileRelation {
         }
     }
 
+    fn file_stamp(file: &Path) -> Result<FileStamp> {
+        let metadata = fs::metadata(file)?;
+        Ok((metadata.len(), metadata.modified()?))
+    }
+
+    /// Find objects of every binary by its upatch ids, which are kept until the binary changes
+    fn find_binary_objects(
+        &mut self,
+        object_dir: &Path,
+    ) -> Result<IndexMap<PathBuf, IndexSet<PathBuf>>> {
+        let mut binary_objects = IndexMap::new();
+        let object_index = Self::read_object_index(object_dir)?;
+
+        for binary in self.binary_debug_map.keys() {
+            let stamp = Self::file_stamp(binary)
+                .with_context(|| format!("Failed to read metadata of {}", binary.display()))?;
+            let upatch_ids = match self.upatch_id_map.get(binary) {
+                Some((cached_stamp, upatch_ids)) if *cached_stamp == stamp => upatch_ids,
+                _ => {
+                    let upatch_ids = Self::parse_upatch_ids(binary).with_context(|| {
+                        format!("Failed to parse upatch id of {}", binary.display())
+                    })?;
+                    self.upatch_id_map
+                        .insert(binary.to_path_buf(), (stamp, upatch_ids));
+                    &self.upatch_id_map[binary].1
+                }
+            };
+
+            let mut objects = IndexSet::new();
+            for upatch_id in upatch_ids {
+                let object = match &object_index {
+                    Some(object_index) => Self::store_object(object_dir, object_index, upatch_id),
+                    None => Self::find_object_file(object_dir, upatch_id),
+                }
+                .with_context(|| {
+                    format!("Failed to find object of {}", upatch_id.to_string_lossy())
+                })?;
+                objects.insert(object);
+            }
+            binary_objects.insert(binary.to_path_buf(), objects);
+        }
+
+        Ok(binary_objects)
+    }
+
+    /// Parse source file of each object, objects are split among `jobs` threads
+    fn parse_source_files(&self, objects: &IndexSet<PathBuf>) -> Result<Vec<PathBuf>> {
+        let objects = Arc::new(objects.iter().cloned().collect::<Vec<_>>());
+        let chunk_size = (objects.len() + self.jobs - 1) / self.jobs;
+        if chunk_size == 0 {
+            return Ok(vec![]);
+        }
+
+        let mut workers = Vec::new();
+        for start in (0..objects.len()).step_by(chunk_size) {
+            let objects = objects.clone();
+            let end = (start + chunk_size).min(objects.len());
+            let worker = thread::Builder::new()
+                .name(PARSE_THREAD_NAME.to_string())
+                .spawn(move || {
+                    objects[start..end]
+                        .iter()
+                        .map(|object| {
+                            Dwarf::parse_source_file(object).with_context(|| {
+                                format!("Failed to parse source file of {}", object.display())
+                            })
+                        })
+                        .collect::<Result<Vec<_>>>()
+                })
+                .with_context(|| format!("Failed to create thread '{}'", PARSE_THREAD_NAME))?;
+            workers.push(worker);
+        }
+
+        let mut source_files = Vec::with_capacity(objects.len());
+        for worker in workers {
+            let results = worker
+                .join()
+                .map_err(|_| anyhow!("Thread '{}' panicked", PARSE_THREAD_NAME))?;
+            source_files.extend(results?);
+        }
+
+        Ok(source_files)
+    }
+
+    /*
+     * In capture mode, objects are left where the build put them, and the hijacker appends
+     * "<upatch id> <object path>" to an index file instead. Only the last record of each path
+     * is valid, since the object was overwritten by the latest assembler run.
+     */
+    fn read_object_index(object_dir: &Path) -> Result<Option<IndexMap<OsString, PathBuf>>> {
+        let index_file = object_dir.join(OBJECT_INDEX_NAME);
+        if !index_file.is_file() {
+            return Ok(None);
+        }
+
+        let content = fs::read(&index_file)?;
+        let mut path_map = IndexMap::new();
+        for record in content
+            .split(|&b| b == b'\n')
+            .filter(|line| !line.is_empty())
+        {
+            let pos = record
+                .iter()
+                .position(|&b| b == b' ')
+                .with_context(|| format!("Invalid record in {}", index_file.display()))?;
+            let upatch_id = OsStr::from_bytes(&record[..pos]).to_os_string();
+            let object = PathBuf::from(OsStr::from_bytes(&record[pos + 1..]));
+
+            path_map.insert(object, upatch_id);
+        }
+
+        Ok(Some(
+            path_map
+                .into_iter()
+                .map(|(object, upatch_id)| (upatch_id, object))
+                .collect(),
+        ))
+    }
+
+    /// Copy an indexed object into the object directory, named by its content digest
+    fn store_object(
+        object_dir: &Path,
+        object_index: &IndexMap<OsString, PathBuf>,
+        upatch_id: &OsStr,
+    ) -> Result<PathBuf> {
+        let object = object_index
+            .get(upatch_id)
+            .context("Object is not in the index")?;
+        let object_digest = digest::file(object)
+            .with_context(|| format!("Cannot access object {}", object.display()))?;
+
+        let mut file_path = object_dir.join(object_digest);
+        file_path.set_extension(OBJECT_EXTENSION);
+        if !file_path.is_file() {
+            fs::copy(object, &file_path)?;
+        }
+
+        Ok(file_path)
+    }
+
     fn find_object_file<P, S>(object_dir: P, upatch_id: S) -> Result<PathBuf>
     where
         P: AsRef<Path>,
@@ -47,29 +47,32 @@ impl Hijacker<'_> {
         info!("Hijacking compiler(s)");
         for exec_path in &self.programs {
             info!("- {}", exec_path.display());
-            self.proxy
-                .enable_hijack(exec_path)
-                .with_context(|| format!("Failed to hijack {}", exec_path.display()))?;
-
-            self.finished.push(exec_path);
         }
+        self.proxy
+            .enable_hijacks(&self.programs)
+            .context("Failed to hijack compiler(s)")?;
+        self.finished.extend(&self.programs);
 
         Ok(())
     }
 
     fn unhack(&mut self) {
+        if self.finished.is_empty() {
+            return;
+        }
+
         info!("Releasing compiler(s)");
-        while let Some(exec_path) = self.finished.pop() {
+        for exec_path in self.finished.iter().rev() {
             info!("- {}", exec_path.display());
-            let result = self
-                .proxy
-                .disable_hijack(exec_path)
-                .with_context(|| format!("Failed to release {}", exec_path.display()));
-
-            if let Err(e) = result {
-                error!("{:?}", e);
-            }
         }
+        let result = self
+            .proxy
+            .disable_hijacks(&self.finished)
+            .context("Failed to release compiler(s)");
+        if let Err(e) = result {
+            error!("{:?}", e);
+        }
+        self.finished.clear();
     }
 }
 
@@ -15,21 +15,27 @@
 use std::{
     ffi::OsStr,
     fs::Permissions,
-    os::unix::fs::PermissionsExt,
+    os::unix::{ffi::OsStrExt, fs::PermissionsExt},
     path::{Path, PathBuf},
     process,
+    sync::{
+        atomic::{AtomicBool, AtomicUsize, Ordering},
+        Arc,
+    },
+    thread,
 };
 
-use anyhow::{ensure, Context, Result};
+use anyhow::{anyhow, ensure, Context, Result};
 use flexi_logger::{
     DeferredNow, Duplicate, FileSpec, LogSpecification, Logger, LoggerHandle, WriteMode,
 };
 use indexmap::IndexSet;
 use log::{debug, error, info, warn, Level, LevelFilter, Record};
 use object::{write, Object, ObjectSection, SectionKind};
-use syscare_common::{concat_os, fs, os, process::Command};
+use syscare_common::{concat_os, fs, os, process::Command, util::digest};
 
 mod args;
+mod build_cache;
 mod build_root;
 mod compiler;
 mod dwarf;
@@ -42,6 +48,7 @@ mod resolve;
 mod rpc;
 
 use args::Arguments;
+use build_cache::BuildCache;
 use build_root::BuildRoot;
 use compiler::Compiler;
 use dwarf::Dwarf;
@@ -55,12 +62,14 @@ const CLI_ABOUT: &str = env!("CARGO_PKG_DESCRIPTION");
 const CLI_UMASK: u32 = 0o022;
 
 const LOG_FILE_NAME: &str = "build";
+const BUILD_THREAD_NAME: &str = "build_patch";
 
 struct BuildInfo {
     files: FileRelation,
     linker: PathBuf,
     build_dir: PathBuf,
     output_dir: PathBuf,
+    jobs: usize,
     verbose: bool,
 }
 
@@ -87,6 +96,9 @@ impl UpatchBuild {
         let args = Arguments::new()?;
         let build_root = BuildRoot::new(&args.build_root)?;
         fs::create_dir_all(&args.output_dir)?;
+        if let Some(cache_dir) = &args.cache_dir {
+            fs::create_dir_all(cache_dir)?;
+        }
 
         // Initialize logger
         let log_level_max = LevelFilter::Trace;
@@ -189,33 +201,87 @@ impl UpatchBuild {
         Ok(())
     }
 
+    /// Digest of object sections which may affect the patch, debug info & notes are ignored
+    fn object_digest<P: AsRef<Path>>(object: P) -> Result<String> {
+        const IGNORED_SECTION_PREFIXES: [&str; 4] = [".debug", ".rela.debug", ".note", ".comment"];
+
+        let object_elf = unsafe { memmap2::Mmap::map(&std::fs::File::open(object)?)? };
+        let object_file = object::File::parse(&*object_elf).context("Failed to parse object")?;
+
+        let mut section_digests = Vec::new();
+        for section in object_file.sections() {
+            let section_name = section.name().context("Failed to get section name")?;
+            if IGNORED_SECTION_PREFIXES
+                .iter()
+                .any(|prefix| section_name.starts_with(prefix))
+            {
+                continue;
+            }
+            let section_data = section.data().context("Failed to get section data")?;
+            section_digests.push(format!(
+                "{} {} {}",
+                section_name,
+                section.size(),
+                digest::bytes(section_data)
+            ));
+        }
+
+        Ok(digest::bytes(section_digests.join("\n")))
+    }
+
+    fn is_same_object(original_object: &Path, patched_object: &Path) -> Result<bool> {
+        Ok(Self::object_digest(original_object)? == Self::object_digest(patched_object)?)
+    }
+
+    /// Diff all (original, patched) object pairs with one upatch-diff run,
+    /// which parses the debuginfo once and handles up to `jobs` pairs at a time.
     fn create_diff_objs(
-        original_object: &Path,
-        patched_object: &Path,
+        object_pairs: &[(PathBuf, PathBuf)],
         debuginfo: &Path,
         output_dir: &Path,
+        jobs: usize,
         verbose: bool,
     ) -> Result<()> {
         const UPATCH_DIFF_BIN: &str = "/usr/libexec/syscare/upatch-diff";
+        const MANIFEST_FILE_NAME: &str = "diff.manifest";
 
-        let ouput_name = original_object.file_name().with_context(|| {
-            format!(
-                "Failed to parse patch file name of {}",
-                original_object.display()
-            )
-        })?;
-        let output_file = output_dir.join(ouput_name);
+        if object_pairs.is_empty() {
+            return Ok(());
+        }
+
+        let mut manifest = Vec::new();
+        for (original_object, patched_object) in object_pairs {
+            let ouput_name = original_object.file_name().with_context(|| {
+                format!(
+                    "Failed to parse patch file name of {}",
+                    original_object.display()
+                )
+            })?;
+            let output_file = output_dir.join(ouput_name);
+
+            for (index, path) in [original_object, patched_object, &output_file]
+                .iter()
+                .enumerate()
+            {
+                if index != 0 {
+                    manifest.push(b'\t');
+                }
+                manifest.extend_from_slice(path.as_os_str().as_bytes());
+            }
+            manifest.push(b'\n');
+        }
+
+        let manifest_file = output_dir.join(MANIFEST_FILE_NAME);
+        fs::write(&manifest_file, manifest)?;
 
         let mut command = Command::new(UPATCH_DIFF_BIN);
         command
-            .arg("-s")
-            .arg(original_object)
-            .arg("-p")
-            .arg(patched_object)
-            .arg("-o")
-            .arg(output_file)
+            .arg("-m")
+            .arg(&manifest_file)
             .arg("-r")
-            .arg(debuginfo);
+            .arg(debuginfo)
+            .arg("-j")
+            .arg(jobs.to_string());
 
         if verbose {
             command.arg("-d");
@@ -224,6 +290,20 @@ impl UpatchBuild {
         command.stdout(Level::Trace).run_with_output()?.exit_ok()
     }
 
+    fn open_build_cache(&self, compilers: &[Compiler]) -> Option<BuildCache> {
+        let cache_root = self.args.cache_dir.as_deref()?;
+        match BuildCache::new(&self.args, compilers, cache_root) {
+            Ok(cache) => {
+                debug!("Build cache: {}", cache.key());
+                Some(cache)
+            }
+            Err(e) => {
+                warn!("Warning: Build cache is disabled, {:#}", e);
+                None
+            }
+        }
+    }
+
     fn link_objects<P, I, S, Q>(linker: P, objects: I, output: Q) -> Result<()>
     where
         P: AsRef<Path>,
@@ -243,7 +323,6 @@ impl UpatchBuild {
 /* Main process */
 impl UpatchBuild {
     fn build_patch(
-        &self,
         build_info: &BuildInfo,
         binary: &Path,
         debuginfo: &Path,
@@ -261,7 +340,7 @@ impl UpatchBuild {
 
         debug!("- Preparing to build patch");
         fs::create_dir_all(&output_dir)?;
-        fs::copy(debuginfo, &new_debuginfo)?;
+        fs::reflink_copy(debuginfo, &new_debuginfo)?;
         fs::set_permissions(&new_debuginfo, Permissions::from_mode(0o644))?;
 
         debug!("- Resolving debuginfo");
@@ -273,6 +352,7 @@ impl UpatchBuild {
             .get_patched_objects(binary)
             .with_context(|| format!("Failed to find objects of {}", binary.display()))?;
 
+        let mut object_pairs = Vec::with_capacity(patched_objects.len());
         for patched_object in patched_objects {
             let original_object = build_info
                 .files
@@ -283,23 +363,31 @@ impl UpatchBuild {
                         patched_object.display()
                     )
                 })?;
-
-            UpatchBuild::create_diff_objs(
-                original_object,
-                patched_object,
-                &new_debuginfo,
-                &output_dir,
-                build_info.verbose,
-            )
-            .with_context(|| format!("Failed to create diff objects for {}", binary.display()))?;
+            // Digest failure is not fatal, upatch-diff would report the real error
+            if Self::is_same_object(original_object, patched_object).unwrap_or(false) {
+                debug!("- Skipped unchanged object {}", patched_object.display());
+                continue;
+            }
+            object_pairs.push((original_object.to_path_buf(), patched_object.clone()));
         }
 
+        UpatchBuild::create_diff_objs(
+            &object_pairs,
+            &new_debuginfo,
+            &output_dir,
+            build_info.jobs,
+            build_info.verbose,
+        )
+        .with_context(|| format!("Failed to create diff objects for {}", binary.display()))?;
+
         debug!("- Collecting changes");
         let mut changed_objects = fs::list_files_by_ext(
             &output_dir,
             OBJECT_EXTENSION,
             fs::TraverseOptions { recursive: false },
         )?;
+        // Directory order is unspecified, keep link order stable
+        changed_objects.sort();
         if changed_objects.is_empty() {
             debug!("- No functional changes");
             return Ok(());
@@ -321,7 +409,9 @@ impl UpatchBuild {
         Ok(())
     }
 
+    /// Build patches of all binaries, binaries are built in parallel within the job budget
     fn build_patches(&self, build_info: BuildInfo, name: &OsStr) -> Result<()> {
+        let mut patches = Vec::new();
         for (binary, debuginfo) in build_info.files.get_files() {
             let binary_name = binary
                 .file_name()
@@ -332,14 +422,75 @@ impl UpatchBuild {
             };
             let output_file = build_info.output_dir.join(&patch_name);
 
-            info!("Generating patch {}", patch_name.to_string_lossy());
-            self.build_patch(&build_info, binary, debuginfo, &output_file)
-                .with_context(|| {
-                    format!("Failed to build patch {}", patch_name.to_string_lossy())
-                })?;
+            patches.push((
+                patch_name,
+                binary.to_path_buf(),
+                debuginfo.to_path_buf(),
+                output_file,
+            ));
+        }
+        if patches.is_empty() {
+            return Ok(());
         }
 
-        Ok(())
+        // Each build gets an equal share of jobs for its diff
+        let worker_num = build_info.jobs.min(patches.len()).max(1);
+        let build_info = Arc::new(BuildInfo {
+            jobs: (build_info.jobs / worker_num).max(1),
+            ..build_info
+        });
+        let patches = Arc::new(patches);
+        let next_index = Arc::new(AtomicUsize::new(0));
+        let failed = Arc::new(AtomicBool::new(false));
+
+        let mut workers = Vec::with_capacity(worker_num);
+        for _ in 0..worker_num {
+            let build_info = build_info.clone();
+            let patches = patches.clone();
+            let next_index = next_index.clone();
+            let failed = failed.clone();
+
+            let worker = thread::Builder::new()
+                .name(BUILD_THREAD_NAME.to_string())
+                .spawn(move || {
+                    let mut results = Vec::new();
+                    // Builds not started yet are skipped after any failure
+                    while !failed.load(Ordering::Relaxed) {
+                        let index = next_index.fetch_add(1, Ordering::Relaxed);
+                        let (patch_name, binary, debuginfo, output_file) = match patches.get(index)
+                        {
+                            Some(patch) => patch,
+                            None => break,
+                        };
+
+                        info!("Generating patch {}", patch_name.to_string_lossy());
+                        let result = Self::build_patch(&build_info, binary, debuginfo, output_file)
+                            .with_context(|| {
+                                format!("Failed to build patch {}", patch_name.to_string_lossy())
+                            });
+                        if result.is_err() {
+                            failed.store(true, Ordering::Relaxed);
+                        }
+                        results.push((index, result));
+                    }
+                    results
+                })
+                .with_context(|| format!("Failed to create thread '{}'", BUILD_THREAD_NAME))?;
+            workers.push(worker);
+        }
+
+        let mut results = Vec::with_capacity(patches.len());
+        for worker in workers {
+            results.extend(
+                worker
+                    .join()
+                    .map_err(|_| anyhow!("Thread '{}' panicked", BUILD_THREAD_NAME))?,
+            );
+        }
+
+        // Report the first failure in order of binaries
+        results.sort_by_key(|(index, _)| *index);
+        results.into_iter().map(|(_, result)| result).collect()
     }
 
     fn run(&mut self) -> Result<()> {
@@ -392,7 +543,7 @@ impl UpatchBuild {
             true => warn!("Warning: Skipped compiler version check!"),
         }
 
-        let mut files = FileRelation::new();
+        let mut files = FileRelation::new(self.args.jobs);
         let hijacker = Hijacker::new(&compilers, work_dir).context("Failed to hack compilers")?;
 
         info!("Preparing {}", project);
@@ -400,19 +551,43 @@ impl UpatchBuild {
             .prepare()
             .with_context(|| format!("Failed to prepare {}", project))?;
 
-        info!("Building {}", project);
-        project
-            .build()
-            .with_context(|| format!("Failed to build {}", project))?;
-
-        info!("Collecting file relations");
-        files.collect_outputs(binaries, debuginfos)?;
-        files.collect_original_build(original_dir)?;
+        let build_cache = self.open_build_cache(&compilers);
+        let cached_build = match &build_cache {
+            Some(cache) => cache.load(original_dir).unwrap_or_else(|e| {
+                warn!("Warning: Failed to load build cache, {:#}", e);
+                None
+            }),
+            None => None,
+        };
+        let is_cached = cached_build.is_some();
 
-        info!("Preparing {}", project);
-        project
-            .prepare()
-            .with_context(|| format!("Failed to prepare {}", project))?;
+        match cached_build {
+            Some(source_origin_map) => {
+                info!("Using cached build of {}", project);
+                files.restore_original_build(source_origin_map);
+            }
+            None => {
+                info!("Building {}", project);
+                project
+                    .build()
+                    .with_context(|| format!("Failed to build {}", project))?;
+
+                info!("Collecting file relations");
+                files.collect_outputs(binaries, debuginfos)?;
+                files.collect_original_build(original_dir)?;
+
+                if let Some(cache) = &build_cache {
+                    if let Err(e) = cache.store(files.get_original_build()) {
+                        warn!("Warning: Failed to save build cache, {:#}", e);
+                    }
+                }
+
+                info!("Preparing {}", project);
+                project
+                    .prepare()
+                    .with_context(|| format!("Failed to prepare {}", project))?;
+            }
+        }
 
         info!("Patching {}", project);
         project
@@ -425,6 +600,10 @@ impl UpatchBuild {
             .with_context(|| format!("Failed to rebuild {}", project))?;
 
         info!("Collecting file relations");
+        if is_cached {
+            // There were no original binaries, use the rebuilt ones instead
+            files.collect_outputs(binaries, debuginfos)?;
+        }
         files.collect_patched_build(patched_dir)?;
 
         // Unhack compilers
@@ -435,6 +614,7 @@ impl UpatchBuild {
             files,
             build_dir: build_dir.to_path_buf(),
             output_dir: output_dir.to_path_buf(),
+            jobs: self.args.jobs,
             verbose,
         };
         self.build_patches(build_info, name)?;
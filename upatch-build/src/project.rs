@@ -25,10 +25,11 @@ use anyhow::{Context, Result};
 use log::{debug, Level};
 use syscare_common::{fs, process::Command};
 
-use crate::{args::Arguments, build_root::BuildRoot};
+use crate::{args::Arguments, build_root::BuildRoot, file_relation::OBJECT_INDEX_NAME};
 
 const PATCH_BIN: &str = "patch";
 const COMPILER_CMD_ENV: &str = "UPATCH_HIJACKER";
+const OBJECT_INDEX_ENV: &str = "UPATCH_HIJACKER_INDEX";
 
 const PREPARE_SCRIPT_NAME: &str = "prepare.sh";
 const BUILD_SCRIPT_NAME: &str = "build.sh";
@@ -41,6 +42,7 @@ pub struct Project<'a> {
     patched_dir: &'a Path,
     prepare_cmd: &'a str,
     build_cmd: &'a str,
+    capture_objects: bool,
 }
 
 impl<'a> Project<'a> {
@@ -53,6 +55,7 @@ impl<'a> Project<'a> {
         let name = fs::file_name(root_dir);
         let prepare_cmd = args.prepare_cmd.as_str();
         let build_cmd = args.build_cmd.as_str();
+        let capture_objects = args.capture_objects;
 
         Self {
             name,
@@ -62,6 +65,7 @@ impl<'a> Project<'a> {
             patched_dir,
             prepare_cmd,
             build_cmd,
+            capture_objects,
         }
     }
 }
@@ -123,7 +127,17 @@ impl Project<'_> {
         }
         let script = self.create_script(script_name, command)?;
 
-        Command::new("sh")
+        let mut build_cmd = Command::new("sh");
+        if self.capture_objects {
+            // Records of a previous build would point to stale objects
+            let index_file = object_dir.as_ref().join(OBJECT_INDEX_NAME);
+            if index_file.exists() {
+                fs::remove_file(&index_file)?;
+            }
+            build_cmd.env(OBJECT_INDEX_ENV, index_file);
+        }
+
+        build_cmd
             .arg(script)
             .env(COMPILER_CMD_ENV, object_dir.as_ref())
             .current_dir(self.root_dir)
@@ -12,7 +12,10 @@
  * See the Mulan PSL v2 for more details.
  */
 
-use std::{path::Path, rc::Rc};
+use std::{
+    path::{Path, PathBuf},
+    rc::Rc,
+};
 
 use anyhow::Result;
 use function_name::named;
@@ -30,18 +33,37 @@ impl UpatchProxy {
     }
 
     #[named]
-    pub fn enable_hijack<P: AsRef<Path>>(&self, exec_path: P) -> Result<()> {
+    pub fn enable_hijacks<I, P>(&self, exec_paths: I) -> Result<()>
+    where
+        I: IntoIterator<Item = P>,
+        P: AsRef<Path>,
+    {
         self.remote.call_with_args(
             function_name!(),
-            RpcArguments::new().arg(exec_path.as_ref().to_path_buf()),
+            RpcArguments::new().arg(Self::path_list(exec_paths)),
         )
     }
 
     #[named]
-    pub fn disable_hijack<P: AsRef<Path>>(&self, exec_path: P) -> Result<()> {
+    pub fn disable_hijacks<I, P>(&self, exec_paths: I) -> Result<()>
+    where
+        I: IntoIterator<Item = P>,
+        P: AsRef<Path>,
+    {
         self.remote.call_with_args(
             function_name!(),
-            RpcArguments::new().arg(exec_path.as_ref().to_path_buf()),
+            RpcArguments::new().arg(Self::path_list(exec_paths)),
         )
     }
+
+    fn path_list<I, P>(paths: I) -> Vec<PathBuf>
+    where
+        I: IntoIterator<Item = P>,
+        P: AsRef<Path>,
+    {
+        paths
+            .into_iter()
+            .map(|path| path.as_ref().to_path_buf())
+            .collect()
+    }
 }
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * arena.c
+ *
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+#include "log.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static size_t align_up(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+}
+
+static struct arena_block *new_block(size_t size)
+{
+    struct arena_block *block;
+
+    block = calloc(1, sizeof(*block) + size);
+    if (!block)
+        ERROR("calloc");
+
+    block->size = size;
+    return block;
+}
+
+void arena_init(struct arena *arena)
+{
+    arena->blocks = NULL;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_block *block = arena->blocks;
+    void *ptr;
+
+    size = align_up(size ? size : 1);
+
+    /* large requests get their own block, keep the current one for bumping */
+    if (size > ARENA_BLOCK_SIZE / 4) {
+        block = new_block(size);
+        if (arena->blocks) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            arena->blocks = block;
+        }
+        block->used = size;
+        return block->data;
+    }
+
+    if (!block || block->size - block->used < size) {
+        block = new_block(ARENA_BLOCK_SIZE);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arena_move(struct arena *dst, struct arena *src)
+{
+    struct arena_block *tail;
+
+    if (!src->blocks)
+        return;
+
+    if (!dst->blocks) {
+        dst->blocks = src->blocks;
+    } else {
+        /* keep the current block of dst at the head */
+        for (tail = src->blocks; tail->next; tail = tail->next)
+            ;
+        tail->next = dst->blocks->next;
+        dst->blocks->next = src->blocks;
+    }
+    src->blocks = NULL;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    struct arena_block *block, *next;
+
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->blocks = NULL;
+}
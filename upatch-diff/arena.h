@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * arena.h
+ *
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+#ifndef __UPATCH_ARENA_H_
+#define __UPATCH_ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (1UL << 20)
+
+struct arena_block;
+
+/*
+ * Bump allocator, memory is zeroed and only released all at once.
+ * A zeroed arena is a valid empty arena.
+ */
+struct arena {
+    struct arena_block *blocks;
+};
+
+void arena_init(struct arena *);
+
+void *arena_alloc(struct arena *, size_t);
+
+/* move all blocks of src into dst, src becomes empty */
+void arena_move(struct arena *, struct arena *);
+
+void arena_destroy(struct arena *);
+
+#endif /* __UPATCH_ARENA_H_ */
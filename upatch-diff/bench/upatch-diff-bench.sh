@@ -0,0 +1,163 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# upatch-diff throughput benchmark
+#
+# Generates (original, patched, running elf) triples of increasing section
+# numbers, runs upatch-diff over each of them for a few rounds, then reports
+# the median time & the peak rss of each pass, which are taken from the stats
+# lines of 'upatch-diff --stats'.
+
+set -e
+
+SIZES="1000 10000 100000"
+CHANGED=10
+ROUNDS=3
+WORK_DIR="$(pwd)/upatch-diff-bench"
+OUTPUT=""
+UPATCH_DIFF="upatch-diff"
+CC="${CC:-gcc}"
+PASSES="load correlate compare include create write"
+
+usage() {
+    cat <<EOF
+Usage: $(basename "$0") [options]
+
+Options:
+  --sizes <list>        Section numbers of generated objects [default: ${SIZES}]
+  --changed <num>       Changed functions of each object [default: ${CHANGED}]
+  --rounds <num>        Rounds of each object [default: ${ROUNDS}]
+  --work-dir <dir>      Directory of generated files [default: ${WORK_DIR}]
+  --output <file>       Append results to a csv file, eg. to compare commits
+  --upatch-diff <bin>   Path of upatch-diff [default: ${UPATCH_DIFF}]
+EOF
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    --sizes) SIZES="$2"; shift ;;
+    --changed) CHANGED="$2"; shift ;;
+    --rounds) ROUNDS="$2"; shift ;;
+    --work-dir) WORK_DIR="$2"; shift ;;
+    --output) OUTPUT="$2"; shift ;;
+    --upatch-diff) UPATCH_DIFF="$2"; shift ;;
+    *) usage ;;
+    esac
+    shift
+done
+
+# Each unit is a function & its variable: .text.*, .rela.text.* and .data.*
+gen_source() {
+    local file="$1"
+    local units="$2"
+    local changed="$3"
+    local step=$(( (changed > 0) ? ((units + changed - 1) / changed) : (units + 1) ))
+
+    awk -v units="${units}" -v step="${step}" -v changed="${changed}" 'BEGIN {
+        for (i = 0; i < units; i++) {
+            factor = (changed && (i % step) == 0) ? 3 : 2
+            printf "int bench_var_%d = %d;\n", i, i + 1
+            printf "int bench_func_%d(int v) { return v * %d + bench_var_%d; }\n", \
+                i, factor, i
+        }
+    }' > "${file}"
+}
+
+gen_corpus() {
+    local size="$1"
+    local dir="${WORK_DIR}/${size}-${CHANGED}"
+    local units=$(( (size + 2) / 3 ))
+    local cflags="-g -O2 -fPIC -ffunction-sections -fdata-sections"
+
+    # Corpus is kept, thus results of different commits are comparable
+    if [ -f "${dir}/running" ]; then
+        return
+    fi
+    rm -rf "${dir}"
+    mkdir -p "${dir}"
+
+    gen_source "${dir}/bench.c" "${units}" 0
+    gen_source "${dir}/patched.c" "${units}" "${CHANGED}"
+    echo "int main(void) { return 0; }" > "${dir}/main.c"
+
+    # Both objects have to be built from the same file name
+    ${CC} ${cflags} -c -o "${dir}/original.o" "${dir}/bench.c"
+    cp "${dir}/patched.c" "${dir}/bench.c"
+    ${CC} ${cflags} -c -o "${dir}/patched.o" "${dir}/bench.c"
+    gen_source "${dir}/bench.c" "${units}" 0
+    ${CC} -g -o "${dir}/running" "${dir}/main.c" "${dir}/original.o"
+}
+
+# Fetch a field of a pass from the stats line
+stats_field() {
+    sed -n "s/^UPATCH_DIFF_STATS .*\"$2\":{\"time_us\":\([0-9]*\),\"peak_rss_kb\":\([0-9]*\)}.*/\\$3/p" "$1"
+}
+
+median() {
+    sort -n "$1" | awk '{ v[NR] = $1 } END { print (NR == 0) ? 0 : v[int((NR + 1) / 2)] }'
+}
+
+maximum() {
+    sort -n "$1" | tail -n 1
+}
+
+run_corpus() {
+    local size="$1"
+    local dir="${WORK_DIR}/${size}-${CHANGED}"
+    local result_dir="${dir}/result"
+
+    rm -rf "${result_dir}"
+    mkdir -p "${result_dir}"
+    for ((round = 0; round < ROUNDS; round++)); do
+        local log="${result_dir}/round-${round}.log"
+
+        "${UPATCH_DIFF}" --stats \
+            -s "${dir}/original.o" \
+            -p "${dir}/patched.o" \
+            -r "${dir}/running" \
+            -o "${dir}/output.o" > "${log}" 2>&1 || {
+            echo "Failed to diff objects of size ${size}, see ${log}" >&2
+            exit 1
+        }
+        for pass in ${PASSES}; do
+            stats_field "${log}" "${pass}" 1 >> "${result_dir}/${pass}.time"
+            stats_field "${log}" "${pass}" 2 >> "${result_dir}/${pass}.rss"
+        done
+    done
+}
+
+report() {
+    local version
+    version="$("${UPATCH_DIFF}" --version 2>/dev/null | head -n 1 | awk '{print $2}')"
+
+    if [ -n "${OUTPUT}" ] && [ ! -s "${OUTPUT}" ]; then
+        echo "version,sections,changed,rounds,pass,time_us,peak_rss_kb" > "${OUTPUT}"
+    fi
+
+    printf "%-10s %-10s %12s %12s\n" "sections" "pass" "time_us" "peak_rss_kb"
+    for size in ${SIZES}; do
+        local result_dir="${WORK_DIR}/${size}-${CHANGED}/result"
+        for pass in ${PASSES}; do
+            if [ ! -s "${result_dir}/${pass}.time" ]; then
+                continue
+            fi
+            local time_us rss_kb
+            time_us="$(median "${result_dir}/${pass}.time")"
+            rss_kb="$(maximum "${result_dir}/${pass}.rss")"
+            printf "%-10s %-10s %12s %12s\n" "${size}" "${pass}" "${time_us}" "${rss_kb}"
+            if [ -n "${OUTPUT}" ]; then
+                echo "${version},${size},${CHANGED},${ROUNDS},${pass},${time_us},${rss_kb}" >> "${OUTPUT}"
+            fi
+        done
+    done
+    echo "(median time of ${ROUNDS} round(s), peak rss is the high water mark at the end of pass)"
+}
+
+mkdir -p "${WORK_DIR}"
+for size in ${SIZES}; do
+    gen_corpus "${size}"
+    run_corpus "${size}"
+done
+
+report
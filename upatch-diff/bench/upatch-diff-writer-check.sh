@@ -0,0 +1,153 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# upatch-diff output writer check
+#
+# Native 64-bit objects are written directly, others through libelf. Each
+# generated (original, patched, running elf) triple is diffed twice, once
+# with '--libelf-write', then both output objects have to match byte for
+# byte. Objects of SHN_LORESERVE sections or more are not generated, as
+# only the direct writer sets e_shstrndx of them right.
+
+set -e
+
+WORK_DIR="$(pwd)/upatch-diff-writer-check"
+UPATCH_DIFF="upatch-diff"
+CC="${CC:-gcc}"
+CXX="${CXX:-g++}"
+LARGE_UNITS=3000
+
+usage() {
+    cat <<EOF
+Usage: $(basename "$0") [options]
+
+Options:
+  --work-dir <dir>      Directory of generated files [default: ${WORK_DIR}]
+  --upatch-diff <bin>   Path of upatch-diff [default: ${UPATCH_DIFF}]
+EOF
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    --work-dir) WORK_DIR="$2"; shift ;;
+    --upatch-diff) UPATCH_DIFF="$2"; shift ;;
+    *) usage ;;
+    esac
+    shift
+done
+
+# Each unit is a function & its variable, every tenth function is changed
+gen_c_source() {
+    local file="$1"
+    local units="$2"
+    local factor="$3"
+
+    awk -v units="${units}" -v factor="${factor}" 'BEGIN {
+        for (i = 0; i < units; i++) {
+            printf "int check_var_%d = %d;\n", i, i + 1
+            printf "int check_func_%d(int v) { return v * %d + check_var_%d; }\n", \
+                i, (i % 10) ? 2 : factor, i
+        }
+    }' > "${file}"
+}
+
+# Inline & template functions are in comdat groups of the input objects
+gen_cxx_source() {
+    local file="$1"
+    local factor="$2"
+
+    cat > "${file}" <<EOF
+#include <string>
+template <typename T> T check_scale(T v) { return v * ${factor}; }
+inline int check_inline(int v) { return check_scale(v) + 1; }
+std::string check_name(int v) { return std::to_string(check_inline(v)); }
+int check_func(int v) { return check_scale<long>(v) + check_name(v).size(); }
+EOF
+}
+
+# Builds original.o & patched.o from the same file name, then the running elf
+build_case() {
+    local name="$1"
+    local compiler="$2"
+    local ext="$3"
+    local cflags="$4"
+    local dir="${WORK_DIR}/${name}"
+
+    mkdir -p "${dir}"
+    cp "${dir}/original.${ext}" "${dir}/check.${ext}"
+    ${compiler} ${cflags} -c -o "${dir}/original.o" "${dir}/check.${ext}"
+    cp "${dir}/patched.${ext}" "${dir}/check.${ext}"
+    ${compiler} ${cflags} -c -o "${dir}/patched.o" "${dir}/check.${ext}"
+    echo "int main(void) { return 0; }" > "${dir}/main.c"
+    ${CC} -c -o "${dir}/main.o" "${dir}/main.c"
+    ${compiler} -g -o "${dir}/running" "${dir}/main.o" "${dir}/original.o"
+}
+
+run_case() {
+    local name="$1"
+    local dir="${WORK_DIR}/${name}"
+
+    for writer in direct libelf; do
+        local opts=""
+        if [ "${writer}" = "libelf" ]; then
+            opts="--libelf-write"
+        fi
+        "${UPATCH_DIFF}" ${opts} \
+            -s "${dir}/original.o" \
+            -p "${dir}/patched.o" \
+            -r "${dir}/running" \
+            -o "${dir}/${writer}.o" > "${dir}/${writer}.log" 2>&1 || {
+            echo "Failed to diff objects of '${name}', see ${dir}/${writer}.log" >&2
+            return 1
+        }
+    done
+
+    if ! cmp "${dir}/direct.o" "${dir}/libelf.o"; then
+        echo "FAIL ${name}: output of writers differs" >&2
+        return 1
+    fi
+    echo "PASS ${name}"
+}
+
+rm -rf "${WORK_DIR}"
+mkdir -p "${WORK_DIR}"
+failed=0
+cases=""
+
+gen_c() {
+    local name="$1"
+    local units="$2"
+    local cflags="$3"
+
+    mkdir -p "${WORK_DIR}/${name}"
+    gen_c_source "${WORK_DIR}/${name}/original.c" "${units}" 2
+    gen_c_source "${WORK_DIR}/${name}/patched.c" "${units}" 3
+    build_case "${name}" "${CC}" c "${cflags}"
+    cases="${cases} ${name}"
+}
+
+CFLAGS_BASE="-g -O2 -fPIC -ffunction-sections -fdata-sections"
+
+gen_c plain 100 "${CFLAGS_BASE}"
+gen_c large "${LARGE_UNITS}" "${CFLAGS_BASE}"
+if echo "int v;" | ${CC} -gz -x c -c -o /dev/null - 2>/dev/null; then
+    gen_c compressed 100 "${CFLAGS_BASE} -gz"
+else
+    echo "SKIP compressed: ${CC} does not support -gz"
+fi
+if command -v "${CXX}" > /dev/null; then
+    mkdir -p "${WORK_DIR}/cxx"
+    gen_cxx_source "${WORK_DIR}/cxx/original.cpp" 2
+    gen_cxx_source "${WORK_DIR}/cxx/patched.cpp" 3
+    build_case cxx "${CXX}" cpp "${CFLAGS_BASE}"
+    cases="${cases} cxx"
+else
+    echo "SKIP cxx: ${CXX} is not found"
+fi
+
+for name in ${cases}; do
+    run_case "${name}" || failed=1
+done
+
+exit ${failed}
@@ -0,0 +1,382 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * compare-cache.c
+ *
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "elf-common.h"
+#include "compare-cache.h"
+
+#define CACHE_MAGIC "upatch-diff compare cache"
+#define HASH_SEED 0x2545f4914f6cdd1dUL
+
+struct cache_entry {
+    unsigned long hash;
+    char *name;
+    enum status status;
+    bool valid; /* false if sections of the same name & hash differ */
+};
+
+struct compare_cache {
+    char *path;
+    char *buf;
+    struct cache_entry *entries;
+    size_t nr;
+};
+
+static inline unsigned long hash_mix(unsigned long hash, uint64_t value)
+{
+    hash ^= value * 0x9e3779b97f4a7c15UL;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * 0xc2b2ae3d27d4eb4fUL;
+}
+
+/*
+ * Words are mixed rather than bytes, into four independent lanes, so that
+ * hashing one side keeps up with memcmp() of both sides.
+ */
+static unsigned long hash_bytes(unsigned long hash, const void *buf, size_t size)
+{
+    const unsigned char *p = buf;
+    unsigned long lanes[4] = { hash, hash + 1, hash + 2, hash + 3 };
+    uint64_t words[4], word;
+    int i;
+
+    for (; size >= sizeof(words); p += sizeof(words), size -= sizeof(words)) {
+        memcpy(words, p, sizeof(words));
+        for (i = 0; i < 4; i++)
+            lanes[i] = hash_mix(lanes[i], words[i]);
+    }
+
+    hash = hash_mix(lanes[0], size);
+    for (i = 1; i < 4; i++)
+        hash = hash_mix(hash, lanes[i]);
+    for (; size >= sizeof(word); p += sizeof(word), size -= sizeof(word)) {
+        memcpy(&word, p, sizeof(word));
+        hash = hash_mix(hash, word);
+    }
+    if (size) {
+        word = 0;
+        memcpy(&word, p, size);
+        hash = hash_mix(hash, word);
+    }
+
+    return hash;
+}
+
+static unsigned long hash_string(unsigned long hash, const char *str)
+{
+    return hash_bytes(hash, str, str ? strlen(str) : 0);
+}
+
+unsigned long compare_cache_hash(struct section *sec)
+{
+    struct rela *rela;
+    unsigned long hash = HASH_SEED;
+
+    hash = hash_string(hash, sec->twin ? sec->twin->name : NULL);
+    hash = hash_mix(hash, sec->sh.sh_type);
+    hash = hash_mix(hash, sec->sh.sh_flags);
+    hash = hash_mix(hash, sec->sh.sh_entsize);
+    hash = hash_mix(hash, sec->sh.sh_addralign);
+    hash = hash_mix(hash, sec->sh.sh_size);
+    hash = hash_mix(hash, sec->data->d_size);
+
+    /* symbols are renamed by correlation, names tell what relas refer to */
+    if (is_rela_section(sec)) {
+        list_for_each_entry(rela, &sec->relas, list) {
+            hash = hash_mix(hash, rela->type);
+            hash = hash_mix(hash, rela->offset);
+            hash = hash_mix(hash, (uint64_t)rela->addend);
+            if (rela->string) {
+                hash = hash_string(hash, rela->string);
+                continue;
+            }
+            hash = hash_string(hash, rela->sym->name);
+            hash = hash_string(hash, rela->sym->twin ? rela->sym->twin->name : NULL);
+        }
+        return hash;
+    }
+
+    hash = hash_mix(hash, sec->rela != NULL);
+    if (sec->sh.sh_type != SHT_NOBITS && sec->data->d_buf)
+        hash = hash_bytes(hash, sec->data->d_buf, sec->data->d_size);
+
+    return hash;
+}
+
+/* a text section depends on its relas, since line macro changes are told from them */
+static unsigned long section_key(struct section *sec)
+{
+    if (is_rela_section(sec) || !sec->rela || !sec->rela->twin)
+        return sec->hash;
+
+    return hash_mix(sec->hash, sec->rela->hash);
+}
+
+static int compare_entry(const void *a, const void *b)
+{
+    const struct cache_entry *entry1 = a, *entry2 = b;
+
+    if (entry1->hash != entry2->hash)
+        return (entry1->hash < entry2->hash) ? -1 : 1;
+
+    return strcmp(entry1->name, entry2->name);
+}
+
+/* the cache belongs to the content of the source object, wherever it is */
+static bool hash_file(const char *file, unsigned long *hash)
+{
+    struct stat st;
+    void *buf;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1)
+        return false;
+    if (fstat(fd, &st) || !st.st_size) {
+        close(fd);
+        return false;
+    }
+
+    buf = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return false;
+
+    *hash = hash_bytes(HASH_SEED, buf, (size_t)st.st_size);
+    munmap(buf, (size_t)st.st_size);
+
+    return true;
+}
+
+/* cached status is only known to this build & running binary */
+static char *cache_header(void)
+{
+    char *header;
+
+    if (asprintf(&header, "%s %s %s\n", CACHE_MAGIC, BUILD_VERSION,
+        basename(upatch_elf_name)) == -1)
+        ERROR("malloc");
+
+    return header;
+}
+
+/* names of entries point into the file content, which is kept with the cache */
+static void read_entries(struct compare_cache *cache, char *buf)
+{
+    char *header = cache_header(), *line, *next, *end;
+    size_t cap = 0, i;
+    unsigned long hash;
+    char status;
+
+    line = buf;
+    if (strncmp(line, header, strlen(header)))
+        goto out;
+    line += strlen(header);
+
+    for (; *line; line = next) {
+        next = strchr(line, '\n');
+        if (!next)
+            goto invalid;
+        *next++ = '\0';
+
+        /* "<hash> <S|C> <name>" */
+        hash = strtoul(line, &end, 16);
+        if (end == line || end[0] != ' ' || (end[1] != 'S' && end[1] != 'C') ||
+            end[2] != ' ')
+            goto invalid;
+        status = end[1];
+
+        if (cache->nr == cap) {
+            cap = cap ? cap * 2 : 1024;
+            cache->entries = realloc(cache->entries, cap * sizeof(*cache->entries));
+            if (!cache->entries)
+                ERROR("realloc");
+        }
+        cache->entries[cache->nr].hash = hash;
+        cache->entries[cache->nr].name = end + 3;
+        cache->entries[cache->nr].status = (status == 'S') ? SAME : CHANGED;
+        cache->entries[cache->nr].valid = true;
+        cache->nr++;
+    }
+
+    qsort(cache->entries, cache->nr, sizeof(*cache->entries), compare_entry);
+    for (i = 1; i < cache->nr; i++) {
+        if (compare_entry(&cache->entries[i - 1], &cache->entries[i]) ||
+            cache->entries[i - 1].status == cache->entries[i].status)
+            continue;
+        cache->entries[i - 1].valid = false;
+        cache->entries[i].valid = false;
+    }
+    goto out;
+
+invalid:
+    cache->nr = 0;
+out:
+    free(header);
+}
+
+static char *read_file(const char *path)
+{
+    struct stat st;
+    char *buf;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return NULL;
+    }
+
+    buf = malloc((size_t)st.st_size + 1);
+    if (!buf)
+        ERROR("malloc");
+    if (read(fd, buf, (size_t)st.st_size) != st.st_size) {
+        free(buf);
+        buf = NULL;
+    } else {
+        buf[st.st_size] = '\0';
+    }
+    close(fd);
+
+    return buf;
+}
+
+struct compare_cache *compare_cache_load(const char *dir, const char *source_obj)
+{
+    struct compare_cache *cache;
+    unsigned long source_hash;
+
+    if (!dir)
+        return NULL;
+
+    if (!hash_file(source_obj, &source_hash)) {
+        log_warn("Failed to hash %s, compare cache is skipped\n", source_obj);
+        return NULL;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache || asprintf(&cache->path, "%s/%016lx.cache", dir, source_hash) == -1)
+        ERROR("malloc");
+
+    cache->buf = read_file(cache->path);
+    if (!cache->buf)
+        return cache;
+
+    read_entries(cache, cache->buf);
+
+    log_debug("loaded %zu sections from compare cache %s\n", cache->nr, cache->path);
+    return cache;
+}
+
+bool compare_cache_lookup(struct compare_cache *cache, struct section *sec,
+    enum status *status)
+{
+    struct cache_entry key = { .hash = section_key(sec), .name = sec->name };
+    struct cache_entry *entry;
+
+    if (!cache || !cache->nr)
+        return false;
+
+    entry = bsearch(&key, cache->entries, cache->nr, sizeof(*cache->entries),
+        compare_entry);
+    if (!entry || !entry->valid)
+        return false;
+
+    *status = entry->status;
+    return true;
+}
+
+void compare_cache_save(struct compare_cache *cache, struct upatch_elf *uelf)
+{
+    struct section *sec;
+    char *temp_path, *header;
+    size_t nr = 0, hits = 0;
+    FILE *file;
+
+    if (!cache)
+        return;
+
+    /* nothing moved, the cache file is up to date */
+    list_for_each_entry(sec, &uelf->sections, list) {
+        if (!sec->twin || sec->status == NEW)
+            continue;
+        nr++;
+        hits += sec->cached;
+    }
+    if (nr == hits && nr == cache->nr)
+        return;
+
+    if (asprintf(&temp_path, "%s.%d", cache->path, getpid()) == -1)
+        ERROR("malloc");
+
+    file = fopen(temp_path, "w");
+    if (!file) {
+        log_warn("Failed to create compare cache %s with errno = %d\n",
+            temp_path, errno);
+        free(temp_path);
+        return;
+    }
+
+    header = cache_header();
+    fputs(header, file);
+    free(header);
+    list_for_each_entry(sec, &uelf->sections, list) {
+        if (!sec->twin || sec->status == NEW)
+            continue;
+        fprintf(file, "%016lx %c %s\n", section_key(sec),
+            (sec->status == SAME) ? 'S' : 'C', sec->name);
+    }
+
+    /* an interrupted write leaves the previous cache */
+    if (fclose(file) || rename(temp_path, cache->path)) {
+        log_warn("Failed to write compare cache %s with errno = %d\n",
+            cache->path, errno);
+        unlink(temp_path);
+    }
+    free(temp_path);
+}
+
+void compare_cache_free(struct compare_cache *cache)
+{
+    if (!cache)
+        return;
+
+    free(cache->entries);
+    free(cache->buf);
+    free(cache->path);
+    free(cache);
+}
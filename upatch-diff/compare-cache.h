@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * compare-cache.h
+ *
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+#ifndef __UPATCH_COMPARE_CACHE_H_
+#define __UPATCH_COMPARE_CACHE_H_
+
+#include <stdbool.h>
+
+#include "upatch-elf.h"
+
+/*
+ * Compare result of the previous diff of a source object, which is the
+ * hash & status of each correlated section of the patched object.
+ *
+ * While the source object stays the same, a patched section hashing to
+ * the same value as before compares to the same status, thus only the
+ * sections whose hashes moved are compared again.
+ */
+struct compare_cache;
+
+/* Returns NULL if dir is NULL, a missing or stale cache file is empty */
+struct compare_cache *compare_cache_load(const char *dir, const char *source_obj);
+
+/* Hash what comparing a correlated section looks at, patched side only */
+unsigned long compare_cache_hash(struct section *);
+
+/* Status of the section with the same name & hash, false if unknown */
+bool compare_cache_lookup(struct compare_cache *, struct section *, enum status *);
+
+/* Replace the cache file by status of correlated sections of the patched object */
+void compare_cache_save(struct compare_cache *, struct upatch_elf *);
+
+void compare_cache_free(struct compare_cache *);
+
+#endif /* __UPATCH_COMPARE_CACHE_H_ */
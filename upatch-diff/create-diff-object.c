@@ -47,8 +47,11 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "log.h"
+#include "diff-stats.h"
+#include "compare-cache.h"
 #include "elf-debug.h"
 #include "elf-common.h"
 #include "elf-insn.h"
@@ -66,12 +69,27 @@ enum loglevel loglevel = NORMAL;
 char *logprefix;
 char *upatch_elf_name;
 
+static char *compare_cache_dir;
+
 struct arguments {
     char *source_obj;
     char *patched_obj;
     char *running_elf;
     char *output_obj;
+    char *manifest;
+    char *compare_cache;
+    long jobs;
     bool debug;
+    bool stats;
+    bool libelf_write;
+};
+
+/* One line of the manifest: source, patched & output object */
+struct diff_task {
+    char *source_obj;
+    char *patched_obj;
+    char *output_obj;
+    int status;
 };
 
 static struct argp_option options[] = {
@@ -80,13 +98,23 @@ static struct argp_option options[] = {
     {"patched", 'p', "patched", 0, "Patched object"},
     {"running", 'r', "running", 0, "Running binary file"},
     {"output", 'o', "output", 0, "Output object"},
+    {"manifest", 'm', "manifest", 0,
+        "Tab separated source, patched & output objects, one triple per line"},
+    {"jobs", 'j', "jobs", 0, "Number of concurrent objects in manifest mode"},
+    {"compare-cache", 'c', "dir", 0,
+        "Compare only sections changed since the previous diff of each source object"},
+    {"stats", 'S', NULL, 0,
+        "Print time & peak rss of each pass as a json line per object"},
+    {"libelf-write", 'L', NULL, OPTION_HIDDEN,
+        "Write output objects through libelf, as before the direct writer"},
     {NULL}
 };
 
 static char program_doc[] =
     "upatch-build -- generate a patch object based on the source object";
 
-static char args_doc[] = "-s source_obj -p patched_obj -r elf_file -o output_obj";
+static char args_doc[] = "-s source_obj -p patched_obj -r elf_file -o output_obj\n"
+    "-m manifest -r elf_file [-j jobs]";
 
 const char *argp_program_version = PROG_VERSION;
 
@@ -94,10 +122,12 @@ static error_t check_opt(struct argp_state *state)
 {
     struct arguments *arguments = state->input;
 
-    if (arguments->source_obj == NULL ||
+    if (arguments->running_elf == NULL ||
+        (arguments->manifest == NULL &&
+        (arguments->source_obj == NULL ||
         arguments->patched_obj == NULL ||
-        arguments->running_elf == NULL ||
-        arguments->output_obj == NULL) {
+        arguments->output_obj == NULL)) ||
+        arguments->jobs < 0) {
             argp_usage(state);
             return ARGP_ERR_UNKNOWN;
     }
@@ -125,6 +155,21 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         case 'o':
             arguments->output_obj = arg;
             break;
+        case 'm':
+            arguments->manifest = arg;
+            break;
+        case 'j':
+            arguments->jobs = strtol(arg, NULL, 10);
+            break;
+        case 'c':
+            arguments->compare_cache = arg;
+            break;
+        case 'S':
+            arguments->stats = true;
+            break;
+        case 'L':
+            arguments->libelf_write = true;
+            break;
         case ARGP_KEY_ARG:
             break;
         case ARGP_KEY_END:
@@ -148,6 +193,11 @@ static struct argp argp = {options, parse_opt, args_doc, program_doc};
 /* Format of output file is the only export API */
 static void show_program_info(struct arguments *arguments)
 {
+    if (arguments->manifest) {
+        log_debug("manifest: %s\n", arguments->manifest);
+        log_debug("running binary: %s\n", arguments->running_elf);
+        return;
+    }
     log_debug("source object: %s\n", arguments->source_obj);
     log_debug("patched object: %s\n", arguments->patched_obj);
     log_debug("running binary: %s\n", arguments->running_elf);
@@ -415,12 +465,11 @@ static void find_local_syms(struct running_elf *relf, struct symbol *file_sym,
     int i;
     enum LOCAL_MATCH found;
 
-    for (i = 0; i < relf->obj_nr; ++i) {
-        running_sym = &relf->obj_syms[i];
+    for (running_sym = relf_first_local(relf, file_sym->name); running_sym;
+         running_sym = relf_next_local(relf, running_sym)) {
         if (running_sym->type != STT_FILE)
             continue;
-        if (strcmp(file_sym->name, running_sym->name))
-            continue;
+        i = (int)(running_sym - relf->obj_syms);
         found = locals_match(relf, i, file_sym, sym_list);
         if (found == NOT_FOUND) {
             continue;
@@ -844,9 +893,13 @@ static void migrate_included_elements(struct upatch_elf *uelf_patched, struct up
     memset(uelf_out, 0, sizeof(struct upatch_elf));
     uelf_out->arch = uelf_patched->arch;
 
+    /* migrated elements still live in the arena of uelf_patched */
+    arena_init(&uelf_out->arena);
+    arena_move(&uelf_out->arena, &uelf_patched->arena);
+
     INIT_LIST_HEAD(&uelf_out->sections);
     INIT_LIST_HEAD(&uelf_out->symbols);
-    INIT_LIST_HEAD(&uelf_out->strings);
+    strtab_init(&uelf_out->strings, 0);
 
     /* migrate included sections from uelf_patched to uelf_out */
     list_for_each_entry_safe(sec, safesec, &uelf_patched->sections, list) {
@@ -874,33 +927,18 @@ static void migrate_included_elements(struct upatch_elf *uelf_patched, struct up
     }
 }
 
-int main(int argc, char*argv[])
+/* Diff one object pair, the running elf is only read */
+static int create_diff_object(char *source_obj, char *patched_obj,
+    char *output_obj, struct running_elf *relf)
 {
-    struct arguments arguments;
     struct upatch_elf uelf_source, uelf_patched, uelf_out;
-    struct running_elf relf;
-
+    struct compare_cache *cache;
     int num_changed, new_globals_exist;
 
-    memset(&arguments, 0, sizeof(arguments));
-    argp_parse(&argp, argc, argv, 0, NULL, &arguments);
-
-    if (arguments.debug)
-        loglevel = DEBUG;
-    logprefix = basename(arguments.source_obj);
-    show_program_info(&arguments);
-
-    if (elf_version(EV_CURRENT) ==  EV_NONE)
-        ERROR("ELF library initialization failed");
-
-    /* TODO: with debug info, this may changed */
-    upatch_elf_name = arguments.running_elf;
-
     /* check error in log, since errno may be from libelf */
-    upatch_elf_open(&uelf_source, arguments.source_obj);
-    upatch_elf_open(&uelf_patched, arguments.patched_obj);
-
-    relf_init(arguments.running_elf, &relf);
+    diff_stats_begin(PASS_LOAD);
+    upatch_elf_open(&uelf_source, source_obj);
+    upatch_elf_open(&uelf_patched, patched_obj);
 
     compare_elf_headers(&uelf_source, &uelf_patched);
     check_program_headers(&uelf_source);
@@ -911,8 +949,10 @@ int main(int argc, char*argv[])
 
     detect_child_functions(&uelf_source);
     detect_child_functions(&uelf_patched);
+    diff_stats_end(PASS_LOAD);
 
-    find_file_symbol(&uelf_source, &relf);
+    diff_stats_begin(PASS_CORRELATE);
+    find_file_symbol(&uelf_source, relf);
 
     mark_grouped_sections(&uelf_patched);
 
@@ -921,16 +961,24 @@ int main(int argc, char*argv[])
 
     upatch_correlate_elf(&uelf_source, &uelf_patched);
     upatch_correlate_static_local_variables(&uelf_source, &uelf_patched);
+    diff_stats_end(PASS_CORRELATE);
 
     /* Now, we can only check uelf_patched, all we need is in the twin part */
     /* Also, we choose part of uelf_patched and output new object */
+    diff_stats_begin(PASS_COMPARE);
     mark_ignored_sections(&uelf_patched);
 
+    cache = compare_cache_load(compare_cache_dir, source_obj);
+    upatch_compare_set_cache(cache);
     upatch_compare_correlated_elements(&uelf_patched);
+    upatch_compare_set_cache(NULL);
+    compare_cache_free(cache);
 
     mark_ignored_functions_same(&uelf_patched);
     mark_ignored_sections_same(&uelf_patched);
+    diff_stats_end(PASS_COMPARE);
 
+    diff_stats_begin(PASS_INCLUDE);
     upatch_elf_teardown(&uelf_source);
     upatch_elf_free(&uelf_source);
 
@@ -939,6 +987,8 @@ int main(int argc, char*argv[])
     num_changed = include_changed_functions(&uelf_patched);
     new_globals_exist = include_new_globals(&uelf_patched);
     if (!num_changed && !new_globals_exist) {
+        diff_stats_end(PASS_INCLUDE);
+        diff_stats_report(source_obj);
         log_normal("No functional changes\n");
         return 0;
     }
@@ -954,7 +1004,9 @@ int main(int argc, char*argv[])
     verify_patchability(&uelf_patched);
 
     include_special_local_section(&uelf_patched);
+    diff_stats_end(PASS_INCLUDE);
 
+    diff_stats_begin(PASS_CREATE);
     migrate_included_elements(&uelf_patched, &uelf_out);
 
     /* since out elf still point to it, we only destroy it, not free it */
@@ -962,9 +1014,9 @@ int main(int argc, char*argv[])
 
     upatch_create_strings_elements(&uelf_out);
 
-    upatch_create_patches_sections(&uelf_out, &relf);
+    upatch_create_patches_sections(&uelf_out, relf);
 
-    upatch_create_intermediate_sections(&uelf_out, &relf);
+    upatch_create_intermediate_sections(&uelf_out, relf);
 
     create_kpatch_arch_section(&uelf_out);
 
@@ -990,19 +1042,204 @@ int main(int argc, char*argv[])
 
     upatch_create_strtab(&uelf_out);
 
-    upatch_partly_resolve(&uelf_out, &relf);
+    upatch_partly_resolve(&uelf_out, relf);
 
     upatch_create_symtab(&uelf_out);
 
     upatch_dump_kelf(&uelf_out);
+    diff_stats_end(PASS_CREATE);
 
-    upatch_write_output_elf(&uelf_out, uelf_patched.elf, arguments.output_obj, 0664);
+    diff_stats_begin(PASS_WRITE);
+    upatch_write_output_elf(&uelf_out, uelf_patched.elf, output_obj, 0664);
+    diff_stats_end(PASS_WRITE);
 
-    relf_destroy(&relf);
     upatch_elf_free(&uelf_patched);
     upatch_elf_teardown(&uelf_out);
     upatch_elf_free(&uelf_out);
 
+    diff_stats_report(source_obj);
     log_normal("Done\n");
     return 0;
 }
+
+static struct diff_task *read_manifest(const char *manifest, int *task_nr)
+{
+    FILE *file;
+    char *line = NULL;
+    size_t len = 0;
+    struct diff_task *tasks = NULL;
+    int nr = 0, cap = 0;
+
+    file = fopen(manifest, "r");
+    if (!file)
+        ERROR("fopen manifest with errno = %d", errno);
+
+    while (getline(&line, &len, file) != -1) {
+        char *save = NULL;
+        char *source = strtok_r(line, "\t\n", &save);
+        char *patched = strtok_r(NULL, "\t\n", &save);
+        char *output = strtok_r(NULL, "\t\n", &save);
+
+        if (!source)
+            continue;
+        if (!patched || !output)
+            ERROR("invalid manifest line %d", nr + 1);
+
+        if (nr == cap) {
+            cap = cap ? cap * 2 : 64;
+            tasks = realloc(tasks, cap * sizeof(*tasks));
+            if (!tasks)
+                ERROR("realloc");
+        }
+        tasks[nr].source_obj = strdup(source);
+        tasks[nr].patched_obj = strdup(patched);
+        tasks[nr].output_obj = strdup(output);
+        if (!tasks[nr].source_obj || !tasks[nr].patched_obj ||
+            !tasks[nr].output_obj)
+            ERROR("strdup");
+        tasks[nr].status = EXIT_STATUS_SUCCESS;
+        nr++;
+    }
+
+    free(line);
+    fclose(file);
+
+    *task_nr = nr;
+    return tasks;
+}
+
+static void wait_task(struct diff_task *tasks, pid_t *pids, int task_nr)
+{
+    int i, status;
+    pid_t pid;
+
+    do {
+        pid = wait(&status);
+    } while (pid == -1 && errno == EINTR);
+    if (pid == -1)
+        ERROR("wait with errno = %d", errno);
+
+    for (i = 0; i < task_nr; i++) {
+        if (pids[i] != pid)
+            continue;
+        pids[i] = 0;
+        if (WIFEXITED(status))
+            tasks[i].status = WEXITSTATUS(status);
+        else
+            tasks[i].status = EXIT_STATUS_ERROR;
+        break;
+    }
+}
+
+static long online_cpus(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (cpus > 0) ? cpus : 1;
+}
+
+/*
+ * Each object is diffed in a forked child. The children share the parsed
+ * running elf, and an error exits only the child which hits it.
+ */
+static int run_manifest(struct arguments *arguments, struct running_elf *relf)
+{
+    struct diff_task *tasks;
+    pid_t *pids;
+    int task_nr, running = 0, ret = EXIT_STATUS_SUCCESS;
+    int i;
+    long jobs = arguments->jobs;
+
+    tasks = read_manifest(arguments->manifest, &task_nr);
+    if (jobs <= 0)
+        jobs = online_cpus();
+
+    /* cpus left by concurrent children compare sections of each object */
+    upatch_compare_set_threads(online_cpus() /
+        ((task_nr > 0 && task_nr < jobs) ? task_nr : jobs));
+
+    pids = calloc(task_nr ? task_nr : 1, sizeof(pid_t));
+    if (!pids)
+        ERROR("calloc");
+
+    /* children inherit buffered output otherwise */
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < task_nr; i++) {
+        if (running >= jobs) {
+            wait_task(tasks, pids, task_nr);
+            running--;
+        }
+
+        pids[i] = fork();
+        if (pids[i] == -1)
+            ERROR("fork with errno = %d", errno);
+        if (pids[i] == 0) {
+            logprefix = basename(tasks[i].source_obj);
+            exit(create_diff_object(tasks[i].source_obj,
+                tasks[i].patched_obj, tasks[i].output_obj, relf));
+        }
+        running++;
+    }
+
+    while (running > 0) {
+        wait_task(tasks, pids, task_nr);
+        running--;
+    }
+
+    /* report the first failed object, in manifest order */
+    for (i = 0; i < task_nr; i++) {
+        if (tasks[i].status != EXIT_STATUS_SUCCESS) {
+            log_warn("Failed to create diff object for %s, status=%d\n",
+                tasks[i].source_obj, tasks[i].status);
+            if (ret == EXIT_STATUS_SUCCESS)
+                ret = tasks[i].status;
+        }
+        free(tasks[i].source_obj);
+        free(tasks[i].patched_obj);
+        free(tasks[i].output_obj);
+    }
+
+    free(pids);
+    free(tasks);
+    return ret;
+}
+
+int main(int argc, char*argv[])
+{
+    struct arguments arguments;
+    struct running_elf relf;
+    int ret;
+
+    memset(&arguments, 0, sizeof(arguments));
+    argp_parse(&argp, argc, argv, 0, NULL, &arguments);
+
+    if (arguments.debug)
+        loglevel = DEBUG;
+    diff_stats_set_enabled(arguments.stats);
+    upatch_write_set_libelf(arguments.libelf_write);
+    logprefix = basename(arguments.manifest ? arguments.running_elf :
+        arguments.source_obj);
+    show_program_info(&arguments);
+
+    if (elf_version(EV_CURRENT) ==  EV_NONE)
+        ERROR("ELF library initialization failed");
+
+    /* TODO: with debug info, this may changed */
+    upatch_elf_name = arguments.running_elf;
+    compare_cache_dir = arguments.compare_cache;
+
+    relf_init(arguments.running_elf, &relf);
+
+    if (arguments.manifest) {
+        ret = run_manifest(&arguments, &relf);
+    } else {
+        upatch_compare_set_threads(online_cpus());
+        ret = create_diff_object(arguments.source_obj,
+            arguments.patched_obj, arguments.output_obj, &relf);
+    }
+
+    relf_destroy(&relf);
+    return ret;
+}
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * diff-stats.c
+ *
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "diff-stats.h"
+
+struct pass_stats {
+    struct timespec begin;
+    long time_us;
+    long peak_rss_kb;
+    bool done;
+};
+
+static const char *pass_names[PASS_NUM] = {
+    [PASS_LOAD] = "load",
+    [PASS_CORRELATE] = "correlate",
+    [PASS_COMPARE] = "compare",
+    [PASS_INCLUDE] = "include",
+    [PASS_CREATE] = "create",
+    [PASS_WRITE] = "write",
+};
+
+static bool stats_enabled;
+static struct pass_stats stats[PASS_NUM];
+
+void diff_stats_set_enabled(bool enabled)
+{
+    stats_enabled = enabled;
+}
+
+void diff_stats_begin(enum diff_pass pass)
+{
+    if (!stats_enabled)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &stats[pass].begin);
+}
+
+void diff_stats_end(enum diff_pass pass)
+{
+    struct pass_stats *stat = &stats[pass];
+    struct timespec end;
+    struct rusage usage;
+
+    if (!stats_enabled)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stat->time_us = (end.tv_sec - stat->begin.tv_sec) * 1000000L +
+        (end.tv_nsec - stat->begin.tv_nsec) / 1000L;
+
+    /* ru_maxrss never decreases, it is the peak till the end of pass */
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        stat->peak_rss_kb = usage.ru_maxrss;
+    stat->done = true;
+}
+
+void diff_stats_report(const char *object)
+{
+    bool first = true;
+    int i;
+
+    if (!stats_enabled)
+        return;
+
+    printf("%s {\"object\":\"%s\",\"passes\":{", DIFF_STATS_PREFIX, object);
+    for (i = 0; i < PASS_NUM; i++) {
+        if (!stats[i].done)
+            continue;
+        printf("%s\"%s\":{\"time_us\":%ld,\"peak_rss_kb\":%ld}",
+            first ? "" : ",", pass_names[i],
+            stats[i].time_us, stats[i].peak_rss_kb);
+        first = false;
+    }
+    printf("}}\n");
+    fflush(stdout);
+
+    memset(stats, 0, sizeof(stats));
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * diff-stats.h
+ *
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+#ifndef __UPATCH_DIFF_STATS_H_
+#define __UPATCH_DIFF_STATS_H_
+
+#include <stdbool.h>
+
+#define DIFF_STATS_PREFIX "UPATCH_DIFF_STATS"
+
+/* Passes of create_diff_object, in pipeline order */
+enum diff_pass {
+    PASS_LOAD,
+    PASS_CORRELATE,
+    PASS_COMPARE,
+    PASS_INCLUDE,
+    PASS_CREATE,
+    PASS_WRITE,
+    PASS_NUM,
+};
+
+void diff_stats_set_enabled(bool);
+
+void diff_stats_begin(enum diff_pass);
+
+void diff_stats_end(enum diff_pass);
+
+/*
+ * Print time (us) & peak rss (kB, high water mark at the end) of each
+ * finished pass as a json line.
+ */
+void diff_stats_report(const char *);
+
+#endif /* __UPATCH_DIFF_STATS_H_ */
@@ -80,22 +80,6 @@ bool is_normal_static_local(struct symbol *sym)
 	return true;
 }
 
-int offset_of_string(struct list_head *list, char *name)
-{
-	struct string *string;
-	int index = 0;
-
-	list_for_each_entry(string, list, list) {
-		if (!strcmp(string->name, name))
-			return index;
-		index += (int)strlen(string->name) + 1;
-	}
-
-	ALLOC_LINK(string, list);
-	string->name = name;
-	return index;
-}
-
 // no need for X86
 bool is_gcc6_localentry_bundled_sym(struct upatch_elf *uelf, struct symbol *sym)
 {
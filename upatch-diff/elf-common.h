@@ -45,6 +45,15 @@
 		list_add_tail(&(_new)->list, (_list)); \
 }
 
+/* same as ALLOC_LINK, but the node is released with its arena */
+#define ARENA_ALLOC_LINK(_arena, _new, _list) \
+{ \
+	(_new) = arena_alloc((_arena), sizeof(*(_new))); \
+	INIT_LIST_HEAD(&(_new)->list); \
+	if (_list) \
+		list_add_tail(&(_new)->list, (_list)); \
+}
+
 static inline bool is_rela_section(struct section *sec)
 {
     /*
@@ -208,7 +217,6 @@ static inline char *status_str(enum status status)
 	return NULL;
 }
 
-int offset_of_string(struct list_head *, char *);
 
 static inline unsigned int absolute_rela_type(struct upatch_elf *uelf)
 {
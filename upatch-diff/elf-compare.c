@@ -23,11 +23,14 @@
  */
 
 #include <libgen.h>
+#include <pthread.h>
+#include <stdlib.h>
 
 #include "log.h"
 #include "elf-common.h"
 #include "elf-compare.h"
 #include "elf-insn.h"
+#include "compare-cache.h"
 
 static void compare_correlated_symbol(struct symbol *sym, struct symbol *symtwin)
 {
@@ -68,16 +71,9 @@ void upatch_compare_symbols(struct upatch_elf *uelf)
 	}
 }
 
-static bool rela_equal(struct rela *rela1, struct rela *rela2)
+/* compare what relas refer to, their type & offset are known to be equal */
+static bool rela_target_equal(struct rela *rela1, struct rela *rela2)
 {
-    if (rela1->type != rela2->type ||
-        rela1->offset != rela2->offset)
-        return false;
-
-    /* TODO: handle altinstr_aux */
-
-    /* TODO: handle rela for toc section */
-
 	if (rela1->string)
 		return rela2->string && !strcmp(rela1->string, rela2->string);
 
@@ -86,17 +82,45 @@ static bool rela_equal(struct rela *rela1, struct rela *rela2)
 		return false;
     }
 
+	/* correlated symbols are renamed to the same name */
+	if (rela1->sym->twin == rela2->sym)
+		return true;
+
     return !mangled_strcmp(rela1->sym->name, rela2->sym->name);
 }
 
+static bool rela_equal(struct rela *rela1, struct rela *rela2)
+{
+    if (rela1->type != rela2->type ||
+        rela1->offset != rela2->offset)
+        return false;
+
+    /* TODO: handle altinstr_aux */
+
+    /* TODO: handle rela for toc section */
+
+	return rela_target_equal(rela1, rela2);
+}
+
 static void compare_correlated_rela_section(struct section *relasec, struct section *relasec_twin)
 {
 	struct rela *rela1, *rela2 = NULL;
+	bool (*equal)(struct rela *, struct rela *) = rela_equal;
+
+	/*
+	 * Most sections are unchanged, their raw relas are identical, thus only
+	 * what relas refer to is left to compare. Otherwise the symbol indexes
+	 * may be just renumbered, relas are compared field by field.
+	 */
+	if (relasec->data->d_size == relasec_twin->data->d_size &&
+	    !memcmp(relasec->data->d_buf, relasec_twin->data->d_buf,
+		    relasec->data->d_size))
+		equal = rela_target_equal;
 
     /* check relocation item one by one, order matters */
 	rela2 = list_entry(relasec_twin->relas.next, struct rela, list);
 	list_for_each_entry(rela1, &relasec->relas, list) {
-		if (rela_equal(rela1, rela2)) {
+		if (equal(rela1, rela2)) {
 			rela2 = list_entry(rela2->list.next, struct rela, list);
 			continue;
 		}
@@ -136,6 +160,15 @@ static int compare_correlated_section(struct section *sec, struct section *sectw
 		goto out;
 	}
 
+	/*
+	 * Debug sections are included as a whole anyway, and their status
+	 * is not looked at, thus their data is not read.
+	 */
+	if (is_debug_section(sec)) {
+		sec->status = SAME;
+		goto out;
+	}
+
 	/* As above but for aarch64 */
 	if (!strcmp(sec->name, ".rela__patchable_function_entries") ||
 	    !strcmp(sec->name, "__patchable_function_entries")) {
@@ -183,6 +216,23 @@ bool check_line_func(struct upatch_elf *uelf, const char *symname)
 	return false;
 }
 
+/*
+ * A changed instruction is accepted only in front of a call to a line function,
+ * thus a section calling none of them is not a line-only change, which is told
+ * from its relas without decoding any instruction.
+ */
+static bool has_line_func_rela(struct upatch_elf *uelf, struct section *sec)
+{
+	struct rela *rela;
+
+	list_for_each_entry(rela, &sec->rela->relas, list) {
+		if (!rela->string && check_line_func(uelf, rela->sym->name))
+			return true;
+	}
+
+	return false;
+}
+
 /* Determine if a section has changed only due to a __LINE__ bumber change.
  * For example, a WARN() or might_sleep() macro's embedding of the line number into an
  * instruction operand.
@@ -199,7 +249,8 @@ static bool _line_macro_change_only(struct upatch_elf *uelf, struct section *sec
 		!is_text_section(sec) ||
 		sec->sh.sh_size != sec->twin->sh.sh_size ||
 		!sec->rela ||
-		sec->rela->status != SAME)
+		sec->rela->status != SAME ||
+		!has_line_func_rela(uelf, sec))
 		return false;
 
 	data1 = sec->twin->data->d_buf;
@@ -208,20 +259,23 @@ static bool _line_macro_change_only(struct upatch_elf *uelf, struct section *sec
 		insn1 = data1 + offset;
 		insn2 = data2 + offset;
 
-		insn1_len = insn_length(uelf, insn1);
-		insn2_len = insn_length(uelf, insn2);
+		insn1_len = insn_length(uelf, sec->twin, offset);
+		if (!insn1_len)
+			ERROR("decode instruction in section %s at offset 0x%lx failed",
+				sec->name, offset);
+
+		/* if insn are same, continue, the twin decodes to the same length */
+		if (!memcmp(insn1, insn2, insn1_len))
+			continue;
 
-		if (!insn1_len || !insn2_len)
+		insn2_len = insn_length(uelf, sec, offset);
+		if (!insn2_len)
 			ERROR("decode instruction in section %s at offset 0x%lx failed",
 				sec->name, offset);
 
 		if (insn1_len != insn2_len)
 			return false;
 
-		/* if insn are same, continue*/
-		if (!memcmp(insn1, insn2, insn1_len))
-			continue;
-
 		log_debug("check list for %s at 0x%lx \n", sec->name, offset);
 
 		/*
@@ -234,8 +288,8 @@ static bool _line_macro_change_only(struct upatch_elf *uelf, struct section *sec
 		 * 2) the instructions are followed by certain expected relocations.
 		 *    (white-list)
 		 */
-		if (!insn_is_load_immediate(uelf, insn1) ||
-			!insn_is_load_immediate(uelf, insn2))
+		if (!insn_is_load_immediate(uelf, sec->twin, offset) ||
+			!insn_is_load_immediate(uelf, sec, offset))
 			return false;
 
 		found = false;
@@ -274,14 +328,15 @@ static bool _line_macro_change_only_aarch64(struct upatch_elf *uelf, struct sect
 	struct rela *rela;
 	bool found_any = false, found;
 	unsigned int mov_imm_mask = ((1<<16) - 1)<<5;
-	unsigned long insn_len = insn_length(uelf, NULL);
+	unsigned long insn_len = insn_length(uelf, sec, 0);
 
 	if (sec->status != CHANGED ||
 	    is_rela_section(sec) ||
 	    !is_text_section(sec) ||
 	    sec->sh.sh_size != sec->twin->sh.sh_size ||
 	    !sec->rela ||
-	    sec->rela->status != SAME)
+	    sec->rela->status != SAME ||
+	    !has_line_func_rela(uelf, sec))
 		return false;
 
 	start1 = (unsigned long)sec->twin->data->d_buf;
@@ -336,26 +391,139 @@ static bool line_macro_change_only(struct upatch_elf *uelf, struct section *sec)
 	return false;
 }
 
+/* sections are taken by threads in chunks, a chunk is not worth a thread */
+#define COMPARE_CHUNK_SIZE 64
+
+static long compare_threads = 1;
+static struct compare_cache *compare_cache;
+
+void upatch_compare_set_threads(long threads)
+{
+	compare_threads = (threads > 0) ? threads : 1;
+}
+
+void upatch_compare_set_cache(struct compare_cache *cache)
+{
+	compare_cache = cache;
+}
+
+struct compare_work {
+	struct upatch_elf *uelf;
+	struct section **secs;
+	unsigned long nr;
+	unsigned long next; /* first section of the next chunk, taken atomically */
+	void (*fn)(struct upatch_elf *, struct section *);
+};
+
+static void *compare_worker(void *arg)
+{
+	struct compare_work *work = arg;
+	unsigned long start, end, i;
+
+	while ((start = __atomic_fetch_add(&work->next, COMPARE_CHUNK_SIZE,
+			__ATOMIC_RELAXED)) < work->nr) {
+		end = start + COMPARE_CHUNK_SIZE;
+		if (end > work->nr)
+			end = work->nr;
+		for (i = start; i < end; i++)
+			work->fn(work->uelf, work->secs[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Call fn on every section, which may only write status of its own section.
+ * The calling thread works too, thus a failure to create threads only slows
+ * it down.
+ */
+static void compare_run(struct upatch_elf *uelf, struct section **secs,
+	unsigned long nr, void (*fn)(struct upatch_elf *, struct section *))
+{
+	struct compare_work work = { uelf, secs, nr, 0, fn };
+	unsigned long chunks = (nr + COMPARE_CHUNK_SIZE - 1) / COMPARE_CHUNK_SIZE;
+	long threads = compare_threads;
+	pthread_t *tids = NULL;
+	long i, created = 0;
+
+	if ((unsigned long)threads > chunks)
+		threads = (long)chunks;
+	if (threads > 1)
+		tids = calloc((size_t)threads - 1, sizeof(pthread_t));
+
+	for (i = 0; tids && i < threads - 1; i++) {
+		if (pthread_create(&tids[i], NULL, compare_worker, &work))
+			break;
+		created++;
+	}
+	compare_worker(&work);
+	for (i = 0; i < created; i++)
+		pthread_join(tids[i], NULL);
+
+	free(tids);
+}
+
+static void hash_section(struct upatch_elf *uelf, struct section *sec)
+{
+	(void)uelf;
+
+	if (sec->twin)
+		sec->hash = compare_cache_hash(sec);
+}
+
+static void compare_section(struct upatch_elf *uelf, struct section *sec)
+{
+	(void)uelf;
+
+	if (!sec->twin) {
+		sec->status = NEW;
+		return;
+	}
+
+	/* the cached status is final, line macro changes are reverted already */
+	sec->cached = compare_cache_lookup(compare_cache, sec, &sec->status);
+	if (!sec->cached)
+		compare_correlated_section(sec, sec->twin);
+}
+
+/* exclude WARN-only, might_sleep changes, status of relas must be known */
+static void revert_line_macro_section(struct upatch_elf *uelf, struct section *sec)
+{
+	if (sec->cached)
+		return;
+
+	if (line_macro_change_only(uelf, sec)) {
+		log_debug("reverting macro / line number section %s status to SAME\n", sec->name);
+		sec->status = SAME;
+	}
+}
+
 void upatch_compare_sections(struct upatch_elf *uelf)
 {
 	struct section *sec;
 	struct list_head *seclist = &uelf->sections;
+	struct section **secs;
+	unsigned long nr = 0;
 
-	/* compare all sections */
-	list_for_each_entry(sec, seclist, list) {
-		if (sec->twin)
-			compare_correlated_section(sec, sec->twin);
-		else
-			sec->status = NEW;
-	}
+	list_for_each_entry(sec, seclist, list)
+		nr++;
 
-	/* exclude WARN-only, might_sleep changes */
-	list_for_each_entry(sec, seclist, list) {
-		if (line_macro_change_only(uelf, sec)) {
-			log_debug("reverting macro / line number section %s status to SAME\n", sec->name);
-			sec->status = SAME;
-		}
-	}
+	secs = calloc(nr ? nr : 1, sizeof(struct section *));
+	if (!secs)
+		ERROR("calloc");
+
+	nr = 0;
+	list_for_each_entry(sec, seclist, list)
+		secs[nr++] = sec;
+
+	/* compare all sections, each section is independent */
+	if (compare_cache)
+		compare_run(uelf, secs, nr, hash_section);
+	compare_run(uelf, secs, nr, compare_section);
+	compare_run(uelf, secs, nr, revert_line_macro_section);
+	free(secs);
+
+	compare_cache_save(compare_cache, uelf);
 
 	/* sync symbol status */
 	list_for_each_entry(sec, seclist, list) {
@@ -370,4 +538,4 @@ void upatch_compare_sections(struct upatch_elf *uelf)
                 /* TODO: handle child func */
 		}
 	}
-}
\ No newline at end of file
+}
@@ -31,6 +31,13 @@ void upatch_compare_symbols(struct upatch_elf *);
 
 void upatch_compare_sections(struct upatch_elf *);
 
+/* Threads comparing sections of one object, 1 by default */
+void upatch_compare_set_threads(long);
+
+/* Reuse status of unchanged sections from the cache, none by default */
+struct compare_cache;
+void upatch_compare_set_cache(struct compare_cache *);
+
 static inline void upatch_compare_correlated_elements(struct upatch_elf *uelf)
 {
     upatch_compare_sections(uelf);
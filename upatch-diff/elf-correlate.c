@@ -22,11 +22,97 @@
  * 02110-1301, USA.
  */
 
+#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "elf-common.h"
 #include "elf-correlate.h"
 
+/*
+ * Candidates of correlation, bucketed by mangled name hash.
+ * Each chain keeps the order of the original list, so the first match
+ * found in a chain is the same one a full list walk would find.
+ */
+struct correlate_node {
+	void *item;
+	struct correlate_node *next;
+};
+
+struct correlate_table {
+	size_t nbucket;
+	struct correlate_node **heads;
+	struct correlate_node **tails;
+	struct correlate_node *nodes;
+	size_t num;
+};
+
+/*
+ * Hash a name with every ".<digits>" dropped, names which are equal
+ * according to mangled_strcmp() always have the same hash.
+ */
+static unsigned long mangled_hash(const char *name)
+{
+	unsigned long hash = 5381;
+
+	while (*name) {
+		if (name[0] == '.' && isdigit(name[1])) {
+			name++;
+			while (isdigit(*name))
+				name++;
+			continue;
+		}
+		hash = (hash << 5) + hash + (unsigned char)*name++;
+	}
+
+	return hash;
+}
+
+static void correlate_table_init(struct correlate_table *table, size_t num)
+{
+	table->nbucket = num | 1;
+	table->num = 0;
+	table->heads = calloc(table->nbucket, sizeof(struct correlate_node *));
+	table->tails = calloc(table->nbucket, sizeof(struct correlate_node *));
+	table->nodes = calloc(num + 1, sizeof(struct correlate_node));
+	if (!table->heads || !table->tails || !table->nodes)
+		ERROR("calloc");
+}
+
+static void correlate_table_add(struct correlate_table *table,
+	unsigned long hash, void *item)
+{
+	size_t bucket = hash % table->nbucket;
+	struct correlate_node *node = &table->nodes[table->num++];
+
+	node->item = item;
+	node->next = NULL;
+	if (table->tails[bucket])
+		table->tails[bucket]->next = node;
+	else
+		table->heads[bucket] = node;
+	table->tails[bucket] = node;
+}
+
+static struct correlate_node *correlate_table_find(struct correlate_table *table,
+	unsigned long hash)
+{
+	return table->heads[hash % table->nbucket];
+}
+
+static void correlate_table_destroy(struct correlate_table *table)
+{
+	free(table->heads);
+	free(table->tails);
+	free(table->nodes);
+	memset(table, 0, sizeof(struct correlate_table));
+}
+
+static unsigned long symbol_hash(struct symbol *sym)
+{
+	return mangled_hash(sym->name) * 31 + sym->type;
+}
+
 static void correlate_symbol(struct symbol *sym_orig, struct symbol *sym_patched)
 {
     log_debug("correlate symbol %s <-> %s \n", sym_orig->name, sym_patched->name);
@@ -47,31 +133,43 @@ static void correlate_symbol(struct symbol *sym_orig, struct symbol *sym_patched
 void upatch_correlate_symbols(struct upatch_elf *uelf_source, struct upatch_elf *uelf_patched)
 {
 	struct symbol *sym_orig, *sym_patched;
+	struct correlate_table table;
+	struct correlate_node *node;
+	size_t num = 0;
+
+	list_for_each_entry(sym_patched, &uelf_patched->symbols, list)
+		num++;
+
+	correlate_table_init(&table, num);
+	list_for_each_entry(sym_patched, &uelf_patched->symbols, list)
+		correlate_table_add(&table, symbol_hash(sym_patched), sym_patched);
 
 	list_for_each_entry(sym_orig, &uelf_source->symbols, list) {
 		if (sym_orig->twin)
 			continue;
 
-        /* find matched symbol */
-		list_for_each_entry(sym_patched, &uelf_patched->symbols, list) {
-			if (mangled_strcmp(sym_orig->name, sym_patched->name) ||
-			    sym_orig->type != sym_patched->type || sym_patched->twin)
-				continue;
+		if (is_special_static(sym_orig))
+			continue;
 
-			if (is_special_static(sym_orig))
-				continue;
+		/*
+		 * The .LCx symbols point to string literals in
+		 * '.rodata.<func>.str1.*' sections.  They get included
+		 * in include_standard_elements().
+		 * Clang creates similar .Ltmp%d symbols in .rodata.str
+		 */
+		if (sym_orig->type == STT_NOTYPE &&
+			(!strncmp(sym_orig->name, ".LC", 3) || !strncmp(sym_orig->name, ".Ltmp", 5)))
+			continue;
 
-			/*
-			 * The .LCx symbols point to string literals in
-			 * '.rodata.<func>.str1.*' sections.  They get included
-			 * in include_standard_elements().
-			 * Clang creates similar .Ltmp%d symbols in .rodata.str
-			 */
-			if (sym_orig->type == STT_NOTYPE &&
-				(!strncmp(sym_orig->name, ".LC", 3) || !strncmp(sym_orig->name, ".Ltmp", 5)))
-				continue;
+		if (is_mapping_symbol(uelf_source, sym_orig))
+			continue;
 
-			if (is_mapping_symbol(uelf_source, sym_orig))
+        /* find matched symbol */
+		node = correlate_table_find(&table, symbol_hash(sym_orig));
+		for (; node != NULL; node = node->next) {
+			sym_patched = node->item;
+			if (mangled_strcmp(sym_orig->name, sym_patched->name) ||
+			    sym_orig->type != sym_patched->type || sym_patched->twin)
 				continue;
 
 			/* group section symbols must have correlated sections */
@@ -83,6 +181,8 @@ void upatch_correlate_symbols(struct upatch_elf *uelf_source, struct upatch_elf
 			break;
 		}
 	}
+
+	correlate_table_destroy(&table);
 }
 
 static void __correlate_section(struct section *sec_orig, struct section *sec_patched)
@@ -129,22 +229,34 @@ static void correlate_section(struct section *sec_orig, struct section *sec_patc
 void upatch_correlate_sections(struct upatch_elf *uelf_source, struct upatch_elf *uelf_patched)
 {
 	struct section *sec_orig, *sec_patched;
+	struct correlate_table table;
+	struct correlate_node *node;
+	size_t num = 0;
+
+	list_for_each_entry(sec_patched, &uelf_patched->sections, list)
+		num++;
+
+	correlate_table_init(&table, num);
+	list_for_each_entry(sec_patched, &uelf_patched->sections, list)
+		correlate_table_add(&table, mangled_hash(sec_patched->name), sec_patched);
 
 	list_for_each_entry(sec_orig, &uelf_source->sections, list) {
         /* already found */
 		if (sec_orig->twin)
 			continue;
 
-		list_for_each_entry(sec_patched, &uelf_patched->sections, list) {
+		if (is_special_static(is_rela_section(sec_orig) ?
+				      sec_orig->base->secsym :
+				      sec_orig->secsym))
+			continue;
+
+		node = correlate_table_find(&table, mangled_hash(sec_orig->name));
+		for (; node != NULL; node = node->next) {
+			sec_patched = node->item;
 			if (mangled_strcmp(sec_orig->name, sec_patched->name) ||
 			    sec_patched->twin)
 				continue;
 
-			if (is_special_static(is_rela_section(sec_orig) ?
-					      sec_orig->base->secsym :
-					      sec_orig->secsym))
-				continue;
-
 			/*
 			 * Group sections must match exactly to be correlated.
 			 */
@@ -160,6 +272,8 @@ void upatch_correlate_sections(struct upatch_elf *uelf_source, struct upatch_elf
 			break;
 		}
 	}
+
+	correlate_table_destroy(&table);
 }
 
 /* TODO: need handle .toc section */
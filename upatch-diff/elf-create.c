@@ -22,12 +22,18 @@
  * 02110-1301, USA.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <endian.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "elf-common.h"
 #include "elf-insn.h"
@@ -50,7 +56,7 @@ static struct section *create_section_pair(struct upatch_elf *uelf, char *name,
     strcat(relaname, name);
 
     /* allocate text section resourcce */
-    ALLOC_LINK(sec, &uelf->sections);
+    ARENA_ALLOC_LINK(&uelf->arena, sec, &uelf->sections);
     sec->name = name;
     sec->data = malloc(sizeof(*sec->data));
     if (!sec->data)
@@ -71,7 +77,7 @@ static struct section *create_section_pair(struct upatch_elf *uelf, char *name,
     sec->sh.sh_size = entsize * nr;
 
     /* set relocation section */
-    ALLOC_LINK(relasec, &uelf->sections);
+    ARENA_ALLOC_LINK(&uelf->arena, relasec, &uelf->sections);
     relasec->name = relaname;
     INIT_LIST_HEAD(&relasec->relas);
 
@@ -100,7 +106,7 @@ void upatch_create_strings_elements(struct upatch_elf *uelf)
     struct symbol *sym;
 
     /* create section header */
-    ALLOC_LINK(sec, &uelf->sections);
+    ARENA_ALLOC_LINK(&uelf->arena, sec, &uelf->sections);
     sec->name = ".upatch.strings";
 
     sec->data = malloc(sizeof(*sec->data));
@@ -115,7 +121,7 @@ void upatch_create_strings_elements(struct upatch_elf *uelf)
     sec->sh.sh_flags = SHF_ALLOC;
 
     /* create symbol */
-    ALLOC_LINK(sym, &uelf->symbols);
+    ARENA_ALLOC_LINK(&uelf->arena, sym, &uelf->symbols);
     sym->sec = sec;
     sym->sym.st_info = GELF_ST_INFO(STB_LOCAL, STT_SECTION);
     sym->type = STT_SECTION;
@@ -172,17 +178,18 @@ void upatch_create_patches_sections(struct upatch_elf *uelf, struct running_elf
         log_debug("change func %s from 0x%lx.\n", sym->name, funcs[index].old_addr);
 
         /* Add a rela than will handle funcs[index].new_addr */
-        ALLOC_LINK(rela, &relasec->relas);
+        ARENA_ALLOC_LINK(&uelf->arena, rela, &relasec->relas);
         rela->sym = sym;
         rela->type = absolute_rela_type(uelf);
         rela->addend = 0;
         rela->offset = (unsigned int)(index * sizeof(*funcs));
 
         /* Add a rela than will handle funcs[index].name */
-        ALLOC_LINK(rela, &relasec->relas);
+        ARENA_ALLOC_LINK(&uelf->arena, rela, &relasec->relas);
         rela->sym = strsym;
         rela->type = absolute_rela_type(uelf);
-        rela->addend = offset_of_string(&uelf->strings, sym->name);
+        rela->addend = (long)strtab_offset(&uelf->strings,
+            strtab_add(&uelf->strings, sym->name));
         rela->offset = (unsigned int)(index * sizeof(*funcs) +
             offsetof(struct upatch_patch_func, name));
 
@@ -253,7 +260,7 @@ void upatch_create_intermediate_sections(struct upatch_elf *uelf, struct running
     usym_sec = create_section_pair(uelf, ".upatch.symbols", sizeof(*usyms), nr);
     usyms = usym_sec->data->d_buf;
 
-    ALLOC_LINK(usym_sec_sym, &uelf->symbols);
+    ARENA_ALLOC_LINK(&uelf->arena, usym_sec_sym, &uelf->symbols);
     usym_sec_sym->sec = usym_sec;
     usym_sec_sym->sym.st_info = GELF_ST_INFO(STB_LOCAL, STT_SECTION);
     usym_sec_sym->type = STT_SECTION;
@@ -293,32 +300,15 @@ void upatch_create_intermediate_sections(struct upatch_elf *uelf, struct running
 void upatch_build_strings_section_data(struct upatch_elf *uelf)
 {
     struct section *sec;
-    struct string *string;
     size_t size;
-    char *strtab;
 
     sec = find_section_by_name(&uelf->sections, ".upatch.strings");
     if (!sec)
         ERROR("can't find strings section.");
 
-    size = 0;
-    list_for_each_entry(string, &uelf->strings, list)
-        size += strlen(string->name) + 1;
-
-    /* allocate section resources */
-    strtab = malloc(size);
-    if (!strtab)
-        ERROR("strtab malloc failed.");
-
-    sec->data->d_buf = strtab;
+    /* offsets are taken by relas already, thus tails are not merged */
+    sec->data->d_buf = strtab_finalize(&uelf->strings, &size);
     sec->data->d_size = size;
-
-    /* populate strings section data */
-    list_for_each_entry(string, &uelf->strings, list) {
-        log_debug("add string %s.\n", string->name);
-        strcpy(strtab, string->name);
-        strtab += strlen(string->name) + 1;
-    }
 }
 
 static void migrate_symbols(struct list_head *src,
@@ -361,10 +351,8 @@ void upatch_strip_unneeded_syms(struct upatch_elf *uelf)
     struct symbol *sym, *sym_safe;
 
     list_for_each_entry_safe(sym, sym_safe, &uelf->symbols, list) {
-        if (sym->strip == SYMBOL_STRIP) {
+        if (sym->strip == SYMBOL_STRIP)
             list_del(&sym->list);
-            free(sym);
-        }
     }
 }
 
@@ -460,7 +448,8 @@ static void print_strtab(char *buf, size_t size)
 
 void upatch_create_shstrtab(struct upatch_elf *uelf)
 {
-    size_t size, offset, len;
+    struct strtab tab;
+    size_t size;
     struct section *shstrtab, *sec;
     char *buf;
 
@@ -468,26 +457,15 @@ void upatch_create_shstrtab(struct upatch_elf *uelf)
     if (!shstrtab)
         ERROR("find_section_by_name failed.");
 
-    /* determine size of string table */
-    size = 1;
+    /* sh_name keeps index of the name until the table is laid out */
+    strtab_init(&tab, STRTAB_NULL_FIRST | STRTAB_TAIL_MERGE);
     list_for_each_entry(sec, &uelf->sections, list)
-        size += strlen(sec->name) + 1;
-
-    buf = malloc(size);
-    if (!buf)
-        ERROR("malloc shstrtab failed.");
-    memset(buf, 0, size);
+        sec->sh.sh_name = (unsigned int)strtab_add(&tab, sec->name);
 
-    offset = 1;
-    list_for_each_entry(sec, &uelf->sections, list) {
-        len = strlen(sec->name) + 1;
-        sec->sh.sh_name = (unsigned int)offset;
-        memcpy(buf + offset, sec->name, len);
-        offset += len;
-    }
-
-    if (offset != size)
-        ERROR("shstrtab size mismatch.");
+    buf = strtab_finalize(&tab, &size);
+    list_for_each_entry(sec, &uelf->sections, list)
+        sec->sh.sh_name = (unsigned int)strtab_offset(&tab, sec->sh.sh_name);
+    strtab_destroy(&tab);
 
     shstrtab->data->d_buf = buf;
     shstrtab->data->d_size = size;
@@ -502,39 +480,32 @@ void upatch_create_shstrtab(struct upatch_elf *uelf)
 
 void upatch_create_strtab(struct upatch_elf *uelf)
 {
+    struct strtab tab;
     struct section *strtab;
     struct symbol *sym;
-    size_t size = 0, offset = 0, len = 0;
+    size_t size;
     char *buf;
 
     strtab = find_section_by_name(&uelf->sections, ".strtab");
     if (!strtab)
         ERROR("find section failed in create strtab.");
 
+    /* st_name keeps index of the name until the table is laid out */
+    strtab_init(&tab, STRTAB_NULL_FIRST | STRTAB_TAIL_MERGE);
     list_for_each_entry(sym, &uelf->symbols, list) {
         if (sym->type == STT_SECTION)
             continue;
-        size += strlen(sym->name) + 1;
+        sym->sym.st_name = (unsigned int)strtab_add(&tab, sym->name);
     }
 
-    buf = malloc(size);
-    if (!buf)
-        ERROR("malloc buf failed in create strtab");
-    memset(buf, 0, size);
-
+    buf = strtab_finalize(&tab, &size);
     list_for_each_entry(sym, &uelf->symbols, list) {
-        if (sym->type == STT_SECTION) {
+        if (sym->type == STT_SECTION)
             sym->sym.st_name = 0;
-            continue;
-        }
-        len = strlen(sym->name) + 1;
-        sym->sym.st_name = (unsigned int)offset;
-        memcpy(buf + offset, sym->name, len);
-        offset += len;
+        else
+            sym->sym.st_name = (unsigned int)strtab_offset(&tab, sym->sym.st_name);
     }
-
-    if (offset != size)
-        ERROR("shstrtab size mismatch.");
+    strtab_destroy(&tab);
 
     strtab->data->d_buf = buf;
     strtab->data->d_size = size;
@@ -591,7 +562,189 @@ void upatch_create_symtab(struct upatch_elf *uelf)
     symtab->sh.sh_info = nr_local;
 }
 
-void upatch_write_output_elf(struct upatch_elf *uelf, Elf *elf, char *outfile, mode_t mode)
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define ELF_NATIVE_DATA ELFDATA2LSB
+#else
+#define ELF_NATIVE_DATA ELFDATA2MSB
+#endif
+
+#define ELF_ALIGN(x, a) (((x) + (a) - 1) & ~((GElf_Off)(a) - 1))
+
+/*
+ * Lay out sections the way elf_update() does: in list order right after the
+ * ELF header, each one aligned to its sh_addralign, followed by the section
+ * header table. Returns offset of the section header table.
+ */
+static GElf_Off layout_output_elf(struct upatch_elf *uelf, GElf_Xword *max_pad)
+{
+    struct section *sec;
+    GElf_Off offset = sizeof(GElf_Ehdr);
+
+    *max_pad = sizeof(GElf_Off) - 1;
+    list_for_each_entry(sec, &uelf->sections, list) {
+        switch (sec->sh.sh_type) {
+        case SHT_SYMTAB:
+        case SHT_DYNSYM:
+            sec->sh.sh_entsize = sizeof(GElf_Sym);
+            break;
+        case SHT_RELA:
+            sec->sh.sh_entsize = sizeof(GElf_Rela);
+            break;
+        case SHT_REL:
+            sec->sh.sh_entsize = sizeof(GElf_Rel);
+            break;
+        case SHT_GROUP:
+        case SHT_SYMTAB_SHNDX:
+        case SHT_HASH:
+            sec->sh.sh_entsize = sizeof(GElf_Word);
+            break;
+        case SHT_DYNAMIC:
+            sec->sh.sh_entsize = sizeof(GElf_Dyn);
+            break;
+        default:
+            break;
+        }
+
+        if (sec->sh.sh_flags & SHF_COMPRESSED)
+            sec->sh.sh_addralign = __alignof__(Elf64_Chdr);
+        if (!sec->sh.sh_addralign)
+            sec->sh.sh_addralign = 1;
+        if (sec->sh.sh_addralign & (sec->sh.sh_addralign - 1))
+            ERROR("invalid alignment of section %s.", sec->name);
+        if (sec->sh.sh_addralign - 1 > *max_pad)
+            *max_pad = sec->sh.sh_addralign - 1;
+
+        /* nobits sections are aligned as well, but take no space */
+        offset = ELF_ALIGN(offset, sec->sh.sh_addralign);
+        sec->sh.sh_offset = offset;
+        sec->sh.sh_size = sec->data->d_size;
+        if (sec->sh.sh_type != SHT_NOBITS)
+            offset += sec->sh.sh_size;
+    }
+
+    return ELF_ALIGN(offset, sizeof(GElf_Off));
+}
+
+static void write_iovecs(int fd, struct iovec *iov, int nr)
+{
+    ssize_t len;
+
+    while (nr > 0) {
+        len = writev(fd, iov, nr < IOV_MAX ? nr : IOV_MAX);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            ERROR("writev failed, %s.", strerror(errno));
+        }
+
+        /* skip what was written, then retry the rest of a partial write */
+        while (nr > 0 && (size_t)len >= iov->iov_len) {
+            len -= (ssize_t)iov->iov_len;
+            iov++;
+            nr--;
+        }
+        if (nr > 0) {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= (size_t)len;
+        }
+    }
+}
+
+static void push_iovec(struct iovec *iov, int *nr, void *buf, size_t size)
+{
+    if (!size)
+        return;
+
+    iov[*nr].iov_base = buf;
+    iov[*nr].iov_len = size;
+    (*nr)++;
+}
+
+/*
+ * Write a 64-bit native-endian object directly. Everything is written by
+ * writev() from the buffers which sections and section headers already
+ * have, without handing them over to libelf first.
+ */
+static void write_output_elf64(struct upatch_elf *uelf, GElf_Ehdr *eh,
+    char *outfile, mode_t mode)
+{
+    int fd, nr_iov = 0;
+    size_t shnum = 1;
+    GElf_Off offset, shoff;
+    GElf_Xword max_pad;
+    GElf_Ehdr ehout;
+    GElf_Shdr shnull;
+    struct iovec *iov;
+    struct section *sec, *shstrtab;
+    char *pad;
+
+    shstrtab = find_section_by_name(&uelf->sections, ".shstrtab");
+    if (!shstrtab)
+        ERROR("missing .shstrtab sections in write output elf");
+
+    list_for_each_entry(sec, &uelf->sections, list)
+        shnum++;
+
+    shoff = layout_output_elf(uelf, &max_pad);
+
+    memset(&ehout, 0, sizeof(ehout));
+    memcpy(ehout.e_ident, ELFMAG, SELFMAG);
+    ehout.e_ident[EI_CLASS] = ELFCLASS64;
+    ehout.e_ident[EI_DATA] = eh->e_ident[EI_DATA];
+    ehout.e_ident[EI_VERSION] = EV_CURRENT;
+    ehout.e_type = eh->e_type;
+    ehout.e_machine = eh->e_machine;
+    ehout.e_version = EV_CURRENT;
+    ehout.e_shoff = shoff;
+    ehout.e_ehsize = sizeof(GElf_Ehdr);
+    ehout.e_shentsize = sizeof(GElf_Shdr);
+
+    /* too many sections are counted by the null section header */
+    memset(&shnull, 0, sizeof(shnull));
+    if (shnum >= SHN_LORESERVE)
+        shnull.sh_size = shnum;
+    else
+        ehout.e_shnum = (unsigned short)shnum;
+    if ((unsigned int)shstrtab->index >= SHN_LORESERVE) {
+        shnull.sh_link = shstrtab->index;
+        ehout.e_shstrndx = SHN_XINDEX;
+    } else {
+        ehout.e_shstrndx = (unsigned short)shstrtab->index;
+    }
+
+    /* elf header, padding & data of each section, section headers */
+    iov = malloc((3 + 3 * shnum) * sizeof(*iov));
+    pad = calloc(1, max_pad);
+    if (!iov || !pad)
+        ERROR("malloc failed in write output elf.");
+
+    push_iovec(iov, &nr_iov, &ehout, sizeof(ehout));
+    offset = sizeof(ehout);
+    list_for_each_entry(sec, &uelf->sections, list) {
+        if (sec->sh.sh_type == SHT_NOBITS)
+            continue;
+        push_iovec(iov, &nr_iov, pad, sec->sh.sh_offset - offset);
+        push_iovec(iov, &nr_iov, sec->data->d_buf, sec->sh.sh_size);
+        offset = sec->sh.sh_offset + sec->sh.sh_size;
+    }
+    push_iovec(iov, &nr_iov, pad, shoff - offset);
+    push_iovec(iov, &nr_iov, &shnull, sizeof(shnull));
+    list_for_each_entry(sec, &uelf->sections, list)
+        push_iovec(iov, &nr_iov, &sec->sh, sizeof(sec->sh));
+
+    fd = creat(outfile, mode);
+    if (fd == -1)
+        ERROR("creat failed.");
+
+    write_iovecs(fd, iov, nr_iov);
+
+    close(fd);
+    free(pad);
+    free(iov);
+}
+
+static void write_output_elf_libelf(struct upatch_elf *uelf, Elf *elf,
+    char *outfile, mode_t mode)
 {
     int fd;
     Elf *elfout;
@@ -663,4 +816,28 @@ void upatch_write_output_elf(struct upatch_elf *uelf, Elf *elf, char *outfile, m
 
     elf_end(elfout);
     close(fd);
-}
\ No newline at end of file
+}
+
+static bool write_libelf;
+
+void upatch_write_set_libelf(bool enable)
+{
+    write_libelf = enable;
+}
+
+void upatch_write_output_elf(struct upatch_elf *uelf, Elf *elf, char *outfile, mode_t mode)
+{
+    GElf_Ehdr eh;
+
+    if (!gelf_getehdr(elf, &eh))
+        ERROR("gelf_getehdr elf failed.");
+
+    /* section data is kept in memory form, only native objects match the file form */
+    if (!write_libelf && (gelf_getclass(elf) == ELFCLASS64) &&
+        (eh.e_ident[EI_DATA] == ELF_NATIVE_DATA)) {
+        write_output_elf64(uelf, &eh, outfile, mode);
+        return;
+    }
+
+    write_output_elf_libelf(uelf, elf, outfile, mode);
+}
@@ -53,6 +53,9 @@ void upatch_create_strtab(struct upatch_elf *);
 
 void upatch_create_symtab(struct upatch_elf *);
 
+/* Write every object through libelf, which the direct writer is checked against */
+void upatch_write_set_libelf(bool);
+
 void upatch_write_output_elf(struct upatch_elf *, Elf *, char *, mode_t);
 
 #endif /* __UPATCH_CREATE_H_ */
\ No newline at end of file
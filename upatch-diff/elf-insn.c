@@ -23,31 +23,110 @@
  * 02110-1301, USA.
  */
 
+#include <pthread.h>
 #include <string.h>
 
 #include "elf-common.h"
 #include "elf-insn.h"
 
-void rela_insn(const struct section *sec, const struct rela *rela, struct insn *insn)
+#define INSN_MAP_LEN_MASK 0x0f
+#define INSN_MAP_LOAD_IMM 0x10
+
+/*
+ * Each byte of info tells the length & class of the x86 instruction starting
+ * at the same offset of the section, and is 0 inside of an instruction.
+ */
+struct insn_map {
+    unsigned long size; /* decoding stops at the first bad instruction */
+    unsigned char info[];
+};
+
+/* sections are compared in parallel, while the arena is not thread safe */
+static pthread_mutex_t insn_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* check: http://ref.x86asm.net/coder64.html */
+static bool x86_is_load_immediate(const unsigned char *insn, unsigned long len)
+{
+    /* arg2: mov $imm, %esi */
+    if (insn[0] == 0xbe)
+        return true;
+
+    /* arg3: mov $imm, %edx */
+    if (insn[0] == 0xba)
+        return true;
+
+    /* 0x41 is the prefix extend - REX.B */
+    if (len > 1 && insn[0] == 0x41 && insn[1] == 0xb8)
+        return true;
+
+    return false;
+}
+
+/*
+ * The map is allocated from the arena of the elf doing the lookup, which
+ * outlives twin sections of the other elf.
+ */
+static struct insn_map *section_insn_map(struct upatch_elf *uelf, struct section *sec)
 {
-    unsigned long insn_addr, start, end, rela_addr;
+    struct insn_map *map;
+    unsigned char *start;
+    unsigned long offset;
+    struct insn insn;
+
+    if (sec->insn_map)
+        return sec->insn_map;
+
+    pthread_mutex_lock(&insn_map_lock);
+    map = arena_alloc(&uelf->arena, sizeof(*map) + sec->sh.sh_size);
+    pthread_mutex_unlock(&insn_map_lock);
+
+    start = sec->data->d_buf;
+    for (offset = 0; offset < sec->sh.sh_size; offset += insn.length) {
+        insn_init(&insn, start + offset, 1);
+        insn_get_length(&insn);
+        if (!insn.length || insn.length > INSN_MAP_LEN_MASK)
+            break;
+
+        map->info[offset] = (unsigned char)insn.length;
+        if (x86_is_load_immediate(start + offset, insn.length))
+            map->info[offset] |= INSN_MAP_LOAD_IMM;
+    }
+    map->size = (offset < sec->sh.sh_size) ? offset : sec->sh.sh_size;
+
+    sec->insn_map = map;
+    return map;
+}
 
-    start = (unsigned long)sec->data->d_buf;
-    end = start + sec->sh.sh_size;
+void rela_insn(struct upatch_elf *uelf, struct section *sec,
+    const struct rela *rela, struct insn *insn)
+{
+    struct insn_map *map;
+    unsigned long offset;
+    unsigned int back;
 
-    if (end <= start)
+    if (!sec->sh.sh_size)
         ERROR("bad section size");
 
-    rela_addr = start + rela->offset;
-    for (insn_addr = start; insn_addr < end; insn_addr += insn->length) {
-        insn_init(insn, (void *)insn_addr, 1);
-        insn_get_length(insn);
-        if (!insn->length)
+    map = section_insn_map(uelf, sec);
+    if (rela->offset >= map->size) {
+        if (map->size < sec->sh.sh_size)
             ERROR("can't decode instruction in section %s at offset 0x%lx",
-                sec->name, insn_addr);
-        if (rela_addr >= insn_addr &&
-            rela_addr < insn_addr + insn->length)
-            return;
+                sec->name, map->size);
+        ERROR("can't find instruction for rela at %s+0x%x",
+            sec->name, rela->offset);
+    }
+
+    /* an instruction is at most 15 bytes, its start is close by */
+    for (back = 0; back <= INSN_MAP_LEN_MASK && back <= rela->offset; back++) {
+        offset = rela->offset - back;
+        if (!map->info[offset])
+            continue;
+        if ((map->info[offset] & INSN_MAP_LEN_MASK) <= back)
+            break;
+
+        insn_init(insn, (unsigned char *)sec->data->d_buf + offset, 1);
+        insn_get_length(insn);
+        return;
     }
 
     ERROR("can't find instruction for rela at %s+0x%x",
@@ -72,7 +151,7 @@ long rela_target_offset(struct upatch_elf *uelf, struct section *relasec, struct
         else if (rela->type == R_X86_64_PC32 ||
                 rela->type == R_X86_64_PLT32) {
             struct insn insn;
-            rela_insn(sec, rela, &insn);
+            rela_insn(uelf, sec, rela, &insn);
             add_off = (long)insn.next_byte -
                         (long)sec->data->d_buf -
                         rela->offset;
@@ -88,17 +167,19 @@ long rela_target_offset(struct upatch_elf *uelf, struct section *relasec, struct
     return rela->addend + add_off;
 }
 
-unsigned int insn_length(struct upatch_elf *uelf, void *addr)
+unsigned int insn_length(struct upatch_elf *uelf, struct section *sec,
+    unsigned long offset)
 {
-    struct insn decoded_insn;
+    struct insn_map *map;
 
     switch(uelf->arch) {
     case AARCH64:
         return ARM64_INSTR_LEN;
     case X86_64:
-        insn_init(&decoded_insn, addr, 1);
-        insn_get_length(&decoded_insn);
-        return decoded_insn.length;
+        map = section_insn_map(uelf, sec);
+        if (offset >= map->size)
+            return 0;
+        return map->info[offset] & INSN_MAP_LEN_MASK;
     default:
         ERROR("unsupported arch");
     }
@@ -106,28 +187,19 @@ unsigned int insn_length(struct upatch_elf *uelf, void *addr)
     return 0;
 }
 
-/* check: http://ref.x86asm.net/coder64.html */
-bool insn_is_load_immediate(struct upatch_elf *uelf, void *addr)
+bool insn_is_load_immediate(struct upatch_elf *uelf, struct section *sec,
+    unsigned long offset)
 {
-    unsigned char *insn = addr;
+    struct insn_map *map;
 
     switch(uelf->arch) {
     case X86_64:
-        /* arg2: mov $imm, %esi */
-        if (insn[0] == 0xbe)
-            return true;
-
-        /* arg3: mov $imm, %edx */
-        if (insn[0] == 0xba)
-            return true;
-
-        /* 0x41 is the prefix extend - REX.B */
-        if (insn[0] == 0x41 && insn[1] == 0xb8)
-            return true;
-
-        break;
+        map = section_insn_map(uelf, sec);
+        if (offset >= map->size)
+            return false;
+        return (map->info[offset] & INSN_MAP_LOAD_IMM) != 0;
     default:
         ERROR("unsupported arch");
     }
     return false;
-}
\ No newline at end of file
+}
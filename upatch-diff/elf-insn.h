@@ -31,7 +31,11 @@
 
 #define ARM64_INSTR_LEN 4
 
-void rela_insn(const struct section *sec, const struct rela *rela, struct insn *insn);
+/*
+ * Instructions are looked up in the boundary map of the section, which is
+ * decoded once, thus each lookup takes constant time.
+ */
+void rela_insn(struct upatch_elf *, struct section *, const struct rela *, struct insn *);
 
 /*
  * For S + A: addend is the section offset
@@ -41,8 +45,9 @@ void rela_insn(const struct section *sec, const struct rela *rela, struct insn *
 
 long rela_target_offset(struct upatch_elf *, struct section *, struct rela *);
 
-unsigned int insn_length(struct upatch_elf *, void *);
+/* 0 if offset is not the start of a decodable instruction */
+unsigned int insn_length(struct upatch_elf *, struct section *, unsigned long);
 
-bool insn_is_load_immediate(struct upatch_elf *, void *);
+bool insn_is_load_immediate(struct upatch_elf *, struct section *, unsigned long);
 
 #endif /* __UPATCH_INSN_H_ */
\ No newline at end of file
@@ -53,6 +53,99 @@ static bool is_exec(struct Elf *elf)
     return ehdr.e_type == ET_EXEC || (ehdr.e_type == ET_DYN && is_pie(elf));
 }
 
+static unsigned int name_hash(const char *name)
+{
+    unsigned int hash = 5381;
+
+    while (*name)
+        hash = hash * 33 + (unsigned char)*name++;
+
+    return hash;
+}
+
+static int *hash_bucket(struct running_elf *relf, int *table, const char *name)
+{
+    return &table[name_hash(name) & (relf->hash_size - 1)];
+}
+
+/* find the first symbol named as name, chained from the head */
+static int hash_find(struct running_elf *relf, int head, const char *name)
+{
+    int i;
+
+    for (i = head; i != -1; i = relf->obj_syms[i].hash_next) {
+        if (!strcmp(relf->obj_syms[i].name, name))
+            return i;
+    }
+
+    return -1;
+}
+
+static bool is_global_or_weak(struct object_symbol *sym)
+{
+    return sym->bind == STB_GLOBAL || sym->bind == STB_WEAK;
+}
+
+/*
+ * Group symbols by name, so every lookup only visits symbols with the
+ * same name. Groups keep symbol table order, which defines sympos.
+ */
+static void build_symbol_index(struct running_elf *relf)
+{
+    struct object_symbol *sym;
+    int *table, *bucket, *tails;
+    int i, first, last_file = -1;
+
+    relf->hash_size = 1;
+    while (relf->hash_size < (unsigned int)relf->obj_nr)
+        relf->hash_size <<= 1;
+
+    relf->local_hash = malloc(relf->hash_size * sizeof(int));
+    relf->global_hash = malloc(relf->hash_size * sizeof(int));
+    tails = malloc(relf->hash_size * sizeof(int));
+    if (!relf->local_hash || !relf->global_hash || !tails)
+        ERROR("malloc with errno = %d", errno);
+
+    memset(relf->local_hash, -1, relf->hash_size * sizeof(int));
+    memset(relf->global_hash, -1, relf->hash_size * sizeof(int));
+
+    for (i = 0; i < relf->obj_nr; i++) {
+        sym = &relf->obj_syms[i];
+        sym->next = -1;
+        sym->hash_next = -1;
+        sym->file_end = relf->obj_nr;
+
+        if (sym->type == STT_FILE) {
+            if (last_file != -1)
+                relf->obj_syms[last_file].file_end = i;
+            last_file = i;
+        }
+
+        if (sym->bind == STB_LOCAL)
+            table = relf->local_hash;
+        else if (is_global_or_weak(sym))
+            table = relf->global_hash;
+        else
+            continue;
+
+        bucket = hash_bucket(relf, table, sym->name);
+        first = hash_find(relf, *bucket, sym->name);
+        if (first == -1) {
+            sym->hash_next = *bucket;
+            sym->sympos = 1;
+            *bucket = i;
+            tails[i] = i;
+            continue;
+        }
+
+        sym->sympos = relf->obj_syms[tails[first]].sympos + 1;
+        relf->obj_syms[tails[first]].next = i;
+        tails[first] = i;
+    }
+
+    free(tails);
+}
+
 void relf_init(char *elf_name, struct running_elf *relf)
 {
     GElf_Shdr shdr;
@@ -100,11 +193,15 @@ void relf_init(char *elf_name, struct running_elf *relf)
         relf->obj_syms[i].addr = sym.st_value;
         relf->obj_syms[i].size = sym.st_size;
     }
+
+    build_symbol_index(relf);
 }
 
 int relf_destroy(struct running_elf *relf)
 {
     free(relf->obj_syms);
+    free(relf->local_hash);
+    free(relf->global_hash);
     elf_end(relf->elf);
     relf->elf = NULL;
     close(relf->fd);
@@ -113,38 +210,40 @@ int relf_destroy(struct running_elf *relf)
     return 0;
 }
 
+struct object_symbol *relf_first_local(struct running_elf *relf, const char *name)
+{
+    int i = hash_find(relf, *hash_bucket(relf, relf->local_hash, name), name);
+
+    return i == -1 ? NULL : &relf->obj_syms[i];
+}
+
+struct object_symbol *relf_next_local(struct running_elf *relf, struct object_symbol *sym)
+{
+    return sym->next == -1 ? NULL : &relf->obj_syms[sym->next];
+}
+
 bool lookup_relf(struct running_elf *relf, struct symbol *lookup_sym,
                  struct lookup_result *result)
 {
-    int i;
     struct object_symbol *sym;
-    unsigned long sympos = 0;
-    bool in_file = false;
+    struct object_symbol *file_sym = lookup_sym->lookup_running_file_sym;
+    int i, first;
 
     memset(result, 0, sizeof(*result));
 
-    for (i = 0; i < relf->obj_nr; i ++) {
-        sym = &relf->obj_syms[i];
-        if (sym->bind == STB_LOCAL && !strcmp(sym->name, lookup_sym->name))
-            sympos ++;
-
-        if (lookup_sym->lookup_running_file_sym == sym) {
-            in_file = true;
-            continue;
-        }
-
-        if (!in_file)
-            continue;
+    if (file_sym) {
+        for (sym = relf_first_local(relf, lookup_sym->name); sym;
+             sym = relf_next_local(relf, sym)) {
+            if (sym <= file_sym)
+                continue;
+            if (sym - relf->obj_syms >= file_sym->file_end)
+                break;
 
-        if (sym->type == STT_FILE)
-            break;
-
-        if (sym->bind == STB_LOCAL && !strcmp(sym->name, lookup_sym->name)) {
             if (result->symbol)
                 ERROR("duplicate local symbol found for %s", lookup_sym->name);
 
             result->symbol = sym;
-            result->sympos = sympos;
+            result->sympos = sym->sympos;
             result->global = false;
         }
     }
@@ -152,15 +251,13 @@ bool lookup_relf(struct running_elf *relf, struct symbol *lookup_sym,
     if (!!result->symbol)
         return !!result->symbol;
 
-    for (i = 0; i < relf->obj_nr; i ++) {
-        sym = &relf->obj_syms[i];
-        if ((sym->bind == STB_GLOBAL || sym->bind == STB_WEAK) &&
-                !strcmp(sym->name, lookup_sym->name)) {
-            if (result->symbol)
-                ERROR("duplicated global symbol for %s \n", lookup_sym->name);
-            result->symbol = sym;
-            result->global = true;
-        }
+    first = hash_find(relf, *hash_bucket(relf, relf->global_hash,
+        lookup_sym->name), lookup_sym->name);
+    for (i = first; i != -1; i = relf->obj_syms[i].next) {
+        if (result->symbol)
+            ERROR("duplicated global symbol for %s \n", lookup_sym->name);
+        result->symbol = &relf->obj_syms[i];
+        result->global = true;
     }
 
     return !!result->symbol;
@@ -46,11 +46,23 @@ struct object_symbol {
     unsigned int shndx;
     unsigned long addr;
     unsigned long size;
+    /* position among local symbols with the same name, starting from 1 */
+    unsigned long sympos;
+    /* next symbol with the same name and binding class, -1 for none */
+    int next;
+    /* next name in the same hash bucket, only valid for the first symbol */
+    int hash_next;
+    /* index of the next STT_FILE symbol, only valid for STT_FILE */
+    int file_end;
 };
 
 struct running_elf {
     int obj_nr;
     struct object_symbol *obj_syms;
+    /* name indexes of local and global/weak symbols */
+    unsigned int hash_size;
+    int *local_hash;
+    int *global_hash;
     int fd;
     Elf *elf;
     bool is_exec;
@@ -62,4 +74,9 @@ int relf_destroy(struct running_elf *);
 
 bool lookup_relf(struct running_elf *, struct symbol *, struct lookup_result *);
 
+/* iterate local symbols with the same name, in symbol table order */
+struct object_symbol *relf_first_local(struct running_elf *, const char *);
+
+struct object_symbol *relf_next_local(struct running_elf *, struct object_symbol *);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * strtab.c
+ *
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "strtab.h"
+
+struct strtab_entry {
+    const char *name;
+    size_t len;
+    size_t offset;
+    unsigned int hash;
+    /* next entry in the same bucket */
+    int next;
+};
+
+static unsigned int name_hash(const char *name)
+{
+    unsigned int hash = 5381;
+
+    while (*name)
+        hash = hash * 33 + (unsigned char)*name++;
+
+    return hash;
+}
+
+static void strtab_rehash(struct strtab *tab, size_t bucket_size)
+{
+    size_t i;
+
+    free(tab->buckets);
+    tab->buckets = malloc(bucket_size * sizeof(int));
+    if (!tab->buckets)
+        ERROR("malloc strtab buckets failed.");
+    memset(tab->buckets, -1, bucket_size * sizeof(int));
+    tab->bucket_size = bucket_size;
+
+    for (i = 0; i < tab->nr; i++) {
+        int *bucket = &tab->buckets[tab->entries[i].hash & (bucket_size - 1)];
+
+        tab->entries[i].next = *bucket;
+        *bucket = (int)i;
+    }
+}
+
+void strtab_init(struct strtab *tab, unsigned int flags)
+{
+    memset(tab, 0, sizeof(*tab));
+    tab->flags = flags;
+
+    if (flags & STRTAB_NULL_FIRST)
+        strtab_add(tab, "");
+}
+
+size_t strtab_add(struct strtab *tab, const char *name)
+{
+    unsigned int hash = name_hash(name);
+    struct strtab_entry *entry;
+    int *bucket;
+    int i;
+
+    if (tab->bucket_size) {
+        bucket = &tab->buckets[hash & (tab->bucket_size - 1)];
+        for (i = *bucket; i != -1; i = tab->entries[i].next) {
+            if (tab->entries[i].hash == hash &&
+                !strcmp(tab->entries[i].name, name))
+                return (size_t)i;
+        }
+    }
+
+    if (tab->nr == tab->capacity) {
+        tab->capacity = tab->capacity ? tab->capacity * 2 : 64;
+        tab->entries = realloc(tab->entries,
+            tab->capacity * sizeof(*tab->entries));
+        if (!tab->entries)
+            ERROR("realloc strtab entries failed.");
+    }
+
+    entry = &tab->entries[tab->nr];
+    entry->name = name;
+    entry->len = strlen(name);
+    entry->hash = hash;
+    entry->offset = tab->size;
+    tab->size += entry->len + 1;
+    tab->nr++;
+
+    /* keep the load factor under 1 */
+    if (tab->nr > tab->bucket_size) {
+        strtab_rehash(tab, tab->bucket_size ? tab->bucket_size * 2 : 64);
+    } else {
+        bucket = &tab->buckets[hash & (tab->bucket_size - 1)];
+        entry->next = *bucket;
+        *bucket = (int)(tab->nr - 1);
+    }
+
+    return tab->nr - 1;
+}
+
+size_t strtab_offset(const struct strtab *tab, size_t index)
+{
+    return tab->entries[index].offset;
+}
+
+/* sort by reversed strings, a string comes after the ones it is tail of */
+static int tail_compare(const void *a, const void *b)
+{
+    const struct strtab_entry *lhs = *(const struct strtab_entry * const *)a;
+    const struct strtab_entry *rhs = *(const struct strtab_entry * const *)b;
+    size_t l = lhs->len;
+    size_t r = rhs->len;
+
+    while (l && r) {
+        unsigned char lc = (unsigned char)lhs->name[--l];
+        unsigned char rc = (unsigned char)rhs->name[--r];
+
+        if (lc != rc)
+            return lc < rc ? -1 : 1;
+    }
+    /* longer one comes first */
+    return (l < r) - (l > r);
+}
+
+static void strtab_merge_tails(struct strtab *tab)
+{
+    struct strtab_entry **sorted;
+    struct strtab_entry *prev = NULL;
+    size_t start, i;
+
+    /* the leading empty string keeps offset 0 */
+    start = (tab->flags & STRTAB_NULL_FIRST) ? 1 : 0;
+    if (tab->nr <= start)
+        return;
+
+    sorted = malloc((tab->nr - start) * sizeof(*sorted));
+    if (!sorted)
+        ERROR("malloc strtab sort buffer failed.");
+    for (i = start; i < tab->nr; i++)
+        sorted[i - start] = &tab->entries[i];
+    qsort(sorted, tab->nr - start, sizeof(*sorted), tail_compare);
+
+    tab->size = start;
+    for (i = 0; i < tab->nr - start; i++) {
+        struct strtab_entry *entry = sorted[i];
+
+        if (prev && prev->len >= entry->len &&
+            !memcmp(prev->name + prev->len - entry->len, entry->name,
+                entry->len)) {
+            entry->offset = prev->offset + prev->len - entry->len;
+            continue;
+        }
+        entry->offset = tab->size;
+        tab->size += entry->len + 1;
+        prev = entry;
+    }
+
+    free(sorted);
+}
+
+char *strtab_finalize(struct strtab *tab, size_t *size)
+{
+    char *buf;
+    size_t i;
+
+    if (tab->flags & STRTAB_TAIL_MERGE)
+        strtab_merge_tails(tab);
+
+    buf = malloc(tab->size ? tab->size : 1);
+    if (!buf)
+        ERROR("malloc strtab failed.");
+
+    /* merged strings are copied over equal bytes of their hosts */
+    for (i = 0; i < tab->nr; i++)
+        memcpy(buf + tab->entries[i].offset, tab->entries[i].name,
+            tab->entries[i].len + 1);
+
+    *size = tab->size;
+    return buf;
+}
+
+void strtab_destroy(struct strtab *tab)
+{
+    free(tab->entries);
+    free(tab->buckets);
+    memset(tab, 0, sizeof(*tab));
+}
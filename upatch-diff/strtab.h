@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * strtab.h
+ *
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+#ifndef __UPATCH_STRTAB_H_
+#define __UPATCH_STRTAB_H_
+
+#include <stddef.h>
+
+/* offset 0 holds the empty string, as ELF string tables require */
+#define STRTAB_NULL_FIRST (1U << 0)
+/* a string which is the tail of another one shares its bytes, like ld does */
+#define STRTAB_TAIL_MERGE (1U << 1)
+
+struct strtab_entry;
+
+/*
+ * String table builder, a string is added only once, no matter how often
+ * it is asked for. Strings are not copied, they must outlive the table.
+ * A zeroed table is a valid table to destroy.
+ */
+struct strtab {
+    unsigned int flags;
+    struct strtab_entry *entries;
+    size_t nr;
+    size_t capacity;
+    int *buckets;
+    size_t bucket_size;
+    size_t size;
+};
+
+void strtab_init(struct strtab *, unsigned int flags);
+
+/* returns index of the string in table */
+size_t strtab_add(struct strtab *, const char *);
+
+/*
+ * Offset of the string of index, it's known once the string is added,
+ * unless the table merges tails, then it's known after strtab_finalize().
+ */
+size_t strtab_offset(const struct strtab *, size_t);
+
+/* lay out all strings, returns the table content, released by caller */
+char *strtab_finalize(struct strtab *, size_t *);
+
+void strtab_destroy(struct strtab *);
+
+#endif /* __UPATCH_STRTAB_H_ */
@@ -42,7 +42,7 @@ static void create_section_list(struct upatch_elf *uelf)
 {
     size_t shstrndx, sections_nr;
 
-    struct section *sec;
+    struct section *secs, *sec;
     Elf_Scn *scn = NULL;
 
     if (elf_getshdrnum(uelf->elf, &sections_nr))
@@ -54,8 +54,10 @@ static void create_section_list(struct upatch_elf *uelf)
         ERROR("elf_getshdrstrndx with error %s", elf_errmsg(0));
 
     log_debug("=== section list (%zu) === \n", sections_nr);
-    while (sections_nr --) {
-        ALLOC_LINK(sec, &uelf->sections);
+    secs = arena_alloc(&uelf->arena, sections_nr * sizeof(*secs));
+    for (sec = secs; sections_nr --; sec++) {
+        INIT_LIST_HEAD(&sec->list);
+        list_add_tail(&sec->list, &uelf->sections);
 
         scn = elf_nextscn(uelf->elf, scn);
         if (!scn)
@@ -90,7 +92,7 @@ static void create_symbol_list(struct upatch_elf *uelf)
     struct section *symtab;
     unsigned int symbols_nr;
     Elf32_Word shndx;
-    struct symbol *sym;
+    struct symbol *syms, *sym;
     unsigned int index = 0;
 
     /* consider type first */
@@ -101,8 +103,10 @@ static void create_symbol_list(struct upatch_elf *uelf)
     symbols_nr = (unsigned int)(symtab->sh.sh_size / symtab->sh.sh_entsize);
 
     log_debug("\n=== symbol list (%d entries) ===\n", symbols_nr);
-    while (symbols_nr --) {
-        ALLOC_LINK(sym, &uelf->symbols);
+    syms = arena_alloc(&uelf->arena, symbols_nr * sizeof(*syms));
+    for (sym = syms; symbols_nr --; sym++) {
+        INIT_LIST_HEAD(&sym->list);
+        list_add_tail(&sym->list, &uelf->symbols);
         INIT_LIST_HEAD(&sym->children);
 
         sym->index = index;
@@ -154,7 +158,7 @@ static void create_rela_list(struct upatch_elf *uelf, struct section *relasec)
 {
     unsigned long rela_nr;
     unsigned int symndx;
-    struct rela *rela;
+    struct rela *relas, *rela;
     int index = 0, skip = 0;
 
     /* for relocation sections, sh_info is the index which these informations apply */
@@ -178,8 +182,11 @@ static void create_rela_list(struct upatch_elf *uelf, struct section *relasec)
         skip = 1;
     }
 
-    while (rela_nr --) {
-        ALLOC_LINK(rela, &relasec->relas);
+    /* keep relas of one section contiguous */
+    relas = arena_alloc(&uelf->arena, rela_nr * sizeof(*relas));
+    for (rela = relas; rela_nr --; rela++) {
+        INIT_LIST_HEAD(&rela->list);
+        list_add_tail(&rela->list, &relasec->relas);
 
         /* use index because we need to keep the order of rela */
         if (!gelf_getrela(relasec->data, index, &rela->rela))
@@ -226,14 +233,20 @@ void upatch_elf_open(struct upatch_elf *uelf, const char *name)
     if (fd == -1)
         ERROR("open %s failed with errno %d \n", name, errno);
 
-    elf = elf_begin(fd, ELF_C_RDWR, NULL);
+    /*
+     * Input objects are never written, mapping them leaves pages of data
+     * which is not looked at (eg. debug sections of source object) unread.
+     * On native objects elf_getdata() points into the mapping, not a copy.
+     */
+    elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
     if (!elf)
         ERROR("open elf %s failed with error %s \n", name, elf_errmsg(0));
 
     memset(uelf, 0, sizeof(*uelf));
+    arena_init(&uelf->arena);
     INIT_LIST_HEAD(&uelf->sections);
     INIT_LIST_HEAD(&uelf->symbols);
-    INIT_LIST_HEAD(&uelf->strings);
+    strtab_init(&uelf->strings, 0);
 
     uelf->elf = elf;
     uelf->fd = fd;
@@ -275,28 +288,17 @@ void upatch_elf_open(struct upatch_elf *uelf, const char *name)
 
 void upatch_elf_teardown(struct upatch_elf *uelf)
 {
-    struct section *sec, *safesec;
-    struct symbol *sym, *safesym;
-    struct rela *rela, *saferela;
+    struct section *sec;
+    struct symbol *sym;
 
-    list_for_each_entry_safe(sec, safesec, &uelf->sections, list) {
+    list_for_each_entry(sec, &uelf->sections, list) {
         if (sec->twin)
             sec->twin->twin = NULL;
-        if (is_rela_section(sec)) {
-            list_for_each_entry_safe(rela, saferela, &sec->relas, list) {
-                memset(rela, 0, sizeof(*rela));
-                free(rela);
-            }
-        }
-        memset(sec, 0, sizeof(*sec));
-        free(sec);
     }
 
-    list_for_each_entry_safe(sym, safesym, &uelf->symbols, list) {
+    list_for_each_entry(sym, &uelf->symbols, list) {
         if (sym->twin)
             sym->twin->twin = NULL;
-        memset(sym, 0, sizeof(*sym));
-        free(sym);
     }
 
     INIT_LIST_HEAD(&uelf->sections);
@@ -305,6 +307,8 @@ void upatch_elf_teardown(struct upatch_elf *uelf)
 
 void upatch_elf_free(struct upatch_elf *uelf)
 {
+    arena_destroy(&uelf->arena);
+    strtab_destroy(&uelf->strings);
     elf_end(uelf->elf);
     close(uelf->fd);
     memset(uelf, 0, sizeof(*uelf));
@@ -29,8 +29,10 @@
 #include <gelf.h>
 #include <stdbool.h>
 
+#include "arena.h"
 #include "list.h"
 #include "running-elf.h"
+#include "strtab.h"
 
 extern char *upatch_elf_name;
 
@@ -38,6 +40,7 @@ extern char *upatch_elf_name;
 struct section;
 struct rela;
 struct symbol;
+struct insn_map;
 
 enum status {
 	NEW,
@@ -51,11 +54,6 @@ enum symbol_strip {
 	SYMBOL_STRIP,
 };
 
-struct string {
-	struct list_head list;
-	char *name;
-};
-
 struct section {
 	struct list_head list;
 	struct section *twin;
@@ -67,6 +65,11 @@ struct section {
 	int grouped;
 	unsigned int index;
 	enum status status;
+	/* patched side only, see compare-cache.h */
+	unsigned long hash;
+	bool cached;
+	/* x86 text sections only, built on first lookup, see elf-insn.c */
+	struct insn_map *insn_map;
 	union {
         // section with relocation information
 		struct {
@@ -120,10 +123,13 @@ enum architecture {
 
 struct upatch_elf {
 	Elf *elf;
+	/* sections, symbols & relas are allocated here */
+	struct arena arena;
 	enum architecture arch;
 	struct list_head sections;
 	struct list_head symbols;
-	struct list_head strings;
+	/* content of .upatch.strings */
+	struct strtab strings;
 	Elf_Data *symtab_shndx;
 	int fd;
 };
@@ -131,7 +137,7 @@ struct upatch_elf {
 // init a upatch_elf from a path
 void upatch_elf_open(struct upatch_elf *, const char *);
 
-// Destory upatch_elf struct
+// Destory upatch_elf struct, elements are released in upatch_elf_free
 void upatch_elf_teardown(struct upatch_elf *);
 
 void upatch_elf_free(struct upatch_elf *);
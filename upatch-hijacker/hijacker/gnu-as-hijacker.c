@@ -14,6 +14,7 @@
 
 #define _GNU_SOURCE
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -27,6 +28,7 @@
 #endif
 
 #define DEFSYM_MAX 64
+#define RECORD_MAX (PATH_MAX * 2)
 
 static const char *DEFSYM_FLAG = "--defsym";
 static const char *DEFSYM_VALUE = ".upatch_0x%x=";
@@ -34,9 +36,45 @@ static const int APPEND_ARG_LEN = 2;
 
 static const char *OUTPUT_PATH = "%s/0x%x.o";
 static const char *NULL_DEV_PATH = "/dev/null";
+static const char *INDEX_RECORD = "0x%x %s%s%s\n";
 
 static char g_defsym[DEFSYM_MAX] = { 0 };
 static char g_new_output_file[PATH_MAX] = { 0 };
+static char g_cwd[PATH_MAX] = { 0 };
+static char g_record[RECORD_MAX] = { 0 };
+
+/*
+ * Append "<upatch id> <absolute output path>" to the object index.
+ * Records are written by a single O_APPEND write, thus assemblers running
+ * in parallel never interleave them.
+ */
+static int append_index_record(const char *index_file, pid_t tid, const char *output_file)
+{
+    const char *dir = "";
+    const char *sep = "";
+
+    if (output_file[0] != '/') {
+        if (getcwd(g_cwd, PATH_MAX) == NULL) {
+            return -errno;
+        }
+        dir = g_cwd;
+        sep = "/";
+    }
+
+    int len = snprintf(g_record, RECORD_MAX, INDEX_RECORD, tid, dir, sep, output_file);
+    if ((len < 0) || (len >= RECORD_MAX)) {
+        return -ENAMETOOLONG;
+    }
+
+    int fd = open(index_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    ssize_t ret = write(fd, g_record, (size_t)len);
+    (void)close(fd);
+
+    return (ret == len) ? 0 : -EIO;
+}
 
 /*
  * The whole part:
@@ -45,6 +83,11 @@ static char g_new_output_file[PATH_MAX] = { 0 };
  * 3. Hijacker would add some arguments and calls execve() again.
  * 4. Under layer redirects argv[0] to original path.
  * Pid would keep same.
+ *
+ * By default, the output is redirected to "<output_dir>/0x<tid>.o" and the
+ * original output path is linked to it. In capture mode, which is enabled
+ * by the index env, the output is kept at its original path and recorded
+ * into the index file instead, so no link is created for any object.
  */
 int main(int argc, char *argv[], char *envp[])
 {
@@ -105,7 +148,15 @@ int main(int argc, char *argv[], char *envp[])
     new_argv[new_argc++] = defsym_value;
     new_argv[new_argc] = NULL;
 
-    // Handle output file
+    // Handle output file, capture mode only records it
+    const char *index_file = get_hijacker_index_env();
+    if (index_file != NULL) {
+        if (append_index_record(index_file, tid, output_file) != 0) {
+            return execve(filename, argv, envp);
+        }
+        return execve(filename, (char* const*)new_argv, envp);
+    }
+
     snprintf(new_output_file, PATH_MAX, OUTPUT_PATH, output_dir, tid);
     new_argv[output_index] = new_output_file;
 
@@ -23,6 +23,7 @@
 #include <linux/limits.h>
 
 static const char *UPATCH_ENV_NAME = "UPATCH_HIJACKER";
+static const char *UPATCH_INDEX_ENV_NAME = "UPATCH_HIJACKER_INDEX";
 static const char *EXEC_SELF_PATH = "/proc/self/exe";
 static const char *OUTPUT_FLAG_NAME = "-o";
 
@@ -44,6 +45,11 @@ static inline const char* get_hijacker_env()
     return getenv(UPATCH_ENV_NAME);
 }
 
+static inline const char* get_hijacker_index_env()
+{
+    return getenv(UPATCH_INDEX_ENV_NAME);
+}
+
 static inline int find_output_flag(int argc, char* const argv[])
 {
     for (int i = 0; i < argc; i++) {
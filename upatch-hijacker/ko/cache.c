@@ -20,40 +20,128 @@
 
 #include "cache.h"
 
+#include <linux/atomic.h>
+#include <linux/limits.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
+#include <linux/topology.h>
 
 #include "log.h"
 
+/*
+ * Each cpu owns a preallocated buffer, which is claimed without waiting.
+ * The buffer may be released from another cpu after the task migrates.
+ * When it is still in use, a buffer is taken from the slab instead.
+ */
+struct path_buf {
+    bool percpu;
+    atomic_t busy;
+    char data[PATH_MAX];
+};
+
 static const char *CACHE_SLAB_NAME = "upatch_hijacker";
 
 static struct kmem_cache *g_path_cache = NULL;
 
+static DEFINE_PER_CPU(struct path_buf *, g_percpu_buf);
+static DEFINE_PER_CPU(unsigned long, g_hit_count);
+static DEFINE_PER_CPU(unsigned long, g_miss_count);
+
+static void free_percpu_bufs(void)
+{
+    int cpu = 0;
+
+    for_each_possible_cpu(cpu) {
+        struct path_buf *buf = per_cpu(g_percpu_buf, cpu);
+
+        if (buf != NULL) {
+            kmem_cache_free(g_path_cache, buf);
+            per_cpu(g_percpu_buf, cpu) = NULL;
+        }
+    }
+}
+
 int cache_init(void)
 {
+    struct path_buf *buf = NULL;
+    int cpu = 0;
+
     g_path_cache = kmem_cache_create_usercopy(CACHE_SLAB_NAME,
-        PATH_MAX, 0, SLAB_MEM_SPREAD | SLAB_ACCOUNT | SLAB_RECLAIM_ACCOUNT,
-        0, PATH_MAX, NULL);
+        sizeof(struct path_buf), 0,
+        SLAB_MEM_SPREAD | SLAB_ACCOUNT | SLAB_RECLAIM_ACCOUNT,
+        offsetof(struct path_buf, data), PATH_MAX, NULL);
     if (g_path_cache == NULL) {
         pr_err("failed to create slab '%s'\n", CACHE_SLAB_NAME);
         return -ENOMEM;
     }
+
+    for_each_possible_cpu(cpu) {
+        buf = kmem_cache_alloc_node(g_path_cache, GFP_KERNEL | __GFP_ZERO,
+            cpu_to_node(cpu));
+        if (buf == NULL) {
+            pr_err("failed to alloc path buffer for cpu %d\n", cpu);
+            cache_exit();
+            return -ENOMEM;
+        }
+        buf->percpu = true;
+        per_cpu(g_percpu_buf, cpu) = buf;
+    }
+
     return 0;
 }
 
 void cache_exit(void)
 {
+    free_percpu_bufs();
     kmem_cache_destroy(g_path_cache);
+    g_path_cache = NULL;
 }
 
 char *path_buf_alloc(void)
 {
-    return kmem_cache_alloc(g_path_cache, GFP_KERNEL);
+    struct path_buf *buf = get_cpu_var(g_percpu_buf);
+
+    if (atomic_cmpxchg(&buf->busy, 0, 1) == 0) {
+        this_cpu_inc(g_hit_count);
+        put_cpu_var(g_percpu_buf);
+        return buf->data;
+    }
+    this_cpu_inc(g_miss_count);
+    put_cpu_var(g_percpu_buf);
+
+    buf = kmem_cache_alloc(g_path_cache, GFP_KERNEL);
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf->percpu = false;
+
+    return buf->data;
 }
 
 void path_buf_free(char *buff)
 {
+    struct path_buf *buf = NULL;
+
     if (buff == NULL) {
         return;
     }
-    kmem_cache_free(g_path_cache, buff);
+
+    buf = container_of(buff, struct path_buf, data[0]);
+    if (buf->percpu) {
+        atomic_set_release(&buf->busy, 0);
+        return;
+    }
+    kmem_cache_free(g_path_cache, buf);
+}
+
+void path_buf_stats(u64 *hit, u64 *miss)
+{
+    int cpu = 0;
+
+    *hit = 0;
+    *miss = 0;
+    for_each_possible_cpu(cpu) {
+        *hit += per_cpu(g_hit_count, cpu);
+        *miss += per_cpu(g_miss_count, cpu);
+    }
 }
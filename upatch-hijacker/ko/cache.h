@@ -21,10 +21,13 @@
 #ifndef _UPATCH_HIJACKER_KO_CACHE_H
 #define _UPATCH_HIJACKER_KO_CACHE_H
 
+#include <linux/types.h>
+
 int cache_init(void);
 void cache_exit(void);
 
 char *path_buf_alloc(void);
 void path_buf_free(char *buff);
+void path_buf_stats(u64 *hit, u64 *miss);
 
 #endif /* _UPATCH_HIJACKER_KO_CACHE_H */
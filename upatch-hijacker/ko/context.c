@@ -21,7 +21,9 @@
 #include "context.h"
 
 #include <linux/fs.h>
+#include <linux/kref.h>
 #include <linux/pid_namespace.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include <linux/uprobes.h>
 
@@ -31,7 +33,9 @@
 #include "uprobe.h"
 #include "utils.h"
 
+/* context map holds one reference, ioctl handlers hold the others */
 struct context {
+    struct kref ref;
     struct pid_namespace *ns;
     struct uprobe_record *uprobe;
     struct map *hijacker_map;
@@ -40,18 +44,27 @@ struct context {
 static bool find_hijacker_context(const struct context *context,
     const struct pid_namespace *ns);
 static void free_hijacker_context(struct context *context);
+static void drop_hijacker_context(struct context *context);
+static size_t hijacker_context_keys(const struct context *context,
+    unsigned long *keys);
+static unsigned long ns_key(const struct pid_namespace *ns);
 
 static const struct map_ops HIJACK_MAP_OPS = {
     .find_value = (find_value_fn)find_hijacker_record,
     .free_value = (free_value_fn)free_hijacker_record,
+    .param_key = (param_key_fn)inode_key,
+    .value_keys = (value_keys_fn)hijacker_record_keys,
 };
 static const struct map_ops CONTEXT_MAP_OPS = {
     .find_value = (find_value_fn)find_hijacker_context,
-    .free_value = (free_value_fn)free_hijacker_context,
+    .free_value = (free_value_fn)drop_hijacker_context,
+    .param_key = (param_key_fn)ns_key,
+    .value_keys = (value_keys_fn)hijacker_context_keys,
 };
 
 static const size_t MAX_CONTEXT_NUM = 1024;
-static const size_t HIJACKER_PER_CONTEXT = 16;
+/* hijacker maps start small and grow up to the limit */
+static const size_t HIJACKER_PER_CONTEXT = 1024;
 
 static struct map *g_context_map = NULL;
 
@@ -95,6 +108,7 @@ static int create_hijacker_context(struct context **context,
         return ret;
     }
 
+    kref_init(&new_context->ref);
     new_context->ns = get_pid_ns(ns);
     new_context->uprobe = uprobe;
     new_context->hijacker_map = hijacker_map;
@@ -118,12 +132,36 @@ static void free_hijacker_context(struct context *context)
     kfree(context);
 }
 
+static void release_hijacker_context(struct kref *kref)
+{
+    free_hijacker_context(container_of(kref, struct context, ref));
+}
+
+static void drop_hijacker_context(struct context *context)
+{
+    if (context != NULL) {
+        kref_put(&context->ref, release_hijacker_context);
+    }
+}
+
 static bool find_hijacker_context(const struct context *context,
     const struct pid_namespace *ns)
 {
     return ns_equal(context->ns, ns);
 }
 
+static size_t hijacker_context_keys(const struct context *context,
+    unsigned long *keys)
+{
+    keys[0] = ns_key(context->ns);
+    return 1;
+}
+
+static unsigned long ns_key(const struct pid_namespace *ns)
+{
+    return ns->ns.inum;
+}
+
 /* Context public interface */
 int context_init(void)
 {
@@ -163,6 +201,7 @@ int build_hijacker_context(const char *path, loff_t offset)
     ret = map_insert(g_context_map, context);
     if (ret != 0) {
         pr_err("failed to register hijacker context, ret=%d\n", ret);
+        free_hijacker_context(context);
         return ret;
     }
 
@@ -180,6 +219,32 @@ size_t hijacker_context_count(void)
     return map_size(g_context_map);
 }
 
+struct context *get_hijacker_context(void)
+{
+    struct pid_namespace *ns = task_active_pid_ns(current);
+    struct context *context = NULL;
+
+    rcu_read_lock();
+    context = (struct context *)map_get(g_context_map, ns);
+    if ((context != NULL) && !kref_get_unless_zero(&context->ref)) {
+        context = NULL;
+    }
+    rcu_read_unlock();
+
+    return context;
+}
+
+void put_hijacker_context(struct context *context)
+{
+    drop_hijacker_context(context);
+}
+
+struct map *hijacker_context_map(const struct context *context)
+{
+    return context->hijacker_map;
+}
+
+/* caller must hold rcu_read_lock() while using the result */
 struct map *get_hijacker_map(void)
 {
     struct pid_namespace *ns = task_active_pid_ns(current);
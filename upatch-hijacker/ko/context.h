@@ -23,6 +23,7 @@
 
 #include <linux/types.h>
 
+struct context;
 struct map;
 
 int context_init(void);
@@ -32,6 +33,14 @@ int build_hijacker_context(const char *path, loff_t offset);
 void destroy_hijacker_context(void);
 size_t hijacker_context_count(void);
 
+/* takes a reference of the context of current pid namespace */
+struct context *get_hijacker_context(void);
+/* dropping the last reference unregisters the uprobe, thus it may sleep */
+void put_hijacker_context(struct context *context);
+/* the map lives as long as the context reference */
+struct map *hijacker_context_map(const struct context *context);
+
+/* caller must hold rcu_read_lock() while using the result */
 struct map *get_hijacker_map(void);
 
 #endif /* _UPATCH_HIJACKER_KO_CONTEXT_H */
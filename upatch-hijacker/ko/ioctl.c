@@ -27,9 +27,11 @@
 #include <linux/uaccess.h>
 
 #include "log.h"
+#include "cache.h"
 #include "map.h"
 #include "records.h"
 #include "context.h"
+#include "uprobe.h"
 #include "utils.h"
 
 static const struct file_operations HIJACKER_DEV_FOPS = {
@@ -79,18 +81,13 @@ static inline void handle_disable_hijacker(void)
     destroy_hijacker_context();
 }
 
-static inline int handle_register_hijacker(void __user *arg)
+static inline int handle_register_hijacker(struct map *hijacker_map,
+    void __user *arg)
 {
     upatch_register_request_t *msg = NULL;
-    struct map *hijacker_map = get_hijacker_map();
     struct hijacker_record *record = NULL;
     int ret = 0;
 
-    if (hijacker_map == NULL) {
-        pr_err("failed to get hijacker map\n");
-        return -EFAULT;
-    }
-
     msg = kzalloc(sizeof(upatch_register_request_t), GFP_KERNEL);
     if (msg == NULL) {
         pr_err("failed to alloc message\n");
@@ -114,7 +111,7 @@ static inline int handle_register_hijacker(void __user *arg)
 
     pr_debug("register hijacker, inode=%lu, addr=0x%lx\n",
         record->exec_inode->i_ino, (unsigned long)record);
-    ret = map_insert(get_hijacker_map(), record);
+    ret = map_insert(hijacker_map, record);
     if (ret != 0) {
         pr_err("failed to register hijacker record [%s -> %s], ret=%d\n",
             msg->exec_path, msg->jump_path, ret);
@@ -127,20 +124,14 @@ static inline int handle_register_hijacker(void __user *arg)
     return 0;
 }
 
-static inline int handle_unregister_hijacker(void __user *arg)
+static inline int handle_unregister_hijacker(struct map *hijacker_map,
+    void __user *arg)
 {
     upatch_register_request_t *msg = NULL;
-    struct map *hijacker_map = get_hijacker_map();
     struct inode *inode = NULL;
 
     int ret = 0;
 
-    if (hijacker_map == NULL) {
-        pr_err("failed to get hijacker map\n");
-        return -EFAULT;
-    }
-
-
     msg = kzalloc(sizeof(upatch_register_request_t), GFP_KERNEL);
     if (msg == NULL) {
         pr_err("failed to alloc message\n");
@@ -168,6 +159,195 @@ static inline int handle_unregister_hijacker(void __user *arg)
     return 0;
 }
 
+static inline int copy_register_batch(void __user *arg,
+    upatch_register_batch_t *batch)
+{
+    if (copy_from_user(batch, arg, sizeof(upatch_register_batch_t)) != 0) {
+        pr_err("failed to copy message from user space\n");
+        return -EFAULT;
+    }
+
+    if ((batch->count == 0) || (batch->count > UPATCH_HIJACKER_BATCH_MAX)) {
+        pr_err("invalid batch size %llu\n", batch->count);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static inline int copy_register_request(const upatch_register_batch_t *batch,
+    size_t index, upatch_register_request_t *msg)
+{
+    const upatch_register_request_t __user *requests =
+        u64_to_user_ptr(batch->requests);
+
+    if (copy_from_user(msg, &requests[index],
+        sizeof(upatch_register_request_t)) != 0) {
+        pr_err("failed to copy message from user space\n");
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static inline int handle_register_hijacker_batch(struct map *hijacker_map,
+    void __user *arg)
+{
+    upatch_register_batch_t batch = { 0 };
+    upatch_register_request_t *msg = NULL;
+    struct hijacker_record **records = NULL;
+    size_t created = 0;
+    size_t i = 0;
+    int ret = 0;
+
+    ret = copy_register_batch(arg, &batch);
+    if (ret != 0) {
+        return ret;
+    }
+
+    msg = kzalloc(sizeof(upatch_register_request_t), GFP_KERNEL);
+    records = kcalloc(batch.count, sizeof(struct hijacker_record *),
+        GFP_KERNEL);
+    if ((msg == NULL) || (records == NULL)) {
+        pr_err("failed to alloc message\n");
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* resolve all paths first, thus the map is changed only once */
+    for (created = 0; created < batch.count; created++) {
+        ret = copy_register_request(&batch, created, msg);
+        if (ret != 0) {
+            goto out_free_records;
+        }
+
+        ret = create_hijacker_record(&records[created], msg->exec_path,
+            msg->jump_path);
+        if (ret != 0) {
+            pr_err("failed to create hijacker record [%s -> %s], ret=%d\n",
+                msg->exec_path, msg->jump_path, ret);
+            goto out_free_records;
+        }
+    }
+
+    pr_debug("register hijackers, count=%llu\n", batch.count);
+    ret = map_insert_batch(hijacker_map, (void **)records, batch.count);
+    if (ret != 0) {
+        pr_err("failed to register %llu hijacker records, ret=%d\n",
+            batch.count, ret);
+        goto out_free_records;
+    }
+    goto out;
+
+out_free_records:
+    for (i = 0; i < created; i++) {
+        free_hijacker_record(records[i]);
+    }
+out:
+    kfree(records);
+    kfree(msg);
+    return ret;
+}
+
+static inline int handle_unregister_hijacker_batch(struct map *hijacker_map,
+    void __user *arg)
+{
+    upatch_register_batch_t batch = { 0 };
+    upatch_register_request_t *msg = NULL;
+    struct inode **inodes = NULL;
+    size_t i = 0;
+    int ret = 0;
+
+    ret = copy_register_batch(arg, &batch);
+    if (ret != 0) {
+        return ret;
+    }
+
+    msg = kzalloc(sizeof(upatch_register_request_t), GFP_KERNEL);
+    inodes = kcalloc(batch.count, sizeof(struct inode *), GFP_KERNEL);
+    if ((msg == NULL) || (inodes == NULL)) {
+        pr_err("failed to alloc message\n");
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < batch.count; i++) {
+        ret = copy_register_request(&batch, i, msg);
+        if (ret != 0) {
+            goto out;
+        }
+
+        inodes[i] = path_inode(msg->exec_path);
+        if (inodes[i] == NULL) {
+            pr_err("failed to get file inode, path=%s\n", msg->exec_path);
+            ret = -ENOENT;
+            goto out;
+        }
+    }
+
+    pr_debug("remove hijackers, count=%llu\n", batch.count);
+    map_remove_batch(hijacker_map, (const void **)inodes, batch.count);
+
+out:
+    kfree(inodes);
+    kfree(msg);
+    return ret;
+}
+
+typedef int (*map_handler_fn)(struct map *hijacker_map, void __user *arg);
+
+/*
+ * The context may be disabled by another thread meanwhile, a reference
+ * keeps its map until the handler returns, which may sleep in between.
+ */
+static inline int handle_with_hijacker_map(map_handler_fn handler,
+    void __user *arg)
+{
+    struct context *context = get_hijacker_context();
+    int ret = 0;
+
+    if (context == NULL) {
+        pr_err("failed to get hijacker map\n");
+        return -EFAULT;
+    }
+
+    ret = handler(hijacker_context_map(context), arg);
+    put_hijacker_context(context);
+
+    return ret;
+}
+
+static inline int handle_get_stats(void __user *arg)
+{
+    upatch_stats_t msg = { 0 };
+    u64 hit = 0;
+    u64 miss = 0;
+
+    path_buf_stats(&hit, &miss);
+    msg.path_buf_hit = hit;
+    msg.path_buf_miss = miss;
+
+    if (copy_to_user(arg, &msg, sizeof(upatch_stats_t)) != 0) {
+        pr_err("failed to copy message to user space\n");
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static inline int handle_get_uprobe_stats(void __user *arg)
+{
+    upatch_uprobe_stats_t msg;
+
+    uprobe_stats(&msg);
+    if (copy_to_user(arg, &msg, sizeof(upatch_uprobe_stats_t)) != 0) {
+        pr_err("failed to copy message to user space\n");
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
 int ioctl_init(void)
 {
     int ret = 0;
@@ -203,10 +383,26 @@ long handle_ioctl(struct file *file,
         handle_disable_hijacker();
         break;
     case UPATCH_HIJACKER_REGISTER:
-        ret = handle_register_hijacker((void __user *)arg);
+        ret = handle_with_hijacker_map(handle_register_hijacker,
+            (void __user *)arg);
         break;
     case UPATCH_HIJACKER_UNREGISTER:
-        ret = handle_unregister_hijacker((void __user *)arg);
+        ret = handle_with_hijacker_map(handle_unregister_hijacker,
+            (void __user *)arg);
+        break;
+    case UPATCH_HIJACKER_STATS:
+        ret = handle_get_stats((void __user *)arg);
+        break;
+    case UPATCH_HIJACKER_REGISTER_BATCH:
+        ret = handle_with_hijacker_map(handle_register_hijacker_batch,
+            (void __user *)arg);
+        break;
+    case UPATCH_HIJACKER_UNREGISTER_BATCH:
+        ret = handle_with_hijacker_map(handle_unregister_hijacker_batch,
+            (void __user *)arg);
+        break;
+    case UPATCH_HIJACKER_UPROBE_STATS:
+        ret = handle_get_uprobe_stats((void __user *)arg);
         break;
     default:
         ret = -EBADMSG;
@@ -35,6 +35,17 @@
     upatch_register_request_t)
 #define UPATCH_HIJACKER_UNREGISTER _IOW(UPATCH_HIJACKER_IOC_MAGIC, 0x4, \
     upatch_register_request_t)
+#define UPATCH_HIJACKER_STATS _IOR(UPATCH_HIJACKER_IOC_MAGIC, 0x5, \
+    upatch_stats_t)
+#define UPATCH_HIJACKER_REGISTER_BATCH _IOW(UPATCH_HIJACKER_IOC_MAGIC, 0x6, \
+    upatch_register_batch_t)
+#define UPATCH_HIJACKER_UNREGISTER_BATCH _IOW(UPATCH_HIJACKER_IOC_MAGIC, 0x7, \
+    upatch_register_batch_t)
+#define UPATCH_HIJACKER_UPROBE_STATS _IOR(UPATCH_HIJACKER_IOC_MAGIC, 0x8, \
+    upatch_uprobe_stats_t)
+
+#define UPATCH_HIJACKER_BATCH_MAX 64
+#define UPATCH_HIJACKER_LATENCY_NUM 16
 
 typedef struct {
     char path[PATH_MAX];
@@ -46,6 +57,32 @@ typedef struct {
     char jump_path[PATH_MAX];
 } upatch_register_request_t;
 
+/* requests points to an array of upatch_register_request_t */
+typedef struct {
+    __u64 count;
+    __u64 requests;
+} upatch_register_batch_t;
+
+typedef struct {
+    __u64 path_buf_hit;
+    __u64 path_buf_miss;
+} upatch_stats_t;
+
+/*
+ * Results of handle_uprobe, since the module is loaded.
+ * Latency bucket 0 counts calls below 1us, bucket i counts [2^(i-1), 2^i) us,
+ * the last one counts all slower calls.
+ */
+typedef struct {
+    __u64 hits;
+    __u64 hijacks;
+    __u64 miss_no_record;
+    __u64 miss_read_path;
+    __u64 miss_no_inode;
+    __u64 miss_error;
+    __u64 latency[UPATCH_HIJACKER_LATENCY_NUM];
+} upatch_uprobe_stats_t;
+
 struct file;
 
 int ioctl_init(void);
@@ -20,84 +20,226 @@
 
 #include "map.h"
 
+#include <linux/hash.h>
 #include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/mutex.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
 
 #include "log.h"
 
+#define MAP_INIT_CAPACITY 16
+
+struct map_entry;
+
+struct map_node {
+    struct hlist_node node;
+    unsigned long key;
+    struct map_entry *entry;
+};
+
 struct map_entry {
     struct map *parent;
     void *value;
     struct kref ref;
+    struct list_head list;
+    size_t key_num;
+    struct map_node nodes[MAP_MAX_KEYS];
 };
 
+struct map_table {
+    struct rcu_head rcu;
+    unsigned int bits;
+    struct hlist_head buckets[];
+};
+
+/*
+ * Writers are serialized by the mutex, readers walk the buckets under rcu.
+ * Removed entries are freed after a grace period.
+ * The table grows with the map, readers which raced with rehashing may
+ * miss an entry, thus they retry by the sequence count.
+ */
 struct map {
     struct mutex lock;
+    seqcount_t seq;
     size_t length;
     size_t capacity;
     const struct map_ops *ops;
-    struct map_entry entries[];
+    struct list_head entries;
+    struct map_table __rcu *table;
 };
 
 /* Map private interface */
-static inline void insert_entry(struct map_entry *entry, struct map *parent,
-    void *value)
+static inline struct hlist_head *key_bucket(struct map_table *table,
+    unsigned long key)
+{
+    return &table->buckets[hash_long(key, table->bits)];
+}
+
+static inline struct map_table *map_table(struct map *map)
+{
+    return rcu_dereference_check(map->table, lockdep_is_held(&map->lock));
+}
+
+/* keep load factor below 1/2 with two keys per value */
+static inline unsigned int table_bits(size_t length)
+{
+    return ilog2(roundup_pow_of_two(max_t(size_t, length, 1) * MAP_MAX_KEYS));
+}
+
+static inline struct map_table *new_table(unsigned int bits)
+{
+    struct map_table *table = NULL;
+
+    table = kzalloc(struct_size(table, buckets, 1UL << bits), GFP_KERNEL);
+    if (table == NULL) {
+        return NULL;
+    }
+    table->bits = bits;
+
+    return table;
+}
+
+/* rehash all entries into a larger table, caller holds the map lock */
+static int grow_table(struct map *map, size_t length)
+{
+    struct map_table *old_table = map_table(map);
+    struct map_table *table = NULL;
+    struct map_entry *entry = NULL;
+    unsigned int bits = table_bits(length);
+    size_t i = 0;
+
+    if (bits <= old_table->bits) {
+        return 0;
+    }
+
+    table = new_table(bits);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    pr_debug("grow map table, map=0x%lx, bits=%u\n", (unsigned long)map, bits);
+    preempt_disable();
+    write_seqcount_begin(&map->seq);
+    list_for_each_entry(entry, &map->entries, list) {
+        for (i = 0; i < entry->key_num; i++) {
+            hlist_del_rcu(&entry->nodes[i].node);
+            hlist_add_head_rcu(&entry->nodes[i].node,
+                key_bucket(table, entry->nodes[i].key));
+        }
+    }
+    rcu_assign_pointer(map->table, table);
+    write_seqcount_end(&map->seq);
+    preempt_enable();
+
+    kfree_rcu(old_table, rcu);
+    return 0;
+}
+
+static inline struct map_entry *new_entry(struct map *parent, void *value)
 {
-    pr_debug("insert map entry, map=0x%lx, index=%lu, value=0x%lx\n",
-        (unsigned long)parent, (entry - &parent->entries[0]),
-        (unsigned long)value);
+    struct map_entry *entry = NULL;
+    unsigned long keys[MAP_MAX_KEYS];
+    size_t key_num = 0;
+    size_t i = 0;
+
+    key_num = parent->ops->value_keys(value, keys);
+    if ((key_num == 0) || (key_num > MAP_MAX_KEYS)) {
+        return NULL;
+    }
+
+    entry = kzalloc(sizeof(struct map_entry), GFP_KERNEL);
+    if (entry == NULL) {
+        return NULL;
+    }
+
     entry->parent = parent;
     entry->value = value;
+    entry->key_num = key_num;
     kref_init(&entry->ref);
+    for (i = 0; i < key_num; i++) {
+        entry->nodes[i].key = keys[i];
+        entry->nodes[i].entry = entry;
+    }
+
+    return entry;
 }
 
-static inline void remove_entry(struct map_entry *entry)
+static inline void insert_entry(struct map_entry *entry)
 {
     struct map *parent = entry->parent;
-    void *value = entry->value;
+    struct map_table *table = map_table(parent);
+    size_t i = 0;
 
-    if (value == NULL) {
-        return;
+    pr_debug("insert map entry, map=0x%lx, key=%lu, value=0x%lx\n",
+        (unsigned long)parent, entry->nodes[0].key,
+        (unsigned long)entry->value);
+    for (i = 0; i < entry->key_num; i++) {
+        hlist_add_head_rcu(&entry->nodes[i].node,
+            key_bucket(table, entry->nodes[i].key));
     }
+    list_add_tail(&entry->list, &parent->entries);
+    WRITE_ONCE(parent->length, parent->length + 1);
+}
+
+static inline void unhash_entry(struct map_entry *entry)
+{
+    struct map *parent = entry->parent;
+    size_t i = 0;
 
-    pr_debug("remove map entry, map=0x%lx, index=%lu\n", (unsigned long)parent,
-        (entry - &parent->entries[0]));
-    entry->parent = NULL;
-    entry->value = NULL;
-    parent->ops->free_value(value);
+    pr_debug("remove map entry, map=0x%lx, key=%lu\n", (unsigned long)parent,
+        entry->nodes[0].key);
+    for (i = 0; i < entry->key_num; i++) {
+        hlist_del_rcu(&entry->nodes[i].node);
+    }
+    list_del(&entry->list);
+    WRITE_ONCE(parent->length, parent->length - 1);
 }
 
 static inline void release_entry(struct kref *kref)
 {
-    remove_entry(container_of(kref, struct map_entry, ref));
+    unhash_entry(container_of(kref, struct map_entry, ref));
+}
+
+/* must be called after a grace period since the entry was unhashed */
+static inline void free_entry(struct map_entry *entry)
+{
+    entry->parent->ops->free_value(entry->value);
+    kfree(entry);
 }
 
 static inline struct map_entry *lookup_entry(struct map *map, const void *param)
 {
-    struct map_entry *entry = NULL;
-    size_t i = 0;
+    unsigned long key = map->ops->param_key(param);
+    struct map_node *node = NULL;
 
-    for (i = 0; i < map->capacity; i++) {
-        entry = &map->entries[i];
-        if (entry->value == NULL) {
+    hlist_for_each_entry_rcu(node, key_bucket(map_table(map), key), node,
+        lockdep_is_held(&map->lock)) {
+        if (node->key != key) {
             continue;
         }
-        if (map->ops->find_value(entry->value, param)) {
-            return entry;
+        if (map->ops->find_value(node->entry->value, param)) {
+            return node->entry;
         }
     }
 
     return NULL;
 }
 
-static inline struct map_entry *lookup_free_entry(struct map *map)
+/* find an entry with the same identity key, caller holds the map lock */
+static inline struct map_entry *lookup_same_entry(struct map *map,
+    const struct map_entry *entry)
 {
-    size_t i = 0;
+    unsigned long key = entry->nodes[0].key;
+    struct map_node *node = NULL;
 
-    for (i = 0; i < map->capacity; i++) {
-        if (map->entries[i].value == NULL) {
-            return &map->entries[i];
+    hlist_for_each_entry_rcu(node, key_bucket(map_table(map), key), node,
+        lockdep_is_held(&map->lock)) {
+        if (node->entry->nodes[0].key == key) {
+            return node->entry;
         }
     }
 
@@ -108,23 +250,29 @@ static inline struct map_entry *lookup_free_entry(struct map *map)
 int new_map(struct map **map, size_t capacity, const struct map_ops *ops)
 {
     struct map *new_map = NULL;
-    size_t map_size = 0;
+    struct map_table *table = NULL;
 
     if ((map == NULL) || (capacity == 0) || (ops == NULL)) {
         return -EINVAL;
     }
 
-    map_size += sizeof(struct map);
-    map_size += sizeof(struct map_entry) * capacity;
-
-    new_map = kzalloc(map_size, GFP_KERNEL);
+    new_map = kzalloc(sizeof(struct map), GFP_KERNEL);
     if (new_map == NULL) {
         return -ENOMEM;
     }
 
+    table = new_table(table_bits(min_t(size_t, capacity, MAP_INIT_CAPACITY)));
+    if (table == NULL) {
+        kfree(new_map);
+        return -ENOMEM;
+    }
+
     mutex_init(&new_map->lock);
+    seqcount_init(&new_map->seq);
+    INIT_LIST_HEAD(&new_map->entries);
     new_map->ops = ops;
     new_map->capacity = capacity;
+    RCU_INIT_POINTER(new_map->table, table);
 
     *map = new_map;
     return 0;
@@ -132,8 +280,9 @@ int new_map(struct map **map, size_t capacity, const struct map_ops *ops)
 
 void free_map(struct map *map)
 {
-    size_t capacity = 0;
-    size_t i = 0;
+    struct map_entry *entry = NULL;
+    struct map_entry *tmp = NULL;
+    LIST_HEAD(removed);
 
     if (map == NULL) {
         return;
@@ -141,97 +290,177 @@ void free_map(struct map *map)
 
     mutex_lock(&map->lock);
 
-    capacity = map->capacity;
-    map->length = 0;
-    map->capacity = 0;
-    for (i = 0; i < capacity; i++) {
-        remove_entry(&map->entries[i]);
+    list_for_each_entry_safe(entry, tmp, &map->entries, list) {
+        unhash_entry(entry);
+        list_add_tail(&entry->list, &removed);
     }
+    map->capacity = 0;
 
     mutex_unlock(&map->lock);
-    mutex_destroy(&map->lock);
 
+    synchronize_rcu();
+    list_for_each_entry_safe(entry, tmp, &removed, list) {
+        free_entry(entry);
+    }
+
+    mutex_destroy(&map->lock);
+    kfree(rcu_dereference_protected(map->table, true));
     kfree(map);
 }
 
 int map_insert(struct map *map, void *value)
 {
-    struct map_entry *entry = NULL;
+    return map_insert_batch(map, &value, 1);
+}
 
-    if ((map == NULL) || (value == NULL)) {
+int map_insert_batch(struct map *map, void **values, size_t count)
+{
+    struct map_entry **entries = NULL;
+    struct map_entry *same_entry = NULL;
+    size_t new_num = 0;
+    size_t i = 0;
+    int ret = 0;
+
+    if ((map == NULL) || (values == NULL) || (count == 0)) {
         return -EINVAL;
     }
 
+    entries = kcalloc(count, sizeof(struct map_entry *), GFP_KERNEL);
+    if (entries == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < count; i++) {
+        entries[i] = (values[i] != NULL) ? new_entry(map, values[i]) : NULL;
+        if (entries[i] == NULL) {
+            ret = (values[i] != NULL) ? -ENOMEM : -EINVAL;
+            goto out_free;
+        }
+    }
+
     /*
-     * try to find the record
+     * try to find the records
      * if found, increase refence
-     * if not found, create a new entry
+     * if not found, insert the new entry
+     * nothing is changed unless all entries fit into the map
      */
     mutex_lock(&map->lock);
 
-    entry = lookup_entry(map, value);
-    if (entry != NULL) {
+    for (i = 0; i < count; i++) {
+        if (lookup_same_entry(map, entries[i]) == NULL) {
+            new_num++;
+        }
+    }
+
+    if (map->length + new_num > map->capacity) {
         mutex_unlock(&map->lock);
-        kref_get(&entry->ref);
-        return 0;
+        ret = -ENOBUFS;
+        goto out_free;
     }
 
-    entry = lookup_free_entry(map);
-    if (entry == NULL) {
+    ret = grow_table(map, map->length + new_num);
+    if (ret != 0) {
         mutex_unlock(&map->lock);
-        return -ENOBUFS;
+        goto out_free;
     }
 
-    insert_entry(entry, map, value);
-    map->length++;
+    for (i = 0; i < count; i++) {
+        same_entry = lookup_same_entry(map, entries[i]);
+        if (same_entry != NULL) {
+            kref_get(&same_entry->ref);
+            continue;
+        }
+        insert_entry(entries[i]);
+        entries[i] = NULL;
+    }
 
     mutex_unlock(&map->lock);
 
+    /* duplicated values were never visible to readers */
+    for (i = 0; i < count; i++) {
+        if (entries[i] != NULL) {
+            free_entry(entries[i]);
+        }
+    }
+    kfree(entries);
+
     return 0;
+
+out_free:
+    /* values are still owned by the caller */
+    for (i = 0; i < count; i++) {
+        kfree(entries[i]);
+    }
+    kfree(entries);
+
+    return ret;
 }
 
 void map_remove(struct map *map, const void *param)
+{
+    map_remove_batch(map, &param, 1);
+}
+
+void map_remove_batch(struct map *map, const void **params, size_t count)
 {
     struct map_entry *entry = NULL;
+    struct map_entry *tmp = NULL;
+    LIST_HEAD(removed);
+    size_t i = 0;
 
-    if ((map == NULL) || (param == NULL)) {
+    if ((map == NULL) || (params == NULL)) {
         return;
     }
 
     mutex_lock(&map->lock);
 
-    entry = lookup_entry(map, param);
-    if (entry == NULL) {
-        mutex_unlock(&map->lock);
-        return;
-    }
+    for (i = 0; i < count; i++) {
+        if (params[i] == NULL) {
+            continue;
+        }
+
+        entry = lookup_entry(map, params[i]);
+        if (entry == NULL) {
+            continue;
+        }
 
-    // decrease reference and try to free
-    if (kref_put(&entry->ref, release_entry)) {
-        map->length--;
-    };
+        // decrease reference and try to unhash
+        if (kref_put(&entry->ref, release_entry)) {
+            list_add_tail(&entry->list, &removed);
+        }
+    }
 
     mutex_unlock(&map->lock);
+
+    if (list_empty(&removed)) {
+        return;
+    }
+
+    // wait for readers, which may still use the values
+    synchronize_rcu();
+    list_for_each_entry_safe(entry, tmp, &removed, list) {
+        free_entry(entry);
+    }
 }
 
 void *map_get(struct map *map, const void *param)
 {
     struct map_entry *entry = NULL;
+    unsigned int seq = 0;
 
     if ((map == NULL) || (param == NULL)) {
         return NULL;
     }
 
-    mutex_lock(&map->lock);
-
-    entry = lookup_entry(map, param);
-
-    mutex_unlock(&map->lock);
+    do {
+        seq = read_seqcount_begin(&map->seq);
+        entry = lookup_entry(map, param);
+    } while ((entry == NULL) && read_seqcount_retry(&map->seq, seq));
 
     return (entry != NULL) ? entry->value : NULL;
 }
 
 size_t map_size(const struct map *map)
 {
-    return (map != NULL) ? map->length : 0;
+    return (map != NULL) ? READ_ONCE(map->length) : 0;
 }
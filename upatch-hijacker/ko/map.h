@@ -23,20 +23,38 @@
 
 #include <linux/types.h>
 
+#define MAP_MAX_KEYS 2
+
 typedef bool (*find_value_fn)(const void *value, const void *param);
 typedef void (*free_value_fn)(void *value);
+typedef unsigned long (*param_key_fn)(const void *param);
+typedef size_t (*value_keys_fn)(const void *value, unsigned long *keys);
 
+/*
+ * A value is hashed by up to MAP_MAX_KEYS keys, the first one identifies
+ * the value. A param is hashed to a single key, find_value() resolves
+ * hash collisions.
+ */
 struct map_ops {
     find_value_fn find_value;
     free_value_fn free_value;
+    param_key_fn param_key;
+    value_keys_fn value_keys;
 };
 struct map;
 
+/* capacity limits the length, buckets are allocated as the map grows */
 int new_map(struct map **map, size_t capacity, const struct map_ops *ops);
 void free_map(struct map *map);
 
+/* map takes the value on success, a duplicated value is freed */
 int map_insert(struct map *map, void *value);
+/* either all values are taken, or none of them, the table grows on demand */
+int map_insert_batch(struct map *map, void **values, size_t count);
 void map_remove(struct map *map, const void *param);
+/* removed values are freed after a single grace period */
+void map_remove_batch(struct map *map, const void **params, size_t count);
+/* caller must hold rcu_read_lock() while using the value */
 void *map_get(struct map *map, const void *param);
 size_t map_size(const struct map *map);
 
@@ -100,7 +100,7 @@ int create_hijacker_record(struct hijacker_record **record,
     }
 
     new_record = kzalloc(sizeof(struct hijacker_record), GFP_KERNEL);
-    if (record == NULL) {
+    if (new_record == NULL) {
         return -ENOMEM;
     }
 
@@ -130,3 +130,19 @@ bool find_hijacker_record(const struct hijacker_record *record,
     return (inode_equal(record->exec_inode, inode) ||
         inode_equal(record->jump_inode, inode));
 }
+
+size_t hijacker_record_keys(const struct hijacker_record *record,
+    unsigned long *keys)
+{
+    keys[0] = inode_key(record->exec_inode);
+    if (inode_equal(record->exec_inode, record->jump_inode)) {
+        return 1;
+    }
+    keys[1] = inode_key(record->jump_inode);
+    return 2;
+}
+
+unsigned long inode_key(const struct inode *inode)
+{
+    return inode->i_ino;
+}
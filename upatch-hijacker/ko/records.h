@@ -52,5 +52,8 @@ int create_hijacker_record(struct hijacker_record **record,
 void free_hijacker_record(struct hijacker_record *record);
 bool find_hijacker_record(const struct hijacker_record *record,
     const struct inode *inode);
+size_t hijacker_record_keys(const struct hijacker_record *record,
+    unsigned long *keys);
+unsigned long inode_key(const struct inode *inode);
 
 #endif /* _UPATCH_HIJACKER_KO_ENTITY_H */
@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-hijacker kernel module
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM upatch_hijacker
+
+#if !defined(_UPATCH_HIJACKER_KO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UPATCH_HIJACKER_KO_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+/* __assign_str() takes the source from __string() since v6.10 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define hijacker_assign_str(dst, src) __assign_str(dst)
+#else
+#define hijacker_assign_str(dst, src) __assign_str(dst, src)
+#endif
+
+/* Execve of a registered compiler, argv0 is redirected to jump_path */
+TRACE_EVENT(hijacker_hit,
+    TP_PROTO(const char *elf_path, const char *jump_path),
+    TP_ARGS(elf_path, jump_path),
+    TP_STRUCT__entry(
+        __string(elf_path, elf_path)
+        __string(jump_path, jump_path)
+    ),
+    TP_fast_assign(
+        hijacker_assign_str(elf_path, elf_path);
+        hijacker_assign_str(jump_path, jump_path);
+    ),
+    TP_printk("elf_path=%s jump_path=%s", __get_str(elf_path), __get_str(jump_path))
+);
+
+/* Execve is probed while hijackers are registered, but is not hijacked */
+TRACE_EVENT(hijacker_miss,
+    TP_PROTO(const char *elf_path, const char *reason),
+    TP_ARGS(elf_path, reason),
+    TP_STRUCT__entry(
+        __string(elf_path, elf_path)
+        __string(reason, reason)
+    ),
+    TP_fast_assign(
+        hijacker_assign_str(elf_path, elf_path);
+        hijacker_assign_str(reason, reason);
+    ),
+    TP_printk("elf_path=%s reason=%s", __get_str(elf_path), __get_str(reason))
+);
+
+#endif /* _UPATCH_HIJACKER_KO_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
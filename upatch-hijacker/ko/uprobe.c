@@ -20,11 +20,16 @@
 
 #include "uprobe.h"
 
+#include <linux/bitops.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
 #include <linux/mman.h>
 #include <linux/namei.h>
 #include <linux/uprobes.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 
 #include "log.h"
@@ -34,6 +39,9 @@
 #include "cache.h"
 #include "utils.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 #ifdef __x86_64__
 #define _reg_argv0 regs->di
 #endif
@@ -42,6 +50,23 @@
 #define _reg_argv0 regs->regs[0]
 #endif
 
+enum uprobe_result {
+    UPROBE_IGNORED, /* nothing is registered */
+    UPROBE_HIJACKED,
+    UPROBE_NO_RECORD,
+    UPROBE_READ_PATH_FAILED,
+    UPROBE_NO_INODE,
+    UPROBE_FAILED,
+    UPROBE_RESULT_NUM,
+};
+
+struct uprobe_counters {
+    unsigned long results[UPROBE_RESULT_NUM];
+    unsigned long latency[UPATCH_HIJACKER_LATENCY_NUM];
+};
+
+static DEFINE_PER_CPU(struct uprobe_counters, g_uprobe_counters);
+
 /* Uprobe private interface */
 static inline char* read_user_str(char *dst, const char __user *src, size_t count)
 {
@@ -86,13 +111,11 @@ static inline const char *select_jump_path(const struct hijacker_record *record,
     return NULL;
 }
 
-/* Uprobe public interface */
-int handle_uprobe(struct uprobe_consumer *self, struct pt_regs *regs)
+static enum uprobe_result hijack_execve(struct pt_regs *regs)
 {
     const char __user *argv0 = (const char __user *)_reg_argv0;
     const char __user *new_argv0 = NULL;
 
-    struct map *hijacker_map = get_hijacker_map();
     const struct hijacker_record *record = NULL;
 
     const char *elf_path = NULL;
@@ -101,55 +124,71 @@ int handle_uprobe(struct uprobe_consumer *self, struct pt_regs *regs)
     const struct inode *inode = NULL;
     char *path_buff = NULL;
     size_t path_len = 0;
+    size_t record_num = 0;
 
     if ((argv0 == NULL) || (hijacker_context_count() == 0)) {
-        return 0;
+        return UPROBE_IGNORED;
     }
 
-    if (map_size(hijacker_map) == 0) {
-        return 0;
+    rcu_read_lock();
+    record_num = map_size(get_hijacker_map());
+    rcu_read_unlock();
+    if (record_num == 0) {
+        return UPROBE_IGNORED;
     }
 
     path_buff = path_buf_alloc();
     if (path_buff == NULL) {
         pr_err_ratelimited("failed to alloc path cache\n");
-        return 0;
+        return UPROBE_FAILED;
     }
 
     elf_path = read_user_str(path_buff, argv0, PATH_MAX);
     if (elf_path == NULL) {
         pr_err_ratelimited("failed to read execve argument from userspace\n");
         path_buf_free(path_buff);
-        return 0;
+        return UPROBE_READ_PATH_FAILED;
     }
 
     inode = path_inode(elf_path);
     if (inode == NULL) {
+        trace_hijacker_miss(elf_path, "no inode");
         path_buf_free(path_buff);
-        return 0;
+        return UPROBE_NO_INODE;
     }
 
-    record = (const struct hijacker_record *)map_get(hijacker_map, inode);
+    /* record may be removed once leaving rcu, copy the jump path out */
+    rcu_read_lock();
+
+    record = (const struct hijacker_record *)map_get(get_hijacker_map(), inode);
     if (record == NULL) {
+        rcu_read_unlock();
         pr_debug("record not found, elf_path=%s\n", elf_path);
+        trace_hijacker_miss(elf_path, "no record");
         path_buf_free(path_buff);
-        return 0;
+        return UPROBE_NO_RECORD;
     }
 
     jump_path = select_jump_path(record, inode);
     if (jump_path == NULL) {
+        rcu_read_unlock();
         pr_err_ratelimited("failed to find jump path, elf_path=%s\n", elf_path);
+        trace_hijacker_miss(elf_path, "no jump path");
         path_buf_free(path_buff);
-        return 0;
+        return UPROBE_FAILED;
     }
-    path_len = strnlen(jump_path, PATH_MAX) + 1;
     pr_debug("[hijacked] elf_path=%s, jump_path=%s\n", elf_path, jump_path);
+    trace_hijacker_hit(elf_path, jump_path);
+    strlcpy(path_buff, jump_path, PATH_MAX);
+    path_len = strnlen(path_buff, PATH_MAX) + 1;
+
+    rcu_read_unlock();
 
-    new_argv0 = new_user_str(jump_path, path_len);
+    new_argv0 = new_user_str(path_buff, path_len);
     if (new_argv0 == NULL) {
         pr_err_ratelimited("failed to write new execve argument\n");
         path_buf_free(path_buff);
-        return 0;
+        return UPROBE_FAILED;
     }
 
     path_buf_free(path_buff);
@@ -158,5 +197,44 @@ int handle_uprobe(struct uprobe_consumer *self, struct pt_regs *regs)
     // since it would be used by execve
     _reg_argv0 = (unsigned long)new_argv0;
 
+    return UPROBE_HIJACKED;
+}
+
+/* Uprobe public interface */
+int handle_uprobe(struct uprobe_consumer *self, struct pt_regs *regs)
+{
+    u64 start = ktime_get_ns();
+    enum uprobe_result result = hijack_execve(regs);
+    u64 elapsed_us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+    unsigned int bucket = min_t(unsigned int, fls64(elapsed_us),
+        UPATCH_HIJACKER_LATENCY_NUM - 1);
+
+    /* task may sleep & migrate meanwhile, counters are summed up anyway */
+    this_cpu_inc(g_uprobe_counters.results[result]);
+    this_cpu_inc(g_uprobe_counters.latency[bucket]);
+
     return 0; // always return 0, so that execve would never fail
 }
+
+void uprobe_stats(upatch_uprobe_stats_t *stats)
+{
+    int cpu = 0;
+    int i = 0;
+
+    memset(stats, 0, sizeof(upatch_uprobe_stats_t));
+    for_each_possible_cpu(cpu) {
+        const struct uprobe_counters *counters = per_cpu_ptr(&g_uprobe_counters, cpu);
+
+        for (i = 0; i < UPROBE_RESULT_NUM; i++) {
+            stats->hits += counters->results[i];
+        }
+        stats->hijacks += counters->results[UPROBE_HIJACKED];
+        stats->miss_no_record += counters->results[UPROBE_NO_RECORD];
+        stats->miss_read_path += counters->results[UPROBE_READ_PATH_FAILED];
+        stats->miss_no_inode += counters->results[UPROBE_NO_INODE];
+        stats->miss_error += counters->results[UPROBE_FAILED];
+        for (i = 0; i < UPATCH_HIJACKER_LATENCY_NUM; i++) {
+            stats->latency[i] += counters->latency[i];
+        }
+    }
+}
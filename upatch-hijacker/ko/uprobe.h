@@ -23,9 +23,12 @@
 
 #include <linux/types.h>
 
+#include "ioctl.h"
+
 struct uprobe_consumer;
 struct pt_regs;
 
 int handle_uprobe(struct uprobe_consumer *self, struct pt_regs *regs);
+void uprobe_stats(upatch_uprobe_stats_t *stats);
 
 #endif /* _UPATCH_HIJACKER_KO_UPROBE_H */
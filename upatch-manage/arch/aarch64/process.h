@@ -25,4 +25,9 @@
 #define MAX_DISTANCE 0x8000000
 #endif
 
+/* Reach of pc relative data references, patch beyond it cannot be relocated */
+#ifndef MAX_DATA_DISTANCE
+#define MAX_DATA_DISTANCE 0x100000000UL
+#endif
+
 #endif
\ No newline at end of file
@@ -56,6 +56,68 @@ int upatch_arch_syscall_remote(struct upatch_ptrace_ctx *pctx, int nr,
 	return ret;
 }
 
+/* Syscall table is placed below the stack pointer of the stopped thread */
+#define REMOTE_STACK_RESERVE 256
+
+int upatch_arch_syscall_remote_batch(struct upatch_ptrace_ctx *pctx,
+				     struct upatch_remote_syscall *calls,
+				     size_t num)
+{
+	struct user_regs_struct regs;
+	struct iovec regs_iov;
+	size_t size = num * sizeof(*calls);
+	unsigned long table;
+
+	/* x19 points to the current entry, x20 counts the left ones */
+	unsigned char syscall[] = {
+		0x68, 0x02, 0x40, 0xa9, // 0xa9400268 loop: ldp x8, x0, [x19]
+		0x61, 0x0a, 0x41, 0xa9, // 0xa9410a61 ldp x1, x2, [x19, #16]
+		0x63, 0x12, 0x42, 0xa9, // 0xa9421263 ldp x3, x4, [x19, #32]
+		0x65, 0x1a, 0x40, 0xf9, // 0xf9401a65 ldr x5, [x19, #48]
+		0x01, 0x00, 0x00, 0xd4, // 0xd4000001 svc #0
+		0x60, 0x1e, 0x00, 0xf9, // 0xf9001e60 str x0, [x19, #56]
+		0x1f, 0xfc, 0x3f, 0xb1, // 0xb13ffc1f cmn x0, #4095
+		0x82, 0x00, 0x00, 0x54, // 0x54000082 b.hs done
+		0x73, 0x02, 0x01, 0x91, // 0x91010273 add x19, x19, #64
+		0x94, 0x06, 0x00, 0xf1, // 0xf1000694 subs x20, x20, #1
+		0xc1, 0xfe, 0xff, 0x54, // 0x54fffec1 b.ne loop
+		0xa0, 0x00, 0x20, 0xd4, // 0xd42000a0 done: brk #5
+	};
+	int ret;
+
+	regs_iov.iov_base = &regs;
+	regs_iov.iov_len = sizeof(regs);
+	ret = ptrace(PTRACE_GETREGSET, pctx->pid, (void *)NT_PRSTATUS,
+		     (void *)&regs_iov);
+	if (ret < 0) {
+		log_error("can't get regs - %d\n", pctx->pid);
+		return -1;
+	}
+
+	table = (regs.sp - REMOTE_STACK_RESERVE - size) & ~0xfUL;
+	ret = upatch_process_mem_write(pctx->proc, calls, table, size);
+	if (ret < 0) {
+		log_error("can't poke syscall table - %d\n", pctx->pid);
+		return -1;
+	}
+
+	regs.regs[19] = table;
+	regs.regs[20] = num;
+
+	ret = upatch_execute_remote(pctx, syscall, sizeof(syscall), &regs);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = upatch_process_mem_read(pctx->proc, table, calls, size);
+	if (ret < 0) {
+		log_error("can't peek syscall results - %d\n", pctx->pid);
+		return -1;
+	}
+
+	return 0;
+}
+
 int upatch_arch_execute_remote_func(struct upatch_ptrace_ctx *pctx,
 				    const unsigned char *code, size_t codelen,
 				    struct user_regs_struct *pregs,
@@ -178,25 +240,36 @@ size_t get_upatch_addr_len()
 	return UPATCH_ADDR_LEN;
 }
 
-// for long jumper
-unsigned long get_new_insn(struct object_file *obj, unsigned long old_addr,
-                           unsigned long new_addr)
+#define UPATCH_B_INSN_LEN 4
+#define UPATCH_B_RANGE 0x8000000L
+
+static bool b_insn_in_range(unsigned long old_addr, unsigned long new_addr)
 {
-	unsigned int insn0 = 0x58000051; // ldr x17, #8
-	unsigned int insn4 = 0xd61f0220; // br x17
-	return (unsigned long)(insn0 | ((unsigned long)insn4 << 32));
+	long offset = (long)(new_addr - old_addr);
+
+	return offset >= -UPATCH_B_RANGE && offset < UPATCH_B_RANGE &&
+	       (offset & 0x3) == 0;
 }
 
-#if 0
-unsigned long get_new_insn(struct object_file *obj, unsigned long old_addr,
-			   unsigned long new_addr)
+size_t get_upatch_jmp_len(unsigned long old_addr, unsigned long new_addr)
 {
-	unsigned char b_insn[] = { 0x00, 0x00, 0x00, 0x00 }; /* ins: b IMM */
+	if (b_insn_in_range(old_addr, new_addr)) {
+		return UPATCH_B_INSN_LEN;
+	}
+	return UPATCH_INSN_LEN + UPATCH_ADDR_LEN;
+}
 
-	*(unsigned int *)(b_insn) = (unsigned int)(new_addr - old_addr) / 4;
-	b_insn[3] &= 0x3;
-	b_insn[3] |= 0x14;
+/* Direct branch if the patch is within +-128MiB, long jumper otherwise */
+unsigned long get_new_insn(struct object_file *obj, unsigned long old_addr,
+                           unsigned long new_addr)
+{
+	unsigned int insn0 = 0x58000051; // ldr x17, #8
+	unsigned int insn4 = 0xd61f0220; // br x17
 
-	return *(unsigned int *)b_insn;
+	if (b_insn_in_range(old_addr, new_addr)) {
+		// b IMM
+		return 0x14000000 |
+		       (((unsigned long)(new_addr - old_addr) >> 2) & 0x3ffffff);
+	}
+	return (unsigned long)(insn0 | ((unsigned long)insn4 << 32));
 }
-#endif
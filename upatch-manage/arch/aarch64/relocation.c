@@ -68,6 +68,7 @@ int apply_relocate_add(struct upatch_elf *uelf, unsigned int symindex,
 	void *loc;
 	void *uloc;
 	u64 val;
+	u64 target;
 	s64 result;
 	GElf_Shdr *shdrs = (void *)uelf->info.shdrs;
 	GElf_Rela *rel = (void *)shdrs[relsec].sh_addr;
@@ -226,6 +227,14 @@ int apply_relocate_add(struct upatch_elf *uelf, unsigned int symindex,
 			break;
 		case R_AARCH64_JUMP26:
 		case R_AARCH64_CALL26:
+			/* Call the function directly, jmp table is only the fallback */
+			target = resolve_direct_target(uelf, sym->st_value);
+			if (target != 0) {
+				result = calc_reloc(RELOC_OP_PREL, uloc,
+						    target + rel[i].r_addend);
+				if (result >= -(s64)BIT(27) && result < (s64)BIT(27))
+					val = target + rel[i].r_addend;
+			}
 			result = calc_reloc(RELOC_OP_PREL, uloc, val);
 			if (result < -(s64)BIT(27) || result >= (s64)BIT(27)) {
 				log_debug(
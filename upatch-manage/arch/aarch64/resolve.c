@@ -33,6 +33,14 @@
 #define AARCH64_JUMP_TABLE_JMP1 0x58000071580000d0
 #define AARCH64_JUMP_TABLE_JMP2 0xffffffffd61f0220
 
+/*
+ * ldr x16, #24
+ * ldr x17, [x16]
+ * br x17
+ * undefined
+ */
+#define AARCH64_JUMP_TABLE_JMP_GOT1 0xf9400211580000d0
+
 struct upatch_jmp_table_entry {
 	unsigned long inst[2];
 	unsigned long addr[2];
@@ -64,6 +72,25 @@ static unsigned long setup_jmp_table(struct upatch_elf *uelf,
 			       index * sizeof(struct upatch_jmp_table_entry));
 }
 
+/*
+ * Jump through the GOT slot itself, for slots not bound yet by the dynamic
+ * linker. A copy of an unbound slot would go through the resolver forever.
+ */
+static unsigned long setup_got_jmp_table(struct upatch_elf *uelf,
+					 unsigned long jmp_addr,
+					 unsigned long got_addr)
+{
+	unsigned long elf_addr = setup_jmp_table(uelf, jmp_addr, got_addr);
+	struct upatch_jmp_table_entry *table =
+		uelf->core_layout.kbase + uelf->jmp_offs;
+
+	if (elf_addr != 0) {
+		table[uelf->jmp_cur_entry - 1].inst[0] =
+			AARCH64_JUMP_TABLE_JMP_GOT1;
+	}
+	return elf_addr;
+}
+
 static unsigned long setup_got_table(struct upatch_elf *uelf,
 				     unsigned long jmp_addr,
 				     unsigned long tls_addr)
@@ -93,21 +120,25 @@ unsigned long insert_plt_table(struct upatch_elf *uelf, struct object_file *obj,
 	unsigned long tls_addr = 0xffffffff;
 	unsigned long elf_addr = 0;
 
-	if (upatch_process_mem_read(obj->proc, addr, &jmp_addr,
-				    sizeof(jmp_addr))) {
+	if (upatch_process_mem_read_cached(obj->proc, addr, &jmp_addr,
+					   sizeof(jmp_addr))) {
 		log_error("copy address failed\n");
 		goto out;
 	}
 
 	if (r_type == R_AARCH64_TLSDESC &&
-	    upatch_process_mem_read(obj->proc, addr + sizeof(unsigned long),
-				    &tls_addr, sizeof(tls_addr))) {
+	    upatch_process_mem_read_cached(obj->proc,
+					   addr + sizeof(unsigned long),
+					   &tls_addr, sizeof(tls_addr))) {
 		log_error("copy address failed\n");
 		goto out;
 	}
 
 	if (r_type == R_AARCH64_TLSDESC)
 		elf_addr = setup_got_table(uelf, jmp_addr, tls_addr);
+	/* Lazy binding, slot still points to the PLT of the object */
+	else if (object_has_addr(obj, jmp_addr))
+		elf_addr = setup_got_jmp_table(uelf, jmp_addr, (unsigned long)addr);
 	else
 		elf_addr = setup_jmp_table(uelf, jmp_addr, (unsigned long)addr);
 
@@ -125,15 +156,16 @@ unsigned long insert_got_table(struct upatch_elf *uelf, struct object_file *obj,
 	unsigned long tls_addr = 0xffffffff;
 	unsigned long elf_addr = 0;
 
-	if (upatch_process_mem_read(obj->proc, addr, &jmp_addr,
-				    sizeof(jmp_addr))) {
+	if (upatch_process_mem_read_cached(obj->proc, addr, &jmp_addr,
+					   sizeof(jmp_addr))) {
 		log_error("copy address failed\n");
 		goto out;
 	}
 
 	if (r_type == R_AARCH64_TLSDESC &&
-	    upatch_process_mem_read(obj->proc, addr + sizeof(unsigned long),
-				    &tls_addr, sizeof(tls_addr))) {
+	    upatch_process_mem_read_cached(obj->proc,
+					   addr + sizeof(unsigned long),
+					   &tls_addr, sizeof(tls_addr))) {
 		log_error("copy address failed\n");
 		goto out;
 	}
@@ -163,4 +195,29 @@ unsigned long search_insert_plt_table(struct upatch_elf *uelf,
 	}
 
 	return setup_jmp_table(uelf, jmp_addr, origin_addr);
-}
\ No newline at end of file
+}
+
+unsigned long get_jmp_table_target(struct upatch_elf *uelf, unsigned long addr)
+{
+	struct upatch_jmp_table_entry *table =
+		uelf->core_layout.kbase + uelf->jmp_offs;
+	unsigned long table_start =
+		(unsigned long)uelf->core_layout.base + uelf->jmp_offs;
+	unsigned long index;
+
+	if (addr < table_start) {
+		return 0;
+	}
+	index = (addr - table_start) / sizeof(struct upatch_jmp_table_entry);
+	if (index >= uelf->jmp_cur_entry ||
+	    addr != table_start + index * sizeof(struct upatch_jmp_table_entry)) {
+		return 0;
+	}
+
+	/* GOT entries hold data, GOT jumps follow slots which could change */
+	if (table[index].inst[0] != AARCH64_JUMP_TABLE_JMP1 ||
+	    table[index].inst[1] != AARCH64_JUMP_TABLE_JMP2) {
+		return 0;
+	}
+	return table[index].addr[0];
+}
@@ -18,6 +18,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdint.h>
 #include <string.h>
 
 #include <sys/ptrace.h>
@@ -57,6 +58,68 @@ int upatch_arch_syscall_remote(struct upatch_ptrace_ctx *pctx, int nr,
 	return ret;
 }
 
+/* Syscall table is placed below the red zone of the stopped thread */
+#define REMOTE_STACK_RESERVE 128
+
+int upatch_arch_syscall_remote_batch(struct upatch_ptrace_ctx *pctx,
+				     struct upatch_remote_syscall *calls,
+				     size_t num)
+{
+	struct user_regs_struct regs;
+	size_t size = num * sizeof(*calls);
+	unsigned long table;
+
+	/* rbx points to the current entry, r12 counts the left ones */
+	unsigned char syscall[] = {
+		0x48, 0x8b, 0x03, /* loop: mov (%rbx),%rax */
+		0x48, 0x8b, 0x7b, 0x08, /* mov 0x8(%rbx),%rdi */
+		0x48, 0x8b, 0x73, 0x10, /* mov 0x10(%rbx),%rsi */
+		0x48, 0x8b, 0x53, 0x18, /* mov 0x18(%rbx),%rdx */
+		0x4c, 0x8b, 0x53, 0x20, /* mov 0x20(%rbx),%r10 */
+		0x4c, 0x8b, 0x43, 0x28, /* mov 0x28(%rbx),%r8 */
+		0x4c, 0x8b, 0x4b, 0x30, /* mov 0x30(%rbx),%r9 */
+		0x0f, 0x05, /* syscall */
+		0x48, 0x89, 0x43, 0x38, /* mov %rax,0x38(%rbx) */
+		0x48, 0x3d, 0x01, 0xf0, 0xff, 0xff, /* cmp $-4095,%rax */
+		0x73, 0x09, /* jae done */
+		0x48, 0x83, 0xc3, 0x40, /* add $0x40,%rbx */
+		0x49, 0xff, 0xcc, /* dec %r12 */
+		0x75, 0xce, /* jnz loop */
+		0xcc, /* done: int3 */
+	};
+	int ret;
+
+	ret = ptrace(PTRACE_GETREGS, pctx->pid, NULL, &regs);
+	if (ret < 0) {
+		log_error("can't get regs - %d\n", pctx->pid);
+		return -1;
+	}
+
+	table = (regs.rsp - REMOTE_STACK_RESERVE - size) & ~0xfUL;
+	ret = upatch_process_mem_write(pctx->proc, calls, table, size);
+	if (ret < 0) {
+		log_error("can't poke syscall table - %d\n", pctx->pid);
+		return -1;
+	}
+
+	memset(&regs, 0, sizeof(struct user_regs_struct));
+	regs.rbx = table;
+	regs.r12 = num;
+
+	ret = upatch_execute_remote(pctx, syscall, sizeof(syscall), &regs);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = upatch_process_mem_read(pctx->proc, table, calls, size);
+	if (ret < 0) {
+		log_error("can't peek syscall results - %d\n", pctx->pid);
+		return -1;
+	}
+
+	return 0;
+}
+
 int upatch_arch_execute_remote_func(struct upatch_ptrace_ctx *pctx,
 				    const unsigned char *code, size_t codelen,
 				    struct user_regs_struct *pregs,
@@ -165,22 +228,34 @@ size_t get_upatch_addr_len()
 }
 
 
-unsigned long get_new_insn(struct object_file *obj, unsigned long old_addr,
-               unsigned long new_addr)
+#define UPATCH_JMP_REL32_LEN 5
+
+static bool jmp_rel32_in_range(unsigned long old_addr, unsigned long new_addr)
 {
-	char jmp_insn[] = { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00};
-	return *(unsigned long *)jmp_insn;
+	long offset = (long)(new_addr - old_addr - UPATCH_JMP_REL32_LEN);
+
+	return offset >= INT32_MIN && offset <= INT32_MAX;
 }
 
-#if 0
+size_t get_upatch_jmp_len(unsigned long old_addr, unsigned long new_addr)
+{
+	if (jmp_rel32_in_range(old_addr, new_addr)) {
+		return UPATCH_JMP_REL32_LEN;
+	}
+	return UPATCH_INSN_LEN + UPATCH_ADDR_LEN;
+}
+
+/* Direct jump if the patch is within +-2GiB, indirect one otherwise */
 unsigned long get_new_insn(struct object_file *obj, unsigned long old_addr,
 			   unsigned long new_addr)
 {
-	char jmp_insn[] = { 0xe9, 0x00, 0x00, 0x00, 0x00 }; /* jmp IMM */
+	char jmp_insn[8] = { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00 }; /* jmp *0(%rip) */
 
-	*(unsigned int *)(jmp_insn + 1) =
-		(unsigned int)(new_addr - old_addr - 5);
+	if (jmp_rel32_in_range(old_addr, new_addr)) {
+		jmp_insn[0] = 0xe9; /* jmp IMM */
+		*(int *)(jmp_insn + 1) =
+			(int)(new_addr - old_addr - UPATCH_JMP_REL32_LEN);
+	}
 
 	return *(unsigned long *)jmp_insn;
 }
-#endif
@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include "upatch-relocation.h"
+#include "upatch-resolve.h"
 
 int apply_relocate_add(struct upatch_elf *uelf, unsigned int symindex,
 		       unsigned int relsec)
@@ -31,6 +32,8 @@ int apply_relocate_add(struct upatch_elf *uelf, unsigned int symindex,
 	GElf_Sym *sym;
 	void *loc, *real_loc;
 	u64 val;
+	u64 target;
+	s64 offset;
 	const char *sym_name;
 	GElf_Xword tls_size;
 	GElf_Shdr *shdrs = (void *)uelf->info.shdrs;
@@ -101,6 +104,16 @@ int apply_relocate_add(struct upatch_elf *uelf, unsigned int symindex,
 			if (*(u32 *)loc != 0)
 				goto invalid_relocation;
 			val -= (u64)real_loc;
+			/* Call the function directly, jmp table is only the fallback */
+			target = resolve_direct_target(uelf, sym->st_value);
+			if (target != 0 &&
+			    (GELF_R_TYPE(rel[i].r_info) == R_X86_64_PC32 ||
+			     GELF_R_TYPE(rel[i].r_info) == R_X86_64_PLT32)) {
+				offset = (s64)(target + rel[i].r_addend -
+					       (u64)real_loc);
+				if (offset == (s32)offset)
+					val = (u64)offset;
+			}
 			memcpy(loc, &val, 4);
 			break;
 		case R_X86_64_PC64:
@@ -18,12 +18,16 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdint.h>
+
 #include <gelf.h>
 
 #include "upatch-ptrace.h"
 #include "upatch-resolve.h"
 
 #define X86_64_JUMP_TABLE_JMP 0x90900000000225ff /* jmp [rip+2]; nop; nop */
+#define X86_64_JUMP_TABLE_JMP_GOT 0x90900000000025ff /* jmp [rip+IMM]; nop; nop */
+#define X86_64_JUMP_TABLE_JMP_LEN 6
 
 struct upatch_jmp_table_entry {
 	unsigned long inst;
@@ -53,6 +57,36 @@ static unsigned long setup_jmp_table(struct upatch_elf *uelf,
 			       index * sizeof(struct upatch_jmp_table_entry));
 }
 
+/*
+ * Jump through the GOT slot itself, for slots not bound yet by the dynamic
+ * linker. A copy of an unbound slot would go through the resolver forever.
+ */
+static unsigned long setup_got_jmp_table(struct upatch_elf *uelf,
+					 unsigned long jmp_addr,
+					 unsigned long got_addr)
+{
+	struct upatch_jmp_table_entry *table =
+		uelf->core_layout.kbase + uelf->jmp_offs;
+	unsigned int index = uelf->jmp_cur_entry;
+	unsigned long entry = (unsigned long)(uelf->core_layout.base +
+		uelf->jmp_offs + index * sizeof(struct upatch_jmp_table_entry));
+	long offset = (long)(got_addr - entry - X86_64_JUMP_TABLE_JMP_LEN);
+
+	if (offset < INT32_MIN || offset > INT32_MAX) {
+		return setup_jmp_table(uelf, jmp_addr);
+	}
+	if (index >= uelf->jmp_max_entry) {
+		log_error("jmp table overflow\n");
+		return 0;
+	}
+
+	table[index].inst = X86_64_JUMP_TABLE_JMP_GOT |
+			    ((unsigned long)(unsigned int)offset << 16);
+	table[index].addr = got_addr;
+	uelf->jmp_cur_entry++;
+	return entry;
+}
+
 /*
  * Jmp tabale records address and used call instruction to execute it.
  * So, we need 'Inst' and 'addr'
@@ -84,13 +118,18 @@ unsigned long insert_plt_table(struct upatch_elf *uelf, struct object_file *obj,
 	unsigned long jmp_addr;
 	unsigned long elf_addr = 0;
 
-	if (upatch_process_mem_read(obj->proc, addr, &jmp_addr,
-				    sizeof(jmp_addr))) {
+	if (upatch_process_mem_read_cached(obj->proc, addr, &jmp_addr,
+					   sizeof(jmp_addr))) {
 		log_error("copy address failed\n");
 		goto out;
 	}
 
-	elf_addr = setup_jmp_table(uelf, jmp_addr);
+	/* Lazy binding, slot still points to the PLT of the object */
+	if (object_has_addr(obj, jmp_addr)) {
+		elf_addr = setup_got_jmp_table(uelf, jmp_addr, addr);
+	} else {
+		elf_addr = setup_jmp_table(uelf, jmp_addr);
+	}
 
 	log_debug("0x%lx: jmp_addr=0x%lx\n", elf_addr, jmp_addr);
 
@@ -105,8 +144,8 @@ unsigned long insert_got_table(struct upatch_elf *uelf, struct object_file *obj,
 	unsigned long tls_addr = 0xffffffff;
 	unsigned long elf_addr = 0;
 
-	if (upatch_process_mem_read(obj->proc, addr, &jmp_addr,
-				    sizeof(jmp_addr))) {
+	if (upatch_process_mem_read_cached(obj->proc, addr, &jmp_addr,
+					   sizeof(jmp_addr))) {
 		log_error("copy address failed\n");
 		goto out;
 	}
@@ -117,8 +156,9 @@ unsigned long insert_got_table(struct upatch_elf *uelf, struct object_file *obj,
 	 * R_X86_64_DTPMOD64.
 	 */
 	if (r_type == R_X86_64_DTPMOD64 &&
-	    upatch_process_mem_read(obj->proc, addr + sizeof(unsigned long),
-				    &tls_addr, sizeof(tls_addr))) {
+	    upatch_process_mem_read_cached(obj->proc,
+					   addr + sizeof(unsigned long),
+					   &tls_addr, sizeof(tls_addr))) {
 		log_error("copy address failed\n");
 		goto out;
 	}
@@ -129,4 +169,28 @@ unsigned long insert_got_table(struct upatch_elf *uelf, struct object_file *obj,
 
 out:
 	return elf_addr;
-}
\ No newline at end of file
+}
+
+unsigned long get_jmp_table_target(struct upatch_elf *uelf, unsigned long addr)
+{
+	struct upatch_jmp_table_entry *table =
+		uelf->core_layout.kbase + uelf->jmp_offs;
+	unsigned long table_start =
+		(unsigned long)uelf->core_layout.base + uelf->jmp_offs;
+	unsigned long index;
+
+	if (addr < table_start) {
+		return 0;
+	}
+	index = (addr - table_start) / sizeof(struct upatch_jmp_table_entry);
+	if (index >= uelf->jmp_cur_entry ||
+	    addr != table_start + index * sizeof(struct upatch_jmp_table_entry)) {
+		return 0;
+	}
+
+	/* GOT entries hold data, GOT jumps follow slots which could change */
+	if (table[index].inst != X86_64_JUMP_TABLE_JMP) {
+		return 0;
+	}
+	return table[index].addr;
+}
@@ -0,0 +1,309 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# upatch-manage freeze time benchmark
+#
+# Generates a synthetic target and its patch, keeps the target running with
+# the requested threads & mappings, then patches and unpatches it repeatedly.
+# Reports p50/p99 of the time the target is stopped and of the whole operation,
+# which are taken from the timing lines of 'upatch-manage --timing'.
+
+set -e
+
+THREADS=16
+MAPPINGS=1024
+FUNCS=16
+EXTERNS=16
+ROUNDS=100
+WORK_DIR="$(pwd)/upatch-bench"
+OUTPUT=""
+UPATCH_MANAGE="upatch-manage"
+UPATCH_BUILD="upatch-build"
+CC="${CC:-gcc}"
+MANAGE_ARGS=""
+
+usage() {
+    cat <<EOF
+Usage: $(basename "$0") [options]
+
+Options:
+  --threads <num>       Threads of target process [default: ${THREADS}]
+  --mappings <num>      Extra memory mappings of target process [default: ${MAPPINGS}]
+  --funcs <num>         Patched functions [default: ${FUNCS}]
+  --externs <num>       External symbols referenced by the patch [default: ${EXTERNS}]
+  --rounds <num>        Rounds of patch & unpatch [default: ${ROUNDS}]
+  --work-dir <dir>      Directory of generated files [default: ${WORK_DIR}]
+  --output <file>       Append results to a csv file, eg. to compare commits
+  --upatch-manage <bin> Path of upatch-manage [default: ${UPATCH_MANAGE}]
+  --upatch-build <bin>  Path of upatch-build [default: ${UPATCH_BUILD}]
+  --manage-args <args>  Extra arguments of upatch-manage, eg. '--freeze'
+EOF
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    --threads) THREADS="$2"; shift ;;
+    --mappings) MAPPINGS="$2"; shift ;;
+    --funcs) FUNCS="$2"; shift ;;
+    --externs) EXTERNS="$2"; shift ;;
+    --rounds) ROUNDS="$2"; shift ;;
+    --work-dir) WORK_DIR="$2"; shift ;;
+    --output) OUTPUT="$2"; shift ;;
+    --upatch-manage) UPATCH_MANAGE="$2"; shift ;;
+    --upatch-build) UPATCH_BUILD="$2"; shift ;;
+    --manage-args) MANAGE_ARGS="$2"; shift ;;
+    *) usage ;;
+    esac
+    shift
+done
+
+if [ "${FUNCS}" -lt 1 ]; then
+    echo "At least one patched function is required" >&2
+    exit 1
+fi
+
+SOURCE_DIR="${WORK_DIR}/source"
+PATCH_DIR="${WORK_DIR}/patch"
+RESULT_DIR="${WORK_DIR}/result"
+TARGET="${WORK_DIR}/bench-target"
+TARGET_PID=""
+
+cleanup() {
+    if [ -n "${TARGET_PID}" ]; then
+        kill "${TARGET_PID}" 2>/dev/null || true
+        wait "${TARGET_PID}" 2>/dev/null || true
+    fi
+}
+trap cleanup EXIT
+
+# External symbols live in a shared library, so the patch resolves them by plt/got
+gen_extern_lib() {
+    local file="$1"
+
+    echo "int bench_ext_common(int v) { return v; }" > "${file}"
+    for ((i = 0; i < EXTERNS; i++)); do
+        echo "int bench_ext_${i}(int v) { return v + ${i}; }" >> "${file}"
+    done
+}
+
+# Each function references its share of external symbols, 'delta' is what the patch changes
+gen_funcs() {
+    local file="$1"
+    local delta="$2"
+
+    echo "extern int bench_ext_common(int);" > "${file}"
+    for ((i = 0; i < EXTERNS; i++)); do
+        echo "extern int bench_ext_${i}(int);" >> "${file}"
+    done
+    for ((i = 0; i < FUNCS; i++)); do
+        echo "__attribute__((noinline)) int bench_func_${i}(int v)" >> "${file}"
+        echo "{" >> "${file}"
+        echo "    v = bench_ext_common(v) + ${delta};" >> "${file}"
+        for ((j = i; j < EXTERNS; j += FUNCS)); do
+            echo "    v = bench_ext_${j}(v);" >> "${file}"
+        done
+        echo "    return v;" >> "${file}"
+        echo "}" >> "${file}"
+    done
+
+    echo "int (*bench_funcs[])(int) = {" >> "${file}"
+    for ((i = 0; i < FUNCS; i++)); do
+        echo "    bench_func_${i}," >> "${file}"
+    done
+    echo "};" >> "${file}"
+    echo "int bench_func_num = ${FUNCS};" >> "${file}"
+}
+
+gen_main() {
+    cat > "$1" <<EOF
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+extern int (*bench_funcs[])(int);
+extern int bench_func_num;
+
+static void *bench_thread(void *arg)
+{
+    struct timespec ts = { 0, 1000000 };
+    int index = (int)(long)arg % bench_func_num;
+    volatile int v = 0;
+
+    for (;;) {
+        v = bench_funcs[index](v);
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = (argc > 1) ? atoi(argv[1]) : 0;
+    int mappings = (argc > 2) ? atoi(argv[2]) : 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    /* Alternate protections, thus adjacent mappings are never merged */
+    for (int i = 0; i < mappings; i++) {
+        int prot = (i % 2) ? PROT_READ : PROT_NONE;
+        if (mmap(NULL, page_size, prot, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0) == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+    }
+
+    for (long i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, bench_thread, (void *)i) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    printf("ready\n");
+    fflush(stdout);
+    for (;;) {
+        pause();
+    }
+    return 0;
+}
+EOF
+}
+
+gen_source() {
+    rm -rf "${SOURCE_DIR}"
+    mkdir -p "${SOURCE_DIR}"
+
+    gen_extern_lib "${SOURCE_DIR}/bench-ext.c"
+    gen_funcs "${SOURCE_DIR}/bench-funcs.c" 0
+    gen_main "${SOURCE_DIR}/bench-main.c"
+    cat > "${SOURCE_DIR}/build.sh" <<EOF
+#!/bin/bash
+set -e
+cd "\$(dirname "\$0")"
+${CC} -g -O2 -fPIC -shared -o libbench-ext.so bench-ext.c
+${CC} -g -O2 -fPIE -pie -o bench-target bench-main.c bench-funcs.c \\
+    -L. -lbench-ext -Wl,-rpath,'\$ORIGIN' -lpthread
+EOF
+    chmod +x "${SOURCE_DIR}/build.sh"
+    "${SOURCE_DIR}/build.sh"
+
+    # Sources are rebuilt by upatch-build, the running target is kept aside
+    cp "${SOURCE_DIR}/bench-target" "${SOURCE_DIR}/libbench-ext.so" "${WORK_DIR}/"
+
+    # Patch changes every function, thus all of them are replaced
+    local patched_dir="${WORK_DIR}/patched"
+    rm -rf "${patched_dir}"
+    mkdir -p "${patched_dir}"
+    gen_funcs "${patched_dir}/bench-funcs.c" 1
+    (cd "${WORK_DIR}" && diff -u "source/bench-funcs.c" "patched/bench-funcs.c" \
+        > "${WORK_DIR}/bench.patch") || true
+    sed -i -e '1s|^--- source/|--- a/|' -e '2s|^+++ patched/|+++ b/|' \
+        "${WORK_DIR}/bench.patch"
+}
+
+build_patch() {
+    rm -rf "${PATCH_DIR}"
+    mkdir -p "${PATCH_DIR}"
+
+    "${UPATCH_BUILD}" \
+        --source-dir "${SOURCE_DIR}" \
+        --build-cmd "${SOURCE_DIR}/build.sh" \
+        --debuginfo "${TARGET}" \
+        --elf-dir "${SOURCE_DIR}" \
+        --elf "bench-target" \
+        --patch "${WORK_DIR}/bench.patch" \
+        --output-dir "${PATCH_DIR}" \
+        --skip-compiler-check > "${WORK_DIR}/upatch-build.log" 2>&1 || {
+        echo "Failed to build patch, see ${WORK_DIR}/upatch-build.log" >&2
+        exit 1
+    }
+}
+
+start_target() {
+    local fifo="${WORK_DIR}/target.fifo"
+
+    rm -f "${fifo}"
+    mkfifo "${fifo}"
+    "${TARGET}" "${THREADS}" "${MAPPINGS}" > "${fifo}" &
+    TARGET_PID=$!
+    read -r _ < "${fifo}"
+    rm -f "${fifo}"
+}
+
+# Fetch a phase of the timing line, in microseconds
+timing_phase() {
+    sed -n "s/^UPATCH_TIMING .*\"$2\":\([0-9]*\).*/\1/p" "$1"
+}
+
+run_manage() {
+    local cmd="$1"
+    local log="${RESULT_DIR}/${cmd}.log"
+
+    # shellcheck disable=SC2086
+    "${UPATCH_MANAGE}" "${cmd}" --timing ${MANAGE_ARGS} \
+        --uuid "${UUID}" \
+        --pid "${TARGET_PID}" \
+        --binary "${TARGET}" \
+        --upatch "${PATCH_DIR}/bench-target" > "${log}" 2>&1 || {
+        echo "Failed to ${cmd} process ${TARGET_PID}, see ${log}" >&2
+        exit 1
+    }
+    timing_phase "${log}" "stopped" >> "${RESULT_DIR}/${cmd}.stopped"
+    timing_phase "${log}" "total" >> "${RESULT_DIR}/${cmd}.total"
+}
+
+# Nearest-rank percentile of a file of numbers
+percentile() {
+    sort -n "$1" | awk -v p="$2" '
+        { v[NR] = $1 }
+        END {
+            if (NR == 0) { print 0; exit }
+            i = int((NR * p + 99) / 100)
+            print v[(i < 1) ? 1 : i]
+        }'
+}
+
+report() {
+    local version
+    version="$("${UPATCH_MANAGE}" --version 2>/dev/null | head -n 1 | awk '{print $2}')"
+
+    printf "%-8s %12s %12s %12s %12s\n" "cmd" "stopped_p50" "stopped_p99" "total_p50" "total_p99"
+    for cmd in patch unpatch; do
+        local values=(
+            "$(percentile "${RESULT_DIR}/${cmd}.stopped" 50)"
+            "$(percentile "${RESULT_DIR}/${cmd}.stopped" 99)"
+            "$(percentile "${RESULT_DIR}/${cmd}.total" 50)"
+            "$(percentile "${RESULT_DIR}/${cmd}.total" 99)"
+        )
+        printf "%-8s %12s %12s %12s %12s\n" "${cmd}" "${values[@]}"
+
+        if [ -n "${OUTPUT}" ]; then
+            if [ ! -s "${OUTPUT}" ]; then
+                echo "version,cmd,threads,mappings,funcs,externs,rounds,stopped_p50,stopped_p99,total_p50,total_p99" > "${OUTPUT}"
+            fi
+            echo "${version},${cmd},${THREADS},${MAPPINGS},${FUNCS},${EXTERNS},${ROUNDS},$(IFS=,; echo "${values[*]}")" >> "${OUTPUT}"
+        fi
+    done
+    echo "(microseconds, threads=${THREADS}, mappings=${MAPPINGS}, funcs=${FUNCS}, externs=${EXTERNS}, rounds=${ROUNDS})"
+}
+
+mkdir -p "${WORK_DIR}"
+gen_source
+build_patch
+
+rm -rf "${RESULT_DIR}"
+mkdir -p "${RESULT_DIR}"
+UUID="$(cat /proc/sys/kernel/random/uuid)"
+
+start_target
+for ((round = 0; round < ROUNDS; round++)); do
+    run_manage patch
+    run_manage unpatch
+done
+
+report
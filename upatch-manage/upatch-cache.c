@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "log.h"
+#include "upatch-cache.h"
+
+struct elf_cache_entry {
+	struct list_head list;
+
+	dev_t dev;
+	ino_t inode;
+	off_t size;
+	struct timespec mtime;
+
+	char *path;
+	bool is_patch;
+	union {
+		struct upatch_elf uelf;
+		struct running_elf relf;
+	};
+};
+
+static LIST_HEAD(elf_cache);
+static unsigned int elf_cache_num;
+
+static void cache_entry_free(struct elf_cache_entry *entry)
+{
+	list_del(&entry->list);
+	elf_cache_num--;
+
+	if (entry->is_patch) {
+		upatch_close(&entry->uelf);
+	} else {
+		binary_close(&entry->relf);
+	}
+	free(entry->path);
+	free(entry);
+}
+
+static bool cache_entry_match(struct elf_cache_entry *entry,
+			      struct stat *st, bool is_patch)
+{
+	return entry->is_patch == is_patch && entry->dev == st->st_dev &&
+	       entry->inode == st->st_ino;
+}
+
+static bool cache_entry_valid(struct elf_cache_entry *entry, struct stat *st)
+{
+	return entry->size == st->st_size &&
+	       entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static struct elf_cache_entry *cache_lookup(const char *path, bool is_patch)
+{
+	struct elf_cache_entry *entry, *tmp;
+	struct stat st;
+	int ret;
+
+	if (stat(path, &st) != 0) {
+		log_error("Failed to stat file '%s'\n", path);
+		return NULL;
+	}
+
+	list_for_each_entry_safe(entry, tmp, &elf_cache, list) {
+		if (!cache_entry_match(entry, &st, is_patch)) {
+			continue;
+		}
+		if (cache_entry_valid(entry, &st)) {
+			/* Keep recently used entries at the list head */
+			list_del(&entry->list);
+			list_add_head(&entry->list, &elf_cache);
+			log_debug("Found cached elf '%s'\n", path);
+			return entry;
+		}
+		log_debug("Cached elf '%s' is outdated\n", entry->path);
+		cache_entry_free(entry);
+		break;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->path = strdup(path);
+	if (entry->path == NULL) {
+		free(entry);
+		return NULL;
+	}
+
+	entry->dev = st.st_dev;
+	entry->inode = st.st_ino;
+	entry->size = st.st_size;
+	entry->mtime = st.st_mtim;
+	entry->is_patch = is_patch;
+
+	ret = is_patch ? upatch_init(&entry->uelf, entry->path) :
+			 binary_init(&entry->relf, entry->path);
+
+	INIT_LIST_HEAD(&entry->list);
+	list_add_head(&entry->list, &elf_cache);
+	elf_cache_num++;
+
+	if (ret) {
+		cache_entry_free(entry);
+		return NULL;
+	}
+
+	if (elf_cache_num > ELF_CACHE_MAX_ENTRY) {
+		cache_entry_free(list_entry(elf_cache.prev,
+					    struct elf_cache_entry, list));
+	}
+
+	return entry;
+}
+
+struct upatch_elf *upatch_cache_get_patch(const char *path)
+{
+	struct elf_cache_entry *entry = cache_lookup(path, true);
+
+	return entry ? &entry->uelf : NULL;
+}
+
+struct running_elf *upatch_cache_get_binary(const char *path)
+{
+	struct elf_cache_entry *entry = cache_lookup(path, false);
+
+	return entry ? &entry->relf : NULL;
+}
+
+void upatch_cache_destroy(void)
+{
+	struct elf_cache_entry *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, &elf_cache, list) {
+		cache_entry_free(entry);
+	}
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UPATCH_CACHE__
+#define __UPATCH_CACHE__
+
+#include "upatch-elf.h"
+
+#define ELF_CACHE_MAX_ENTRY 64
+
+/*
+ * Parsed elf cache for long-running upatch-manage instances.
+ * Entries are keyed by device & inode, and are dropped once the file
+ * size or modification time changes.
+ */
+struct upatch_elf *upatch_cache_get_patch(const char *);
+
+struct running_elf *upatch_cache_get_binary(const char *);
+
+void upatch_cache_destroy(void);
+
+#endif
@@ -50,6 +50,8 @@ static inline int page_shift(int n)
 #define PAGE_MASK (~(PAGE_SIZE - 1))
 #define PAGE_SHIFT page_shift(PAGE_SIZE)
 #endif
+/* PMD size of 4K pages, the size of transparent huge pages */
+#define HUGE_PAGE_SIZE 0x200000UL
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define ALIGN(x, a) (((x) + (a)-1) & (~((a)-1)))
 #define PAGE_ALIGN(x) ALIGN((x), PAGE_SIZE)
@@ -0,0 +1,516 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include "log.h"
+#include "upatch-coro.h"
+
+#define CORO_SCAN_THREADS 8
+/* Fewer stacks are not worth another thread */
+#define CORO_STACKS_PER_THREAD 64
+#define CORO_SCAN_BLOCK 0x10000UL
+#define CORO_PAGEMAP_BATCH 512
+
+/* See Documentation/admin-guide/mm/soft-dirty.rst */
+#define PAGEMAP_SOFT_DIRTY (1ULL << 55)
+#define CLEAR_REFS_SOFT_DIRTY "4"
+
+static bool is_anon_rw(const struct upatch_coro_vma *vma)
+{
+	return (strcmp(vma->perms, "rw-p") == 0) && (vma->name[0] == '\0');
+}
+
+/* Stacks mapped above a guard page, eg. boost.context, folly fibers, bthread */
+static bool guarded_is_stack(const struct upatch_coro_vma *vma,
+			     const struct upatch_coro_vma *prev)
+{
+	return is_anon_rw(vma) && (prev != NULL) && (prev->end == vma->start) &&
+	       (strcmp(prev->perms, "---p") == 0) && (prev->name[0] == '\0');
+}
+
+/*
+ * Stacks allocated by malloc, eg. libco, are not told apart from other heap
+ * data by mappings, such runtimes are left out rather than scanning the heap.
+ */
+static const struct upatch_coro_runtime coro_runtimes[] = {
+	{ "guarded", guarded_is_stack },
+};
+
+#define CORO_RUNTIME_NUM (sizeof(coro_runtimes) / sizeof(coro_runtimes[0]))
+
+static bool runtime_enabled[CORO_RUNTIME_NUM];
+static bool coro_enabled;
+static bool coro_soft_dirty;
+
+int upatch_coro_set_runtimes(const char *names)
+{
+	char *saveptr = NULL;
+	char *list = NULL;
+	int ret = 0;
+
+	list = strdup(names);
+	if (list == NULL) {
+		return -ENOMEM;
+	}
+	for (char *name = strtok_r(list, ",", &saveptr); name != NULL;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		size_t i;
+
+		for (i = 0; i < CORO_RUNTIME_NUM; i++) {
+			if (strcmp(coro_runtimes[i].name, name) == 0) {
+				break;
+			}
+		}
+		if (i == CORO_RUNTIME_NUM) {
+			log_error("Unknown coroutine runtime '%s'\n", name);
+			ret = -EINVAL;
+			break;
+		}
+		runtime_enabled[i] = true;
+		coro_enabled = true;
+	}
+	free(list);
+
+	return ret;
+}
+
+void upatch_coro_set_soft_dirty(bool enable)
+{
+	coro_soft_dirty = enable;
+}
+
+bool upatch_coro_enabled(void)
+{
+	return coro_enabled;
+}
+
+static bool coro_is_stack(const struct upatch_coro_vma *vma,
+			  const struct upatch_coro_vma *prev)
+{
+	for (size_t i = 0; i < CORO_RUNTIME_NUM; i++) {
+		if (runtime_enabled[i] && coro_runtimes[i].is_stack(vma, prev)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void coro_free_list(struct list_head *coros)
+{
+	struct upatch_coro *coro, *safe;
+
+	list_for_each_entry_safe(coro, safe, coros, list) {
+		free(coro);
+	}
+	INIT_LIST_HEAD(coros);
+}
+
+/* Stacks are listed in address order, as mappings are */
+static int coro_discover(int pid, struct list_head *coros, size_t *nr)
+{
+	struct upatch_coro_vma vmas[2];
+	struct upatch_coro_vma *prev = NULL;
+	char *lines[2] = { NULL, NULL };
+	size_t lens[2] = { 0, 0 };
+	char path[PATH_MAX];
+	FILE *file = NULL;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	file = fopen(path, "r");
+	if (file == NULL) {
+		log_error("Failed to open '%s'\n", path);
+		return -errno;
+	}
+
+	*nr = 0;
+	/* Two lines are kept, name of the previous mapping points into one */
+	for (int cur = 0; getline(&lines[cur], &lens[cur], file) > 0; cur ^= 1) {
+		struct upatch_coro_vma *vma = &vmas[cur];
+		struct upatch_coro *coro = NULL;
+		int pos = 0;
+
+		if ((sscanf(lines[cur], "%lx-%lx %4s %*s %*s %*s %n", &vma->start,
+			    &vma->end, vma->perms, &pos) < 3) || (pos == 0)) {
+			prev = NULL;
+			continue;
+		}
+		lines[cur][pos + (int)strcspn(lines[cur] + pos, "\n")] = '\0';
+		vma->name = lines[cur] + pos;
+
+		if (coro_is_stack(vma, prev)) {
+			coro = calloc(1, sizeof(*coro));
+			if (coro == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+			coro->start = vma->start;
+			coro->end = vma->end;
+			coro->fresh = true;
+			list_add(&coro->list, coros);
+			(*nr)++;
+		}
+		prev = vma;
+	}
+	free(lines[0]);
+	free(lines[1]);
+	fclose(file);
+
+	if (ret != 0) {
+		coro_free_list(coros);
+	}
+	return ret;
+}
+
+/* Both lists are sorted, a stack of the same extent keeps its state */
+static void coro_merge(struct upatch_process *proc, struct list_head *found)
+{
+	struct list_head *head = &proc->coro.coros;
+	struct list_head *pos = head->next;
+	struct upatch_coro *coro;
+
+	list_for_each_entry(coro, found, list) {
+		struct upatch_coro *old = NULL;
+
+		while (pos != head) {
+			old = list_entry(pos, struct upatch_coro, list);
+			if (old->start >= coro->start) {
+				break;
+			}
+			pos = pos->next;
+		}
+		if (pos == head) {
+			break;
+		}
+		if ((old->start == coro->start) && (old->end == coro->end)) {
+			coro->fresh = old->fresh;
+			coro->busy = old->busy;
+		}
+	}
+
+	coro_free_list(head);
+	list_splice(found, head);
+}
+
+/* CONFIG_MEM_SOFT_DIRTY may be off, no page is ever reported dirty then */
+static bool soft_dirty_supported(void)
+{
+	static int supported = -1;
+	long page_size = sysconf(_SC_PAGESIZE);
+	volatile char *page;
+	uint64_t entry = 0;
+	int fd;
+
+	if (supported >= 0) {
+		return supported;
+	}
+	supported = 0;
+
+	page = mmap(NULL, (size_t)page_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED) {
+		return false;
+	}
+	page[0] = 1;
+
+	fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (write(fd, CLEAR_REFS_SOFT_DIRTY, 1) == 1) {
+			page[0] = 2;
+			close(fd);
+			fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+			if ((fd >= 0) &&
+			    (pread(fd, &entry, sizeof(entry),
+				   (off_t)((unsigned long)page / (unsigned long)page_size *
+					   sizeof(entry))) == sizeof(entry))) {
+				supported = (entry & PAGEMAP_SOFT_DIRTY) ? 1 : 0;
+			}
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	munmap((void *)page, (size_t)page_size);
+
+	return supported;
+}
+
+/* Soft-dirty bits of the whole process are cleared, see upatch-coro.h */
+static int coro_clear_soft_dirty(int pid)
+{
+	char path[PATH_MAX];
+	int ret = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/clear_refs", pid);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+	if (write(fd, CLEAR_REFS_SOFT_DIRTY, 1) != 1) {
+		ret = -errno;
+	}
+	close(fd);
+
+	return ret;
+}
+
+struct coro_scan {
+	struct upatch_process *proc;
+	const struct upatch_stack_range *ranges;
+	size_t num;
+	struct upatch_coro **coros;
+	size_t nr;
+	/* -1 if stacks are scanned as a whole */
+	int pagemap_fd;
+	unsigned long page_size;
+	bool stop_on_busy;
+	/* Updated by workers */
+	size_t next;
+	bool busy;
+	unsigned long bytes;
+};
+
+/* Returns 1 if a word inside the ranges is found, -1 if unreadable */
+static int coro_scan_range(struct coro_scan *scan, unsigned long start,
+			   unsigned long end, unsigned long *buf)
+{
+	while (start < end) {
+		size_t size = MIN(end - start, CORO_SCAN_BLOCK);
+		ssize_t len = pread(scan->proc->memfd, buf, size, (off_t)start);
+
+		if (len <= 0) {
+			return -1;
+		}
+		__atomic_add_fetch(&scan->bytes, (unsigned long)len, __ATOMIC_RELAXED);
+		for (ssize_t i = 0; i < len / (ssize_t)sizeof(unsigned long); i++) {
+			if (upatch_stack_addr_in_ranges(buf[i], scan->ranges, scan->num)) {
+				log_debug("Coroutine at 0x%lx would return to 0x%lx\n",
+					  start + (unsigned long)i * sizeof(unsigned long),
+					  buf[i]);
+				return 1;
+			}
+		}
+		start += (unsigned long)len;
+	}
+	return 0;
+}
+
+/* Only runs of pages written since soft-dirty bits were cleared */
+static int coro_scan_dirty(struct coro_scan *scan, const struct upatch_coro *coro,
+			   unsigned long *buf)
+{
+	uint64_t entries[CORO_PAGEMAP_BATCH];
+	unsigned long addr = coro->start;
+	unsigned long run = 0;
+	int ret;
+
+	while (addr < coro->end) {
+		size_t n = MIN((coro->end - addr) / scan->page_size,
+			       CORO_PAGEMAP_BATCH);
+		off_t offset = (off_t)(addr / scan->page_size * sizeof(uint64_t));
+
+		if (pread(scan->pagemap_fd, entries, n * sizeof(uint64_t), offset) !=
+		    (ssize_t)(n * sizeof(uint64_t))) {
+			/* Written pages are unknown, the rest is scanned */
+			return coro_scan_range(scan, run ? run : addr, coro->end, buf);
+		}
+		for (size_t i = 0; i < n; i++, addr += scan->page_size) {
+			if (entries[i] & PAGEMAP_SOFT_DIRTY) {
+				run = run ? run : addr;
+				continue;
+			}
+			if (run) {
+				ret = coro_scan_range(scan, run, addr, buf);
+				run = 0;
+				if (ret != 0) {
+					return ret;
+				}
+			}
+		}
+	}
+	return run ? coro_scan_range(scan, run, coro->end, buf) : 0;
+}
+
+static void *coro_scan_worker(void *arg)
+{
+	struct coro_scan *scan = arg;
+	unsigned long *buf = NULL;
+
+	buf = malloc(CORO_SCAN_BLOCK);
+	if (buf == NULL) {
+		return NULL;
+	}
+	while (true) {
+		size_t i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+		struct upatch_coro *coro;
+		int ret;
+
+		if (i >= scan->nr) {
+			break;
+		}
+		if (scan->stop_on_busy && __atomic_load_n(&scan->busy, __ATOMIC_RELAXED)) {
+			break;
+		}
+
+		coro = scan->coros[i];
+		if (coro->fresh || coro->busy || (scan->pagemap_fd < 0)) {
+			ret = coro_scan_range(scan, coro->start, coro->end, buf);
+		} else {
+			ret = coro_scan_dirty(scan, coro, buf);
+		}
+		/* An unreadable stack is scanned as a whole next time */
+		coro->fresh = (ret < 0);
+		coro->busy = (ret > 0);
+		if (ret > 0) {
+			__atomic_store_n(&scan->busy, true, __ATOMIC_RELAXED);
+		}
+	}
+	free(buf);
+
+	return NULL;
+}
+
+/* Returns -EBUSY if any stack scanned is busy */
+static int coro_scan_stacks(struct upatch_process *proc,
+			    const struct upatch_stack_range *ranges, size_t num,
+			    bool delta, bool stop_on_busy)
+{
+	struct coro_scan scan = {
+		.proc = proc,
+		.ranges = ranges,
+		.num = num,
+		.nr = proc->coro.num,
+		.pagemap_fd = -1,
+		.page_size = (unsigned long)sysconf(_SC_PAGESIZE),
+		.stop_on_busy = stop_on_busy,
+	};
+	pthread_t tids[CORO_SCAN_THREADS];
+	struct upatch_coro *coro;
+	char path[PATH_MAX];
+	long threads;
+	long created = 0;
+	size_t i = 0;
+
+	if (scan.nr == 0) {
+		return 0;
+	}
+	scan.coros = malloc(scan.nr * sizeof(*scan.coros));
+	if (scan.coros == NULL) {
+		return -ENOMEM;
+	}
+	list_for_each_entry(coro, &proc->coro.coros, list) {
+		scan.coros[i++] = coro;
+	}
+	if (delta) {
+		snprintf(path, sizeof(path), "/proc/%d/pagemap", proc->pid);
+		scan.pagemap_fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+
+	threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1L), CORO_SCAN_THREADS);
+	threads = MIN(threads, (long)(scan.nr / CORO_STACKS_PER_THREAD) + 1);
+	for (long j = 1; j < threads; j++) {
+		if (pthread_create(&tids[created], NULL, coro_scan_worker, &scan) != 0) {
+			break;
+		}
+		created++;
+	}
+	coro_scan_worker(&scan);
+	for (long j = 0; j < created; j++) {
+		pthread_join(tids[j], NULL);
+	}
+
+	if (scan.pagemap_fd >= 0) {
+		close(scan.pagemap_fd);
+	}
+	free(scan.coros);
+	log_debug("Process %d coroutine stacks scanned, %zu stack(s), %lu byte(s)\n",
+		  proc->pid, scan.nr, scan.bytes);
+
+	if (scan.busy) {
+		return -EBUSY;
+	}
+	/* No worker got its buffer, stacks are left unscanned */
+	return (scan.next < scan.nr) ? -ENOMEM : 0;
+}
+
+int upatch_coro_prescan(struct upatch_process *proc,
+			const struct upatch_stack_range *ranges, size_t num)
+{
+	LIST_HEAD(found);
+	size_t nr = 0;
+	int ret;
+
+	/* Without written pages, the check scans all stacks anyway */
+	if (!coro_soft_dirty) {
+		return 0;
+	}
+
+	ret = coro_discover(proc->pid, &found, &nr);
+	if (ret != 0) {
+		return ret;
+	}
+	coro_free_list(&proc->coro.coros);
+	list_splice(&found, &proc->coro.coros);
+	proc->coro.num = nr;
+
+	/* Cleared before scanning, pages written meanwhile are rescanned */
+	proc->coro.soft_dirty = soft_dirty_supported() &&
+				(coro_clear_soft_dirty(proc->pid) == 0);
+	ret = coro_scan_stacks(proc, ranges, num, false, false);
+
+	return (ret == -EBUSY) ? 0 : ret;
+}
+
+int upatch_coro_check(struct upatch_process *proc,
+		      const struct upatch_stack_range *ranges, size_t num)
+{
+	LIST_HEAD(found);
+	size_t nr = 0;
+	int ret;
+
+	/* Coroutines may be created or freed since the prescan */
+	ret = coro_discover(proc->pid, &found, &nr);
+	if (ret != 0) {
+		return ret;
+	}
+	coro_merge(proc, &found);
+	proc->coro.num = nr;
+
+	return coro_scan_stacks(proc, ranges, num, proc->coro.soft_dirty, true);
+}
+
+void upatch_coro_destroy(struct upatch_process *proc)
+{
+	coro_free_list(&proc->coro.coros);
+	proc->coro.num = 0;
+}
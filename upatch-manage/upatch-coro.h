@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UPATCH_CORO__
+#define __UPATCH_CORO__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "list.h"
+#include "upatch-process.h"
+#include "upatch-stack.h"
+
+/* Stack of a parked coroutine, no thread runs on it but it may be resumed */
+struct upatch_coro {
+	struct list_head list;
+	unsigned long start;
+	unsigned long end;
+	/* Not scanned yet, the next scan covers the whole stack */
+	bool fresh;
+	/* A word inside the ranges was found by the last scan */
+	bool busy;
+};
+
+/* Mapping of the process, as read from /proc/<pid>/maps */
+struct upatch_coro_vma {
+	unsigned long start;
+	unsigned long end;
+	char perms[5];
+	const char *name; /* Empty for anonymous mappings */
+};
+
+/*
+ * Stack discovery of a coroutine runtime, tells if a mapping holds stacks
+ * of its coroutines. prev is the mapping right below, may be NULL.
+ */
+struct upatch_coro_runtime {
+	const char *name;
+	bool (*is_stack)(const struct upatch_coro_vma *vma,
+			 const struct upatch_coro_vma *prev);
+};
+
+/* Runtimes are separated by ',', returns -EINVAL on an unknown one */
+int upatch_coro_set_runtimes(const char *names);
+
+/*
+ * Soft-dirty bits of the whole process are cleared by each prescan, thus
+ * another user of them, eg. CRIU incremental dumps, would miss writes done
+ * before. Only enable it for processes nothing else tracks that way.
+ */
+void upatch_coro_set_soft_dirty(bool enable);
+
+bool upatch_coro_enabled(void);
+
+/*
+ * Called before the process is stopped. Stacks are discovered and scanned
+ * in parallel, soft-dirty bits of the process are cleared, thus later checks
+ * only rescan pages written since then. Does nothing unless soft-dirty bits
+ * are enabled.
+ */
+int upatch_coro_prescan(struct upatch_process *proc,
+			const struct upatch_stack_range *ranges, size_t num);
+
+/*
+ * Called with the process stopped, returns -EBUSY if a parked coroutine
+ * would return into the ranges. Busy & new stacks are scanned as a whole,
+ * others by their written pages, or as a whole without a prescan or if
+ * soft-dirty bits are not supported.
+ */
+int upatch_coro_check(struct upatch_process *proc,
+		      const struct upatch_stack_range *ranges, size_t num);
+
+void upatch_coro_destroy(struct upatch_process *proc);
+
+#endif
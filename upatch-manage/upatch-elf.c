@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "log.h"
@@ -30,22 +31,34 @@
 #include "upatch-elf.h"
 #include "upatch-ptrace.h"
 
-static int read_from_offset(int fd, void **buf, int len, off_t offset)
+/*
+ * Map file instead of reading it, so that only touched pages are loaded,
+ * and clean pages are shared with other instances through page cache.
+ * Writable mapping is private, modifications never reach the file.
+ */
+static int map_from_offset(int fd, void **buf, size_t len, off_t offset,
+    bool writable)
 {
-    *buf = malloc(len);
-    if (*buf == NULL) {
-        return -errno;
-    }
+    int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
 
-    int size = pread(fd, *buf, len, offset);
-    if (size == -1) {
+    void *addr = mmap(NULL, len, prot, MAP_PRIVATE, fd, offset);
+    if (addr == MAP_FAILED) {
         return -errno;
     }
 
+    *buf = addr;
     return 0;
 }
 
-static int open_elf(struct elf_info *einfo, const char *name)
+static void unmap_elf(struct elf_info *einfo)
+{
+    if (einfo->patch_buff) {
+        munmap(einfo->patch_buff, einfo->patch_size);
+        einfo->patch_buff = NULL;
+    }
+}
+
+static int open_elf(struct elf_info *einfo, const char *name, bool writable)
 {
     int ret = 0, fd = -1, i;
     char *sec_name;
@@ -65,9 +78,15 @@ static int open_elf(struct elf_info *einfo, const char *name)
         goto out;
     }
 
-    ret = read_from_offset(fd, (void **)&einfo->patch_buff, st.st_size, 0);
+    if (st.st_size < (off_t)sizeof(GElf_Ehdr)) {
+        log_error("File '%s' is not a valid elf\n", name);
+        ret = -ENOEXEC;
+        goto out;
+    }
+
+    ret = map_from_offset(fd, &einfo->patch_buff, st.st_size, 0, writable);
     if (ret != 0) {
-        log_error("Failed to read file '%s'\n", name);
+        log_error("Failed to map file '%s'\n", name);
         goto out;
     }
 
@@ -75,11 +94,19 @@ static int open_elf(struct elf_info *einfo, const char *name)
     einfo->inode = st.st_ino;
     einfo->patch_size = st.st_size;
     einfo->hdr = (void *)einfo->patch_buff;
+
+    /* Accessing beyond file end of a mapping raises SIGBUS */
+    void *einfo_eof = (void *)einfo->hdr + einfo->patch_size;
     einfo->shdrs = (void *)einfo->hdr + einfo->hdr->e_shoff;
-    einfo->shstrtab = (void *)einfo->hdr + einfo->shdrs[einfo->hdr->e_shstrndx].sh_offset;
+    if ((void *)(einfo->shdrs + einfo->hdr->e_shnum) > einfo_eof ||
+        einfo->hdr->e_shstrndx >= einfo->hdr->e_shnum) {
+        log_error("File '%s' is not a valid elf\n", name);
+        ret = -ENOEXEC;
+        goto out;
+    }
 
-    void *einfo_eof = einfo->hdr + einfo->patch_size;
-    if ((void *)einfo->shdrs > einfo_eof || (void *)einfo->shstrtab > einfo_eof) {
+    einfo->shstrtab = (void *)einfo->hdr + einfo->shdrs[einfo->hdr->e_shstrndx].sh_offset;
+    if ((void *)einfo->shstrtab > einfo_eof) {
         log_error("File '%s' is not a valid elf\n", name);
         ret = -ENOEXEC;
         goto out;
@@ -110,7 +137,8 @@ out:
 
 int upatch_init(struct upatch_elf *uelf, const char *name)
 {
-    int ret = open_elf(&uelf->info, name);
+    /* Patch sections are rewritten during layout */
+    int ret = open_elf(&uelf->info, name, true);
     if (ret) {
         log_error("Failed to open file '%s'\n", name);
         return ret;
@@ -129,17 +157,169 @@ int upatch_init(struct upatch_elf *uelf, const char *name)
         }
     }
 
+    size_t shdrs_size = uelf->info.hdr->e_shnum * sizeof(GElf_Shdr);
+    uelf->shdrs_orig = malloc(shdrs_size);
+    if (uelf->shdrs_orig == NULL) {
+        log_error("Failed to backup section headers of '%s'\n", name);
+        return -ENOMEM;
+    }
+    memcpy(uelf->shdrs_orig, uelf->info.shdrs, shdrs_size);
+
+    return 0;
+}
+
+static int build_sym_hash(struct running_elf *relf)
+{
+    GElf_Shdr *shdr = &relf->info.shdrs[relf->index.sym];
+    GElf_Sym *sym = (void *)relf->info.hdr + shdr->sh_offset;
+    unsigned int num = shdr->sh_size / sizeof(GElf_Sym);
+
+    int ret = symbol_hash_init(&relf->sym_hash, num);
+    if (ret) {
+        return ret;
+    }
+
+    for (unsigned int i = num; i-- > 0;) {
+        if (sym[i].st_shndx != SHN_UNDEF) {
+            symbol_hash_add(&relf->sym_hash, i, relf->strtab + sym[i].st_name);
+        }
+    }
+    return 0;
+}
+
+static int build_dynsym_hash(struct running_elf *relf)
+{
+    GElf_Shdr *shdr = &relf->info.shdrs[relf->index.dynsym];
+    GElf_Sym *dynsym = (void *)relf->info.hdr + shdr->sh_offset;
+    unsigned int num = shdr->sh_size / sizeof(GElf_Sym);
+
+    if (relf->index.gnu_hash) {
+        GElf_Shdr *hash_shdr = &relf->info.shdrs[relf->index.gnu_hash];
+        if (gnu_hash_init(&relf->gnu_hash,
+            (void *)relf->info.hdr + hash_shdr->sh_offset, hash_shdr->sh_size) == 0) {
+            return 0;
+        }
+        log_warn("Invalid section '%s', ignored\n", GNU_HASH_NAME);
+    }
+
+    int ret = symbol_hash_init(&relf->dynsym_hash, num);
+    if (ret) {
+        return ret;
+    }
+
+    for (unsigned int i = num; i-- > 0;) {
+        if (dynsym[i].st_value != 0) {
+            symbol_hash_add(&relf->dynsym_hash, i, relf->dynstrtab + dynsym[i].st_name);
+        }
+    }
     return 0;
 }
 
+static int build_rela_dyn_hash(struct running_elf *relf)
+{
+    GElf_Shdr *dynsym_shdr = &relf->info.shdrs[relf->index.dynsym];
+    GElf_Shdr *rela_shdr = &relf->info.shdrs[relf->index.rela_dyn];
+    GElf_Sym *dynsym = (void *)relf->info.hdr + dynsym_shdr->sh_offset;
+    GElf_Rela *rela = (void *)relf->info.hdr + rela_shdr->sh_offset;
+    unsigned int num = rela_shdr->sh_size / sizeof(GElf_Rela);
+
+    int ret = symbol_hash_init(&relf->rela_dyn_hash, num);
+    if (ret) {
+        return ret;
+    }
+
+    relf->rela_dyn_nosym = calloc(num + 1, sizeof(unsigned int));
+    if (relf->rela_dyn_nosym == NULL) {
+        return -ENOMEM;
+    }
+
+    for (unsigned int i = num; i-- > 0;) {
+        unsigned long sym_idx = GELF_R_SYM(rela[i].r_info);
+        if (sym_idx != 0) {
+            symbol_hash_add(&relf->rela_dyn_hash, i,
+                relf->dynstrtab + dynsym[sym_idx].st_name);
+        }
+    }
+    for (unsigned int i = 0; i < num; i++) {
+        if (GELF_R_SYM(rela[i].r_info) == 0) {
+            relf->rela_dyn_nosym[relf->num_rela_dyn_nosym++] = i;
+        }
+    }
+    return 0;
+}
+
+static int build_rela_plt_hash(struct running_elf *relf)
+{
+    GElf_Shdr *dynsym_shdr = &relf->info.shdrs[relf->index.dynsym];
+    GElf_Shdr *rela_shdr = &relf->info.shdrs[relf->index.rela_plt];
+    GElf_Sym *dynsym = (void *)relf->info.hdr + dynsym_shdr->sh_offset;
+    GElf_Rela *rela = (void *)relf->info.hdr + rela_shdr->sh_offset;
+    unsigned int num = rela_shdr->sh_size / sizeof(GElf_Rela);
+
+    int ret = symbol_hash_init(&relf->rela_plt_hash, num);
+    if (ret) {
+        return ret;
+    }
+
+    for (unsigned int i = num; i-- > 0;) {
+        unsigned long sym_idx = GELF_R_SYM(rela[i].r_info);
+        unsigned long sym_type = GELF_ST_TYPE(dynsym[sym_idx].st_info);
+
+        /* symbol 0 is always STT_NOTYPE, so it never matches */
+        if (sym_type != STT_FUNC && sym_type != STT_TLS) {
+            continue;
+        }
+        symbol_hash_add(&relf->rela_plt_hash, i,
+            relf->dynstrtab + dynsym[sym_idx].st_name);
+    }
+    return 0;
+}
+
+static int build_symbol_index(struct running_elf *relf)
+{
+    int ret = 0;
+
+    if (relf->index.sym) {
+        ret = build_sym_hash(relf);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (!relf->index.dynsym) {
+        return 0;
+    }
+
+    ret = build_dynsym_hash(relf);
+    if (ret) {
+        return ret;
+    }
+
+    if (relf->index.rela_dyn) {
+        ret = build_rela_dyn_hash(relf);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (relf->index.rela_plt) {
+        ret = build_rela_plt_hash(relf);
+    }
+
+    return ret;
+}
+
 int binary_init(struct running_elf *relf, const char *name)
 {
-    int ret = open_elf(&relf->info, name);
+    int ret = open_elf(&relf->info, name, false);
     if (ret) {
         log_error("Failed to open file '%s'\n", name);
         return ret;
     }
 
+    /* Symbols are looked up through hash indexes */
+    madvise(relf->info.patch_buff, relf->info.patch_size, MADV_RANDOM);
+
     for (int i = 1; i < relf->info.hdr->e_shnum; i++) {
         char *sec_name = relf->info.shstrtab + relf->info.shdrs[i].sh_name;
         if (relf->info.shdrs[i].sh_type == SHT_SYMTAB) {
@@ -165,9 +345,18 @@ int binary_init(struct running_elf *relf, const char *name)
                    relf->info.shdrs[i].sh_type == SHT_RELA) {
             log_debug("Found section '%s' idx=%d\n", GOT_RELA_NAME, i);
             relf->index.rela_dyn = i;
+        } else if (relf->info.shdrs[i].sh_type == SHT_GNU_HASH) {
+            log_debug("Found section '%s' idx=%d\n", GNU_HASH_NAME, i);
+            relf->index.gnu_hash = i;
         }
     }
 
+    ret = build_symbol_index(relf);
+    if (ret) {
+        log_error("Failed to build symbol index of '%s'\n", name);
+        return ret;
+    }
+
     relf->phdrs = (void *)relf->info.hdr + relf->info.hdr->e_phoff;
     for (int i = 0; i < relf->info.hdr->e_phnum; i++) {
         if (relf->phdrs[i].p_type == PT_TLS) {
@@ -200,17 +389,49 @@ bool check_build_id(struct elf_info *uelf, struct elf_info *relf)
 void binary_close(struct running_elf *relf)
 {
     // TODO: free relf
-    if (relf->info.patch_buff) {
-        free(relf->info.patch_buff);
-	}
+    unmap_elf(&relf->info);
+
+    symbol_hash_destroy(&relf->sym_hash);
+    symbol_hash_destroy(&relf->dynsym_hash);
+    symbol_hash_destroy(&relf->rela_dyn_hash);
+    symbol_hash_destroy(&relf->rela_plt_hash);
+    free(relf->rela_dyn_nosym);
+}
+
+/*
+ * Bring the patch back to the state right after upatch_init(),
+ * so that it can be applied to another process.
+ */
+void upatch_reset(struct upatch_elf *uelf)
+{
+    if (uelf->shdrs_orig) {
+        memcpy(uelf->info.shdrs, uelf->shdrs_orig,
+            uelf->info.hdr->e_shnum * sizeof(GElf_Shdr));
+    }
+
+    if (uelf->core_layout.kbase) {
+        free(uelf->core_layout.kbase);
+    }
+    memset(&uelf->core_layout, 0, sizeof(struct upatch_layout));
+
+    uelf->symoffs = 0;
+    uelf->stroffs = 0;
+    uelf->core_typeoffs = 0;
+    uelf->jmp_offs = 0;
+    uelf->jmp_cur_entry = 0;
+    uelf->jmp_max_entry = 0;
 }
 
 void upatch_close(struct upatch_elf *uelf)
 {
     // TODO: free uelf
-    if (uelf->info.patch_buff) {
-        free(uelf->info.patch_buff);
-	}
+    unmap_elf(&uelf->info);
+
+    if (uelf->shdrs_orig) {
+        free(uelf->shdrs_orig);
+    }
+
+    free(uelf->plan.entries);
 
     if (uelf->core_layout.kbase) {
         free(uelf->core_layout.kbase);
@@ -27,11 +27,15 @@
 #include <unistd.h>
 
 #include "list.h"
+#include "upatch-symhash.h"
 
 #define SYMTAB_NAME ".symtab"
 #define DYNSYM_NAME ".dynsym"
 #define GOT_RELA_NAME ".rela.dyn"
 #define PLT_RELA_NAME ".rela.plt"
+#define GOT_NAME ".got"
+#define GOT_PLT_NAME ".got.plt"
+#define GNU_HASH_NAME ".gnu.hash"
 #define BUILD_ID_NAME ".note.gnu.build-id"
 #define UPATCH_FUNC_NAME ".upatch.funcs"
 #define TDATA_NAME ".tdata"
@@ -112,16 +116,52 @@ struct running_elf {
 		unsigned int sym, str;
 		unsigned int rela_dyn, rela_plt;
 		unsigned int dynsym, dynstr;
+		unsigned int gnu_hash;
 	} index;
 
+	/* name indexes, built once by binary_init() */
+	struct symbol_hash sym_hash;
+	struct symbol_hash dynsym_hash; /* only without '.gnu.hash' */
+	struct symbol_hash rela_dyn_hash;
+	struct symbol_hash rela_plt_hash;
+	struct gnu_hash gnu_hash;
+
+	/* '.rela.dyn' entries without symbol, matched by addend */
+	unsigned int *rela_dyn_nosym;
+	unsigned int num_rela_dyn_nosym;
+
 	/* load bias, used to handle ASLR */
 	unsigned long load_bias;
 	unsigned long load_start;
 };
 
+/* How an undefined symbol is resolved, see simplify_symbols() */
+enum upatch_plan_kind {
+	PLAN_NONE,
+	PLAN_BIAS, /* load bias + value */
+	PLAN_GOT, /* got table entry of the slot at load bias + value */
+	PLAN_PLT, /* jmp table entry of the slot at load bias + value */
+};
+
+struct upatch_plan_entry {
+	enum upatch_plan_kind kind;
+	unsigned long r_type;
+	unsigned long value;
+};
+
+/* Symbol resolution of a patch, reused by processes of the same target */
+struct upatch_plan {
+	ino_t inode;
+	struct upatch_plan_entry *entries; /* indexed by symbol */
+	bool valid;
+};
+
 struct upatch_elf {
 	struct elf_info info;
 
+	/* pristine section headers, layout rewrites info.shdrs in place */
+	GElf_Shdr *shdrs_orig;
+
 	unsigned long num_syms;
 	char *strtab;
 
@@ -137,11 +177,15 @@ struct upatch_elf {
 	/* memory layout for patch */
 	struct upatch_layout core_layout;
 
+	/* kept by upatch_reset() */
+	struct upatch_plan plan;
+
 	struct running_elf *relf;
 };
 
 int upatch_init(struct upatch_elf *, const char *);
 int binary_init(struct running_elf *, const char *);
+void upatch_reset(struct upatch_elf *);
 void upatch_close(struct upatch_elf *);
 void binary_close(struct running_elf *);
 
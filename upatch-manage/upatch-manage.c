@@ -20,6 +20,7 @@
 
 #include <argp.h>
 #include <dirent.h>
+#include <errno.h>
 #include <libgen.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -27,48 +28,106 @@
 #include <string.h>
 
 #include "log.h"
+#include "upatch-cache.h"
+#include "upatch-coro.h"
 #include "upatch-elf.h"
 #include "upatch-patch.h"
+#include "upatch-process.h"
+#include "upatch-resolve.h"
+#include "upatch-share.h"
+#include "upatch-stack.h"
+#include "upatch-timing.h"
 
 #define PROG_VERSION "upatch-manage "BUILD_VERSION
-#define COMMAND_SIZE 4
+#define COMMAND_SIZE 6
+#define PID_SEPARATOR ","
+#define RESULT_PREFIX "UPATCH_RESULT"
+
+/*
+ * Server request: "<cmd>\t<uuid>\t<binary>\t<upatch>\t<pid>[,<pid>...]\n"
+ * Each request is answered by its process results and a "UPATCH_DONE" line.
+ * Multiple patches are listed in uuid & upatch fields, separated by '\x1f'.
+ * Replace lists the applied patch first, then the one replacing it.
+ */
+#define SERVER_FIELD_NUM 5
+#define SERVER_FIELD_SEPARATOR "\t"
+#define SERVER_LIST_SEPARATOR "\x1f"
+#define SERVER_DONE_PREFIX "UPATCH_DONE"
 
 enum loglevel loglevel = NORMAL;
 char *logprefix;
 
-char *command[COMMAND_SIZE] = { "", "patch", "unpatch", "info" };
+char *command[COMMAND_SIZE] = { "", "patch", "unpatch", "info", "server",
+				"replace" };
 enum Command {
 	DEFAULT,
 	PATCH,
 	UNPATCH,
 	INFO,
+	SERVER,
+	REPLACE,
 };
 
 struct arguments {
 	int cmd;
-	int pid;
-	char *upatch;
+	int *pids;
+	size_t pid_num;
+	char **upatches;
+	size_t upatch_num;
 	char *binary;
-	char *uuid;
+	char **uuids;
+	size_t uuid_num;
 	bool verbose;
+	bool freeze;
+	bool direct_bind;
+	bool timing;
+	bool stack_check;
+	bool coro_soft_dirty;
+	bool huge_text;
+	char *share_dir;
 };
 
 static struct argp_option options[] = {
 	{ "verbose", 'v', NULL, 0, "Show verbose output" },
-	{ "uuid", 'U', "uuid", 0, "the uuid of the upatch" },
-	{ "pid", 'p', "pid", 0, "the pid of the user-space process" },
-	{ "upatch", 'u', "upatch", 0, "the upatch file" },
+	{ "freeze", 'f', NULL, 0,
+	  "Stop process by freezing its cgroup, if it is alone in a cgroup v2" },
+	{ "direct-bind", 'd', NULL, 0,
+	  "Call bound external functions directly from patch, if in range" },
+	{ "timing", 't', NULL, 0,
+	  "Report time of each phase as a json line after each process result" },
+	{ "stack-check", 'c', NULL, 0,
+	  "Change jumpers only while no thread runs patched code, retry after a short backoff" },
+	{ "coro-runtime", 'C', "runtime", 0,
+	  "Check stacks of parked coroutines as well, runtimes are separated by ',': "
+	  "'guarded' for stacks mapped above a guard page" },
+	{ "coro-soft-dirty", 'D', NULL, 0,
+	  "Scan coroutine stacks before stopping, then only their written pages, "
+	  "clears soft-dirty bits of the process, not for processes dumped by CRIU" },
+	{ "huge-text", 'H', NULL, 0,
+	  "Place patch text on 2MiB boundary and advise huge pages for it" },
+	{ "share-dir", 's', "dir", 0,
+	  "Map patch text shared by processes of identical layout, image files are kept in dir" },
+	{ "uuid", 'U', "uuid", 0,
+	  "the uuid of the upatch, repeat with '--upatch' to patch several at once" },
+	{ "pid", 'p', "pid", 0,
+	  "the pid of the user-space process, multiple pids are separated by ','" },
+	{ "upatch", 'u', "upatch", 0,
+	  "the upatch file, patches are applied in the given order" },
 	{ "binary", 'b', "binary", 0, "the binary file" },
 	{ "cmd", 0, "patch", 0, "Apply a upatch file to a user-space process" },
 	{ "cmd", 0, "unpatch", 0,
 	  "Unapply a upatch file to a user-space process" },
+	{ "cmd", 0, "replace", 0,
+	  "Replace the first upatch by the second one within one stop of a user-space process" },
+	{ "cmd", 0, "server", 0,
+	  "Serve requests from stdin, parsed files are cached across requests" },
 	{ NULL }
 };
 
 static char program_doc[] = "Operate a upatch file on the user-space process";
 
 static char args_doc[] =
-	"<cmd> --pid <Pid> --upatch <Upatch path> --binary <Binary path> --uuid <Uuid>";
+	"<cmd> --pid <Pid[,Pid...]> --upatch <Upatch path> --binary <Binary path> --uuid <Uuid> [--upatch <Upatch path> --uuid <Uuid>...]";
 
 const char *argp_program_version = PROG_VERSION;
 
@@ -84,17 +143,73 @@ static error_t check_opt(struct argp_state *state)
 	case PATCH:
 	case UNPATCH:
 	case INFO:
-		if (!arguments->pid || arguments->upatch == NULL ||
-		    arguments->binary == NULL || arguments->uuid == NULL) {
+		if (!arguments->pid_num || !arguments->upatch_num ||
+		    arguments->binary == NULL || !arguments->uuid_num) {
 			argp_usage(state);
 			return ARGP_ERR_UNKNOWN;
 		}
+		if (arguments->upatch_num != arguments->uuid_num) {
+			argp_error(state, "Each upatch requires its own uuid");
+			return ARGP_ERR_UNKNOWN;
+		}
+		if ((arguments->cmd != PATCH) && (arguments->upatch_num > 1)) {
+			argp_error(state, "Only patch accepts multiple upatches");
+			return ARGP_ERR_UNKNOWN;
+		}
+		break;
+	case REPLACE:
+		if (!arguments->pid_num || (arguments->upatch_num != 2) ||
+		    arguments->binary == NULL || (arguments->uuid_num != 2)) {
+			argp_error(state, "Replace requires the applied upatch and the new one");
+			return ARGP_ERR_UNKNOWN;
+		}
 	default:
 		break;
 	}
 	return 0;
 }
 
+static int parse_command(const char *arg)
+{
+	for (int i = 1; i < COMMAND_SIZE; ++i) {
+		if (!strcmp(arg, command[i])) {
+			return i;
+		}
+	}
+	return DEFAULT;
+}
+
+static int parse_pids(struct arguments *arguments, char *arg)
+{
+	char *saveptr = NULL;
+
+	for (char *token = strtok_r(arg, PID_SEPARATOR, &saveptr); token != NULL;
+	     token = strtok_r(NULL, PID_SEPARATOR, &saveptr)) {
+		int *pids = realloc(arguments->pids,
+			(arguments->pid_num + 1) * sizeof(int));
+		if (pids == NULL) {
+			return -ENOMEM;
+		}
+		pids[arguments->pid_num++] = atoi(token) & INT32_MAX;
+		arguments->pids = pids;
+	}
+
+	return 0;
+}
+
+static int parse_list(char ***list, size_t *num, char *arg)
+{
+	char **items = realloc(*list, (*num + 1) * sizeof(char *));
+
+	if (items == NULL) {
+		return -ENOMEM;
+	}
+	items[(*num)++] = arg;
+	*list = items;
+
+	return 0;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	struct arguments *arguments = state->input;
@@ -103,29 +218,60 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case 'v':
 		arguments->verbose = true;
 		break;
+	case 'f':
+		arguments->freeze = true;
+		break;
+	case 'd':
+		arguments->direct_bind = true;
+		break;
+	case 't':
+		arguments->timing = true;
+		break;
+	case 'c':
+		arguments->stack_check = true;
+		break;
+	case 'C':
+		if (upatch_coro_set_runtimes(arg)) {
+			argp_failure(state, EXIT_STATUS_ERROR, EINVAL,
+				     "Failed to parse coroutine runtime list");
+		}
+		break;
+	case 'D':
+		arguments->coro_soft_dirty = true;
+		break;
+	case 'H':
+		arguments->huge_text = true;
+		break;
+	case 's':
+		arguments->share_dir = arg;
+		break;
 	case 'p':
-		arguments->pid = atoi(arg);
+		if (parse_pids(arguments, arg)) {
+			argp_failure(state, EXIT_STATUS_ERROR, ENOMEM,
+				     "Failed to parse pid list");
+		}
 		break;
 	case 'u':
-		arguments->upatch = arg;
+		if (parse_list(&arguments->upatches, &arguments->upatch_num, arg)) {
+			argp_failure(state, EXIT_STATUS_ERROR, ENOMEM,
+				     "Failed to parse upatch list");
+		}
 		break;
 	case 'b':
 		arguments->binary = arg;
 		break;
 	case 'U':
-		arguments->uuid = arg;
+		if (parse_list(&arguments->uuids, &arguments->uuid_num, arg)) {
+			argp_failure(state, EXIT_STATUS_ERROR, ENOMEM,
+				     "Failed to parse uuid list");
+		}
 		break;
 	case ARGP_KEY_ARG:
 		if (state->arg_num >= 1)
 			argp_usage(state);
 		if (arguments->cmd != DEFAULT)
 			argp_usage(state);
-		for (int i = 1; i < COMMAND_SIZE; ++i) {
-			if (!strcmp(arg, command[i])) {
-				arguments->cmd = i;
-				break;
-			}
-		}
+		arguments->cmd = parse_command(arg);
 		break;
 	case ARGP_KEY_END:
 		return check_opt(state);
@@ -137,25 +283,182 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 static struct argp argp = { options, parse_opt, args_doc, program_doc };
 
-int patch_upatch(const char *uuid, const char *binary_path, const char *upatch_path, int pid)
+/*
+ * Report the result of each process on its own line, so that the caller
+ * can tell which processes succeeded when operating multiple pids at once.
+ */
+static void report_result(int pid, int ret)
+{
+	printf("%s pid=%d ret=%d\n", RESULT_PREFIX, pid, abs(ret));
+}
+
+/* Same patch twice in one session would be prepared over itself */
+static int check_patch_list(const char **uuids, const char **upatches,
+			    size_t num)
+{
+	for (size_t i = 0; i < num; i++) {
+		for (size_t j = 0; j < i; j++) {
+			if (!strcmp(uuids[i], uuids[j]) ||
+			    !strcmp(upatches[i], upatches[j])) {
+				log_error("Patch '%s' is duplicated\n", uuids[i]);
+				return -EINVAL;
+			}
+		}
+	}
+	return 0;
+}
+
+static int patch_processes(struct upatch_elf **uelfs, struct running_elf *relf,
+			   const char **uuids, size_t num,
+			   const int *pids, size_t pid_num)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < pid_num; i++) {
+		int pid_ret = process_patch(pids[i], uelfs, relf, uuids, num);
+		if (pid_ret) {
+			log_error("Failed to patch process, pid=%d, ret=%d\n",
+				  pids[i], pid_ret);
+			ret = pid_ret;
+		}
+		report_result(pids[i], pid_ret);
+		upatch_timing_report(pids[i], uuids, num, command[PATCH]);
+		for (size_t j = 0; j < num; j++) {
+			upatch_reset(uelfs[j]);
+		}
+	}
+
+	return ret;
+}
+
+int patch_upatch(const char **uuids, const char *binary_path,
+		 const char **upatch_paths, size_t num,
+		 const int *pids, size_t pid_num)
+{
+	struct upatch_elf *uelf = calloc(num, sizeof(struct upatch_elf));
+	struct upatch_elf **uelfs = calloc(num, sizeof(struct upatch_elf *));
+	struct running_elf relf;
+	int ret = 0;
+
+	memset(&relf, 0, sizeof(struct running_elf));
+	if ((uelf == NULL) || (uelfs == NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = check_patch_list(uuids, upatch_paths, num);
+	if (ret) {
+		goto out;
+	}
+
+	upatch_timing_start(PHASE_ELF_LOAD);
+	for (size_t i = 0; i < num; i++) {
+		uelfs[i] = &uelf[i];
+		ret = upatch_init(uelfs[i], upatch_paths[i]);
+		if (ret) {
+			log_error("Failed to initialize patch '%s', ret=%d\n",
+				  upatch_paths[i], ret);
+			goto out;
+		}
+	}
+
+	ret = binary_init(&relf, binary_path);
+	upatch_timing_end(PHASE_ELF_LOAD);
+	if (ret) {
+		log_error("Failed to load binary, ret=%d\n", ret);
+		goto out;
+	}
+
+	/* Patch & binary are parsed only once and shared by all processes */
+	ret = patch_processes(uelfs, &relf, uuids, num, pids, pid_num);
+	upatch_share_release();
+
+out:
+	if (uelf != NULL) {
+		for (size_t i = 0; i < num; i++) {
+			upatch_close(&uelf[i]);
+		}
+	}
+	binary_close(&relf);
+	free(uelfs);
+	free(uelf);
+
+	return ret;
+}
+
+int unpatch_upatch(const char *uuid, const char *binary_path, const char *upatch_path,
+		   const int *pids, size_t pid_num)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < pid_num; i++) {
+		int pid_ret = process_unpatch(pids[i], uuid);
+		if (pid_ret) {
+			log_error("Failed to unpatch process, pid=%d, ret=%d\n",
+				  pids[i], pid_ret);
+			ret = pid_ret;
+		}
+		report_result(pids[i], pid_ret);
+		upatch_timing_report(pids[i], &uuid, 1, command[UNPATCH]);
+	}
+
+	return ret;
+}
+
+static int replace_processes(const char *old_uuid, struct upatch_elf *uelf,
+			     struct running_elf *relf, const char *uuid,
+			     const int *pids, size_t pid_num)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < pid_num; i++) {
+		int pid_ret = process_replace(pids[i], old_uuid, uelf, relf, uuid);
+		if (pid_ret) {
+			log_error("Failed to replace patch, pid=%d, ret=%d\n",
+				  pids[i], pid_ret);
+			ret = pid_ret;
+		}
+		report_result(pids[i], pid_ret);
+		upatch_timing_report(pids[i], &uuid, 1, command[REPLACE]);
+		upatch_reset(uelf);
+	}
+
+	return ret;
+}
+
+/* Applied patch is found in process by its uuid, its file is not parsed */
+int replace_upatch(const char *old_uuid, const char *uuid,
+		   const char *binary_path, const char *upatch_path,
+		   const int *pids, size_t pid_num)
 {
 	struct upatch_elf uelf;
 	struct running_elf relf;
+	int ret = 0;
+
 	memset(&uelf, 0, sizeof(struct upatch_elf));
 	memset(&relf, 0, sizeof(struct running_elf));
+	if (!strcmp(old_uuid, uuid)) {
+		log_error("Patch '%s' is duplicated\n", uuid);
+		return -EINVAL;
+	}
 
-	int ret = upatch_init(&uelf, upatch_path);
+	upatch_timing_start(PHASE_ELF_LOAD);
+	ret = upatch_init(&uelf, upatch_path);
 	if (ret) {
-		log_error("Failed to initialize patch, pid=%d, ret=%d\n", pid, ret);
+		upatch_timing_end(PHASE_ELF_LOAD);
+		log_error("Failed to initialize patch '%s', ret=%d\n",
+			  upatch_path, ret);
 		goto out;
 	}
-
-	ret = process_patch(pid, &uelf, &relf, uuid, binary_path);
+	ret = binary_init(&relf, binary_path);
+	upatch_timing_end(PHASE_ELF_LOAD);
 	if (ret) {
-		log_error("Failed to patch process, pid=%d, ret=%d\n", pid, ret);
+		log_error("Failed to load binary, ret=%d\n", ret);
 		goto out;
 	}
 
+	ret = replace_processes(old_uuid, &uelf, &relf, uuid, pids, pid_num);
+	upatch_share_release();
+
 out:
 	upatch_close(&uelf);
 	binary_close(&relf);
@@ -163,27 +466,197 @@ out:
 	return ret;
 }
 
-int unpatch_upatch(const char *uuid, const char *binary_path, const char *upatch_path, int pid)
+int info_upatch(const char *binary_path, const char *upatch_path,
+		const int *pids, size_t pid_num)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < pid_num; i++) {
+		int pid_ret = process_info(pids[i]);
+		if (pid_ret != 0) {
+			log_error("Failed to get patch info, pid=%d, ret=%d\n",
+				  pids[i], pid_ret);
+			ret = pid_ret;
+		}
+	}
+
+	return ret;
+}
+
+static int server_patch(struct arguments *req)
 {
+	struct upatch_elf **uelfs = NULL;
+	struct running_elf *relf = NULL;
 	int ret = 0;
 
-	ret = process_unpatch(pid, uuid);
+	ret = check_patch_list((const char **)req->uuids,
+			       (const char **)req->upatches, req->upatch_num);
 	if (ret) {
-		log_error("Failed to unpatch process, pid=%d, ret=%d\n", pid, ret);
 		return ret;
 	}
+	uelfs = calloc(req->upatch_num, sizeof(struct upatch_elf *));
+	if (uelfs == NULL) {
+		return -ENOMEM;
+	}
+
+	upatch_timing_start(PHASE_ELF_LOAD);
+	for (size_t i = 0; i < req->upatch_num; i++) {
+		uelfs[i] = upatch_cache_get_patch(req->upatches[i]);
+		if (uelfs[i] == NULL) {
+			log_error("Failed to initialize patch '%s'\n",
+				  req->upatches[i]);
+			ret = -ENOEXEC;
+			goto out;
+		}
+	}
+
+	relf = upatch_cache_get_binary(req->binary);
+	upatch_timing_end(PHASE_ELF_LOAD);
+	if (relf == NULL) {
+		log_error("Failed to load binary '%s'\n", req->binary);
+		ret = -ENOEXEC;
+		goto out;
+	}
+
+	ret = patch_processes(uelfs, relf, (const char **)req->uuids,
+			      req->upatch_num, req->pids, req->pid_num);
+	upatch_share_release();
+
+out:
+	free(uelfs);
+	return ret;
+}
+
+static int server_replace(struct arguments *req)
+{
+	struct upatch_elf *uelf = NULL;
+	struct running_elf *relf = NULL;
+	int ret = 0;
+
+	if (!strcmp(req->uuids[0], req->uuids[1])) {
+		log_error("Patch '%s' is duplicated\n", req->uuids[1]);
+		return -EINVAL;
+	}
+
+	upatch_timing_start(PHASE_ELF_LOAD);
+	uelf = upatch_cache_get_patch(req->upatches[1]);
+	if (uelf == NULL) {
+		upatch_timing_end(PHASE_ELF_LOAD);
+		log_error("Failed to initialize patch '%s'\n", req->upatches[1]);
+		return -ENOEXEC;
+	}
+	relf = upatch_cache_get_binary(req->binary);
+	upatch_timing_end(PHASE_ELF_LOAD);
+	if (relf == NULL) {
+		log_error("Failed to load binary '%s'\n", req->binary);
+		return -ENOEXEC;
+	}
+
+	ret = replace_processes(req->uuids[0], uelf, relf, req->uuids[1],
+				req->pids, req->pid_num);
+	upatch_share_release();
+
+	return ret;
+}
+
+static int parse_server_list(char ***list, size_t *num, char *field)
+{
+	char *saveptr = NULL;
+
+	for (char *token = strtok_r(field, SERVER_LIST_SEPARATOR, &saveptr);
+	     token != NULL;
+	     token = strtok_r(NULL, SERVER_LIST_SEPARATOR, &saveptr)) {
+		if (parse_list(list, num, token)) {
+			return -ENOMEM;
+		}
+	}
 
 	return 0;
 }
 
-int info_upatch(const char *binary_path, const char *upatch_path, int pid)
+static int server_handle_request(char *line)
 {
-	int ret = process_info(pid);
-	if (ret != 0) {
-		log_error("Failed to get patch info, pid=%d, ret=%d\n", pid, ret);
-		return ret;
+	struct arguments req;
+	char *fields[SERVER_FIELD_NUM];
+	char *saveptr = NULL;
+	int ret;
+
+	memset(&req, 0, sizeof(struct arguments));
+	line[strcspn(line, "\n")] = '\0';
+
+	for (int i = 0; i < SERVER_FIELD_NUM; i++) {
+		fields[i] = strtok_r((i == 0) ? line : NULL,
+				     SERVER_FIELD_SEPARATOR, &saveptr);
+		if (fields[i] == NULL) {
+			log_error("Invalid request\n");
+			return -EINVAL;
+		}
+	}
+
+	req.cmd = parse_command(fields[0]);
+	req.binary = fields[2];
+	if (parse_server_list(&req.uuids, &req.uuid_num, fields[1]) ||
+	    parse_server_list(&req.upatches, &req.upatch_num, fields[3]) ||
+	    parse_pids(&req, fields[4])) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if ((req.uuid_num == 0) || (req.uuid_num != req.upatch_num) ||
+	    ((req.cmd == REPLACE) && (req.uuid_num != 2)) ||
+	    ((req.cmd != PATCH) && (req.cmd != REPLACE) && (req.uuid_num > 1))) {
+		log_error("Invalid patch list\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	switch (req.cmd) {
+	case PATCH:
+		ret = server_patch(&req);
+		break;
+	case UNPATCH:
+		ret = unpatch_upatch(req.uuids[0], req.binary, req.upatches[0],
+				     req.pids, req.pid_num);
+		break;
+	case INFO:
+		ret = info_upatch(req.binary, req.upatches[0],
+				  req.pids, req.pid_num);
+		break;
+	case REPLACE:
+		ret = server_replace(&req);
+		break;
+	default:
+		log_error("Invalid command '%s'\n", fields[0]);
+		ret = -EINVAL;
+		break;
+	}
+
+out:
+	free(req.uuids);
+	free(req.upatches);
+	free(req.pids);
+
+	return ret;
+}
+
+/*
+ * Serve requests until stdin is closed, parsed patch & binary files are
+ * kept across requests, so each request costs only the process operation.
+ */
+static int server_main(void)
+{
+	char *line = NULL;
+	size_t len = 0;
+
+	while (getline(&line, &len, stdin) != -1) {
+		int ret = server_handle_request(line);
+
+		printf("%s ret=%d\n", SERVER_DONE_PREFIX, abs(ret));
+		fflush(stdout);
 	}
 
+	free(line);
+	upatch_cache_destroy();
+
 	return 0;
 }
 
@@ -197,29 +670,54 @@ int main(int argc, char *argv[])
 	if (args.verbose) {
 		loglevel = DEBUG;
 	}
+	upatch_process_set_freezer(args.freeze);
+	upatch_resolve_set_direct_bind(args.direct_bind);
+	upatch_timing_set_enabled(args.timing);
+	upatch_stack_set_check(args.stack_check);
+	upatch_coro_set_soft_dirty(args.coro_soft_dirty);
+	upatch_share_set_dir(args.share_dir);
+	upatch_patch_set_huge_text(args.huge_text);
 
-	logprefix = basename(args.upatch);
-	log_debug("PID: %d\n", args.pid);
-	log_debug("UUID: %s\n", args.uuid);
-	log_debug("Patch: %s\n", args.upatch);
+	logprefix = (args.upatch_num != 0) ? basename(args.upatches[0]) :
+					     "upatch-manage";
+	for (size_t i = 0; i < args.pid_num; i++) {
+		log_debug("PID: %d\n", args.pids[i]);
+	}
+	for (size_t i = 0; i < args.upatch_num; i++) {
+		log_debug("UUID: %s\n", args.uuids[i]);
+		log_debug("Patch: %s\n", args.upatches[i]);
+	}
 	log_debug("Binary: %s\n", args.binary);
 
-	args.pid = args.pid & INT32_MAX;
 	switch (args.cmd) {
 	case PATCH:
-		ret = patch_upatch(args.uuid, args.binary, args.upatch, args.pid);
+		ret = patch_upatch((const char **)args.uuids, args.binary,
+				   (const char **)args.upatches, args.upatch_num,
+				   args.pids, args.pid_num);
 		break;
 	case UNPATCH:
-		ret = unpatch_upatch(args.uuid, args.binary, args.upatch, args.pid);
+		ret = unpatch_upatch(args.uuids[0], args.binary,
+				     args.upatches[0], args.pids, args.pid_num);
 		break;
 	case INFO:
-		ret = info_upatch(args.binary, args.upatch, args.pid);
+		ret = info_upatch(args.binary, args.upatches[0],
+				  args.pids, args.pid_num);
+		break;
+	case REPLACE:
+		ret = replace_upatch(args.uuids[0], args.uuids[1], args.binary,
+				     args.upatches[1], args.pids, args.pid_num);
+		break;
+	case SERVER:
+		ret = server_main();
 		break;
 	default:
 		ERROR("Unknown command");
 		ret = EINVAL;
 		break;
 	}
+	free(args.uuids);
+	free(args.upatches);
+	free(args.pids);
 
 	(ret == 0) ? log_normal("SUCCESS\n\n") : log_error("FAILED\n\n");
 	return abs(ret);
@@ -20,22 +20,25 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <asm/unistd.h>
 #include <sys/mman.h>
-#include <sys/time.h>
+#include <sys/param.h>
 
 #include "log.h"
+#include "process.h"
 #include "upatch-common.h"
 #include "upatch-patch.h"
 #include "upatch-process.h"
 #include "upatch-ptrace.h"
 #include "upatch-relocation.h"
 #include "upatch-resolve.h"
-
-#define GET_MICROSECONDS(a, b) \
-	((a.tv_sec - b.tv_sec) * 1000000 + (a.tv_usec - b.tv_usec))
+#include "upatch-share.h"
+#include "upatch-stack.h"
+#include "upatch-timing.h"
 
 #ifndef ARCH_SHF_SMALL
 #define ARCH_SHF_SMALL 0
@@ -47,6 +50,13 @@
 /* If this is set, the section belongs in the init part of the module */
 #define BITS_PER_LONG sizeof(unsigned long) * 8
 
+static bool huge_text_enabled;
+
+void upatch_patch_set_huge_text(bool enable)
+{
+	huge_text_enabled = enable;
+}
+
 static GElf_Off calculate_load_address(struct running_elf *relf,
 				       bool check_code)
 {
@@ -77,13 +87,12 @@ out:
 
 static unsigned long calculate_mem_load(struct object_file *obj)
 {
-	struct obj_vm_area *ovma;
 	unsigned long load_addr = -1;
 
-	list_for_each_entry(ovma, &obj->vma, list) {
-		if (ovma->inmem.prot & PROT_EXEC) {
-			load_addr = (load_addr > ovma->inmem.start) ?
-					    ovma->inmem.start :
+	for (size_t i = 0; i < obj->num_vmas; i++) {
+		if (obj->vmas[i].prot & PROT_EXEC) {
+			load_addr = (load_addr > obj->vmas[i].start) ?
+					    obj->vmas[i].start :
 					    load_addr;
 		}
 	}
@@ -160,6 +169,59 @@ static void layout_jmptable(struct upatch_elf *uelf)
 	uelf->core_layout.text_size = uelf->core_layout.size;
 }
 
+/*
+ * Sections holding new functions of the patch, which are what runs after
+ * activation. They are told by relocations of the new_addr field of
+ * upatch funcs. Returns NULL if there is none.
+ */
+static bool *find_hot_sections(struct upatch_elf *uelf)
+{
+	GElf_Shdr *shdrs = uelf->info.shdrs;
+	GElf_Sym *symtab = (void *)uelf->info.hdr + shdrs[uelf->index.sym].sh_offset;
+	size_t nsym = shdrs[uelf->index.sym].sh_size / sizeof(GElf_Sym);
+	unsigned int shnum = uelf->info.hdr->e_shnum;
+	bool *hot = NULL;
+	unsigned int i;
+	size_t j;
+
+	for (i = 0; i < shnum; i++) {
+		GElf_Rela *relas = (void *)uelf->info.hdr + shdrs[i].sh_offset;
+		size_t nrela = shdrs[i].sh_size / sizeof(GElf_Rela);
+
+		if (shdrs[i].sh_type != SHT_RELA ||
+		    shdrs[i].sh_info != uelf->index.upatch_funcs)
+			continue;
+
+		for (j = 0; j < nrela; j++) {
+			size_t sym_index = GELF_R_SYM(relas[j].r_info);
+			GElf_Section shndx;
+
+			if (relas[j].r_offset % sizeof(struct upatch_patch_func) !=
+				    offsetof(struct upatch_patch_func, new_addr) ||
+			    sym_index >= nsym)
+				continue;
+
+			shndx = symtab[sym_index].st_shndx;
+			if (shndx == SHN_UNDEF || shndx >= shnum)
+				continue;
+
+			if (hot == NULL) {
+				hot = calloc(shnum, sizeof(bool));
+				if (hot == NULL)
+					return NULL;
+			}
+			hot[shndx] = true;
+		}
+	}
+
+	return hot;
+}
+
+/*
+ * Text of patched functions is laid out first, right after the jmp table,
+ * so that the code running after activation takes as few pages and tlb
+ * entries as possible. The rest keeps the order of the kernel.
+ */
 static void layout_sections(struct upatch_elf *uelf)
 {
 	static unsigned long const masks[][2] = {
@@ -172,30 +234,40 @@ static void layout_sections(struct upatch_elf *uelf)
 		{ SHF_WRITE | SHF_ALLOC, ARCH_SHF_SMALL },
 		{ ARCH_SHF_SMALL | SHF_ALLOC, 0 }
 	};
-	unsigned int m, i;
+	bool *hot = find_hot_sections(uelf);
+	unsigned int m, i, pass;
 
 	for (i = 0; i < uelf->info.hdr->e_shnum; i++)
 		uelf->info.shdrs[i].sh_entsize = ~0UL;
 
 	log_debug("upatch section allocation order:\n");
 	for (m = 0; m < ARRAY_SIZE(masks); ++m) {
-		for (i = 0; i < uelf->info.hdr->e_shnum; ++i) {
-			GElf_Shdr *s = &uelf->info.shdrs[i];
-			const char *sname = uelf->info.shstrtab + s->sh_name;
-
-			if ((s->sh_flags & masks[m][0]) != masks[m][0] ||
-			    (s->sh_flags & masks[m][1]) ||
-			    s->sh_entsize != ~0UL)
-				continue;
-
-			s->sh_entsize =
-				get_offset(uelf, &uelf->core_layout.size, s, i);
-			log_debug("\tm = %d; %s: sh_entsize: 0x%lx\n", m, sname,
-				  s->sh_entsize);
+		/* pass 0 takes the hot text only, pass 1 takes the rest */
+		for (pass = (m == 0 && hot != NULL) ? 0 : 1; pass < 2; pass++) {
+			for (i = 0; i < uelf->info.hdr->e_shnum; ++i) {
+				GElf_Shdr *s = &uelf->info.shdrs[i];
+				const char *sname = uelf->info.shstrtab + s->sh_name;
+
+				if ((s->sh_flags & masks[m][0]) != masks[m][0] ||
+				    (s->sh_flags & masks[m][1]) ||
+				    s->sh_entsize != ~0UL ||
+				    (pass == 0 && !hot[i]))
+					continue;
+
+				s->sh_entsize = get_offset(
+					uelf, &uelf->core_layout.size, s, i);
+				log_debug("\tm = %d; %s: sh_entsize: 0x%lx\n", m,
+					  sname, s->sh_entsize);
+			}
 		}
 		switch (m) {
 		case 0: /* executable */
-			uelf->core_layout.size =
+			/*
+			 * Huge text takes whole huge pages, nothing of other
+			 * protection may share them.
+			 */
+			uelf->core_layout.size = huge_text_enabled ?
+				ROUND_UP(uelf->core_layout.size, HUGE_PAGE_SIZE) :
 				PAGE_ALIGN(uelf->core_layout.size);
 			uelf->core_layout.text_size = uelf->core_layout.size;
 			break;
@@ -216,6 +288,7 @@ static void layout_sections(struct upatch_elf *uelf)
 			break;
 		}
 	}
+	free(hot);
 }
 
 /* TODO: only included used symbol */
@@ -276,58 +349,290 @@ static void layout_symtab(struct upatch_elf *uelf)
 	log_debug("\t%s\n", uelf->info.shstrtab + strsect->sh_name);
 }
 
-static void *upatch_alloc(struct object_file *obj, size_t sz)
+/*
+ * Reserve region for patch, memory is mapped later by upatch_map. Patches
+ * are packed into an arena within direct branch range of the object, so
+ * that calls & jumpers need no jmp table entry. Otherwise a vm hole of its
+ * own is taken, within reach of pc relative data references if possible.
+ * The region starts at a multiple of align, which is a power of 2.
+ */
+static void *upatch_reserve(struct object_file *obj, size_t sz,
+			    unsigned long align)
 {
 	int ret;
 	unsigned long addr;
 	struct vm_hole *hole = NULL;
+	size_t slack = align - PAGE_SIZE;
 
-	addr = object_find_patch_region_nolimit(obj, sz, &hole);
-	if (!addr)
-		return NULL;
-
-	addr = upatch_mmap_remote(proc2pctx(obj->proc), addr, sz,
-				  PROT_READ | PROT_WRITE | PROT_EXEC,
-				  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1,
-				  0);
-	if (addr == 0) {
-		return NULL;
+	addr = object_alloc_arena_region(obj, sz, align);
+	if (addr != 0) {
+		log_debug("Reserved 0x%lx bytes at 0x%lx of '%s'\n", sz, addr,
+			  obj->name);
+		return (void *)addr;
 	}
 
-	log_debug("Allocated 0x%lx bytes at 0x%lx of '%s'\n", sz, addr, obj->name);
+	log_debug("No room within branch range of '%s'\n", obj->name);
+	addr = object_find_patch_region(obj, sz + slack, MAX_DATA_DISTANCE,
+					&hole);
+	if (!addr || addr == -1UL)
+		addr = object_find_patch_region_nolimit(obj, sz + slack, &hole);
+	if (!addr || addr == -1UL)
+		return NULL;
+	addr = ROUND_UP(addr, align);
 
 	// log_debug("Marking this space as busy\n");
-	ret = vm_hole_split(hole, addr, addr + sz);
+	ret = vm_hole_split(obj->proc, hole, addr, addr + sz);
 	if (ret) {
-		// TODO: clear
 		log_error("Failed to split vm hole\n");
 		return NULL;
 	}
 
+	log_debug("Reserved 0x%lx bytes at 0x%lx of '%s'\n", sz, addr, obj->name);
+
 	return (void *)addr;
 }
 
+/* Memory in an arena is given back to it, fresh PROT_NONE pages replace it */
 static void upatch_free(struct object_file *obj, void *base,
 			     unsigned int size)
 {
+	struct upatch_arena *arena = upatch_process_find_arena(obj->proc,
+		(unsigned long)base, (unsigned long)base + size);
+	unsigned long addr;
+
 	log_debug("Free patch memory %p\n", base);
-	if (upatch_munmap_remote(proc2pctx(obj->proc), (unsigned long)base, size)) {
+	if (arena == NULL) {
+		if (upatch_munmap_remote(proc2pctx(obj->proc),
+					 (unsigned long)base, size)) {
+			log_error("Failed to free patch memory %p\n", base);
+		}
+		return;
+	}
+
+	addr = upatch_mmap_remote(proc2pctx(obj->proc), (unsigned long)base,
+				  size, PROT_NONE,
+				  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS |
+					  MAP_NORESERVE,
+				  -1, 0);
+	if (addr != (unsigned long)base) {
 		log_error("Failed to free patch memory %p\n", base);
 	}
 }
 
+/*
+ * List (or unlist) the patch in header of its arena. Header is read back
+ * from process, as its list is shared with the forked ones. Patches out of
+ * arenas are not listed, the registry is a hint, its failure is not fatal.
+ */
+static void upatch_arena_register(struct object_file *obj, const char *uuid,
+				  unsigned long start, unsigned long end,
+				  bool add)
+{
+	struct upatch_arena *arena =
+		upatch_process_find_arena(obj->proc, start, end);
+	struct upatch_arena_header header;
+	unsigned int i;
+
+	if (arena == NULL) {
+		return;
+	}
+	if (upatch_process_mem_read(obj->proc, arena->start, &header,
+				    sizeof(header))) {
+		log_warn("Failed to read arena header at 0x%lx\n",
+			 arena->start);
+		return;
+	}
+	if (header.num_patches > UPATCH_ARENA_MAX_PATCH) {
+		header.num_patches = UPATCH_ARENA_MAX_PATCH;
+	}
+
+	for (i = 0; i < header.num_patches; i++) {
+		if (strncmp(header.patches[i].id, uuid, UPATCH_ID_LEN) == 0) {
+			break;
+		}
+	}
+	if (add) {
+		if (i == UPATCH_ARENA_MAX_PATCH) {
+			log_warn("Arena at 0x%lx is full, patch '%s' is not listed\n",
+				 arena->start, uuid);
+			return;
+		}
+		if (i == header.num_patches) {
+			header.num_patches++;
+		}
+		memset(&header.patches[i], 0, sizeof(header.patches[0]));
+		strncpy(header.patches[i].id, uuid, UPATCH_ID_LEN);
+		header.patches[i].start = start;
+		header.patches[i].end = end;
+	} else {
+		if (i == header.num_patches) {
+			return;
+		}
+		header.num_patches--;
+		memmove(&header.patches[i], &header.patches[i + 1],
+			(header.num_patches - i) * sizeof(header.patches[0]));
+		memset(&header.patches[header.num_patches], 0,
+		       sizeof(header.patches[0]));
+	}
+
+	if (upatch_process_mem_write(obj->proc, &header, arena->start,
+				     sizeof(header))) {
+		log_warn("Failed to write arena header at 0x%lx\n",
+			 arena->start);
+	}
+}
+
+/* Regions of patch memory, each one gets its own protection */
+#define UPATCH_MAP_REGION_NUM 5
+
+struct upatch_map_region {
+	unsigned long start;
+	unsigned long end;
+	int prot;
+	const char *name;
+};
+
+static void upatch_map_add_syscall(struct upatch_remote_syscall *call,
+				   unsigned long nr, unsigned long arg1,
+				   unsigned long arg2, unsigned long arg3,
+				   unsigned long arg4, unsigned long arg5,
+				   unsigned long arg6)
+{
+	call->nr = nr;
+	call->args[0] = arg1;
+	call->args[1] = arg2;
+	call->args[2] = arg3;
+	call->args[3] = arg4;
+	call->args[4] = arg5;
+	call->args[5] = arg6;
+}
+
+/*
+ * Map patch memory and set protection of all its regions by a single remote
+ * syscall batch. The image is written afterwards anyway, since writes to
+ * process memory ignore page protection.
+ * Memory inside an arena is already mapped, only its protection is changed.
+ * A pending arena is mapped along with its first patch.
+ */
+static int upatch_map(struct upatch_elf *uelf, struct object_file *obj)
+{
+	struct upatch_layout *layout = &uelf->core_layout;
+	unsigned long base = (unsigned long)layout->base;
+	struct upatch_arena *arena = upatch_process_find_arena(obj->proc,
+		base, base + layout->size);
+	struct upatch_map_region regions[UPATCH_MAP_REGION_NUM] = {
+		{ 0, layout->text_size, PROT_READ | PROT_EXEC, "text" },
+		{ layout->text_size, layout->ro_size, PROT_READ, "ro" },
+		{ layout->ro_size, layout->ro_after_init_size, PROT_READ,
+		  "ro init" },
+		{ layout->ro_after_init_size, layout->info_size,
+		  PROT_READ | PROT_WRITE, "rw" },
+		{ layout->info_size, layout->size, PROT_READ, "info" },
+	};
+	struct upatch_remote_syscall calls[UPATCH_MAP_REGION_NUM + 2];
+	const char *names[UPATCH_MAP_REGION_NUM + 2];
+	struct upatch_arena_header header;
+	size_t num = 0;
+	size_t i;
+	int ret;
+
+	if (arena == NULL) {
+		upatch_map_add_syscall(&calls[num], __NR_mmap, base,
+				       layout->size,
+				       PROT_READ | PROT_WRITE | PROT_EXEC,
+				       MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
+				       (unsigned long)-1, 0);
+		names[num++] = "patch memory";
+	} else if (arena->pending) {
+		upatch_map_add_syscall(&calls[num], __NR_mmap, arena->start,
+				       arena->end - arena->start, PROT_NONE,
+				       MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS |
+					       MAP_NORESERVE,
+				       (unsigned long)-1, 0);
+		names[num++] = "patch arena";
+		upatch_map_add_syscall(&calls[num], __NR_mprotect,
+				       arena->start, PAGE_SIZE, PROT_READ,
+				       0, 0, 0);
+		names[num++] = "arena header";
+	}
+
+	for (i = 0; i < UPATCH_MAP_REGION_NUM; i++) {
+		struct upatch_map_region *region = &regions[i];
+
+		if (region->end <= region->start) {
+			continue;
+		}
+		upatch_map_add_syscall(&calls[num], __NR_mprotect,
+				       base + region->start,
+				       region->end - region->start,
+				       (unsigned long)region->prot, 0, 0, 0);
+		names[num++] = region->name;
+	}
+
+	ret = upatch_syscall_remote_batch(proc2pctx(obj->proc), calls, num);
+	if ((ret == 0) && (arena != NULL) && arena->pending) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, UPATCH_ARENA_MAGIC,
+		       sizeof(UPATCH_ARENA_MAGIC));
+		header.size = arena->end - arena->start;
+
+		ret = upatch_process_mem_write(obj->proc, &header,
+					       arena->start, sizeof(header));
+		if (ret) {
+			log_error("Failed to write arena header at 0x%lx\n",
+				  arena->start);
+		}
+	}
+	if (ret == 0) {
+		if (arena != NULL) {
+			arena->pending = false;
+		}
+		log_debug("Allocated 0x%x bytes at 0x%lx of '%s'\n",
+			  layout->size, base, obj->name);
+		return 0;
+	}
+
+	ret = -errno;
+	for (i = 0; i < num; i++) {
+		if (calls[i].res < (unsigned long)-MAX_ERRNO) {
+			continue;
+		}
+		if (calls[i].nr == __NR_mmap) {
+			log_error("Failed to map %s at 0x%lx\n", names[i],
+				  calls[i].args[0]);
+		} else {
+			log_error("Failed to change upatch %s protection\n",
+				  names[i]);
+		}
+		break;
+	}
+
+	/* Nothing to release if the first mmap failed */
+	if ((calls[0].nr == __NR_mmap) && (calls[0].res != calls[0].args[0])) {
+		return ret;
+	}
+	if ((arena != NULL) && arena->pending) {
+		upatch_munmap_remote(proc2pctx(obj->proc), arena->start,
+				     arena->end - arena->start);
+	} else {
+		upatch_free(obj, layout->base, layout->size);
+	}
+	return ret;
+}
+
 static int __alloc_memory(struct object_file *obj_file,
 			  struct upatch_layout *layout)
 {
 	/* Do the allocs. */
-	layout->base = upatch_alloc(obj_file, layout->size);
+	layout->base = upatch_reserve(obj_file, layout->size,
+				      huge_text_enabled ? HUGE_PAGE_SIZE :
+							  (unsigned long)PAGE_SIZE);
 	if (!layout->base) {
-		return -errno;
+		return -ENOMEM;
 	}
 
 	layout->kbase = malloc(layout->size);
 	if (!layout->kbase) {
-		upatch_free(obj_file, layout->base, layout->size);
 		return -errno;
 	}
 
@@ -374,7 +679,9 @@ static int alloc_memory(struct upatch_elf *uelf, struct object_file *obj)
 	return 0;
 }
 
-static int post_memory(struct upatch_elf *uelf, struct object_file *obj)
+/* Head of shared patch image is mapped already, it is skipped */
+static int post_memory(struct upatch_elf *uelf, struct upatch_mem_batch *batch,
+		       unsigned long shared)
 {
 	int ret = 0;
 
@@ -382,9 +689,9 @@ static int post_memory(struct upatch_elf *uelf, struct object_file *obj)
 		  (unsigned long)uelf->core_layout.kbase,
 		  uelf->core_layout.size,
 		  (unsigned long)uelf->core_layout.base);
-	ret = upatch_process_mem_write(obj->proc, uelf->core_layout.kbase,
-				       (unsigned long)uelf->core_layout.base,
-				       uelf->core_layout.size);
+	ret = upatch_mem_batch_add(batch, uelf->core_layout.kbase + shared,
+				   (unsigned long)uelf->core_layout.base + shared,
+				   uelf->core_layout.size - shared);
 	if (ret) {
 		log_error("Failed to move kbase to base, ret=%d\n", ret);
 		goto out;
@@ -448,131 +755,73 @@ static int unapply_patch(struct object_file *obj,
 			 struct upatch_info_func *funcs,
 			 unsigned int changed_func_num)
 {
+	struct upatch_mem_batch batch;
+	int ret = 0;
+
+	upatch_mem_batch_init(&batch, obj->proc);
+
 	log_normal("Changed insn:\n");
 	for (int i = 0; i < changed_func_num; ++i) {
 		log_normal("\t0x%lx(0x%lx -> 0x%lx)\n", funcs[i].old_addr,
 			  funcs[i].new_insn, funcs[i].old_insn[0]);
 
-		int ret = upatch_process_mem_write(obj->proc, &funcs[i].old_insn,
+		ret = upatch_mem_batch_add(&batch, &funcs[i].old_insn,
 			(unsigned long)funcs[i].old_addr, get_origin_insn_len());
-
-		if (ret) {
-			log_error("Failed to write old insn at 0x%lx, ret=%d\n",
-				funcs[i].old_addr, ret);
-			return ret;
-		}
-	}
-	return 0;
-}
-
-static int apply_patch(struct upatch_elf *uelf, struct object_file *obj)
-{
-	int ret = 0, i;
-	struct upatch_info *uinfo =
-		(void *)uelf->core_layout.kbase + uelf->core_layout.info_size;
-
-	for (i = 0; i < uinfo->changed_func_num; ++i) {
-		struct upatch_info_func *upatch_func =
-			(void *)uelf->core_layout.kbase +
-			uelf->core_layout.info_size +
-			sizeof(struct upatch_info) +
-			i * sizeof(struct upatch_info_func);
-
-		// write jumper insn to first 8 bytes
-		ret = upatch_process_mem_write(obj->proc, &upatch_func->new_insn,
-			(unsigned long)upatch_func->old_addr, get_upatch_insn_len());
-		if (ret) {
-			log_error(
-				"Failed to ptrace upatch func at 0x%lx(0x%lx) - %d\n",
-				upatch_func->old_addr, upatch_func->new_insn,
-				ret);
-			goto out;
-		}
-		// write 64bit new addr to second 8 bytes
-		ret = upatch_process_mem_write(obj->proc, &upatch_func->new_addr,
-			(unsigned long)upatch_func->old_addr + get_upatch_insn_len(),
-			get_upatch_addr_len());
 		if (ret) {
-			log_error(
-				"Failed to ptrace upatch func at 0x%lx(0x%lx) - %d\n",
-				upatch_func->old_addr + get_upatch_insn_len(),
-				upatch_func->new_addr,
-				ret);
 			goto out;
 		}
 	}
 
-out:
+	ret = upatch_mem_batch_flush(&batch);
 	if (ret) {
-		unapply_patch(obj,
-			(void *)uelf->core_layout.kbase +
-			uelf->core_layout.info_size +
-			sizeof(struct upatch_info),
-			i);
+		log_error("Failed to write old insn, ret=%d\n", ret);
 	}
+
+out:
+	upatch_mem_batch_destroy(&batch);
 	return ret;
 }
 
-static int upatch_mprotect(struct upatch_elf *uelf, struct object_file *obj)
+/* Jumper of a function, insn is written to first 8 bytes, then the address */
+static int add_jumper(struct upatch_mem_batch *batch,
+		      struct upatch_info_func *upatch_func)
 {
+	size_t jmp_len = get_upatch_jmp_len(upatch_func->old_addr,
+		upatch_func->new_addr);
 	int ret;
 
-	if (uelf->core_layout.text_size > 0) {
-		ret = upatch_mprotect_remote(
-			proc2pctx(obj->proc),
-			(unsigned long)uelf->core_layout.base,
-			uelf->core_layout.text_size, PROT_READ | PROT_EXEC);
-		if (ret < 0) {
-			log_error("Failed to change upatch text protection to r-x");
-			return ret;
-		}
+	// write jumper insn to first 8 bytes
+	ret = upatch_mem_batch_add(batch, &upatch_func->new_insn,
+		(unsigned long)upatch_func->old_addr,
+		jmp_len < get_upatch_insn_len() ? jmp_len : get_upatch_insn_len());
+	if (ret) {
+		return ret;
 	}
-
-	if (uelf->core_layout.ro_size > uelf->core_layout.text_size) {
-		ret = upatch_mprotect_remote(
-			proc2pctx(obj->proc),
-			(unsigned long)uelf->core_layout.base + uelf->core_layout.text_size,
-			uelf->core_layout.ro_size - uelf->core_layout.text_size,
-			PROT_READ);
-		if (ret < 0) {
-			log_error("Failed to change upatch ro protection to r--");
-			return ret;
-		}
+	// direct jump does not need the address
+	if (jmp_len <= get_upatch_insn_len()) {
+		return 0;
 	}
+	// write 64bit new addr to second 8 bytes
+	return upatch_mem_batch_add(batch, &upatch_func->new_addr,
+		(unsigned long)upatch_func->old_addr + get_upatch_insn_len(),
+		get_upatch_addr_len());
+}
 
-	if (uelf->core_layout.ro_after_init_size > uelf->core_layout.ro_size) {
-		ret = upatch_mprotect_remote(
-			proc2pctx(obj->proc),
-			(unsigned long)uelf->core_layout.base + uelf->core_layout.ro_size,
-			uelf->core_layout.ro_after_init_size - uelf->core_layout.ro_size,
-			PROT_READ);
-		if (ret < 0) {
-			log_error("Failed to change upatch ro init protection to r--");
-			return ret;
-		}
-	}
+static int apply_patch(struct upatch_elf *uelf, struct upatch_mem_batch *batch)
+{
+	int ret = 0, i;
+	struct upatch_info *uinfo =
+		(void *)uelf->core_layout.kbase + uelf->core_layout.info_size;
 
-	if (uelf->core_layout.info_size >
-	    uelf->core_layout.ro_after_init_size) {
-		ret = upatch_mprotect_remote(
-			proc2pctx(obj->proc),
-			(unsigned long)uelf->core_layout.base + uelf->core_layout.ro_after_init_size,
-			uelf->core_layout.info_size - uelf->core_layout.ro_after_init_size,
-			PROT_READ | PROT_WRITE);
-		if (ret < 0) {
-			log_error("Failed to change upatch rw protection to rw-");
-			return ret;
-		}
-	}
+	for (i = 0; i < uinfo->changed_func_num; ++i) {
+		struct upatch_info_func *upatch_func =
+			(void *)uelf->core_layout.kbase +
+			uelf->core_layout.info_size +
+			sizeof(struct upatch_info) +
+			i * sizeof(struct upatch_info_func);
 
-	if (uelf->core_layout.size > uelf->core_layout.info_size) {
-		ret = upatch_mprotect_remote(
-			proc2pctx(obj->proc),
-			(unsigned long)uelf->core_layout.base + uelf->core_layout.info_size,
-			uelf->core_layout.size - uelf->core_layout.info_size,
-			PROT_READ);
-		if (ret < 0) {
-			log_error("Failed to change upatch info protection to r--");
+		ret = add_jumper(batch, upatch_func);
+		if (ret) {
 			return ret;
 		}
 	}
@@ -580,8 +829,13 @@ static int upatch_mprotect(struct upatch_elf *uelf, struct object_file *obj)
 	return 0;
 }
 
-static int upatch_apply_patches(struct upatch_process *proc,
-				struct upatch_elf *uelf, const char *uuid)
+/*
+ * Build the whole patch image in local memory (kbase), process maps are
+ * read without stopping the process.
+ */
+static int upatch_prepare_patches(struct upatch_process *proc,
+				  struct upatch_elf *uelf, const char *uuid,
+				  struct object_file **pobj)
 {
 	int ret = 0;
 	struct object_file *obj = NULL;
@@ -596,10 +850,9 @@ static int upatch_apply_patches(struct upatch_process *proc,
 	}
 
 	if (!found) {
-		ret = -1;
 		log_debug("Cannot find inode %lu in pid %d, file is not loaded\n",
 			uelf->relf->info.inode, proc->pid);
-		goto out;
+		return -1;
 	}
 
 	min_addr = calculate_load_address(uelf->relf, true);
@@ -607,9 +860,10 @@ static int upatch_apply_patches(struct upatch_process *proc,
 	uelf->relf->load_bias = uelf->relf->load_start - min_addr;
 	log_debug("load_bias = %lx\n", uelf->relf->load_bias);
 
+	upatch_timing_start(PHASE_LAYOUT);
 	ret = rewrite_section_headers(uelf);
 	if (ret)
-		goto free;
+		return ret;
 
 	// Caculate upatch mem size
 	layout_jmptable(uelf);
@@ -630,177 +884,605 @@ static int upatch_apply_patches(struct upatch_process *proc,
 	 * Otherwise we can't use 32-bit jumps.
 	 */
 	ret = alloc_memory(uelf, obj);
+	upatch_timing_end(PHASE_LAYOUT);
 	if (ret) {
 		log_error("Failed to alloc patch memory\n");
-		goto free;
-	}
-
-	ret = upatch_mprotect(uelf, obj);
-	if (ret) {
-		log_error("Failed to set patch memory permission\n");
-		goto free;
+		return ret;
 	}
 
 	/* Fix up syms, so that st_value is a pointer to location. */
+	upatch_timing_start(PHASE_RESOLVE);
 	ret = simplify_symbols(uelf, obj);
+	upatch_timing_end(PHASE_RESOLVE);
 	if (ret) {
-		goto free;
+		return ret;
 	}
 
 	/* upatch new address will be updated */
+	upatch_timing_start(PHASE_RELOCATE);
 	ret = apply_relocations(uelf);
+	upatch_timing_end(PHASE_RELOCATE);
 	if (ret) {
-		goto free;
+		return ret;
 	}
 
 	/* upatch upatch info */
 	ret = complete_info(uelf, obj, uuid);
 	if (ret) {
-		goto free;
+		return ret;
 	}
 
-	ret = post_memory(uelf, obj);
-	if (ret) {
-		goto free;
+	*pobj = obj;
+	return 0;
+}
+
+/* Check mappings which the image was built upon are unchanged */
+static int upatch_validate_maps(struct upatch_elf *uelf, struct object_file *obj)
+{
+	unsigned long start = (unsigned long)uelf->core_layout.base;
+	unsigned long end = start + uelf->core_layout.size;
+	struct upatch_arena *arena =
+		upatch_process_find_arena(obj->proc, start, end);
+	int ret;
+
+	if ((arena != NULL) && !arena->pending) {
+		ret = upatch_process_region_reserved(obj->proc, start, end);
+	} else {
+		if (arena != NULL) {
+			start = arena->start;
+			end = arena->end;
+		}
+		ret = !upatch_process_region_mapped(obj->proc, start, end);
+	}
+	if (ret != 1) {
+		log_error("Patch region 0x%lx-0x%lx is no longer free\n",
+			  start, end);
+		return -EAGAIN;
 	}
 
-	ret = apply_patch(uelf, obj);
-	if (ret) {
-		goto free;
+	/* Another file mapped at the same address would be patched otherwise */
+	if (upatch_process_addr_in_object(obj->proc, uelf->relf->load_start,
+					  obj) != 1) {
+		log_error("Object '%s' is no longer mapped at 0x%lx\n",
+			  obj->name, uelf->relf->load_start);
+		return -EAGAIN;
 	}
 
-	ret = 0;
-	goto out;
+	return 0;
+}
 
-// TODO: clear
-free:
-	upatch_free(obj, uelf->core_layout.base, uelf->core_layout.size);
-out:
-	return ret;
+static struct upatch_info_func *upatch_info_funcs(struct upatch_elf *uelf)
+{
+	return (void *)uelf->core_layout.kbase + uelf->core_layout.info_size +
+	       sizeof(struct upatch_info);
+}
+
+/* Origin insn of a function which is already patched, same as apply_patch */
+static void upatch_stack_insn(struct upatch_info_func *func,
+			      const struct upatch_info_func *prev)
+{
+	unsigned char *insn = (unsigned char *)func->old_insn;
+	size_t jmp_len = get_upatch_jmp_len(prev->old_addr, prev->new_addr);
+	size_t insn_len = get_upatch_insn_len();
+
+	memcpy(insn, prev->old_insn, get_origin_insn_len());
+	memcpy(insn, &prev->new_insn, jmp_len < insn_len ? jmp_len : insn_len);
+	if (jmp_len > insn_len) {
+		memcpy(insn + insn_len, &prev->new_addr, get_upatch_addr_len());
+	}
 }
 
-static void upatch_time_tick(int pid) {
-	static struct timeval start_tv;
-	static struct timeval end_tv;
+struct upatch_stack_func {
+	unsigned long old_addr;
+	size_t patch;
+	struct upatch_info_func *func;
+};
+
+/* By address, then by patch & position, in which functions are stacked */
+static int stack_func_cmp(const void *a, const void *b)
+{
+	const struct upatch_stack_func *fa = a;
+	const struct upatch_stack_func *fb = b;
 
-	if ((end_tv.tv_sec != 0) || (end_tv.tv_usec != 0)) {
-		memset(&start_tv, 0, sizeof(struct timeval));
-		memset(&end_tv, 0, sizeof(struct timeval));
+	if (fa->old_addr != fb->old_addr) {
+		return (fa->old_addr < fb->old_addr) ? -1 : 1;
+	}
+	if (fa->patch != fb->patch) {
+		return (fa->patch < fb->patch) ? -1 : 1;
 	}
+	if (fa->func == fb->func) {
+		return 0;
+	}
+	return (fa->func < fb->func) ? -1 : 1;
+}
 
-	if ((start_tv.tv_sec == 0) && (start_tv.tv_usec == 0)) {
-		gettimeofday(&start_tv, NULL);
-	} else {
-		gettimeofday(&end_tv, NULL);
+/*
+ * Patches of one session are prepared before any of them is active, thus
+ * a function patched again by a later patch still has the original insn.
+ * Take the jumper of the earlier patch instead, as if they were applied one
+ * by one, so that removing the later patch goes back to the earlier one.
+ *
+ * Functions of all patches are sorted by address once, thus the earlier
+ * patch of a function is found next to it, rather than by scanning every
+ * earlier patch for each function.
+ */
+static int upatch_stack_patches(struct upatch_elf **uelfs,
+				struct object_file **objs, size_t num)
+{
+	struct upatch_stack_func *stack_funcs;
+	const struct upatch_stack_func *first = NULL;
+	const struct upatch_stack_func *prev = NULL;
+	size_t count = 0;
+	size_t n = 0;
+
+	if (num < 2) {
+		return 0;
 	}
+	for (size_t i = 0; i < num; i++) {
+		struct upatch_info *uinfo = (void *)uelfs[i]->core_layout.kbase +
+					    uelfs[i]->core_layout.info_size;
 
-	if ((start_tv.tv_sec == 0) || (start_tv.tv_usec == 0) ||
-		(end_tv.tv_sec == 0) || (end_tv.tv_usec == 0)) {
-		return;
+		if (objs[i] != NULL) {
+			count += uinfo->changed_func_num;
+		}
+	}
+	stack_funcs = calloc(count + 1, sizeof(struct upatch_stack_func));
+	if (stack_funcs == NULL) {
+		log_error("Failed to alloc stack functions\n");
+		return -ENOMEM;
 	}
 
-	unsigned long frozen_time = GET_MICROSECONDS(end_tv, start_tv);
-	log_normal("Process %d frozen time is %ld microsecond(s)\n",
-		pid, frozen_time);
-}
+	for (size_t i = 0; i < num; i++) {
+		struct upatch_info *uinfo;
+		struct upatch_info_func *funcs;
 
-int upatch_process_uuid_exist(struct upatch_process *proc, const char *uuid)
-{
-	struct object_file *obj;
-	struct object_patch *patch;
-	list_for_each_entry(obj, &proc->objs, list) {
-		if (!obj->is_patch) {
+		if (objs[i] == NULL) {
 			continue;
 		}
-		list_for_each_entry(patch, &obj->applied_patch, list) {
-			if (strncmp(patch->uinfo->id, uuid, UPATCH_ID_LEN) == 0) {
-				return -EEXIST;
-			}
+		uinfo = (void *)uelfs[i]->core_layout.kbase +
+			uelfs[i]->core_layout.info_size;
+		funcs = upatch_info_funcs(uelfs[i]);
+
+		for (unsigned int j = 0; j < uinfo->changed_func_num; j++) {
+			stack_funcs[n].old_addr = funcs[j].old_addr;
+			stack_funcs[n].patch = i;
+			stack_funcs[n].func = &funcs[j];
+			n++;
+		}
+	}
+	qsort(stack_funcs, n, sizeof(struct upatch_stack_func), stack_func_cmp);
+
+	/* The first match of the latest earlier patch wins, it is stacked already */
+	for (size_t i = 0; i < n; i++) {
+		struct upatch_stack_func *cur = &stack_funcs[i];
+
+		if ((i == 0) || (cur->old_addr != cur[-1].old_addr)) {
+			prev = NULL;
+			first = cur;
+		} else if (cur->patch != cur[-1].patch) {
+			prev = first;
+			first = cur;
+		}
+		if (prev != NULL) {
+			upatch_stack_insn(cur->func, prev->func);
+		}
+		if (cur->patch != 0) {
+			log_debug("Function 0x%lx insn 0x%lx\n",
+				  cur->func->old_addr, cur->func->old_insn[0]);
 		}
 	}
+
+	free(stack_funcs);
 	return 0;
 }
 
-int process_patch(int pid, struct upatch_elf *uelf, struct running_elf *relf, const char *uuid, const char *binary_path)
+/*
+ * Advise huge pages before the image is written, so that faults of the
+ * text take huge pages at once. Shared text is a file mapping, which is
+ * collapsed by khugepaged if the kernel supports huge pages of files.
+ * Small pages work all the same, any failure is only logged.
+ */
+static void upatch_advise_huge_text(struct upatch_elf *uelf,
+				    struct object_file *obj)
 {
-	struct upatch_process proc;
+	unsigned long base = (unsigned long)uelf->core_layout.base;
+	size_t len = ROUND_DOWN(uelf->core_layout.text_size, HUGE_PAGE_SIZE);
 
-	// 查看process的信息，pid: maps, mem, cmdline, exe
-	int ret = upatch_process_init(&proc, pid);
-	if (ret < 0) {
-		log_error("Failed to init process\n");
-		goto out;
+	if (!huge_text_enabled || len == 0)
+		return;
+
+	if (upatch_madvise_remote(proc2pctx(obj->proc), base, len,
+				  MADV_HUGEPAGE)) {
+		log_warn("Failed to advise huge pages for patch text at 0x%lx, "
+			 "errno=%d\n", base, errno);
 	}
+}
 
-	printf("Patch '%s' to ", uuid);
-	upatch_process_print_short(&proc);
+/* Patch image is not reachable until jumpers are written */
+static int upatch_install_patch(struct upatch_elf *uelf,
+				struct object_file *obj)
+{
+	struct upatch_mem_batch batch;
+	long shared;
+	int ret = 0;
 
-	ret = upatch_process_mem_open(&proc, MEM_READ);
-	if (ret < 0) {
-		log_error("Failed to open process memory\n");
-		goto out_free;
+	ret = upatch_validate_maps(uelf, obj);
+	if (ret) {
+		return ret;
 	}
 
-	// use uprobe to hack function. the program has been executed to the entry
-	// point
-
-	/*
+	upatch_timing_start(PHASE_MAP);
+	ret = upatch_map(uelf, obj);
+	if (ret) {
+		upatch_timing_end(PHASE_MAP);
+		return ret;
+	}
+	shared = upatch_share_map(uelf, obj);
+	upatch_timing_end(PHASE_MAP);
+	if (shared < 0) {
+		upatch_free(obj, uelf->core_layout.base, uelf->core_layout.size);
+		return (int)shared;
+	}
+	upatch_advise_huge_text(uelf, obj);
+
+	upatch_mem_batch_init(&batch, obj->proc);
+
+	upatch_timing_start(PHASE_MEM_WRITE);
+	ret = post_memory(uelf, &batch, (unsigned long)shared);
+	if (ret == 0) {
+		ret = upatch_mem_batch_flush(&batch);
+	}
+	upatch_timing_end(PHASE_MEM_WRITE);
+	upatch_mem_batch_destroy(&batch);
+	if (ret) {
+		log_error("Failed to write patch to process, ret=%d\n", ret);
+		upatch_free(obj, uelf->core_layout.base, uelf->core_layout.size);
+	}
+
+	return ret;
+}
+
+static int upatch_deactivate_patch(struct upatch_elf *uelf,
+				   struct object_file *obj)
+{
+	struct upatch_info *uinfo =
+		(void *)uelf->core_layout.kbase + uelf->core_layout.info_size;
+
+	return unapply_patch(obj, upatch_info_funcs(uelf),
+			     uinfo->changed_func_num);
+}
+
+/* All jumpers of a patch are written at once */
+static int upatch_activate_patch(struct upatch_elf *uelf,
+				 struct object_file *obj)
+{
+	struct upatch_mem_batch batch;
+	int ret = 0;
+
+	upatch_mem_batch_init(&batch, obj->proc);
+	ret = apply_patch(uelf, &batch);
+	if (ret == 0) {
+		ret = upatch_mem_batch_flush(&batch);
+	}
+	upatch_mem_batch_destroy(&batch);
+	if (ret) {
+		log_error("Failed to write jumpers to process, ret=%d\n", ret);
+		upatch_deactivate_patch(uelf, obj);
+	}
+
+	return ret;
+}
+
+/* Old functions get their jumpers, no thread may be inside any of them */
+static struct upatch_stack_range *patch_stack_ranges(struct upatch_elf **uelfs,
+						     struct object_file **objs,
+						     size_t num, size_t *range_num)
+{
+	struct upatch_stack_range *ranges = NULL;
+	size_t count = 0;
+
+	for (size_t i = 0; i < num; i++) {
+		if (objs[i] != NULL) {
+			count += uelfs[i]->info.shdrs[uelfs[i]->index.upatch_funcs].sh_size /
+				 sizeof(struct upatch_patch_func);
+		}
+	}
+	ranges = calloc(count + 1, sizeof(struct upatch_stack_range));
+	if (ranges == NULL) {
+		return NULL;
+	}
+
+	*range_num = 0;
+	for (size_t i = 0; i < num; i++) {
+		struct upatch_info *uinfo = (void *)uelfs[i]->core_layout.kbase +
+					    uelfs[i]->core_layout.info_size;
+		struct upatch_info_func *funcs = (void *)uinfo +
+						 sizeof(struct upatch_info);
+		struct upatch_patch_func *patch_funcs = (void *)uelfs[i]->info
+			.shdrs[uelfs[i]->index.upatch_funcs].sh_addr;
+
+		if (objs[i] == NULL) {
+			continue;
+		}
+		for (unsigned int j = 0; j < uinfo->changed_func_num; j++) {
+			struct upatch_stack_range *range = &ranges[(*range_num)++];
+
+			range->start = funcs[j].old_addr;
+			range->end = funcs[j].old_addr +
+				     MAX(patch_funcs[j].old_size, get_upatch_insn_len());
+		}
+	}
+	*range_num = upatch_stack_sort_ranges(ranges, *range_num);
+
+	return ranges;
+}
+
+/*
+ * Runs while the process is attached, only remote operations are left.
+ * Patch image is written first, jumpers are written while all threads are
+ * stopped, which is the whole time with ptrace, or just a moment with freezer.
+ *
+ * Apply patches in order within one freeze, patches without an object are
+ * skipped. Either all of them become active, or none of them does.
+ */
+static int upatch_apply_patches(struct upatch_elf **uelfs,
+				struct object_file **objs, size_t num)
+{
+	struct upatch_process *proc = NULL;
+	struct upatch_stack_range *ranges = NULL;
+	size_t range_num = 0;
+	size_t installed;
+	size_t actived;
+	int ret = 0;
+
+	for (installed = 0; installed < num; installed++) {
+		if (objs[installed] == NULL) {
+			continue;
+		}
+		ret = upatch_install_patch(uelfs[installed], objs[installed]);
+		if (ret) {
+			goto free;
+		}
+		proc = objs[installed]->proc;
+	}
+	if (proc == NULL) {
+		return 0;
+	}
+
+	ranges = patch_stack_ranges(uelfs, objs, num, &range_num);
+	if (ranges == NULL) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	upatch_stack_prepare(proc, ranges, range_num);
+	upatch_timing_start(PHASE_FREEZE);
+	ret = upatch_process_freeze(proc);
+	if (ret) {
+		goto free;
+	}
+	ret = upatch_stack_wait_safe(proc, ranges, range_num);
+	if (ret) {
+		upatch_process_thaw(proc);
+		upatch_timing_end(PHASE_FREEZE);
+		goto free;
+	}
+
+	upatch_timing_start(PHASE_JMP_WRITE);
+	for (actived = 0; actived < num; actived++) {
+		if (objs[actived] == NULL) {
+			continue;
+		}
+		ret = upatch_activate_patch(uelfs[actived], objs[actived]);
+		if (ret) {
+			break;
+		}
+	}
+	/* Roll back in reverse order, functions end up with original insn */
+	while (ret && (actived-- > 0)) {
+		if (objs[actived] != NULL) {
+			upatch_deactivate_patch(uelfs[actived], objs[actived]);
+		}
+	}
+	upatch_timing_end(PHASE_JMP_WRITE);
+	upatch_process_thaw(proc);
+	upatch_timing_end(PHASE_FREEZE);
+	if (ret) {
+		goto free;
+	}
+
+	for (size_t i = 0; i < num; i++) {
+		struct upatch_info *uinfo = (void *)uelfs[i]->core_layout.kbase +
+					    uelfs[i]->core_layout.info_size;
+
+		if (objs[i] != NULL) {
+			upatch_arena_register(objs[i], uinfo->id, uinfo->start,
+					      uinfo->end, true);
+		}
+	}
+	free(ranges);
+
+	return 0;
+
+free:
+	free(ranges);
+	while (installed-- > 0) {
+		if (objs[installed] != NULL) {
+			upatch_free(objs[installed],
+				    uelfs[installed]->core_layout.base,
+				    uelfs[installed]->core_layout.size);
+		}
+	}
+	return ret;
+}
+
+static void upatch_stopped_time(int pid)
+{
+	if (!upatch_timing_end(PHASE_STOPPED)) {
+		return;
+	}
+	log_normal("Process %d frozen time is %lu microsecond(s)\n",
+		pid, upatch_timing_get(PHASE_STOPPED));
+}
+
+int upatch_process_uuid_exist(struct upatch_process *proc, const char *uuid)
+{
+	struct object_file *obj;
+	struct object_patch *patch;
+	list_for_each_entry(obj, &proc->objs, list) {
+		if (!obj->is_patch) {
+			continue;
+		}
+		list_for_each_entry(patch, &obj->applied_patch, list) {
+			if (strncmp(patch->uinfo->id, uuid, UPATCH_ID_LEN) == 0) {
+				return -EEXIST;
+			}
+		}
+	}
+	return 0;
+}
+
+int process_patch(int pid, struct upatch_elf **uelfs, struct running_elf *relf,
+		  const char **uuids, size_t num)
+{
+	struct upatch_process proc;
+	struct object_file **objs = NULL;
+	bool prepared = false;
+	int ret = 0;
+
+	// 查看process的信息，pid: maps, mem, cmdline, exe
+	upatch_timing_start(PHASE_TOTAL);
+	objs = calloc(num, sizeof(struct object_file *));
+	if (objs == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = upatch_process_init(&proc, pid);
+	if (ret < 0) {
+		log_error("Failed to init process\n");
+		goto out;
+	}
+
+	printf("Patch ");
+	for (size_t i = 0; i < num; i++) {
+		printf("%s'%s'", (i == 0) ? "" : ", ", uuids[i]);
+	}
+	printf(" to ");
+	upatch_process_print_short(&proc);
+
+	ret = upatch_process_mem_open(&proc, MEM_READ);
+	if (ret < 0) {
+		log_error("Failed to open process memory\n");
+		goto out_free;
+	}
+
+	// use uprobe to hack function. the program has been executed to the entry
+	// point
+
+	/*
 	 * For each object file that we want to patch (either binary itself or
 	 * shared library) we need its ELF structure to perform relocations.
 	 * Because we know uniq BuildID of the object the section addresses
 	 * stored in the patch are valid for the original object.
 	 */
 	// 解析process的mem-maps，获得各个块的内存映射以及phdr
+	upatch_timing_start(PHASE_MAPS_PARSE);
 	ret = upatch_process_map_object_files(&proc, NULL);
+	upatch_timing_end(PHASE_MAPS_PARSE);
 	if (ret < 0) {
 		log_error("Failed to read process memory mapping\n");
 		goto out_free;
 	}
-	ret = upatch_process_uuid_exist(&proc, uuid);
-	if (ret != 0) {
+
+	/* Nothing is written to process until all patches are prepared */
+	for (size_t i = 0; i < num; i++) {
+		if (upatch_process_uuid_exist(&proc, uuids[i]) != 0) {
+			log_error("Patch '%s' already exists\n", uuids[i]);
+			continue;
+		}
+		uelfs[i]->relf = relf;
+
+		ret = upatch_prepare_patches(&proc, uelfs[i], uuids[i], &objs[i]);
+		if (ret) {
+			log_error("Failed to prepare patch '%s'\n", uuids[i]);
+			goto out_free;
+		}
+		prepared = true;
+	}
+	if (!prepared) {
 		ret = 0;
-		log_error("Patch '%s' already exists\n", uuid);
 		goto out_free;
 	}
-	ret = binary_init(relf, binary_path);
-    if (ret) {
-        log_error("Failed to load binary\n");
-        goto out_free;
-    }
-
-    uelf->relf = relf;
-	upatch_time_tick(pid);
+	ret = upatch_stack_patches(uelfs, objs, num);
+	if (ret) {
+		goto out_free;
+	}
 
 	/* Finally, attach to process */
+	upatch_timing_start(PHASE_STOPPED);
+	upatch_timing_start(PHASE_ATTACH);
 	ret = upatch_process_attach(&proc);
+	upatch_timing_end(PHASE_ATTACH);
 	if (ret < 0) {
 		log_error("Failed to attach process\n");
 		goto out_free;
 	}
 
-	// TODO: 栈解析
 	// 应用
-	ret = upatch_apply_patches(&proc, uelf, uuid);
+	ret = upatch_apply_patches(uelfs, objs, num);
 	if (ret < 0) {
 		log_error("Failed to apply patch\n");
 		goto out_free;
 	}
 
 out_free:
+	upatch_timing_start(PHASE_DETACH);
 	upatch_process_detach(&proc);
-	upatch_time_tick(pid);
+	upatch_timing_end(PHASE_DETACH);
+	upatch_stopped_time(pid);
 
 	upatch_process_destroy(&proc);
 
 out:
+	free(objs);
+	upatch_timing_end(PHASE_TOTAL);
 	return ret;
 }
 
+/*
+ * Patch memory is unmapped once jumpers are restored, no thread may be
+ * inside it, nor inside jumpers being overwritten.
+ */
+static struct upatch_stack_range *unpatch_stack_ranges(struct object_patch *patch,
+							size_t *range_num)
+{
+	unsigned int num = patch->uinfo->changed_func_num;
+	struct upatch_stack_range *ranges = NULL;
+
+	ranges = calloc(num + 1, sizeof(struct upatch_stack_range));
+	if (ranges == NULL) {
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < num; i++) {
+		ranges[i].start = patch->funcs[i].old_addr;
+		ranges[i].end = patch->funcs[i].old_addr + get_upatch_insn_len();
+	}
+	ranges[num].start = patch->uinfo->start;
+	ranges[num].end = patch->uinfo->end;
+	*range_num = upatch_stack_sort_ranges(ranges, num + 1);
+
+	return ranges;
+}
+
 static int upatch_unapply_patches(struct upatch_process *proc, const char *uuid)
 {
 	int ret = 0;
 	struct object_file *obj = NULL;
 	struct object_patch *patch = NULL;
+	struct upatch_stack_range *ranges = NULL;
+	size_t range_num = 0;
 	bool found = false;
 
 	// Traverse all mapped memory and find all upatch memory
@@ -815,16 +1497,48 @@ static int upatch_unapply_patches(struct upatch_process *proc, const char *uuid)
 			}
 			found = true;
 
+			ranges = unpatch_stack_ranges(patch, &range_num);
+			if (ranges == NULL) {
+				ret = -ENOMEM;
+				goto out;
+			}
+
+			upatch_stack_prepare(proc, ranges, range_num);
+			upatch_timing_start(PHASE_FREEZE);
+			ret = upatch_process_freeze(proc);
+			if (ret) {
+				goto out;
+			}
+			ret = upatch_stack_wait_safe(proc, ranges, range_num);
+			if (ret) {
+				upatch_process_thaw(proc);
+				upatch_timing_end(PHASE_FREEZE);
+				goto out;
+			}
+			upatch_timing_start(PHASE_JMP_WRITE);
 			ret = unapply_patch(obj, patch->funcs, patch->uinfo->changed_func_num);
+			upatch_timing_end(PHASE_JMP_WRITE);
+			upatch_process_thaw(proc);
+			upatch_timing_end(PHASE_FREEZE);
 			if (ret) {
 				goto out;
 			}
 
+			/*
+			 * Stack check covered patch memory, and jumpers are
+			 * restored, thus no thread can run inside it anymore.
+			 * Threads go on, unmapping needs just one of them.
+			 */
+			upatch_process_release_others(proc);
+			upatch_stopped_time(proc->pid);
+
 			log_debug("munmap upatch layout core:\n");
 			upatch_free(obj,
 				(void *)patch->uinfo->start,
 				patch->uinfo->end - patch->uinfo->start
 			);
+			upatch_arena_register(obj, uuid, patch->uinfo->start,
+					      patch->uinfo->end, false);
 
 			break;
 		}
@@ -836,6 +1550,7 @@ static int upatch_unapply_patches(struct upatch_process *proc, const char *uuid)
 	}
 
 out:
+	free(ranges);
 	return ret;
 }
 
@@ -844,8 +1559,8 @@ int process_unpatch(int pid, const char *uuid)
 	struct upatch_process proc;
 
 	// TODO: check build id
-	// TODO: 栈解析
 	// 查看process的信息，pid: maps, mem, cmdline, exe
+	upatch_timing_start(PHASE_TOTAL);
 	int ret = upatch_process_init(&proc, pid);
 	if (ret < 0) {
 		log_error("Failed to init process\n");
@@ -871,16 +1586,19 @@ int process_unpatch(int pid, const char *uuid)
 	 * stored in the patch are valid for the original object.
 	 */
 	// 解析process的mem-maps，获得各个块的内存映射以及phdr
+	upatch_timing_start(PHASE_MAPS_PARSE);
 	ret = upatch_process_map_object_files(&proc, NULL);
+	upatch_timing_end(PHASE_MAPS_PARSE);
 	if (ret < 0) {
 		log_error("Failed to read process memory mapping\n");
 		goto out_free;
 	}
 
-	upatch_time_tick(pid);
-
 	/* Finally, attach to process */
+	upatch_timing_start(PHASE_STOPPED);
+	upatch_timing_start(PHASE_ATTACH);
 	ret = upatch_process_attach(&proc);
+	upatch_timing_end(PHASE_ATTACH);
 	if (ret < 0) {
 		log_error("Failed to attach process\n");
 		goto out_free;
@@ -894,12 +1612,335 @@ int process_unpatch(int pid, const char *uuid)
 	}
 
 out_free:
+	upatch_timing_start(PHASE_DETACH);
+	upatch_process_detach(&proc);
+	upatch_timing_end(PHASE_DETACH);
+	upatch_stopped_time(pid);
+
+	upatch_process_destroy(&proc);
+
+out:
+	upatch_timing_end(PHASE_TOTAL);
+	return ret;
+}
+
+/* Applied patch of the uuid, in the patch object which holds it */
+static struct object_patch *upatch_find_applied(struct upatch_process *proc,
+						const char *uuid,
+						struct object_file **pobj)
+{
+	struct object_file *obj = NULL;
+	struct object_patch *patch = NULL;
+
+	list_for_each_entry(obj, &proc->objs, list) {
+		if (!obj->is_patch) {
+			continue;
+		}
+		list_for_each_entry(patch, &obj->applied_patch, list) {
+			if (strncmp(patch->uinfo->id, uuid, UPATCH_ID_LEN) == 0) {
+				*pobj = obj;
+				return patch;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int info_func_cmp(const void *a, const void *b)
+{
+	const struct upatch_info_func *fa = *(struct upatch_info_func *const *)a;
+	const struct upatch_info_func *fb = *(struct upatch_info_func *const *)b;
+
+	if (fa->old_addr == fb->old_addr) {
+		return 0;
+	}
+	return (fa->old_addr < fb->old_addr) ? -1 : 1;
+}
+
+/*
+ * New patch is prepared while the old one is active, thus a function patched
+ * by both of them has the jumper of the old patch as its origin insn. Take the
+ * origin insn of the old patch instead, as if the old patch was removed first.
+ * Functions of the old patch are marked in shared[] by their position.
+ */
+static int upatch_retarget_patch(struct upatch_elf *uelf,
+				 struct object_patch *old, bool *shared)
+{
+	struct upatch_info *uinfo =
+		(void *)uelf->core_layout.kbase + uelf->core_layout.info_size;
+	struct upatch_info_func *funcs = upatch_info_funcs(uelf);
+	unsigned int old_num = old->uinfo->changed_func_num;
+	struct upatch_info_func **old_funcs;
+
+	old_funcs = calloc(old_num + 1, sizeof(struct upatch_info_func *));
+	if (old_funcs == NULL) {
+		log_error("Failed to alloc retarget functions\n");
+		return -ENOMEM;
+	}
+	for (unsigned int i = 0; i < old_num; i++) {
+		old_funcs[i] = &old->funcs[i];
+	}
+	qsort(old_funcs, old_num, sizeof(struct upatch_info_func *),
+	      info_func_cmp);
+
+	for (unsigned int i = 0; i < uinfo->changed_func_num; i++) {
+		struct upatch_info_func *key = &funcs[i];
+		struct upatch_info_func **found = bsearch(&key, old_funcs, old_num,
+			sizeof(struct upatch_info_func *), info_func_cmp);
+
+		if (found == NULL) {
+			continue;
+		}
+		memcpy(funcs[i].old_insn, (*found)->old_insn, get_origin_insn_len());
+		shared[*found - old->funcs] = true;
+		log_debug("Function 0x%lx insn 0x%lx\n", funcs[i].old_addr,
+			  funcs[i].old_insn[0]);
+	}
+
+	free(old_funcs);
+	return 0;
+}
+
+/* Both patches of a replacement, no thread may be inside any of them */
+static struct upatch_stack_range *replace_stack_ranges(struct upatch_elf *uelf,
+						       struct object_file *obj,
+						       struct object_patch *old,
+						       size_t *range_num)
+{
+	struct upatch_stack_range *new_ranges = NULL;
+	struct upatch_stack_range *old_ranges = NULL;
+	struct upatch_stack_range *ranges = NULL;
+	size_t new_num = 0;
+	size_t old_num = 0;
+
+	new_ranges = patch_stack_ranges(&uelf, &obj, 1, &new_num);
+	old_ranges = unpatch_stack_ranges(old, &old_num);
+	if ((new_ranges == NULL) || (old_ranges == NULL)) {
+		goto out;
+	}
+
+	ranges = calloc(new_num + old_num, sizeof(struct upatch_stack_range));
+	if (ranges == NULL) {
+		goto out;
+	}
+	memcpy(ranges, new_ranges, new_num * sizeof(struct upatch_stack_range));
+	memcpy(ranges + new_num, old_ranges,
+	       old_num * sizeof(struct upatch_stack_range));
+	*range_num = upatch_stack_sort_ranges(ranges, new_num + old_num);
+
+out:
+	free(new_ranges);
+	free(old_ranges);
+	return ranges;
+}
+
+/*
+ * Functions only patched by the old patch get their origin insn back, the
+ * others jump to the new patch, all of them are written at once.
+ */
+static int upatch_switch_patch(struct upatch_elf *uelf, struct object_file *obj,
+			       struct object_patch *old, const bool *shared)
+{
+	struct upatch_info *uinfo =
+		(void *)uelf->core_layout.kbase + uelf->core_layout.info_size;
+	struct upatch_info_func *funcs = upatch_info_funcs(uelf);
+	struct upatch_mem_batch batch;
+	int ret = 0;
+
+	upatch_mem_batch_init(&batch, obj->proc);
+	for (unsigned int i = 0; (ret == 0) && (i < old->uinfo->changed_func_num); i++) {
+		if (!shared[i]) {
+			ret = upatch_mem_batch_add(&batch, &old->funcs[i].old_insn,
+				(unsigned long)old->funcs[i].old_addr,
+				get_origin_insn_len());
+		}
+	}
+	for (unsigned int i = 0; (ret == 0) && (i < uinfo->changed_func_num); i++) {
+		ret = add_jumper(&batch, &funcs[i]);
+	}
+	if (ret == 0) {
+		ret = upatch_mem_batch_flush(&batch);
+	}
+	upatch_mem_batch_destroy(&batch);
+	if (ret == 0) {
+		return 0;
+	}
+	log_error("Failed to switch jumpers, ret=%d\n", ret);
+
+	/* Back to the old patch, functions of the new one only get origin insn */
+	upatch_mem_batch_init(&batch, obj->proc);
+	for (unsigned int i = 0; i < uinfo->changed_func_num; i++) {
+		upatch_mem_batch_add(&batch, &funcs[i].old_insn,
+			(unsigned long)funcs[i].old_addr, get_origin_insn_len());
+	}
+	for (unsigned int i = 0; i < old->uinfo->changed_func_num; i++) {
+		add_jumper(&batch, &old->funcs[i]);
+	}
+	if (upatch_mem_batch_flush(&batch)) {
+		log_error("Failed to restore jumpers of patch '%s'\n",
+			  old->uinfo->id);
+	}
+	upatch_mem_batch_destroy(&batch);
+
+	return ret;
+}
+
+static int upatch_replace_patch(struct upatch_elf *uelf, struct object_file *obj,
+				struct object_file *old_obj,
+				struct object_patch *old, const bool *shared)
+{
+	struct upatch_info *uinfo =
+		(void *)uelf->core_layout.kbase + uelf->core_layout.info_size;
+	struct upatch_process *proc = obj->proc;
+	struct upatch_stack_range *ranges = NULL;
+	size_t range_num = 0;
+	int ret = 0;
+
+	ranges = replace_stack_ranges(uelf, obj, old, &range_num);
+	if (ranges == NULL) {
+		return -ENOMEM;
+	}
+
+	ret = upatch_install_patch(uelf, obj);
+	if (ret) {
+		goto out;
+	}
+
+	upatch_stack_prepare(proc, ranges, range_num);
+	upatch_timing_start(PHASE_FREEZE);
+	ret = upatch_process_freeze(proc);
+	if (ret) {
+		goto free;
+	}
+	ret = upatch_stack_wait_safe(proc, ranges, range_num);
+	if (ret) {
+		upatch_process_thaw(proc);
+		upatch_timing_end(PHASE_FREEZE);
+		goto free;
+	}
+	upatch_timing_start(PHASE_JMP_WRITE);
+	ret = upatch_switch_patch(uelf, obj, old, shared);
+	upatch_timing_end(PHASE_JMP_WRITE);
+	upatch_process_thaw(proc);
+	upatch_timing_end(PHASE_FREEZE);
+	if (ret) {
+		goto free;
+	}
+
+	/* Old patch is unreachable now, same as unpatch */
+	upatch_process_release_others(proc);
+	upatch_stopped_time(proc->pid);
+
+	upatch_free(old_obj, (void *)old->uinfo->start,
+		    old->uinfo->end - old->uinfo->start);
+	upatch_arena_register(old_obj, old->uinfo->id, old->uinfo->start,
+			      old->uinfo->end, false);
+	upatch_arena_register(obj, uinfo->id, uinfo->start, uinfo->end, true);
+	goto out;
+
+free:
+	upatch_free(obj, uelf->core_layout.base, uelf->core_layout.size);
+out:
+	free(ranges);
+	return ret;
+}
+
+/*
+ * Replace an applied patch by a new one of the same target within one stop.
+ * New patch image is written before the stop, then functions are switched
+ * from the old patch to the new one at once, and the old patch is removed.
+ * Either the new patch becomes active, or the old one stays.
+ */
+int process_replace(int pid, const char *old_uuid, struct upatch_elf *uelf,
+		    struct running_elf *relf, const char *uuid)
+{
+	struct upatch_process proc;
+	struct object_file *obj = NULL;
+	struct object_file *old_obj = NULL;
+	struct object_patch *old = NULL;
+	bool *shared = NULL;
+	int ret = 0;
+
+	upatch_timing_start(PHASE_TOTAL);
+	ret = upatch_process_init(&proc, pid);
+	if (ret < 0) {
+		log_error("Failed to init process\n");
+		goto out;
+	}
+
+	printf("Replace '%s' by '%s' in ", old_uuid, uuid);
+	upatch_process_print_short(&proc);
+
+	ret = upatch_process_mem_open(&proc, MEM_READ);
+	if (ret < 0) {
+		log_error("Failed to open process memory\n");
+		goto out_free;
+	}
+
+	upatch_timing_start(PHASE_MAPS_PARSE);
+	ret = upatch_process_map_object_files(&proc, NULL);
+	upatch_timing_end(PHASE_MAPS_PARSE);
+	if (ret < 0) {
+		log_error("Failed to read process memory mapping\n");
+		goto out_free;
+	}
+
+	old = upatch_find_applied(&proc, old_uuid, &old_obj);
+	if (old == NULL) {
+		log_error("Patch '%s' is not found\n", old_uuid);
+		ret = -ENOENT;
+		goto out_free;
+	}
+	ret = upatch_process_uuid_exist(&proc, uuid);
+	if (ret) {
+		log_error("Patch '%s' already exists\n", uuid);
+		goto out_free;
+	}
+
+	/* Nothing is written to process until the new patch is prepared */
+	uelf->relf = relf;
+	ret = upatch_prepare_patches(&proc, uelf, uuid, &obj);
+	if (ret) {
+		log_error("Failed to prepare patch '%s'\n", uuid);
+		goto out_free;
+	}
+	shared = calloc(old->uinfo->changed_func_num + 1, sizeof(bool));
+	if (shared == NULL) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	ret = upatch_retarget_patch(uelf, old, shared);
+	if (ret) {
+		goto out_free;
+	}
+
+	upatch_timing_start(PHASE_STOPPED);
+	upatch_timing_start(PHASE_ATTACH);
+	ret = upatch_process_attach(&proc);
+	upatch_timing_end(PHASE_ATTACH);
+	if (ret < 0) {
+		log_error("Failed to attach process\n");
+		goto out_free;
+	}
+
+	ret = upatch_replace_patch(uelf, obj, old_obj, old, shared);
+	if (ret < 0) {
+		log_error("Failed to replace patch\n");
+		goto out_free;
+	}
+
+out_free:
+	upatch_timing_start(PHASE_DETACH);
 	upatch_process_detach(&proc);
-	upatch_time_tick(pid);
+	upatch_timing_end(PHASE_DETACH);
+	upatch_stopped_time(pid);
 
 	upatch_process_destroy(&proc);
 
 out:
+	free(shared);
+	upatch_timing_end(PHASE_TOTAL);
 	return ret;
 }
 
@@ -25,10 +25,25 @@
 #include "upatch-process.h"
 #include "list.h"
 
-int process_patch(int, struct upatch_elf *, struct running_elf *, const char *uuid, const char *binary_path);
+/* Align patch text on huge page boundary and advise huge pages for it */
+void upatch_patch_set_huge_text(bool enable);
+
+/*
+ * Apply patches to a process within one stop, in the given order.
+ * Either all of them are applied, or none of them is.
+ */
+int process_patch(int, struct upatch_elf **, struct running_elf *,
+		  const char **uuids, size_t num);
 
 int process_unpatch(int, const char *uuid);
 
+/*
+ * Replace an applied patch by another one within one stop, the old patch
+ * stays if the new one fails.
+ */
+int process_replace(int, const char *old_uuid, struct upatch_elf *,
+		    struct running_elf *, const char *uuid);
+
 int process_info(int);
 
 #endif
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UPATCH_PROBE__
+#define __UPATCH_PROBE__
+
+/*
+ * USDT probes of provider 'upatch', eg.
+ *   bpftrace -l 'usdt:/usr/libexec/syscare/upatch-manage:upatch:*'
+ *
+ * attach_start(pid, tid)            thread is being seized
+ * attach_end(pid, tid, ret)         0: stopped, 1: exited, -1: failed
+ * remote_syscall(pid, nr, ret, res) ret of injection, raw syscall result
+ * relocate_start(name, num)         relocation section & number of entries
+ * relocate_end(name, ret)
+ * mem_write(pid, addr, size)        single remote write
+ * mem_flush_start(pid, num, size)   batch of remote writes
+ * mem_flush_end(pid, ret)
+ *
+ * Probes are nops unless traced, they are left out without <sys/sdt.h>.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define UPATCH_PROBE(name, ...) STAP_PROBEV(upatch, name, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef UPATCH_PROBE
+#define UPATCH_PROBE(name, ...) do {} while (0)
+#endif
+
+#endif
@@ -24,9 +24,14 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <mntent.h>
+#include <poll.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/ptrace.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -35,11 +40,46 @@
 #include "log.h"
 #include "process.h"
 #include "upatch-common.h"
+#include "upatch-coro.h"
 #include "upatch-elf.h"
 #include "upatch-process.h"
 #include "upatch-ptrace.h"
 
+/* linux/fs.h of linux 6.11, which userspace headers may not have yet */
+#ifndef PROCMAP_QUERY
+struct procmap_query {
+	uint64_t size;
+	uint64_t query_flags;
+	uint64_t query_addr;
+	uint64_t vma_start;
+	uint64_t vma_end;
+	uint64_t vma_flags;
+	uint64_t vma_page_size;
+	uint64_t vma_offset;
+	uint64_t inode;
+	uint32_t dev_major;
+	uint32_t dev_minor;
+	uint32_t vma_name_size;
+	uint32_t build_id_size;
+	uint64_t vma_name_addr;
+	uint64_t build_id_addr;
+};
+
+#define PROCMAP_QUERY _IOWR('f', 17, struct procmap_query)
+#define PROCMAP_QUERY_VMA_READABLE 0x01
+#define PROCMAP_QUERY_VMA_WRITABLE 0x02
+#define PROCMAP_QUERY_VMA_EXECUTABLE 0x04
+#define PROCMAP_QUERY_COVERING_OR_NEXT_VMA 0x10
+#endif
+
+#define PROCMAP_QUERY_VMA_PROT                                     \
+	(PROCMAP_QUERY_VMA_READABLE | PROCMAP_QUERY_VMA_WRITABLE | \
+	 PROCMAP_QUERY_VMA_EXECUTABLE)
+
 static const int MAX_ATTACH_ATTEMPTS = 3;
+static const int FREEZE_TIMEOUT_MS = 1000;
+
+static bool use_cgroup_freezer;
 
 /*
  * Locks process by opening /proc/<pid>/maps
@@ -76,6 +116,8 @@ static void unlock_process(int pid, int fdmaps)
 static int upatch_coroutines_init(struct upatch_process *proc)
 {
 	INIT_LIST_HEAD(&proc->coro.coros);
+	proc->coro.num = 0;
+	proc->coro.soft_dirty = false;
 
 	return 0;
 }
@@ -124,10 +166,11 @@ int upatch_process_init(struct upatch_process *proc, int pid)
 	proc->pid = pid;
 	proc->fdmaps = fdmaps;
 	proc->memfd = -1;
+	proc->freezer.freeze_fd = -1;
+	proc->freezer.events_fd = -1;
 
 	INIT_LIST_HEAD(&proc->ptrace.pctxs);
 	INIT_LIST_HEAD(&proc->objs);
-	INIT_LIST_HEAD(&proc->vmaholes);
 	proc->num_objs = 0;
 
 	if (upatch_coroutines_init(proc)) {
@@ -149,7 +192,6 @@ out_err:
 static void upatch_object_memfree(struct object_file *obj)
 {
 	struct object_patch *opatch, *opatch_safe;
-	struct obj_vm_area *ovma, *ovma_safe;
 
 	if (obj->name) {
 		free(obj->name);
@@ -165,24 +207,28 @@ static void upatch_object_memfree(struct object_file *obj)
 		free(opatch);
 	}
 
-	list_for_each_entry_safe(ovma, ovma_safe, &obj->vma, list) {
-		free(ovma);
-	}
+	free(obj->vmas);
 }
 
 static void upatch_process_memfree(struct upatch_process *proc)
 {
 	struct upatch_ptrace_ctx *p, *p_safe;
 	struct object_file *obj, *obj_safe;
-	struct vm_hole *hole, *hole_safe;
+	size_t i;
 
 	list_for_each_entry_safe(p, p_safe, &proc->ptrace.pctxs, list) {
 		free(p);
 	}
+	upatch_coro_destroy(proc);
+
+	free(proc->maps);
+	free(proc->maps_buf);
+	free(proc->holes);
 
-	list_for_each_entry_safe(hole, hole_safe, &proc->vmaholes, list) {
-		free(hole);
+	for (i = 0; i < proc->num_arenas; i++) {
+		free(proc->arenas[i].holes);
 	}
+	free(proc->arenas);
 
 	list_for_each_entry_safe(obj, obj_safe, &proc->objs, list) {
 		upatch_object_memfree(obj);
@@ -276,27 +322,100 @@ static unsigned int perms2prot(const char *perms)
 	return prot;
 }
 
-static struct vm_hole *process_add_vm_hole(struct upatch_process *proc,
-					   unsigned long hole_start,
-					   unsigned long hole_end)
+/* Make sure there is room for one more element */
+static int array_reserve(void **array, size_t *capacity, size_t num,
+			 size_t elem_size)
 {
-	struct vm_hole *hole;
+	void *new_array;
+	size_t new_capacity;
 
-	hole = malloc(sizeof(*hole));
-	if (hole == NULL)
+	if (num < *capacity) {
+		return 0;
+	}
+
+	new_capacity = (*capacity != 0) ? (*capacity * 2) : 16;
+	new_array = realloc(*array, new_capacity * elem_size);
+	if (new_array == NULL) {
+		return -1;
+	}
+
+	*array = new_array;
+	*capacity = new_capacity;
+	return 0;
+}
+
+static int process_add_vm_hole(struct upatch_process *proc,
+			       unsigned long hole_start,
+			       unsigned long hole_end)
+{
+	if (array_reserve((void **)&proc->holes, &proc->holes_capacity,
+			  proc->num_holes, sizeof(struct vm_hole))) {
+		return -1;
+	}
+
+	proc->holes[proc->num_holes].start = hole_start;
+	proc->holes[proc->num_holes].end = hole_end;
+	proc->num_holes++;
+
+	return 0;
+}
+
+static struct upatch_arena *process_add_arena(struct upatch_process *proc,
+	unsigned long start, unsigned long end, bool pending)
+{
+	struct upatch_arena *arena;
+
+	if (array_reserve((void **)&proc->arenas, &proc->arenas_capacity,
+			  proc->num_arenas, sizeof(struct upatch_arena))) {
 		return NULL;
+	}
+
+	arena = &proc->arenas[proc->num_arenas++];
+	memset(arena, 0, sizeof(struct upatch_arena));
+	arena->start = start;
+	arena->end = end;
+	arena->pending = pending;
+
+	return arena;
+}
+
+static int arena_add_hole(struct upatch_arena *arena, unsigned long start,
+			  unsigned long end)
+{
+	if (array_reserve((void **)&arena->holes, &arena->holes_capacity,
+			  arena->num_holes, sizeof(struct vm_hole))) {
+		return -1;
+	}
 
-	memset(hole, 0, sizeof(*hole));
-	hole->start = hole_start;
-	hole->end = hole_end;
+	arena->holes[arena->num_holes].start = start;
+	arena->holes[arena->num_holes].end = end;
+	arena->num_holes++;
 
-	list_add(&hole->list, &proc->vmaholes);
+	return 0;
+}
+
+/* Free space of an arena is whatever is still PROT_NONE inside it */
+static int process_add_arena_hole(struct upatch_process *proc,
+				  struct vm_area *vma)
+{
+	struct upatch_arena *arena;
+
+	if (proc->num_arenas == 0) {
+		return 0;
+	}
+
+	/* Maps are sorted, the area could only belong to the latest arena */
+	arena = &proc->arenas[proc->num_arenas - 1];
+	if (vma->start < arena->start || vma->start >= arena->end) {
+		return 0;
+	}
 
-	return hole;
+	return arena_add_hole(arena, vma->start,
+			      vma->end < arena->end ? vma->end : arena->end);
 }
 
 static int process_get_object_type(struct upatch_process *proc,
-				   struct vm_area *vma, char *name,
+				   struct vm_area *vma, const char *name,
 				   unsigned char *buf, size_t bufsize)
 {
 	int ret, type = OBJECT_UNKNOWN;
@@ -306,6 +425,10 @@ static int process_get_object_type(struct upatch_process *proc,
 		return -1;
 
 	if (vma->prot == PROT_READ &&
+	    !strncmp(name, "[anonymous]", strlen("[anonymous]")) &&
+	    !memcmp(buf, UPATCH_ARENA_MAGIC, sizeof(UPATCH_ARENA_MAGIC))) {
+		type = OBJECT_ARENA;
+	} else if (vma->prot == PROT_READ &&
 	    !strncmp(name, "[anonymous]", strlen("[anonymous]")) &&
 	    !memcmp(buf, UPATCH_HEADER, UPATCH_HEADER_LEN)) {
 		type = OBJECT_UPATCH;
@@ -324,29 +447,23 @@ static int vm_area_same(struct vm_area *a, struct vm_area *b)
 		(a->prot == b->prot));
 }
 
-static int object_add_vm_area(struct object_file *o, struct vm_area *vma,
-			      struct vm_hole *hole)
+static int object_add_vm_area(struct object_file *o, struct vm_area *vma)
 {
-	struct obj_vm_area *ovma;
+	/* Maps are sorted, a duplicate could only be the last one */
+	if (o->num_vmas != 0 && vm_area_same(vma, &o->vmas[o->num_vmas - 1]))
+		return 0;
 
-	if (o->previous_hole == NULL)
-		o->previous_hole = hole;
-	list_for_each_entry(ovma, &o->vma, list) {
-		if (vm_area_same(vma, &ovma->inmem))
-			return 0;
-	}
-	ovma = malloc(sizeof(*ovma));
-	if (!ovma)
+	if (array_reserve((void **)&o->vmas, &o->vmas_capacity, o->num_vmas,
+			  sizeof(struct vm_area)))
 		return -1;
-	memset(ovma, 0, sizeof(*ovma));
-	ovma->inmem = *vma;
-	list_add(&ovma->list, &o->vma);
+
+	o->vmas[o->num_vmas++] = *vma;
 	return 0;
 }
 
 static struct object_file *
 process_new_object(struct upatch_process *proc, dev_t dev, int inode,
-		   const char *name, struct vm_area *vma, struct vm_hole *hole)
+		   const char *name, struct vm_area *vma)
 {
 	struct object_file *o;
 
@@ -360,7 +477,6 @@ process_new_object(struct upatch_process *proc, dev_t dev, int inode,
 	memset(o, 0, sizeof(struct object_file));
 
 	INIT_LIST_HEAD(&o->list);
-	INIT_LIST_HEAD(&o->vma);
 	INIT_LIST_HEAD(&o->applied_patch);
 	o->num_applied_patch = 0;
 	o->proc = proc;
@@ -368,8 +484,7 @@ process_new_object(struct upatch_process *proc, dev_t dev, int inode,
 	o->inode = inode;
 	o->is_patch = 0;
 
-	o->previous_hole = hole;
-	if (object_add_vm_area(o, vma, hole) < 0) {
+	if (object_add_vm_area(o, vma) < 0) {
 		log_error("Cannot add vm area for %s\n", name);
 		free(o);
 		return NULL;
@@ -385,36 +500,88 @@ process_new_object(struct upatch_process *proc, dev_t dev, int inode,
 	return o;
 }
 
+static bool object_match(struct object_file *o, dev_t dev, int inode,
+			 const char *name)
+{
+	return (dev && inode && o->dev == dev && o->inode == inode) ||
+	       (dev == 0 && !strcmp(o->name, name));
+}
+
+static struct object_file *process_find_object(struct upatch_process *proc,
+					       dev_t dev, int inode,
+					       const char *name)
+{
+	struct object_file *o;
+
+	/* Areas of an object are usually adjacent, start from the latest */
+	list_for_each_entry_reverse(o, &proc->objs, list) {
+		if (object_match(o, dev, inode, name)) {
+			return o;
+		}
+	}
+
+	return NULL;
+}
+
 /**
  * Returns: 0 if everything is ok, -1 on error.
  */
 static int process_add_object_vma(struct upatch_process *proc, dev_t dev,
-				  int inode, char *name, struct vm_area *vma,
-				  struct vm_hole *hole)
+				  int inode, const char *name,
+				  struct vm_area *vma)
 {
 	int object_type;
 	unsigned char header_buf[1024];
 	struct object_file *o;
 
+	/*
+	 * Only read-only anonymous areas could be a upatch, areas of a known
+	 * object do not need to be read at all.
+	 */
+	bool is_anonymous = !strncmp(name, "[anonymous]", strlen("[anonymous]"));
+	bool maybe_upatch = vma->prot == PROT_READ && is_anonymous;
+
+	if (vma->prot == 0 && is_anonymous &&
+	    process_add_arena_hole(proc, vma) < 0) {
+		return -1;
+	}
+	if (!maybe_upatch) {
+		o = process_find_object(proc, dev, inode, name);
+		if (o != NULL) {
+			return object_add_vm_area(o, vma);
+		}
+	}
+
 	/* Event though process_get_object_type() return -1,
 	 * we still need continue process. */
 	object_type = process_get_object_type(proc, vma, name, header_buf,
 					      sizeof(header_buf));
+	if (object_type == OBJECT_ARENA) {
+		/* Only the fixed prefix of the arena header has been read */
+		unsigned long arena_size;
+
+		memcpy(&arena_size,
+		       header_buf + offsetof(struct upatch_arena_header, size),
+		       sizeof(arena_size));
+		if (process_add_arena(proc, vma->start,
+				      vma->start + arena_size, false) == NULL) {
+			return -1;
+		}
+		log_debug("Found patch arena at 0x%lx-0x%lx\n", vma->start,
+			  vma->start + arena_size);
+	}
 
-	if (object_type != OBJECT_UPATCH) {
+	if (object_type != OBJECT_UPATCH && maybe_upatch) {
 		/* Is not a upatch, look if this is a vm_area of an already
 		 * enlisted object.
 		 */
-		list_for_each_entry_reverse(o, &proc->objs, list) {
-			if ((dev && inode && o->dev == dev &&
-			     o->inode == inode) ||
-			    (dev == 0 && !strcmp(o->name, name))) {
-				return object_add_vm_area(o, vma, hole);
-			}
+		o = process_find_object(proc, dev, inode, name);
+		if (o != NULL) {
+			return object_add_vm_area(o, vma);
 		}
 	}
 
-	o = process_new_object(proc, dev, inode, name, vma, hole);
+	o = process_new_object(proc, dev, inode, name, vma);
 	if (o == NULL) {
 		return -1;
 	}
@@ -455,12 +622,204 @@ static int process_add_object_vma(struct upatch_process *proc, dev_t dev,
 	return 0;
 }
 
+/* Read whole /proc/<pid>/maps at once, result is NUL terminated */
+static char *read_proc_maps(int fdmaps, size_t *len)
+{
+	size_t capacity = 64 * 1024;
+	size_t size = 0;
+	char *buf = malloc(capacity);
+
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	while (1) {
+		ssize_t r;
+
+		if (capacity - size < 2) {
+			char *new_buf = realloc(buf, capacity * 2);
+			if (new_buf == NULL) {
+				free(buf);
+				return NULL;
+			}
+			buf = new_buf;
+			capacity *= 2;
+		}
+
+		r = pread(fdmaps, buf + size, capacity - size - 1, (off_t)size);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			free(buf);
+			return NULL;
+		}
+		if (r == 0) {
+			break;
+		}
+		size += r;
+	}
+
+	buf[size] = '\0';
+	*len = size;
+	return buf;
+}
+
+static inline int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static char *parse_hex(char *p, unsigned long *value)
+{
+	unsigned long v = 0;
+	int digit;
+
+	while ((digit = hex_value(*p)) >= 0) {
+		v = (v << 4) | (unsigned long)digit;
+		p++;
+	}
+
+	*value = v;
+	return p;
+}
+
+static char *parse_dec(char *p, unsigned long *value)
+{
+	unsigned long v = 0;
+
+	while (*p >= '0' && *p <= '9') {
+		v = v * 10 + (unsigned long)(*p - '0');
+		p++;
+	}
+
+	*value = v;
+	return p;
+}
+
+static char *skip_spaces(char *p)
+{
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+	return p;
+}
+
+struct maps_entry {
+	struct vm_area vma;
+	unsigned int maj, min;
+	unsigned long inode;
+	char *name;
+};
+
+/*
+ * Parse one line of maps in place, name is terminated inside the buffer.
+ * Format: "start-end perms offset maj:min inode [name]".
+ * Returns start of next line, or NULL at the end of buffer or on failure.
+ */
+static char *parse_maps_line(char *line, struct maps_entry *entry)
+{
+	static char anonymous[] = "[anonymous]";
+	unsigned long value;
+	char *p = line;
+	char *name_end;
+
+	if (*p == '\0') {
+		return NULL;
+	}
+
+	p = parse_hex(p, &entry->vma.start);
+	if (*p++ != '-')
+		return NULL;
+	p = parse_hex(p, &entry->vma.end);
+	p = skip_spaces(p);
+
+	if (p[0] == '\0' || p[1] == '\0' || p[2] == '\0')
+		return NULL;
+	entry->vma.prot = perms2prot(p);
+	while (*p != ' ' && *p != '\0')
+		p++;
+	p = skip_spaces(p);
+
+	p = parse_hex(p, &entry->vma.offset);
+	p = skip_spaces(p);
+
+	p = parse_hex(p, &value);
+	entry->maj = value;
+	if (*p++ != ':')
+		return NULL;
+	p = parse_hex(p, &value);
+	entry->min = value;
+	p = skip_spaces(p);
+
+	p = parse_dec(p, &entry->inode);
+	p = skip_spaces(p);
+
+	/* Name ends at the first space, eg. " (deleted)" is dropped */
+	name_end = p;
+	while (*name_end != '\0' && *name_end != '\n' && *name_end != ' ')
+		name_end++;
+	entry->name = (name_end != p) ? p : anonymous;
+
+	p = name_end;
+	while (*p != '\0' && *p != '\n')
+		p++;
+	if (*p == '\n')
+		p++;
+	*name_end = '\0';
+
+	return p;
+}
+
+/* Length of a parsed line without its newline, the newline may be NUL now */
+static size_t maps_line_len(const char *line, const char *next)
+{
+	size_t len = (size_t)(next - line);
+
+	if (len != 0 && (next[-1] == '\n' || next[-1] == '\0')) {
+		len--;
+	}
+	return len;
+}
+
+static int maps_table_add(struct maps_vma **table, size_t *num,
+			  size_t *capacity, const struct maps_vma *vma)
+{
+	if (array_reserve((void **)table, capacity, *num,
+			  sizeof(struct maps_vma))) {
+		return -1;
+	}
+
+	(*table)[(*num)++] = *vma;
+	return 0;
+}
+
+static void maps_entry_to_vma(const struct maps_entry *entry,
+			      struct maps_vma *vma)
+{
+	vma->start = entry->vma.start;
+	vma->end = entry->vma.end;
+	vma->dev = makedev(entry->maj, entry->min);
+	vma->inode = entry->inode;
+	vma->prot = entry->vma.prot;
+}
+
+// TODO: get addr_space
 int upatch_process_parse_proc_maps(struct upatch_process *proc)
 {
-	FILE *f;
-	int ret, is_libc_base_set = 0;
+	int ret = 0, is_libc_base_set = 0;
 	unsigned long hole_start = 0;
-	struct vm_hole *hole = NULL;
+	unsigned long page_size = PAGE_SIZE;
+	struct maps_entry entry;
+	struct maps_vma vma;
+	size_t len = 0;
+	char *buf, *line;
 
 	/*
 	 * 1. Create the list of all objects in the process
@@ -469,92 +828,76 @@ int upatch_process_parse_proc_maps(struct upatch_process *proc)
 	 *    of the object (we might have references to them
 	 *    in the patch).
 	 */
-	int fd = dup(proc->fdmaps);
-	if (fd < 0) {
-		log_error("unable to dup fd %d", proc->fdmaps);
+	buf = read_proc_maps(proc->fdmaps, &len);
+	if (buf == NULL) {
+		log_error("Failed to read maps of process %d\n", proc->pid);
 		return -1;
 	}
 
-	lseek(fd, 0, SEEK_SET);
-	f = fdopen(fd, "r");
-	if (f == NULL) {
-		log_error("unable to fdopen %d", fd);
-		close(fd);
-		return -1;
-	}
+	/* Text is kept with the vma table for later refresh */
+	free(proc->maps_buf);
+	proc->maps_buf = buf;
+	proc->num_maps = 0;
 
-	do {
-		struct vm_area vma;
-		char line[1024];
-		unsigned long start, end, offset;
-		unsigned int maj, min, inode;
-		char perms[5], name_[256], *name = name_;
-		int r;
-
-		if (!fgets(line, sizeof(line), f)) {
-			break;
-		}
+	line = buf;
+	while (line < buf + len) {
+		char *next = parse_maps_line(line, &entry);
+		char *name;
 
-		r = sscanf(line, "%lx-%lx %s %lx %x:%x %d %255s", &start, &end,
-			   perms, &offset, &maj, &min, &inode, name_);
-		if (r == EOF) {
-			log_error("Failed to read maps: unexpected EOF");
-			goto error;
+		if (next == NULL) {
+			log_error("Failed to read maps: invalid line");
+			return -1;
 		}
 
-		if (r != 8) {
-			strcpy(name, "[anonymous]");
+		maps_entry_to_vma(&entry, &vma);
+		vma.line = (size_t)(line - buf);
+		vma.line_len = maps_line_len(line, next);
+		line = next;
+		if (maps_table_add(&proc->maps, &proc->num_maps,
+				   &proc->maps_capacity, &vma)) {
+			log_error("Failed to add vma");
+			return -1;
 		}
 
-		vma.start = start;
-		vma.end = end;
-		vma.offset = offset;
-		vma.prot = perms2prot(perms);
-
 		/* Hole must be at least 2 pages for guardians */
-		if (start - hole_start > 2 * PAGE_SIZE) {
-			hole = process_add_vm_hole(proc, hole_start + PAGE_SIZE,
-						   start - PAGE_SIZE);
-			if (hole == NULL) {
+		if (entry.vma.start - hole_start > 2 * page_size) {
+			ret = process_add_vm_hole(proc, hole_start + page_size,
+						  entry.vma.start - page_size);
+			if (ret) {
 				log_error("Failed to add vma hole");
-				goto error;
+				return ret;
 			}
 		}
-		hole_start = end;
+		hole_start = entry.vma.end;
 
-		name = name[0] == '/' ? basename(name) : name;
+		name = entry.name;
+		if (name[0] == '/') {
+			name = strrchr(name, '/') + 1;
+		}
 
-		ret = process_add_object_vma(proc, makedev(maj, min), inode,
-					     name, &vma, hole);
+		ret = process_add_object_vma(proc, makedev(entry.maj, entry.min),
+					     entry.inode, name, &entry.vma);
 		if (ret < 0) {
 			log_error("Failed to add object vma");
-			goto error;
+			return ret;
 		}
 
-		if (!is_libc_base_set && !strncmp(basename(name), "libc", 4) &&
-		    vma.prot & PROT_EXEC) {
-			proc->libc_base = start;
+		if (!is_libc_base_set && !strncmp(name, "libc", 4) &&
+		    entry.vma.prot & PROT_EXEC) {
+			proc->libc_base = entry.vma.start;
 			is_libc_base_set = 1;
 		}
-
-	} while (1);
-	fclose(f);
-	close(fd);
+	}
 
 	log_debug("Found %d object file(s)\n", proc->num_objs);
 
 	if (!is_libc_base_set) {
 		log_error("Can't find libc_base required for manipulations: %d",
 			  proc->pid);
-		return -1;
+		ret = -1;
 	}
 
-	return 0;
-
-error:
-	fclose(f);
-	close(fd);
-	return -1;
+	return ret;
 }
 
 int upatch_process_map_object_files(struct upatch_process *proc,
@@ -565,139 +908,797 @@ int upatch_process_map_object_files(struct upatch_process *proc,
 	return upatch_process_parse_proc_maps(proc);
 }
 
-// static int process_has_thread_pid(struct upatch_proces *proc, int pid)
-// {
-// 	struct upatch_ptrace_ctx *pctx;
+/* An area appeared, holes keep a guard page away from it */
+static int process_trim_holes(struct upatch_process *proc,
+			      unsigned long start, unsigned long end)
+{
+	size_t i;
 
-// 	list_for_each_entry(pctx, &proc->ptrace.pctxs, list)
-// 		if (pctx->pid == pid)
-// 			return 1;
+	for (i = 0; i < proc->num_holes; i++) {
+		struct vm_hole *hole = &proc->holes[i];
+		size_t num_holes = proc->num_holes;
 
-// 	return 0;
-// }
+		if (hole->end + PAGE_SIZE <= start) {
+			continue;
+		}
+		if (hole->start >= end + PAGE_SIZE) {
+			break;
+		}
 
-static int process_list_threads(struct upatch_process *proc, int **ppids,
-				size_t *npids, size_t *alloc)
-{
-	DIR *dir = NULL;
-	struct dirent *de;
-	char path[PATH_MAX];
-	int *pids = *ppids;
+		log_debug("Trim vm hole 0x%lx-0x%lx by 0x%lx-0x%lx\n",
+			  hole->start, hole->end, start, end);
+		if (vm_hole_split(proc, hole, start, end)) {
+			return -1;
+		}
+		/* Left part is inserted before the rest */
+		i += proc->num_holes - num_holes;
+	}
 
-	snprintf(path, sizeof(path), "/proc/%d/task", proc->pid);
+	return 0;
+}
 
-	dir = opendir(path);
-	if (!dir) {
-		log_error("Failed to open directory '%s'\n", path);
-		goto dealloc;
+int upatch_process_refresh_maps(struct upatch_process *proc)
+{
+	struct maps_vma *table = NULL;
+	size_t num = 0, capacity = 0, changed = 0, i = 0;
+	bool trim = proc->maps_buf != NULL;
+	struct maps_entry entry;
+	struct maps_vma vma;
+	size_t len = 0;
+	char *buf, *line;
+
+	buf = read_proc_maps(proc->fdmaps, &len);
+	if (buf == NULL) {
+		log_error("Failed to read maps of process %d\n", proc->pid);
+		return -1;
 	}
 
-	*npids = 0;
-	while ((de = readdir(dir))) {
-		int *t;
-		if (de->d_name[0] == '.') {
-			continue;
+	/* Both tables are sorted, lines are matched by the start address */
+	line = buf;
+	while (line < buf + len) {
+		char *eol = strchr(line, '\n');
+		size_t line_len = (eol != NULL) ? (size_t)(eol - line) :
+						  strlen(line);
+		char *next = (eol != NULL) ? eol + 1 : line + line_len;
+		unsigned long start;
+
+		parse_hex(line, &start);
+		while (i < proc->num_maps && proc->maps[i].start < start) {
+			i++;
 		}
 
-		if (*npids >= *alloc) {
-			*alloc = *alloc ? *alloc * 2 : 1;
-
-			t = realloc(pids, *alloc * sizeof(*pids));
-			if (t == NULL) {
-				log_error("Failed to (re)allocate memory for pids\n");
-				goto dealloc;
+		if (i < proc->num_maps && proc->maps[i].start == start &&
+		    proc->maps[i].line_len == line_len &&
+		    !memcmp(proc->maps_buf + proc->maps[i].line, line,
+			    line_len)) {
+			vma = proc->maps[i];
+		} else {
+			if (parse_maps_line(line, &entry) == NULL) {
+				log_error("Failed to read maps: invalid line");
+				goto err;
 			}
-
-			pids = t;
+			maps_entry_to_vma(&entry, &vma);
+			vma.line_len = line_len;
+			if (trim && process_trim_holes(proc, vma.start, vma.end)) {
+				log_error("Failed to trim vma hole");
+				goto err;
+			}
+			changed++;
 		}
+		vma.line = (size_t)(line - buf);
+		line = next;
 
-		pids[*npids] = atoi(de->d_name);
-		(*npids)++;
+		if (maps_table_add(&table, &num, &capacity, &vma)) {
+			log_error("Failed to add vma");
+			goto err;
+		}
 	}
-	closedir(dir);
 
-	*ppids = pids;
+	log_debug("Refreshed maps of process %d, %zu of %zu area(s) changed\n",
+		  proc->pid, changed, num);
 
-	return *npids;
+	free(proc->maps);
+	free(proc->maps_buf);
+	proc->maps = table;
+	proc->num_maps = num;
+	proc->maps_capacity = capacity;
+	proc->maps_buf = buf;
+	return 0;
 
-dealloc:
-	if (dir) {
-		closedir(dir);
-	}
-	free(pids);
-	*ppids = NULL;
-	*alloc = *npids = 0;
+err:
+	free(table);
+	free(buf);
 	return -1;
 }
 
-int upatch_process_attach(struct upatch_process *proc)
+/* Index of the first area ending above addr */
+static size_t process_find_maps(struct upatch_process *proc,
+				unsigned long addr)
 {
-	int *pids = NULL, ret;
-	size_t i, npids = 0, alloc = 0, prevnpids = 0, nattempts;
+	size_t left = 0;
+	size_t right = proc->num_maps;
 
-	if (upatch_process_mem_open(proc, MEM_WRITE) < 0) {
-		return -1;
-	}
-
-	for (nattempts = 0; nattempts < MAX_ATTACH_ATTEMPTS; nattempts++) {
-		ret = process_list_threads(proc, &pids, &npids, &alloc);
-		if (ret == -1)
-			goto detach;
+	while (left < right) {
+		size_t mid = left + (right - left) / 2;
 
-		if (nattempts == 0) {
-			log_debug("Found %lu thread(s), attaching...\n", npids);
+		if (proc->maps[mid].end <= addr) {
+			left = mid + 1;
 		} else {
-			/*
-			 * FIXME(pboldin): This is wrong, amount of threads can
-			 * be the same because some new spawned and some old
-			 * died
-			 */
-			if (prevnpids == npids)
-				break;
-
-			log_debug("Found %lu new thread(s), attaching...\n",
-				  prevnpids - npids);
+			right = mid;
 		}
+	}
 
-		for (i = prevnpids; i < npids; i++) {
-			int pid = pids[i];
-
-			// if (process_has_thread_pid(proc, pid)) {
-			// 	log_debug("already have pid %d\n", pid);
-			// 	continue;
-			// }
+	return left;
+}
 
-			ret = upatch_ptrace_attach_thread(proc, pid);
-			if (ret < 0)
-				goto detach;
-		}
+static bool procmap_query_unsupported;
 
-		prevnpids = npids;
+/*
+ * Look up the area covering addr, or the next one above it, by the
+ * PROCMAP_QUERY ioctl of maps, which saves generating the whole text.
+ * Returns 1 if found, 0 if there is none, -EOPNOTSUPP for old kernels.
+ */
+static int process_query_vma(struct upatch_process *proc, unsigned long addr,
+			     struct procmap_query *query)
+{
+	if (procmap_query_unsupported) {
+		return -EOPNOTSUPP;
 	}
 
-	if (nattempts == MAX_ATTACH_ATTEMPTS) {
-		log_error("Unable to catch up with process, bailing\n");
-		goto detach;
+	memset(query, 0, sizeof(*query));
+	query->size = sizeof(*query);
+	query->query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+	query->query_addr = addr;
+	if (ioctl(proc->fdmaps, PROCMAP_QUERY, query) == 0) {
+		return 1;
 	}
-
-	log_debug("Attached to %lu thread(s): %d", npids, pids[0]);
-	for (i = 1; i < npids; i++) {
-		log_debug(", %d", pids[i]);
+	if (errno == ENOENT) {
+		return 0;
+	}
+	if (errno == ENOTTY || errno == EINVAL || errno == EOPNOTSUPP) {
+		log_debug("PROCMAP_QUERY is not supported, maps are read\n");
+		procmap_query_unsupported = true;
+		return -EOPNOTSUPP;
 	}
-	log_debug("\n");
-
-	free(pids);
-	return 0;
 
-detach:
-	upatch_process_detach(proc);
-	free(pids);
-	return -1;
+	return -errno;
 }
 
-void upatch_process_detach(struct upatch_process *proc)
+/*
+ * Check whether [start, end) overlaps any vma of the process as it is now.
+ * Returns 1 if overlapped, 0 if not, negative value on failure.
+ */
+int upatch_process_region_mapped(struct upatch_process *proc,
+				 unsigned long start, unsigned long end)
 {
-	struct upatch_ptrace_ctx *p, *ptmp;
+	struct procmap_query query;
+	size_t i;
+	int ret;
+
+	ret = process_query_vma(proc, start, &query);
+	if (ret >= 0) {
+		return (ret == 1) && (query.vma_start < end);
+	}
+	if (ret != -EOPNOTSUPP || upatch_process_refresh_maps(proc)) {
+		return -1;
+	}
+
+	i = process_find_maps(proc, start);
+	return (i < proc->num_maps) && (proc->maps[i].start < end);
+}
+
+/*
+ * Check whether [start, end) is fully covered by PROT_NONE anonymous vmas
+ * of the process as it is now, which is the free space of an arena.
+ * Returns 1 if reserved, 0 if not, negative value on failure.
+ */
+int upatch_process_region_reserved(struct upatch_process *proc,
+				   unsigned long start, unsigned long end)
+{
+	struct procmap_query query;
+	unsigned long next = start;
+	size_t i;
+	int ret;
+
+	while ((ret = process_query_vma(proc, next, &query)) == 1) {
+		if (query.vma_start > next || query.inode != 0 ||
+		    (query.vma_flags & PROCMAP_QUERY_VMA_PROT)) {
+			return 0;
+		}
+		next = query.vma_end;
+		if (next >= end) {
+			return 1;
+		}
+	}
+	if (ret == 0) {
+		return 0;
+	}
+	if (ret != -EOPNOTSUPP || upatch_process_refresh_maps(proc)) {
+		return -1;
+	}
+
+	for (i = process_find_maps(proc, next); i < proc->num_maps; i++) {
+		struct maps_vma *vma = &proc->maps[i];
+
+		if (vma->start > next || vma->prot != 0 || vma->inode != 0) {
+			return 0;
+		}
+		next = vma->end;
+		if (next >= end) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int upatch_process_addr_in_object(struct upatch_process *proc,
+				  unsigned long addr,
+				  const struct object_file *obj)
+{
+	struct procmap_query query;
+	size_t i;
+	int ret;
+
+	ret = process_query_vma(proc, addr, &query);
+	if (ret >= 0) {
+		return (ret == 1) && (query.vma_start <= addr) &&
+		       (query.inode == obj->inode) &&
+		       (makedev(query.dev_major, query.dev_minor) == obj->dev);
+	}
+	if (ret != -EOPNOTSUPP || upatch_process_refresh_maps(proc)) {
+		return -1;
+	}
+
+	i = process_find_maps(proc, addr);
+	return (i < proc->num_maps) && (proc->maps[i].start <= addr) &&
+	       (proc->maps[i].inode == obj->inode) &&
+	       (proc->maps[i].dev == obj->dev);
+}
+
+static int pid_cmp(const void *a, const void *b)
+{
+	int pa = *(const int *)a;
+	int pb = *(const int *)b;
+
+	return (pa > pb) - (pa < pb);
+}
+
+/*
+ * Pids of threads seized so far, sorted, thus each thread of a listing is
+ * looked up by halves rather than a walk of all ptrace contexts.
+ */
+static int *process_seized_pids(struct upatch_process *proc, size_t *num)
+{
+	struct upatch_ptrace_ctx *pctx;
+	int *pids = NULL;
+	size_t n = 0;
+
+	list_for_each_entry(pctx, &proc->ptrace.pctxs, list) {
+		n++;
+	}
+	pids = malloc((n + 1) * sizeof(*pids));
+	if (pids == NULL) {
+		log_error("Failed to allocate memory for seized pids\n");
+		return NULL;
+	}
+
+	n = 0;
+	list_for_each_entry(pctx, &proc->ptrace.pctxs, list) {
+		pids[n++] = pctx->pid;
+	}
+	qsort(pids, n, sizeof(*pids), pid_cmp);
+	*num = n;
+
+	return pids;
+}
+
+static bool process_has_thread_pid(const int *seized, size_t num, int pid)
+{
+	return bsearch(&pid, seized, num, sizeof(*seized), pid_cmp) != NULL;
+}
+
+static int process_list_threads(struct upatch_process *proc, int **ppids,
+				size_t *npids, size_t *alloc)
+{
+	DIR *dir = NULL;
+	struct dirent *de;
+	char path[PATH_MAX];
+	int *pids = *ppids;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", proc->pid);
+
+	dir = opendir(path);
+	if (!dir) {
+		log_error("Failed to open directory '%s'\n", path);
+		goto dealloc;
+	}
+
+	*npids = 0;
+	while ((de = readdir(dir))) {
+		int *t;
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+
+		if (*npids >= *alloc) {
+			*alloc = *alloc ? *alloc * 2 : 1;
+
+			t = realloc(pids, *alloc * sizeof(*pids));
+			if (t == NULL) {
+				log_error("Failed to (re)allocate memory for pids\n");
+				goto dealloc;
+			}
+
+			pids = t;
+		}
+
+		pids[*npids] = atoi(de->d_name);
+		(*npids)++;
+	}
+	closedir(dir);
+
+	*ppids = pids;
+
+	return *npids;
+
+dealloc:
+	if (dir) {
+		closedir(dir);
+	}
+	free(pids);
+	*ppids = NULL;
+	*alloc = *npids = 0;
+	return -1;
+}
+
+void upatch_process_set_freezer(bool enable)
+{
+	use_cgroup_freezer = enable;
+}
+
+static int find_cgroup2_mount(char *path, size_t len)
+{
+	struct mntent *ent;
+	int ret = -1;
+
+	FILE *fp = setmntent("/proc/self/mounts", "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	while ((ent = getmntent(fp)) != NULL) {
+		if (strcmp(ent->mnt_type, "cgroup2") == 0) {
+			int n = snprintf(path, len, "%s", ent->mnt_dir);
+			ret = (n < 0 || (size_t)n >= len) ? -1 : 0;
+			break;
+		}
+	}
+	endmntent(fp);
+
+	return ret;
+}
+
+static int process_get_cgroup_dir(struct upatch_process *proc, char *dir,
+				  size_t len)
+{
+	char path[PATH_MAX];
+	char mount[PATH_MAX];
+	char *line = NULL;
+	size_t line_len = 0;
+	int ret = -1;
+
+	if (find_cgroup2_mount(mount, sizeof(mount))) {
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", proc->pid);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	/* cgroup v2 entry is "0::<path>" */
+	while (getline(&line, &line_len, fp) != -1) {
+		if (strncmp(line, "0::", 3) != 0) {
+			continue;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		/* Never freeze the root cgroup */
+		if (strcmp(line + 3, "/") != 0) {
+			int n = snprintf(dir, len, "%s%s", mount, line + 3);
+			ret = (n < 0 || (size_t)n >= len) ? -1 : 0;
+		}
+		break;
+	}
+	free(line);
+	fclose(fp);
+
+	return ret;
+}
+
+static int cgroup_file_path(char *path, size_t len, const char *dir,
+			    const char *name)
+{
+	int ret = snprintf(path, len, "%s/%s", dir, name);
+	if (ret < 0 || (size_t)ret >= len) {
+		log_debug("Path of '%s' in cgroup '%s' is too long\n", name, dir);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Other processes in the cgroup should not be frozen along with the target */
+/*
+ * Freezing a cgroup freezes all of its descendants as well. Child cgroups
+ * are told by their directories, listing fails safe to having children.
+ */
+static bool cgroup_has_children(const char *dir)
+{
+	struct dirent *de;
+	bool found = false;
+	DIR *d = opendir(dir);
+
+	if (d == NULL) {
+		return true;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		if ((de->d_type == DT_DIR) || (de->d_type == DT_UNKNOWN)) {
+			found = true;
+			break;
+		}
+	}
+	closedir(d);
+
+	return found;
+}
+
+static bool cgroup_has_only_process(const char *dir, int pid)
+{
+	char path[PATH_MAX];
+	int cgroup_pid;
+	bool found = false;
+
+	if (cgroup_file_path(path, sizeof(path), dir, "cgroup.procs")) {
+		return false;
+	}
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return false;
+	}
+
+	while (fscanf(fp, "%d", &cgroup_pid) == 1) {
+		if (cgroup_pid != pid) {
+			found = false;
+			break;
+		}
+		found = true;
+	}
+	fclose(fp);
+
+	return found;
+}
+
+static int read_cgroup_file(int fd, char *buf, size_t len)
+{
+	ssize_t n = pread(fd, buf, len - 1, 0);
+	if (n < 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+
+	return 0;
+}
+
+static void process_freezer_close(struct upatch_process *proc)
+{
+	if (proc->freezer.freeze_fd >= 0) {
+		close(proc->freezer.freeze_fd);
+	}
+	if (proc->freezer.events_fd >= 0) {
+		close(proc->freezer.events_fd);
+	}
+	proc->freezer.freeze_fd = -1;
+	proc->freezer.events_fd = -1;
+}
+
+/*
+ * Freezer is only used if the process is alone in its own cgroup,
+ * and nobody else has frozen the cgroup.
+ */
+static int process_freezer_open(struct upatch_process *proc)
+{
+	char dir[PATH_MAX];
+	char path[PATH_MAX];
+	char buf[16];
+
+	if (process_get_cgroup_dir(proc, dir, sizeof(dir))) {
+		log_debug("Process %d has no cgroup v2 to freeze\n", proc->pid);
+		return -1;
+	}
+	if (!cgroup_has_only_process(dir, proc->pid)) {
+		log_debug("Process %d does not own cgroup '%s'\n", proc->pid, dir);
+		return -1;
+	}
+	if (cgroup_has_children(dir)) {
+		log_debug("Cgroup '%s' has child cgroups\n", dir);
+		return -1;
+	}
+
+	if (cgroup_file_path(path, sizeof(path), dir, "cgroup.freeze")) {
+		return -1;
+	}
+	proc->freezer.freeze_fd = open(path, O_RDWR | O_CLOEXEC);
+	if (cgroup_file_path(path, sizeof(path), dir, "cgroup.events")) {
+		goto close;
+	}
+	proc->freezer.events_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (proc->freezer.freeze_fd < 0 || proc->freezer.events_fd < 0) {
+		log_debug("Failed to open freezer of cgroup '%s'\n", dir);
+		goto close;
+	}
+
+	if (read_cgroup_file(proc->freezer.freeze_fd, buf, sizeof(buf)) ||
+	    buf[0] != '0') {
+		log_debug("Cgroup '%s' is frozen already\n", dir);
+		goto close;
+	}
+
+	log_debug("Using freezer of cgroup '%s'\n", dir);
+	return 0;
+
+close:
+	process_freezer_close(proc);
+	return -1;
+}
+
+static bool process_freezer_frozen(struct upatch_process *proc)
+{
+	char buf[256];
+
+	if (read_cgroup_file(proc->freezer.events_fd, buf, sizeof(buf))) {
+		return false;
+	}
+
+	return strstr(buf, "frozen 1") != NULL;
+}
+
+/*
+ * Stop all threads at once, memory could be written through /proc/<pid>/mem
+ * meanwhile. Frozen threads cannot run remote code, thus remote syscalls
+ * have to be done either before freezing or after thawing.
+ * Does nothing if all threads were stopped by ptrace already.
+ */
+int upatch_process_freeze(struct upatch_process *proc)
+{
+	struct pollfd pfd = {
+		.fd = proc->freezer.events_fd,
+		.events = POLLPRI,
+	};
+	int timeout = FREEZE_TIMEOUT_MS;
+
+	if (proc->freezer.freeze_fd < 0 || proc->freezer.frozen) {
+		return 0;
+	}
+
+	if (pwrite(proc->freezer.freeze_fd, "1", 1, 0) != 1) {
+		log_error("Failed to freeze process %d\n", proc->pid);
+		return -1;
+	}
+	proc->freezer.frozen = true;
+
+	/* cgroup.events is notified once 'frozen' changes */
+	while (!process_freezer_frozen(proc)) {
+		if (timeout <= 0) {
+			log_error("Timed out freezing process %d\n", proc->pid);
+			upatch_process_thaw(proc);
+			return -ETIMEDOUT;
+		}
+		if (poll(&pfd, 1, 10) < 0 && errno != EINTR) {
+			log_error("Failed to wait process %d frozen\n", proc->pid);
+			upatch_process_thaw(proc);
+			return -1;
+		}
+		timeout -= 10;
+	}
+
+	return 0;
+}
+
+void upatch_process_thaw(struct upatch_process *proc)
+{
+	if (!proc->freezer.frozen) {
+		return;
+	}
+
+	if (pwrite(proc->freezer.freeze_fd, "0", 1, 0) != 1) {
+		log_error("Failed to thaw process %d\n", proc->pid);
+		return;
+	}
+	proc->freezer.frozen = false;
+}
+
+/* Only one thread is needed for remote syscalls, the others are frozen on demand */
+static int process_attach_leader(struct upatch_process *proc)
+{
+	if (upatch_ptrace_seize_thread(proc, proc->pid) < 0 ||
+	    upatch_ptrace_wait_threads(proc) < 0) {
+		return -1;
+	}
+	if (list_empty(&proc->ptrace.pctxs)) {
+		log_error("Process has no thread to attach\n");
+		return -1;
+	}
+
+	log_debug("Attached to thread %d\n", proc->pid);
+	return 0;
+}
+
+/*
+ * Request all threads to stop at once, then reap their stops together.
+ * Stopped threads cannot spawn new ones, thus once a listing shows no
+ * unknown thread, the whole process is stopped.
+ */
+static int process_seize_threads(struct upatch_process *proc)
+{
+	int *pids = NULL, *seized = NULL, ret;
+	size_t i, npids = 0, alloc = 0, nseized, nnew, nattempts;
+
+	for (nattempts = 0; nattempts < MAX_ATTACH_ATTEMPTS; nattempts++) {
+		ret = process_list_threads(proc, &pids, &npids, &alloc);
+		if (ret == -1)
+			goto err;
+
+		seized = process_seized_pids(proc, &nseized);
+		if (seized == NULL)
+			goto err;
+
+		nnew = 0;
+		for (i = 0; i < npids; i++) {
+			if (process_has_thread_pid(seized, nseized, pids[i])) {
+				continue;
+			}
+
+			ret = upatch_ptrace_seize_thread(proc, pids[i]);
+			if (ret < 0)
+				goto err;
+			nnew++;
+		}
+		free(seized);
+		seized = NULL;
+		if (nnew == 0)
+			break;
+
+		if (nattempts == 0) {
+			log_debug("Found %lu thread(s), attaching...\n", nnew);
+		} else {
+			log_debug("Found %lu new thread(s), attaching...\n", nnew);
+		}
+
+		ret = upatch_ptrace_wait_threads(proc);
+		if (ret < 0)
+			goto err;
+	}
+
+	if (nattempts == MAX_ATTACH_ATTEMPTS) {
+		log_error("Unable to catch up with process, bailing\n");
+		goto err;
+	}
+	if (list_empty(&proc->ptrace.pctxs)) {
+		log_error("Process has no thread to attach\n");
+		goto err;
+	}
+
+	log_debug("Attached to %lu thread(s): %d", npids, pids[0]);
+	for (i = 1; i < npids; i++) {
+		log_debug(", %d", pids[i]);
+	}
+	log_debug("\n");
+
+	free(pids);
+	return 0;
+
+err:
+	free(seized);
+	free(pids);
+	return -1;
+}
+
+int upatch_process_attach(struct upatch_process *proc)
+{
+	if (upatch_process_mem_open(proc, MEM_WRITE) < 0) {
+		return -1;
+	}
+
+	if (use_cgroup_freezer && process_freezer_open(proc) == 0) {
+		if (process_attach_leader(proc) < 0) {
+			goto detach;
+		}
+		return 0;
+	}
+
+	if (process_seize_threads(proc) < 0) {
+		goto detach;
+	}
+
+	return 0;
+
+detach:
+	upatch_process_detach(proc);
+	return -1;
+}
+
+void upatch_process_release(struct upatch_process *proc)
+{
+	struct upatch_ptrace_ctx *pctx;
+
+	upatch_process_thaw(proc);
+	list_for_each_entry(pctx, &proc->ptrace.pctxs, list) {
+		if (pctx->running) {
+			continue;
+		}
+		/* Failure means the thread is exiting, it is reaped on restop */
+		if (ptrace(PTRACE_CONT, pctx->pid, NULL, NULL) < 0) {
+			log_debug("Failed to continue thread %d\n", pctx->pid);
+		}
+		pctx->running = 1;
+	}
+}
+
+int upatch_process_restop(struct upatch_process *proc)
+{
+	struct upatch_ptrace_ctx *pctx;
+
+	list_for_each_entry(pctx, &proc->ptrace.pctxs, list) {
+		if (!pctx->running) {
+			continue;
+		}
+		if (ptrace(PTRACE_INTERRUPT, pctx->pid, NULL, NULL) < 0) {
+			log_debug("Failed to interrupt thread %d\n", pctx->pid);
+		}
+	}
+	if (upatch_ptrace_wait_threads(proc) < 0) {
+		return -1;
+	}
+
+	/* Threads created meanwhile are frozen along with the others */
+	if (proc->freezer.freeze_fd >= 0) {
+		return upatch_process_freeze(proc);
+	}
+	return process_seize_threads(proc);
+}
+
+/*
+ * Let every thread go but the one running remote syscalls, for good. Used
+ * once nothing but cleanup is left, no thread is stopped again afterwards.
+ */
+void upatch_process_release_others(struct upatch_process *proc)
+{
+	struct upatch_ptrace_ctx *remote = proc2pctx(proc);
+	struct upatch_ptrace_ctx *pctx;
+
+	list_for_each_entry(pctx, &proc->ptrace.pctxs, list) {
+		if ((pctx == remote) || pctx->running) {
+			continue;
+		}
+		/* Failure means the thread is exiting, detach reaps it */
+		(void)upatch_ptrace_detach(pctx);
+	}
+}
+
+int upatch_process_list_threads(struct upatch_process *proc, int **pids,
+				size_t *npids, size_t *alloc)
+{
+	return process_list_threads(proc, pids, npids, alloc);
+}
+
+void upatch_process_detach(struct upatch_process *proc)
+{
+	struct upatch_ptrace_ctx *p, *ptmp;
 	int status;
 	pid_t pid;
 
@@ -706,6 +1707,9 @@ void upatch_process_detach(struct upatch_process *proc)
 	}
 	proc->memfd = -1;
 
+	upatch_process_thaw(proc);
+	process_freezer_close(proc);
+
 	list_for_each_entry_safe(p, ptmp, &proc->ptrace.pctxs, list) {
 		/**
 		 * If upatch_ptrace_detach(p) return -ESRCH, there are two situations,
@@ -733,24 +1737,6 @@ void upatch_process_detach(struct upatch_process *proc)
 	log_debug("Process detached\n");
 }
 
-static inline struct vm_hole *next_hole(struct vm_hole *hole,
-					struct list_head *head)
-{
-	if (hole == NULL || hole->list.next == head)
-		return NULL;
-
-	return list_entry(hole->list.next, struct vm_hole, list);
-}
-
-static inline struct vm_hole *prev_hole(struct vm_hole *hole,
-					struct list_head *head)
-{
-	if (hole == NULL || hole->list.prev == head)
-		return NULL;
-
-	return list_entry(hole->list.prev, struct vm_hole, list);
-}
-
 static inline unsigned long hole_size(struct vm_hole *hole)
 {
 	if (hole == NULL)
@@ -758,97 +1744,139 @@ static inline unsigned long hole_size(struct vm_hole *hole)
 	return hole->end - hole->start;
 }
 
-int vm_hole_split(struct vm_hole *hole, unsigned long alloc_start,
-		  unsigned long alloc_end)
+int vm_hole_split(struct upatch_process *proc, struct vm_hole *hole,
+		  unsigned long alloc_start, unsigned long alloc_end)
 {
+	size_t index = hole - proc->holes;
+
 	alloc_start = ROUND_DOWN(alloc_start, PAGE_SIZE) - PAGE_SIZE;
 	alloc_end = ROUND_UP(alloc_end, PAGE_SIZE) + PAGE_SIZE;
 
 	if (alloc_start > hole->start) {
-		struct vm_hole *left = NULL;
-
-		left = malloc(sizeof(*hole));
-		if (left == NULL) {
+		if (array_reserve((void **)&proc->holes, &proc->holes_capacity,
+				  proc->num_holes, sizeof(struct vm_hole))) {
 			log_error("Failed to malloc for vm hole");
 			return -1;
 		}
+		hole = &proc->holes[index];
 
-		left->start = hole->start;
-		left->end = alloc_start;
+		/* Insert left part before the hole to keep holes sorted */
+		memmove(hole + 1, hole,
+			(proc->num_holes - index) * sizeof(struct vm_hole));
+		proc->num_holes++;
 
-		list_add(&left->list, &hole->list);
+		hole->end = alloc_start;
+		hole++;
 	}
 
-	/* Reuse hole pointer as the right hole since it is pointed to by
-	 * the `previous_hole` of some `object_file`. */
 	hole->start = alloc_end;
 	hole->end = hole->end > alloc_end ? hole->end : alloc_end;
 
 	return 0;
 }
 
+/* Find index of the first hole starting at or above addr */
+static size_t find_hole_above(struct upatch_process *proc, unsigned long addr)
+{
+	size_t left = 0;
+	size_t right = proc->num_holes;
+
+	while (left < right) {
+		size_t mid = left + (right - left) / 2;
+
+		if (proc->holes[mid].start < addr) {
+			left = mid + 1;
+		} else {
+			right = mid;
+		}
+	}
+
+	return left;
+}
+
+/*
+ * Locate the holes just below and just above the object.
+ * Index of 'left' is -1 if there is no hole below.
+ */
+static void object_find_near_holes(struct object_file *obj, long *left,
+				   size_t *right, unsigned long *obj_start,
+				   unsigned long *obj_end)
+{
+	struct upatch_process *proc = obj->proc;
+
+	*obj_start = obj->vmas[0].start;
+	*obj_end = obj->vmas[obj->num_vmas - 1].end;
+
+	*right = find_hole_above(proc, *obj_end);
+	*left = (long)find_hole_above(proc, *obj_start) - 1;
+}
+
 /*
- * Find region for a patch. Take object's `previous_hole` as a left candidate
- * and the next hole as a right candidate. Pace through them until there is
- * enough space in the hole for the patch.
+ * Find region for a patch. Take the hole below the object as a left
+ * candidate and the hole above as a right candidate. Pace through them
+ * until there is enough space in the hole for the patch.
  *
- * Since holes can be much larger than 2GiB take extra caution to allocate
- * patch region inside the (-2GiB, +2GiB) range from the original object.
+ * Since holes can be much larger than max_distance take extra caution to
+ * allocate patch region inside the (-max_distance, +max_distance) range
+ * from the original object.
  */
 unsigned long object_find_patch_region(struct object_file *obj, size_t memsize,
+				       unsigned long max_distance,
 				       struct vm_hole **hole)
 {
-	struct list_head *head = &obj->proc->vmaholes;
-	struct vm_hole *left_hole = obj->previous_hole;
-	struct vm_hole *right_hole = next_hole(left_hole, head);
-	unsigned long max_distance = MAX_DISTANCE;
-	struct obj_vm_area *sovma;
-
+	struct vm_hole *holes = obj->proc->holes;
+	size_t num_holes = obj->proc->num_holes;
 	unsigned long obj_start, obj_end;
 	unsigned long region_start = 0, region_end = 0;
+	long left;
+	size_t right;
 
 	log_debug("Looking for patch region for '%s'...\n", obj->name);
 
-	sovma = list_first_entry(&obj->vma, struct obj_vm_area, list);
-	obj_start = sovma->inmem.start;
-	sovma = list_entry(obj->vma.prev, struct obj_vm_area, list);
-	obj_end = sovma->inmem.end;
-
+	object_find_near_holes(obj, &left, &right, &obj_start, &obj_end);
 	max_distance -= memsize;
 
 	/* TODO carefully check for the holes laying between obj_start and
 	 * obj_end, i.e. just after the executable segment of an executable
 	 */
-	while (left_hole != NULL && right_hole != NULL) {
-		if (right_hole != NULL &&
-		    right_hole->start - obj_start > max_distance)
-			right_hole = NULL;
-		else if (hole_size(right_hole) > memsize) {
-			region_start = right_hole->start;
-			region_end = (right_hole->end - obj_start) <=
-						     max_distance ?
-					     right_hole->end - memsize :
-					     obj_start + max_distance;
-			*hole = right_hole;
-			break;
-		} else
-			right_hole = next_hole(right_hole, head);
-
-		if (left_hole != NULL &&
-		    obj_end - left_hole->end > max_distance)
-			left_hole = NULL;
-		else if (hole_size(left_hole) > memsize) {
-			region_start = (obj_end - left_hole->start) <=
-						       max_distance ?
-					       left_hole->start :
-				       obj_end > max_distance ?
-					       obj_end - max_distance :
-					       0;
-			region_end = left_hole->end - memsize;
-			*hole = left_hole;
-			break;
-		} else
-			left_hole = prev_hole(left_hole, head);
+	while (left >= 0 || right < num_holes) {
+		if (right < num_holes) {
+			struct vm_hole *right_hole = &holes[right];
+
+			if (right_hole->start - obj_start > max_distance) {
+				right = num_holes;
+			} else if (hole_size(right_hole) > memsize) {
+				region_start = right_hole->start;
+				region_end = (right_hole->end - obj_start) <=
+							     max_distance ?
+						     right_hole->end - memsize :
+						     obj_start + max_distance;
+				*hole = right_hole;
+				break;
+			} else {
+				right++;
+			}
+		}
+
+		if (left >= 0) {
+			struct vm_hole *left_hole = &holes[left];
+
+			if (obj_end - left_hole->end > max_distance) {
+				left = -1;
+			} else if (hole_size(left_hole) > memsize) {
+				region_start = (obj_end - left_hole->start) <=
+							       max_distance ?
+						       left_hole->start :
+					       obj_end > max_distance ?
+						       obj_end - max_distance :
+						       0;
+				region_end = left_hole->end - memsize;
+				*hole = left_hole;
+				break;
+			} else {
+				left--;
+			}
+		}
 	}
 
 	if (region_start == region_end) {
@@ -862,29 +1890,33 @@ unsigned long object_find_patch_region(struct object_file *obj, size_t memsize,
 
 	return region_start;
 }
+
 unsigned long object_find_patch_region_nolimit(struct object_file *obj, size_t memsize,
 				       struct vm_hole **hole)
 {
-	struct list_head *head = &obj->proc->vmaholes;
-	struct vm_hole *left_hole = obj->previous_hole;
-	struct vm_hole *right_hole = next_hole(left_hole, head);
+	struct vm_hole *holes = obj->proc->holes;
+	size_t num_holes = obj->proc->num_holes;
+	unsigned long obj_start, obj_end;
 	unsigned long region_start = 0;
+	long left;
+	size_t right;
 
 	log_debug("Looking for patch region for '%s'...\n", obj->name);
 
-	while (right_hole != NULL) {
-		if (hole_size(right_hole) > memsize) {
-			*hole = right_hole;
+	object_find_near_holes(obj, &left, &right, &obj_start, &obj_end);
+
+	for (; right < num_holes; right++) {
+		if (hole_size(&holes[right]) > memsize) {
+			*hole = &holes[right];
 			goto found;
-		} else
-			right_hole = next_hole(right_hole, head);
+		}
+	}
 
-	while (left_hole != NULL)
-		if (hole_size(left_hole) > memsize) {
-			*hole = left_hole;
+	for (; left >= 0; left--) {
+		if (hole_size(&holes[left]) > memsize) {
+			*hole = &holes[left];
 			goto found;
-		} else
-			left_hole = prev_hole(left_hole, head);
+		}
 	}
 
 	log_error("Cannot find suitable region for patch '%s'\n", obj->name);
@@ -896,3 +1928,131 @@ found:
 
 	return region_start;
 }
+
+struct upatch_arena *upatch_process_find_arena(struct upatch_process *proc,
+					       unsigned long start,
+					       unsigned long end)
+{
+	size_t i;
+
+	for (i = 0; i < proc->num_arenas; i++) {
+		struct upatch_arena *arena = &proc->arenas[i];
+
+		if (start >= arena->start && end <= arena->end) {
+			return arena;
+		}
+	}
+
+	return NULL;
+}
+
+static bool arena_near_object(struct upatch_arena *arena,
+			      struct object_file *obj)
+{
+	unsigned long obj_start = obj->vmas[0].start;
+	unsigned long obj_end = obj->vmas[obj->num_vmas - 1].end;
+
+	if (arena->start >= obj_end) {
+		return arena->end - obj_start <= MAX_DISTANCE;
+	}
+	if (arena->end <= obj_start) {
+		return obj_end - arena->start <= MAX_DISTANCE;
+	}
+	return false;
+}
+
+/*
+ * Take memory from a hole of the arena, keeping a guard page on both sides.
+ * Space skipped for alignment is not given back.
+ */
+static unsigned long arena_alloc(struct upatch_arena *arena, size_t memsize,
+				 unsigned long align)
+{
+	size_t i;
+
+	for (i = 0; i < arena->num_holes; i++) {
+		struct vm_hole *hole = &arena->holes[i];
+		unsigned long addr = ROUND_UP(hole->start + PAGE_SIZE, align);
+
+		if (addr + memsize + PAGE_SIZE > hole->end) {
+			continue;
+		}
+
+		hole->start = addr + memsize;
+		return addr;
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate patch region from an arena near the object, aligned to align,
+ * which is a power of 2 no less than PAGE_SIZE. If no arena has enough
+ * space, a new one is reserved from the vm holes, which is mapped later
+ * together with the patch.
+ * Returns 0 if there is no room for arena within MAX_DISTANCE.
+ */
+unsigned long object_alloc_arena_region(struct object_file *obj,
+					size_t memsize, unsigned long align)
+{
+	struct upatch_process *proc = obj->proc;
+	struct upatch_arena *arena;
+	struct vm_hole *hole = NULL;
+	unsigned long arena_size;
+	unsigned long addr;
+	size_t i;
+
+	memsize = ROUND_UP(memsize, PAGE_SIZE);
+
+	for (i = 0; i < proc->num_arenas; i++) {
+		arena = &proc->arenas[i];
+		if (!arena_near_object(arena, obj)) {
+			continue;
+		}
+		addr = arena_alloc(arena, memsize, align);
+		if (addr != 0) {
+			log_debug("Allocated patch region 0x%lx from arena "
+				  "0x%lx\n", addr, arena->start);
+			return addr;
+		}
+	}
+
+	/* Header page, guard pages, the patch and room for its alignment */
+	arena_size = memsize + 3 * PAGE_SIZE + (align - PAGE_SIZE);
+	arena_size = arena_size > UPATCH_ARENA_SIZE ? arena_size :
+						      UPATCH_ARENA_SIZE;
+
+	addr = object_find_patch_region(obj, arena_size, MAX_DISTANCE, &hole);
+	if (!addr || addr == -1UL) {
+		return 0;
+	}
+	if (vm_hole_split(proc, hole, addr, addr + arena_size)) {
+		log_error("Failed to split vm hole\n");
+		return 0;
+	}
+
+	arena = process_add_arena(proc, addr, addr + arena_size, true);
+	if (arena == NULL ||
+	    arena_add_hole(arena, addr + PAGE_SIZE, addr + arena_size)) {
+		log_error("Failed to add patch arena\n");
+		return 0;
+	}
+	log_debug("Reserved patch arena 0x%lx-0x%lx\n", arena->start,
+		  arena->end);
+
+	return arena_alloc(arena, memsize, align);
+}
+
+/* Whether addr is inside one of the object's vm areas */
+bool object_has_addr(struct object_file *obj, unsigned long addr)
+{
+	size_t i;
+
+	for (i = 0; i < obj->num_vmas; i++) {
+		if (addr >= obj->vmas[i].start && addr < obj->vmas[i].end) {
+			return true;
+		}
+	}
+
+	return false;
+}
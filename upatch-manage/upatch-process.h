@@ -21,14 +21,18 @@
 #ifndef __UPATCH_PROCESS__
 #define __UPATCH_PROCESS__
 
+#include <stdbool.h>
+
 #include <gelf.h>
 
 #include "list.h"
+#include "upatch-elf.h"
 #include "upatch-patch.h"
 
 #define OBJECT_UNKNOWN 0
 #define OBJECT_ELF 1
 #define OBJECT_UPATCH 2
+#define OBJECT_ARENA 3
 
 #define ELFMAG "\177ELF"
 #define SELFMAG 4
@@ -49,11 +53,10 @@ struct object_file {
 	/* Object name (as seen in /proc/<pid>/maps) */
 	char *name;
 
-	/* List of object's VM areas */
-	struct list_head vma;
-
-	/* Pointer to the previous hole in the patient's mapping */
-	struct vm_hole *previous_hole;
+	/* Object's VM areas, sorted by address */
+	struct vm_area *vmas;
+	size_t num_vmas;
+	size_t vmas_capacity;
 
 	/* Pointer to the applied patch list, if any */
 	struct list_head applied_patch;
@@ -74,15 +77,63 @@ struct vm_area {
 	unsigned int prot;
 };
 
+/* Area of the vma table, kept along with the maps text it was parsed from */
+struct maps_vma {
+	unsigned long start;
+	unsigned long end;
+	dev_t dev;
+	unsigned long inode;
+	unsigned int prot;
+	/* Offset & length of its line in the text, without the newline */
+	size_t line;
+	size_t line_len;
+};
+
 struct vm_hole {
 	unsigned long start;
 	unsigned long end;
-	struct list_head list;
 };
 
-struct obj_vm_area {
-	struct list_head list;
-	struct vm_area inmem;
+/*
+ * Patch arena, address space reserved near patched objects, patches are
+ * carved from it. It starts with a read-only header page, its free space
+ * stays PROT_NONE, thus it could be found again from process maps.
+ */
+#define UPATCH_ARENA_MAGIC "UPATCH_ARENA"
+#define UPATCH_ARENA_SIZE 0x1000000UL
+
+/* Header fits in one page, thus one read of process memory gets all of it */
+#define UPATCH_ARENA_MAX_PATCH 63
+
+/* Applied patch carved from the arena */
+struct upatch_arena_patch {
+	char id[UPATCH_ID_LEN + 1];
+	unsigned long start;
+	unsigned long end;
+};
+
+/*
+ * Patches applied within the arena are listed in its header, thus patch
+ * state of a process (and of its forked children) could be read without
+ * parsing its maps. Headers written by older versions list no patch.
+ */
+struct upatch_arena_header {
+	char magic[16];
+	unsigned long size;
+	unsigned int num_patches;
+	unsigned int reserved;
+	struct upatch_arena_patch patches[UPATCH_ARENA_MAX_PATCH];
+};
+
+struct upatch_arena {
+	unsigned long start;
+	unsigned long end;
+	/* Not mapped yet, it is created along with its first patch */
+	bool pending;
+	/* Free areas, sorted by address */
+	struct vm_hole *holes;
+	size_t num_holes;
+	size_t holes_capacity;
 };
 
 struct object_patch {
@@ -113,12 +164,39 @@ struct upatch_process {
 		struct list_head pctxs;
 	} ptrace;
 
+	/* Stacks of parked coroutines, see upatch-coro.h */
 	struct {
 		struct list_head coros;
+		size_t num;
+		/* Soft-dirty bits were cleared by the last prescan */
+		bool soft_dirty;
 	} coro;
 
-	/* List of free VMA areas */
-	struct list_head vmaholes;
+	/* cgroup v2 freezer, used instead of stopping every thread by ptrace */
+	struct {
+		int freeze_fd;
+		int events_fd;
+		bool frozen;
+	} freezer;
+
+	/* VMA table & text of the latest maps read, sorted by address */
+	struct maps_vma *maps;
+	size_t num_maps;
+	size_t maps_capacity;
+	char *maps_buf;
+
+	/* Free VMA areas, sorted by address */
+	struct vm_hole *holes;
+	size_t num_holes;
+	size_t holes_capacity;
+
+	/* Copy of remote GOT slots while resolving symbols, may be NULL */
+	struct upatch_mem_cache *mem_cache;
+
+	/* Patch arenas, found ones are sorted by address */
+	struct upatch_arena *arenas;
+	size_t num_arenas;
+	size_t arenas_capacity;
 
 	// TODO: other base?
 	/* libc's base address to use as a worksheet */
@@ -135,15 +213,66 @@ int upatch_process_mem_open(struct upatch_process *, int);
 
 int upatch_process_map_object_files(struct upatch_process *, const char *);
 
+/*
+ * Read maps again and update the vma table by the lines which changed,
+ * unchanged lines are not parsed at all. Holes covered by changed areas
+ * are trimmed, holes are never grown, so that reserved regions stay so.
+ * Objects are left as they were parsed.
+ */
+int upatch_process_refresh_maps(struct upatch_process *);
+
+int upatch_process_region_mapped(struct upatch_process *, unsigned long,
+				 unsigned long);
+
+int upatch_process_region_reserved(struct upatch_process *, unsigned long,
+				   unsigned long);
+
+/*
+ * Check whether the vma covering addr is backed by the file of the object,
+ * as the process is now. Returns 1 if so, 0 if not, negative value on failure.
+ */
+int upatch_process_addr_in_object(struct upatch_process *, unsigned long,
+				  const struct object_file *);
+
+void upatch_process_set_freezer(bool enable);
+
 int upatch_process_attach(struct upatch_process *);
 
+int upatch_process_freeze(struct upatch_process *);
+
+void upatch_process_thaw(struct upatch_process *);
+
+/*
+ * Let all stopped threads run, then stop the whole process again, used to
+ * wait for threads to leave some code within one attach.
+ */
+void upatch_process_release(struct upatch_process *proc);
+
+int upatch_process_restop(struct upatch_process *proc);
+
+/* Detach all threads but the one for remote syscalls, before final cleanup */
+void upatch_process_release_others(struct upatch_process *proc);
+
+/* Returns the number of threads, or -1 on failure */
+int upatch_process_list_threads(struct upatch_process *proc, int **pids,
+				size_t *npids, size_t *alloc);
+
 void upatch_process_detach(struct upatch_process *proc);
 
-int vm_hole_split(struct vm_hole *, unsigned long, unsigned long);
+int vm_hole_split(struct upatch_process *, struct vm_hole *, unsigned long,
+		  unsigned long);
 
 unsigned long object_find_patch_region(struct object_file *, size_t,
-				       struct vm_hole **);
+				       unsigned long, struct vm_hole **);
 unsigned long object_find_patch_region_nolimit(struct object_file *, size_t,
 				       struct vm_hole **);
 
+bool object_has_addr(struct object_file *, unsigned long);
+
+struct upatch_arena *upatch_process_find_arena(struct upatch_process *,
+					       unsigned long, unsigned long);
+
+unsigned long object_alloc_arena_region(struct object_file *, size_t,
+					unsigned long);
+
 #endif
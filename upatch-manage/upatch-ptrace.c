@@ -18,7 +18,10 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,10 +29,13 @@
 
 #include <asm/unistd.h>
 #include <sys/ptrace.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include "upatch-common.h"
+#include "upatch-probe.h"
 #include "upatch-ptrace.h"
+#include "upatch-timing.h"
 
 /* process's memory access */
 int upatch_process_mem_read(struct upatch_process *proc, unsigned long src,
@@ -79,15 +85,435 @@ int upatch_process_mem_write(struct upatch_process *proc, void *src,
 	static int use_pwrite = 1;
 	ssize_t w;
 
+	UPATCH_PROBE(mem_write, proc->pid, dst, size);
 	if (use_pwrite) {
 		w = pwrite(proc->memfd, src, size, (off_t)dst);
 	}
 	if (!use_pwrite || (w == -1 && errno == EINVAL)) {
 		use_pwrite = 0;
-		return upatch_process_mem_write_ptrace(proc, src, dst, size);
+		if (upatch_process_mem_write_ptrace(proc, src, dst, size)) {
+			return -1;
+		}
+		upatch_timing_count(COUNTER_MEM_WRITTEN, size);
+		return 0;
+	}
+	if (w != size) {
+		return -1;
+	}
+
+	upatch_timing_count(COUNTER_MEM_WRITTEN, size);
+	return 0;
+}
+
+#define MEM_BATCH_MIN_CAPACITY 16
+
+void upatch_mem_batch_init(struct upatch_mem_batch *batch,
+	struct upatch_process *proc)
+{
+	memset(batch, 0, sizeof(struct upatch_mem_batch));
+	batch->proc = proc;
+}
+
+int upatch_mem_batch_add(struct upatch_mem_batch *batch, void *src,
+	unsigned long dst, size_t size)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	if (batch->num == batch->capacity) {
+		size_t capacity = batch->capacity ?
+			batch->capacity * 2 : MEM_BATCH_MIN_CAPACITY;
+		struct upatch_mem_write *writes = realloc(batch->writes,
+			capacity * sizeof(struct upatch_mem_write));
+		if (writes == NULL) {
+			return -ENOMEM;
+		}
+		batch->writes = writes;
+		batch->capacity = capacity;
+	}
+
+	batch->writes[batch->num].src = src;
+	batch->writes[batch->num].dst = dst;
+	batch->writes[batch->num].size = size;
+	batch->num++;
+
+	return 0;
+}
+
+static size_t mem_batch_size(struct upatch_mem_batch *batch)
+{
+	size_t total = 0;
+
+	for (size_t i = 0; i < batch->num; i++) {
+		total += batch->writes[i].size;
+	}
+	return total;
+}
+
+/*
+ * Write the whole batch with process_vm_writev(), which does not work on
+ * read-only mappings (eg. patched text), thus it may fail partially.
+ */
+static int mem_batch_flush_vm(struct upatch_mem_batch *batch,
+	struct iovec *local, struct iovec *remote)
+{
+	size_t i = 0;
+
+	while (i < batch->num) {
+		size_t count = 0;
+		size_t expected = 0;
+		ssize_t w;
+
+		for (; (i + count < batch->num) && (count < IOV_MAX); count++) {
+			struct upatch_mem_write *write = &batch->writes[i + count];
+
+			local[count].iov_base = write->src;
+			local[count].iov_len = write->size;
+			remote[count].iov_base = (void *)write->dst;
+			remote[count].iov_len = write->size;
+			expected += write->size;
+		}
+
+		w = process_vm_writev(batch->proc->pid, local, count,
+			remote, count, 0);
+		if (w < 0) {
+			return -1;
+		}
+		if ((size_t)w != expected) {
+			errno = EIO;
+			return -1;
+		}
+		i += count;
+	}
+
+	return 0;
+}
+
+/*
+ * Write via /proc/<pid>/mem, which ignores page protection. Consecutive
+ * writes to adjacent addresses are merged into a single pwritev().
+ */
+static int mem_batch_flush_pwrite(struct upatch_mem_batch *batch,
+	struct iovec *local)
+{
+	size_t i = 0;
+
+	while (i < batch->num) {
+		unsigned long start = batch->writes[i].dst;
+		unsigned long next = start;
+		size_t count = 0;
+		ssize_t w;
+
+		for (; (i + count < batch->num) && (count < IOV_MAX); count++) {
+			struct upatch_mem_write *write = &batch->writes[i + count];
+
+			if (write->dst != next) {
+				break;
+			}
+			local[count].iov_base = write->src;
+			local[count].iov_len = write->size;
+			next += write->size;
+		}
+
+		w = pwritev(batch->proc->memfd, local, count, (off_t)start);
+		if (w < 0) {
+			return -1;
+		}
+		if ((size_t)w != next - start) {
+			errno = EIO;
+			return -1;
+		}
+		i += count;
+	}
+
+	return 0;
+}
+
+int upatch_mem_batch_flush(struct upatch_mem_batch *batch)
+{
+	static int use_vm_writev = 1;
+	static int use_pwrite = 1;
+	size_t iov_num = (batch->num < IOV_MAX) ? batch->num : IOV_MAX;
+	struct iovec *local = NULL;
+	struct iovec *remote = NULL;
+	int ret = 0;
+
+	if (batch->num == 0) {
+		return 0;
+	}
+
+	UPATCH_PROBE(mem_flush_start, batch->proc->pid, batch->num,
+		mem_batch_size(batch));
+	local = calloc(iov_num, sizeof(struct iovec));
+	remote = calloc(iov_num, sizeof(struct iovec));
+	if ((local == NULL) || (remote == NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	log_debug("Flush %zu remote write(s), %zu bytes\n",
+		batch->num, mem_batch_size(batch));
+
+	if (use_vm_writev) {
+		if (mem_batch_flush_vm(batch, local, remote) == 0) {
+			goto out;
+		}
+		if (errno == ENOSYS || errno == EPERM) {
+			use_vm_writev = 0;
+		}
+	}
+
+	/* Rewriting the part already done by process_vm_writev is harmless */
+	if (use_pwrite) {
+		if (mem_batch_flush_pwrite(batch, local) == 0) {
+			goto out;
+		}
+		if (errno != EINVAL) {
+			ret = -1;
+			goto out;
+		}
+		use_pwrite = 0;
+	}
+
+	for (size_t i = 0; i < batch->num; i++) {
+		struct upatch_mem_write *write = &batch->writes[i];
+
+		ret = upatch_process_mem_write_ptrace(batch->proc, write->src,
+			write->dst, write->size);
+		if (ret) {
+			break;
+		}
+	}
+
+out:
+	UPATCH_PROBE(mem_flush_end, batch->proc->pid, ret);
+	free(local);
+	free(remote);
+	if (ret == 0) {
+		upatch_timing_count(COUNTER_MEM_WRITTEN, mem_batch_size(batch));
+		batch->num = 0;
+	}
+	return ret;
+}
+
+void upatch_mem_batch_destroy(struct upatch_mem_batch *batch)
+{
+	free(batch->writes);
+	memset(batch, 0, sizeof(struct upatch_mem_batch));
+}
+
+#define MEM_CACHE_MAX_SIZE (4UL << 20)
+
+void upatch_mem_cache_init(struct upatch_mem_cache *cache,
+	struct upatch_process *proc)
+{
+	memset(cache, 0, sizeof(struct upatch_mem_cache));
+	cache->proc = proc;
+}
+
+int upatch_mem_cache_add(struct upatch_mem_cache *cache, unsigned long addr,
+	size_t size)
+{
+	unsigned long start = ROUND_DOWN(addr, PAGE_SIZE);
+	unsigned long end = ROUND_UP(addr + size, PAGE_SIZE);
+
+	if ((size == 0) || (end - start > MEM_CACHE_MAX_SIZE)) {
+		return 0;
+	}
+
+	if (cache->num == cache->capacity) {
+		size_t capacity = cache->capacity ?
+			cache->capacity * 2 : MEM_BATCH_MIN_CAPACITY;
+		struct upatch_mem_range *ranges = realloc(cache->ranges,
+			capacity * sizeof(struct upatch_mem_range));
+		if (ranges == NULL) {
+			return -ENOMEM;
+		}
+		cache->ranges = ranges;
+		cache->capacity = capacity;
+	}
+
+	cache->ranges[cache->num].start = start;
+	cache->ranges[cache->num].size = end - start;
+	cache->ranges[cache->num].data = NULL;
+	cache->num++;
+
+	return 0;
+}
+
+static int mem_range_cmp(const void *a, const void *b)
+{
+	const struct upatch_mem_range *ra = a;
+	const struct upatch_mem_range *rb = b;
+
+	if (ra->start == rb->start) {
+		return 0;
+	}
+	return (ra->start < rb->start) ? -1 : 1;
+}
+
+/* Sort ranges and merge overlapping or adjacent ones, returns total size */
+static size_t mem_cache_merge(struct upatch_mem_cache *cache)
+{
+	size_t total = 0;
+	size_t n = 0;
+
+	qsort(cache->ranges, cache->num, sizeof(struct upatch_mem_range),
+		mem_range_cmp);
+	for (size_t i = 0; i < cache->num; i++) {
+		struct upatch_mem_range *range = &cache->ranges[i];
+
+		if ((n > 0) && (range->start <= cache->ranges[n - 1].start +
+			cache->ranges[n - 1].size)) {
+			struct upatch_mem_range *last = &cache->ranges[n - 1];
+			unsigned long end = range->start + range->size;
+
+			if (end > last->start + last->size) {
+				total += end - (last->start + last->size);
+				last->size = end - last->start;
+			}
+			continue;
+		}
+		cache->ranges[n++] = *range;
+		total += range->size;
+	}
+	cache->num = n;
+
+	return total;
+}
+
+/*
+ * Read all ranges by process_vm_readv(), which stops at the first range
+ * that cannot be read. Returns the number of ranges fully read.
+ */
+static size_t mem_cache_fetch_vm(struct upatch_mem_cache *cache,
+	struct iovec *local, struct iovec *remote)
+{
+	static int use_vm_readv = 1;
+	size_t i = 0;
+
+	while (use_vm_readv && (i < cache->num)) {
+		size_t count = 0;
+		ssize_t r;
+
+		for (; (i + count < cache->num) && (count < IOV_MAX); count++) {
+			struct upatch_mem_range *range = &cache->ranges[i + count];
+
+			local[count].iov_base = range->data;
+			local[count].iov_len = range->size;
+			remote[count].iov_base = (void *)range->start;
+			remote[count].iov_len = range->size;
+		}
+
+		r = process_vm_readv(cache->proc->pid, local, count,
+			remote, count, 0);
+		if (r < 0) {
+			if (errno == ENOSYS || errno == EPERM) {
+				use_vm_readv = 0;
+			}
+			break;
+		}
+		for (size_t j = 0; j < count; j++) {
+			if ((size_t)r < local[j].iov_len) {
+				return i + j;
+			}
+			r -= (ssize_t)local[j].iov_len;
+		}
+		i += count;
 	}
 
-	return w != size ? -1 : 0;
+	return i;
+}
+
+int upatch_mem_cache_fetch(struct upatch_mem_cache *cache)
+{
+	size_t iov_num;
+	struct iovec *local = NULL;
+	struct iovec *remote = NULL;
+	size_t total;
+	size_t done;
+	char *data;
+
+	if (cache->num == 0) {
+		return 0;
+	}
+
+	total = mem_cache_merge(cache);
+	iov_num = (cache->num < IOV_MAX) ? cache->num : IOV_MAX;
+	cache->buff = malloc(total);
+	local = calloc(iov_num, sizeof(struct iovec));
+	remote = calloc(iov_num, sizeof(struct iovec));
+	if ((cache->buff == NULL) || (local == NULL) || (remote == NULL)) {
+		free(local);
+		free(remote);
+		upatch_mem_cache_destroy(cache);
+		return -ENOMEM;
+	}
+
+	data = cache->buff;
+	for (size_t i = 0; i < cache->num; i++) {
+		cache->ranges[i].data = data;
+		data += cache->ranges[i].size;
+	}
+
+	log_debug("Fetch %zu remote range(s), %zu bytes\n", cache->num, total);
+	done = mem_cache_fetch_vm(cache, local, remote);
+
+	/* Ranges unreadable by both ways are dropped, reads fall back */
+	for (size_t i = done; i < cache->num; i++) {
+		struct upatch_mem_range *range = &cache->ranges[i];
+
+		if (upatch_process_mem_read(cache->proc, range->start,
+			range->data, range->size)) {
+			range->size = 0;
+		}
+	}
+
+	free(local);
+	free(remote);
+	return 0;
+}
+
+int upatch_process_mem_read_cached(struct upatch_process *proc,
+	unsigned long src, void *dst, size_t size)
+{
+	struct upatch_mem_cache *cache = proc->mem_cache;
+	size_t lo = 0;
+	size_t hi = 0;
+
+	if ((cache != NULL) && (cache->buff != NULL)) {
+		hi = cache->num;
+	}
+
+	/* Find the last range starting at or before src */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cache->ranges[mid].start <= src) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo > 0) {
+		struct upatch_mem_range *range = &cache->ranges[lo - 1];
+		unsigned long offset = src - range->start;
+
+		if ((offset <= range->size) && (size <= range->size - offset)) {
+			memcpy(dst, (char *)range->data + offset, size);
+			return 0;
+		}
+	}
+
+	return upatch_process_mem_read(proc, src, dst, size);
+}
+
+void upatch_mem_cache_destroy(struct upatch_mem_cache *cache)
+{
+	free(cache->ranges);
+	free(cache->buff);
+	memset(cache, 0, sizeof(struct upatch_mem_cache));
 }
 
 static struct upatch_ptrace_ctx* upatch_ptrace_ctx_alloc(
@@ -112,7 +538,17 @@ static struct upatch_ptrace_ctx* upatch_ptrace_ctx_alloc(
 	return p;
 }
 
-int upatch_ptrace_attach_thread(struct upatch_process *proc, int tid)
+static void upatch_ptrace_ctx_free(struct upatch_ptrace_ctx *pctx)
+{
+	list_del(&pctx->list);
+	free(pctx);
+}
+
+/*
+ * Only request the thread to stop, stops of all threads are reaped
+ * together by upatch_ptrace_wait_threads()
+ */
+int upatch_ptrace_seize_thread(struct upatch_process *proc, int tid)
 {
 	struct upatch_ptrace_ctx *pctx = upatch_ptrace_ctx_alloc(proc);
 	if (pctx == NULL) {
@@ -121,48 +557,94 @@ int upatch_ptrace_attach_thread(struct upatch_process *proc, int tid)
 	}
 
 	pctx->pid = tid;
-	log_debug("Attaching to %d...", tid);
+	log_debug("Seizing %d...\n", tid);
+	UPATCH_PROBE(attach_start, proc->pid, tid);
 
-	long ret = ptrace(PTRACE_ATTACH, tid, NULL, NULL);
+	long ret = ptrace(PTRACE_SEIZE, tid, NULL, NULL);
 	if (ret < 0) {
-		log_error("Failed to attach thread, pid=%d, ret=%ld\n", tid, ret);
+		int err = errno;
+
+		upatch_ptrace_ctx_free(pctx);
+		if (err == ESRCH) {
+			log_debug("Thread %d exited before seizing\n", tid);
+			UPATCH_PROBE(attach_end, proc->pid, tid, 1);
+			return 0;
+		}
+		UPATCH_PROBE(attach_end, proc->pid, tid, -1);
+		log_error("Failed to seize thread, tid=%d, ret=%ld\n", tid, ret);
 		return -1;
 	}
 
-	do {
-		int status = 0;
+	/* Failure means the thread is exiting, its exit would be reaped */
+	ret = ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+	if (ret < 0) {
+		log_debug("Failed to interrupt thread, tid=%d, ret=%ld\n", tid, ret);
+	}
 
-		ret = waitpid(tid, &status, __WALL);
+	return 0;
+}
+
+static int upatch_ptrace_wait_interrupt(struct upatch_ptrace_ctx *pctx)
+{
+	while (1) {
+		int status = 0;
+		int ret = waitpid(pctx->pid, &status, __WALL);
 		if (ret < 0) {
-			log_error("Failed to wait thread, tid=%d, ret=%ld\n", tid, ret);
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("Failed to wait thread, tid=%d, ret=%d\n", pctx->pid, ret);
 			return -1;
 		}
 
-		/* We are expecting SIGSTOP */
-		if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP) {
-			break;
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			return 1;
+		}
+		if (!WIFSTOPPED(status)) {
+			continue;
 		}
 
-		/* If we got SIGTRAP because we just got out of execve, wait
-		 * for the SIGSTOP
-		 */
-		if (WIFSTOPPED(status)) {
-			status = (WSTOPSIG(status) == SIGTRAP) ? 0 : WSTOPSIG(status);
-		} else if (WIFSIGNALED(status)) {
-			/* Resend signal */
-			status = WTERMSIG(status);
+		/* Interrupt or group stop */
+		if ((status >> 16) == PTRACE_EVENT_STOP) {
+			return 0;
 		}
 
-		ret = ptrace(PTRACE_CONT, tid, NULL, (void *)(uintptr_t)status);
+		/* Signal came before the interrupt, deliver it and wait again */
+		status = WSTOPSIG(status);
+		ret = ptrace(PTRACE_CONT, pctx->pid, NULL, (void *)(uintptr_t)status);
 		if (ret < 0) {
-			log_error("Failed to continue thread, tid=%d, ret=%ld\n", tid, ret);
+			log_error("Failed to continue thread, tid=%d, ret=%d\n", pctx->pid, ret);
 			return -1;
 		}
-	} while (1);
+	}
+}
 
-	pctx->running = 0;
+/*
+ * All seized threads were interrupted already, thus waiting them one by one
+ * costs no more than the slowest thread to stop.
+ */
+int upatch_ptrace_wait_threads(struct upatch_process *proc)
+{
+	struct upatch_ptrace_ctx *pctx, *tmp;
+
+	list_for_each_entry_safe(pctx, tmp, &proc->ptrace.pctxs, list) {
+		if (!pctx->running) {
+			continue;
+		}
+
+		int ret = upatch_ptrace_wait_interrupt(pctx);
+		UPATCH_PROBE(attach_end, proc->pid, pctx->pid, ret);
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret > 0) {
+			log_debug("Thread %d exited before stopping\n", pctx->pid);
+			upatch_ptrace_ctx_free(pctx);
+			continue;
+		}
+		pctx->running = 0;
+	}
 
-	log_debug("OK\n");
 	return 0;
 }
 
@@ -225,6 +707,40 @@ int upatch_execute_remote(struct upatch_ptrace_ctx *pctx,
 		pctx, code, codelen, pregs, wait_for_stop, NULL);
 }
 
+int upatch_syscall_remote_batch(struct upatch_ptrace_ctx *pctx,
+	struct upatch_remote_syscall *calls, size_t num)
+{
+	size_t i;
+	int ret;
+
+	if (num == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < num; i++) {
+		calls[i].res = (unsigned long)-ECANCELED;
+	}
+
+	log_debug("Executing %zu syscalls (pid %d)...\n", num, pctx->pid);
+	upatch_timing_count(COUNTER_REMOTE_SYSCALL, num);
+	ret = upatch_arch_syscall_remote_batch(pctx, calls, num);
+	for (i = 0; i < num; i++) {
+		UPATCH_PROBE(remote_syscall, pctx->pid, calls[i].nr, ret,
+			calls[i].res);
+	}
+	if (ret < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (calls[i].res >= (unsigned long)-MAX_ERRNO) {
+			errno = -(long)calls[i].res;
+			return -1;
+		}
+	}
+	return 0;
+}
+
 unsigned long upatch_mmap_remote(struct upatch_ptrace_ctx *pctx,
 	unsigned long addr, size_t length, int prot,
 	int flags, int fd, off_t offset)
@@ -234,8 +750,10 @@ unsigned long upatch_mmap_remote(struct upatch_ptrace_ctx *pctx,
 
 	log_debug("mmap_remote: 0x%lx+%lx, %x, %x, %d, %lx\n", addr, length,
 		  prot, flags, fd, offset);
+	upatch_timing_count(COUNTER_REMOTE_SYSCALL, 1);
 	ret = upatch_arch_syscall_remote(pctx, __NR_mmap, (unsigned long)addr,
 					 length, prot, flags, fd, offset, &res);
+	UPATCH_PROBE(remote_syscall, pctx->pid, __NR_mmap, ret, res);
 	if (ret < 0) {
 		return 0;
 	}
@@ -250,12 +768,36 @@ int upatch_mprotect_remote(struct upatch_ptrace_ctx *pctx, unsigned long addr,
 	size_t length, int prot)
 {
 	int ret;
-	unsigned long res;
+	unsigned long res = 0;
 
 	log_debug("mprotect_remote: 0x%lx+%lx\n", addr, length);
+	upatch_timing_count(COUNTER_REMOTE_SYSCALL, 1);
 	ret = upatch_arch_syscall_remote(pctx, __NR_mprotect,
 					 (unsigned long)addr, length, prot, 0,
 					 0, 0, &res);
+	UPATCH_PROBE(remote_syscall, pctx->pid, __NR_mprotect, ret, res);
+	if (ret < 0)
+		return -1;
+	if (ret == 0 && res >= (unsigned long)-MAX_ERRNO) {
+		errno = -(long)res;
+		return -1;
+	}
+
+	return 0;
+}
+
+int upatch_madvise_remote(struct upatch_ptrace_ctx *pctx, unsigned long addr,
+	size_t length, int advice)
+{
+	int ret;
+	unsigned long res = 0;
+
+	log_debug("madvise_remote: 0x%lx+%lx, advice=%d\n", addr, length, advice);
+	upatch_timing_count(COUNTER_REMOTE_SYSCALL, 1);
+	ret = upatch_arch_syscall_remote(pctx, __NR_madvise,
+					 (unsigned long)addr, length, advice, 0,
+					 0, 0, &res);
+	UPATCH_PROBE(remote_syscall, pctx->pid, __NR_madvise, ret, res);
 	if (ret < 0)
 		return -1;
 	if (ret == 0 && res >= (unsigned long)-MAX_ERRNO) {
@@ -270,11 +812,13 @@ int upatch_munmap_remote(struct upatch_ptrace_ctx *pctx, unsigned long addr,
 	size_t length)
 {
 	int ret;
-	unsigned long res;
+	unsigned long res = 0;
 
 	log_debug("munmap_remote: 0x%lx+%lx\n", addr, length);
+	upatch_timing_count(COUNTER_REMOTE_SYSCALL, 1);
 	ret = upatch_arch_syscall_remote(pctx, __NR_munmap, (unsigned long)addr,
 					 length, 0, 0, 0, 0, &res);
+	UPATCH_PROBE(remote_syscall, pctx->pid, __NR_munmap, ret, res);
 	if (ret < 0)
 		return -1;
 	if (ret == 0 && res >= (unsigned long)-MAX_ERRNO) {
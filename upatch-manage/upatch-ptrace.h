@@ -46,7 +46,66 @@ int upatch_process_mem_read(struct upatch_process *proc, unsigned long src,
 int upatch_process_mem_write(struct upatch_process *, void *, unsigned long,
 			     size_t);
 
-int upatch_ptrace_attach_thread(struct upatch_process *, int);
+struct upatch_mem_write {
+	void *src;
+	unsigned long dst;
+	size_t size;
+};
+
+/*
+ * Pending remote writes, flushed together to save syscalls.
+ * Sources must stay valid until the batch is flushed.
+ */
+struct upatch_mem_batch {
+	struct upatch_process *proc;
+	struct upatch_mem_write *writes;
+	size_t num;
+	size_t capacity;
+};
+
+void upatch_mem_batch_init(struct upatch_mem_batch *, struct upatch_process *);
+
+int upatch_mem_batch_add(struct upatch_mem_batch *, void *, unsigned long,
+			 size_t);
+
+int upatch_mem_batch_flush(struct upatch_mem_batch *);
+
+void upatch_mem_batch_destroy(struct upatch_mem_batch *);
+
+struct upatch_mem_range {
+	unsigned long start;
+	size_t size;
+	void *data;
+};
+
+/*
+ * Local copy of remote ranges, recorded first then fetched together.
+ * Assumes the memory does not change while the copy is used.
+ */
+struct upatch_mem_cache {
+	struct upatch_process *proc;
+	struct upatch_mem_range *ranges;
+	size_t num;
+	size_t capacity;
+	void *buff;
+};
+
+void upatch_mem_cache_init(struct upatch_mem_cache *, struct upatch_process *);
+
+/* Record a range, whole pages around it are fetched */
+int upatch_mem_cache_add(struct upatch_mem_cache *, unsigned long, size_t);
+
+int upatch_mem_cache_fetch(struct upatch_mem_cache *);
+
+void upatch_mem_cache_destroy(struct upatch_mem_cache *);
+
+/* Read from proc->mem_cache if the range is cached, otherwise from memfd */
+int upatch_process_mem_read_cached(struct upatch_process *, unsigned long,
+				   void *, size_t);
+
+int upatch_ptrace_seize_thread(struct upatch_process *, int);
+
+int upatch_ptrace_wait_threads(struct upatch_process *);
 
 int upatch_ptrace_detach(struct upatch_ptrace_ctx *);
 
@@ -65,6 +124,26 @@ int upatch_arch_syscall_remote(struct upatch_ptrace_ctx *, int, unsigned long,
 			       unsigned long, unsigned long, unsigned long,
 			       unsigned long, unsigned long, unsigned long *);
 
+/*
+ * One entry of a remote syscall batch, the layout is shared with the
+ * injected stub, so keep it as 8 words.
+ */
+struct upatch_remote_syscall {
+	unsigned long nr;
+	unsigned long args[6];
+	unsigned long res;
+};
+
+int upatch_arch_syscall_remote_batch(struct upatch_ptrace_ctx *,
+				     struct upatch_remote_syscall *, size_t);
+
+/*
+ * Execute syscalls in order by a single injection, stops at the first
+ * failed one. Entries not executed are left with -ECANCELED.
+ */
+int upatch_syscall_remote_batch(struct upatch_ptrace_ctx *,
+				struct upatch_remote_syscall *, size_t);
+
 unsigned long upatch_mmap_remote(struct upatch_ptrace_ctx *, unsigned long,
 				 size_t, int, int, int, off_t);
 
@@ -73,12 +152,16 @@ int upatch_mprotect_remote(struct upatch_ptrace_ctx *, unsigned long, size_t,
 
 int upatch_munmap_remote(struct upatch_ptrace_ctx *, unsigned long, size_t);
 
+int upatch_madvise_remote(struct upatch_ptrace_ctx *, unsigned long, size_t,
+			  int);
+
 int upatch_execute_remote(struct upatch_ptrace_ctx *, const unsigned char *,
 			  size_t, struct user_regs_struct *);
 
 size_t get_origin_insn_len();
 size_t get_upatch_insn_len();
 size_t get_upatch_addr_len();
+size_t get_upatch_jmp_len(unsigned long, unsigned long);
 unsigned long get_new_insn(struct object_file *, unsigned long, unsigned long);
 
 #endif
@@ -22,6 +22,7 @@
 #include <errno.h>
 
 #include "log.h"
+#include "upatch-probe.h"
 
 int apply_relocations(struct upatch_elf *uelf)
 {
@@ -46,7 +47,10 @@ int apply_relocations(struct upatch_elf *uelf)
 		if (uelf->info.shdrs[i].sh_type == SHT_REL) {
 			return -EPERM;
 		} else if (uelf->info.shdrs[i].sh_type == SHT_RELA) {
+			UPATCH_PROBE(relocate_start, name,
+				uelf->info.shdrs[i].sh_size / sizeof(GElf_Rela));
 			err = apply_relocate_add(uelf, uelf->index.sym, i);
+			UPATCH_PROBE(relocate_end, name, err);
 		}
 
 		if (err < 0)
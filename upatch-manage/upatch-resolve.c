@@ -19,15 +19,47 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "log.h"
 #include "upatch-common.h"
 #include "upatch-elf.h"
+#include "upatch-ptrace.h"
 #include "upatch-resolve.h"
 
+static bool use_direct_bind;
+
+void upatch_resolve_set_direct_bind(bool enable)
+{
+    use_direct_bind = enable;
+}
+
+unsigned long resolve_direct_target(struct upatch_elf *uelf, unsigned long addr)
+{
+    if (!use_direct_bind) {
+        return 0;
+    }
+    return get_jmp_table_target(uelf, addr);
+}
+
+/* Find first '.rela.dyn' entry without symbol whose addend matches */
+static long find_rela_dyn_nosym(struct running_elf *relf, GElf_Rela *rela_dyn,
+    GElf_Sym *patch_sym)
+{
+    for (unsigned int i = 0; i < relf->num_rela_dyn_nosym; i++) {
+        unsigned int idx = relf->rela_dyn_nosym[i];
+        if (rela_dyn[idx].r_addend == patch_sym->st_value) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
 static unsigned long resolve_rela_dyn(struct upatch_elf *uelf,
-    struct object_file *obj, const char *name, GElf_Sym *patch_sym)
+    struct object_file *obj, const char *name, GElf_Sym *patch_sym,
+    struct upatch_plan_entry *entry)
 {
     unsigned long elf_addr = 0;
     struct running_elf *relf = uelf->relf;
@@ -36,53 +68,39 @@ static unsigned long resolve_rela_dyn(struct upatch_elf *uelf,
         return 0;
     }
 
-    GElf_Shdr *dynsym_shdr = &relf->info.shdrs[relf->index.dynsym];
     GElf_Shdr *rela_dyn_shdr = &relf->info.shdrs[relf->index.rela_dyn];
-
-    GElf_Sym *dynsym = (void *)relf->info.hdr + dynsym_shdr->sh_offset;
     GElf_Rela *rela_dyn = (void *)relf->info.hdr + rela_dyn_shdr->sh_offset;
 
-    for (Elf64_Xword i = 0; i < rela_dyn_shdr->sh_size / sizeof(GElf_Rela); i++) {
-        unsigned long sym_idx = GELF_R_SYM(rela_dyn[i].r_info);
+    /* function could also be part of the GOT with the type R_X86_64_GLOB_DAT */
+    long i = symbol_hash_find(&relf->rela_dyn_hash, name);
 
-        if (sym_idx == 0) {
-            /*
-             * some rela don't have the symbol index, use the symbol's value and
-             * rela's addend to find the symbol. for example, R_X86_64_IRELATIVE.
-             */
-            if (rela_dyn[i].r_addend != patch_sym->st_value) {
-                continue;
-            }
-        }
-        else {
-            char *sym_name = relf->dynstrtab + dynsym[sym_idx].st_name;
-            char *sym_splitter = NULL;
-
-            /* strip symbol version if exists */
-            sym_splitter = strchr(sym_name, '@');
-            if (sym_splitter != NULL) {
-                *sym_splitter = '\0';
-            }
+    /*
+     * some rela don't have the symbol index, use the symbol's value and
+     * rela's addend to find the symbol. for example, R_X86_64_IRELATIVE.
+     */
+    long nosym_idx = find_rela_dyn_nosym(relf, rela_dyn, patch_sym);
+    if (nosym_idx >= 0 && (i < 0 || nosym_idx < i)) {
+        i = nosym_idx;
+    }
 
-            /* function could also be part of the GOT with the type R_X86_64_GLOB_DAT */
-            if (!streql(sym_name, name)) {
-                continue;
-            }
-        }
+    if (i < 0) {
+        return 0;
+    }
 
-        /* r_offset is virtual address of GOT table */
-        unsigned long sym_addr = relf->load_bias + rela_dyn[i].r_offset;
-        elf_addr = insert_got_table(uelf, obj, GELF_R_TYPE(rela_dyn[i].r_info), sym_addr);
+    /* r_offset is virtual address of GOT table */
+    unsigned long sym_addr = relf->load_bias + rela_dyn[i].r_offset;
+    elf_addr = insert_got_table(uelf, obj, GELF_R_TYPE(rela_dyn[i].r_info), sym_addr);
+    *entry = (struct upatch_plan_entry){ PLAN_GOT,
+        GELF_R_TYPE(rela_dyn[i].r_info), rela_dyn[i].r_offset };
 
-        log_debug("resolved %s from .rela_dyn at 0x%lx\n", name, elf_addr);
-        break;
-    }
+    log_debug("resolved %s from .rela_dyn at 0x%lx\n", name, elf_addr);
 
     return elf_addr;
 }
 
 static unsigned long resolve_rela_plt(struct upatch_elf *uelf,
-    struct object_file *obj, const char *name, GElf_Sym *patch_sym)
+    struct object_file *obj, const char *name, GElf_Sym *patch_sym,
+    struct upatch_plan_entry *entry)
 {
     unsigned long elf_addr = 0;
     struct running_elf *relf = uelf->relf;
@@ -91,59 +109,52 @@ static unsigned long resolve_rela_plt(struct upatch_elf *uelf,
         return 0;
     }
 
-    GElf_Shdr *dynsym_shdr = &relf->info.shdrs[relf->index.dynsym];
     GElf_Shdr *rela_plt_shdr = &relf->info.shdrs[relf->index.rela_plt];
-
-    GElf_Sym *dynsym = (void *)relf->info.hdr + dynsym_shdr->sh_offset;
     GElf_Rela *rela_plt = (void *)relf->info.hdr + rela_plt_shdr->sh_offset;
 
-    for (Elf64_Xword i = 0; i < rela_plt_shdr->sh_size / sizeof(GElf_Rela); i++) {
-        unsigned long sym_idx = GELF_R_SYM(rela_plt[i].r_info);
-        unsigned long sym_type = GELF_ST_TYPE(dynsym[sym_idx].st_info);
-
-        if (sym_type != STT_FUNC && sym_type != STT_TLS) {
-            continue;
-        }
+    long i = symbol_hash_find(&relf->rela_plt_hash, name);
+    if (i < 0) {
+        return 0;
+    }
 
-        if (sym_idx == 0) {
-            /*
-             * some rela don't have the symbol index, use the symbol's value and
-             * rela's addend to find the symbol. for example, R_X86_64_IRELATIVE.
-             */
-            if (rela_plt[i].r_addend != patch_sym->st_value) {
-                continue;
-            }
-        } else {
-            char *sym_name = relf->dynstrtab + dynsym[sym_idx].st_name;
-            char *sym_splitter = NULL;
-
-            /* strip symbol version if exists */
-            sym_splitter = strchr(sym_name, '@');
-            if (sym_splitter != NULL) {
-                *sym_splitter = '\0';
-            }
+    /* r_offset is virtual address of PLT table */
+    unsigned long sym_addr = relf->load_bias + rela_plt[i].r_offset;
+    elf_addr = insert_plt_table(uelf, obj, GELF_R_TYPE(rela_plt[i].r_info), sym_addr);
+    *entry = (struct upatch_plan_entry){ PLAN_PLT,
+        GELF_R_TYPE(rela_plt[i].r_info), rela_plt[i].r_offset };
 
-            if (!streql(sym_name, name)) {
-                continue;
-            }
-        }
+    log_debug("Resolved '%s' from '.rela_plt' at 0x%lx\n", name, elf_addr);
 
-        /* r_offset is virtual address of PLT table */
-        unsigned long sym_addr = relf->load_bias + rela_plt[i].r_offset;
-        elf_addr = insert_plt_table(uelf, obj, GELF_R_TYPE(rela_plt[i].r_info), sym_addr);
+    return elf_addr;
+}
 
-        log_debug("Resolved '%s' from '.rela_plt' at 0x%lx\n", name, elf_addr);
-        break;
+/*
+ * '.gnu.hash' leaves out undefined symbols, some of which still have an
+ * address (eg. canonical PLT entries of an executable), and is only as
+ * good as the linker made it. Its misses are looked up by the linear scan
+ * it replaced.
+ */
+static long scan_dynsym(struct running_elf *relf, GElf_Sym *dynsym,
+    Elf64_Xword num, const char *name)
+{
+    for (Elf64_Xword i = 0; i < num; i++) {
+        if (dynsym[i].st_value == 0) {
+            continue;
+        }
+        if (symbol_name_eq(relf->dynstrtab + dynsym[i].st_name, name)) {
+            return (long)i;
+        }
     }
-
-    return elf_addr;
+    return -1;
 }
 
 static unsigned long resolve_dynsym(struct upatch_elf *uelf,
-    struct object_file *obj, const char *name, GElf_Sym *patch_sym)
+    struct object_file *obj, const char *name, GElf_Sym *patch_sym,
+    struct upatch_plan_entry *entry)
 {
     unsigned long elf_addr = 0;
     struct running_elf *relf = uelf->relf;
+    long i;
 
     if (!relf || !relf->index.dynsym) {
         return 0;
@@ -152,34 +163,32 @@ static unsigned long resolve_dynsym(struct upatch_elf *uelf,
     GElf_Shdr *dynsym_shdr = &relf->info.shdrs[relf->index.dynsym];
     GElf_Sym *dynsym = (void *)relf->info.hdr + dynsym_shdr->sh_offset;
 
-    for (Elf64_Xword i = 0; i < dynsym_shdr->sh_size / sizeof(GElf_Sym); i++) {
-        if (dynsym[i].st_value == 0) {
-            continue;
-        }
-
-        char *sym_name = relf->dynstrtab + dynsym[i].st_name;
-        char *sym_splitter = strchr(sym_name, '@');
-        if (sym_splitter != NULL) {
-            *sym_splitter = '\0';
+    if (relf->gnu_hash.nbucket) {
+        i = gnu_hash_find(&relf->gnu_hash, dynsym, relf->dynstrtab, name);
+        if (i < 0) {
+            i = scan_dynsym(relf, dynsym,
+                dynsym_shdr->sh_size / sizeof(GElf_Sym), name);
         }
+    } else {
+        i = symbol_hash_find(&relf->dynsym_hash, name);
+    }
+    if (i < 0) {
+        return 0;
+    }
 
-        /* function could also be part of the GOT with the type R_X86_64_GLOB_DAT */
-        if (!streql(sym_name, name)) {
-            continue;
-        }
+    /* function could also be part of the GOT with the type R_X86_64_GLOB_DAT */
+    unsigned long sym_addr = relf->load_bias + dynsym[i].st_value;
+    elf_addr = insert_got_table(uelf, obj, 0, sym_addr);
+    *entry = (struct upatch_plan_entry){ PLAN_GOT, 0, dynsym[i].st_value };
 
-        unsigned long sym_addr = relf->load_bias + dynsym[i].st_value;
-        elf_addr = insert_got_table(uelf, obj, 0, sym_addr);
-
-        log_debug("Resolved '%s' from '.dynsym' at 0x%lx\n", name, elf_addr);
-        break;
-    }
+    log_debug("Resolved '%s' from '.dynsym' at 0x%lx\n", name, elf_addr);
 
     return elf_addr;
 }
 
 static unsigned long resolve_sym(struct upatch_elf *uelf,
-    struct object_file *obj, const char *name, GElf_Sym *patch_sym)
+    struct object_file *obj, const char *name, GElf_Sym *patch_sym,
+    struct upatch_plan_entry *entry)
 {
     unsigned long elf_addr = 0;
     struct running_elf *relf = uelf->relf;
@@ -191,33 +200,22 @@ static unsigned long resolve_sym(struct upatch_elf *uelf,
     GElf_Shdr *sym_shdr = &relf->info.shdrs[relf->index.sym];
     GElf_Sym *sym = (void *)relf->info.hdr + sym_shdr->sh_offset;
 
-    for (Elf64_Xword i = 0; i < sym_shdr->sh_size / sizeof(GElf_Sym); i++) {
-        if (sym[i].st_shndx == SHN_UNDEF) {
-            continue;
-        }
-
-        /* strip symbol version if exists */
-        char *sym_name = relf->strtab + sym[i].st_name;
-        char *sym_splitter = strchr(sym_name, '@');
-        if (sym_splitter != NULL) {
-            *sym_splitter = '\0';
-        }
-
-        if (!streql(sym_name, name)) {
-            continue;
-        }
+    long i = symbol_hash_find(&relf->sym_hash, name);
+    if (i < 0) {
+        return 0;
+    }
 
-        elf_addr = relf->load_bias + sym[i].st_value;
+    elf_addr = relf->load_bias + sym[i].st_value;
+    *entry = (struct upatch_plan_entry){ PLAN_BIAS, 0, sym[i].st_value };
 
-        log_debug("Resolved '%s' from '.sym' at 0x%lx\n", name, elf_addr);
-        break;
-    }
+    log_debug("Resolved '%s' from '.sym' at 0x%lx\n", name, elf_addr);
 
     return elf_addr;
 }
 
 static unsigned long resolve_patch_sym(struct upatch_elf *uelf,
-    struct object_file *obj, const char *name, GElf_Sym *patch_sym)
+    struct object_file *obj, const char *name, GElf_Sym *patch_sym,
+    struct upatch_plan_entry *entry)
 {
     unsigned long elf_addr = 0;
     struct running_elf *relf = uelf->relf;
@@ -231,6 +229,7 @@ static unsigned long resolve_patch_sym(struct upatch_elf *uelf,
     }
 
     elf_addr = relf->load_bias + patch_sym->st_value;
+    *entry = (struct upatch_plan_entry){ PLAN_BIAS, 0, patch_sym->st_value };
     log_debug("Resolved '%s' from patch '.sym' at 0x%lx\n", name, elf_addr);
 
     return elf_addr;
@@ -238,7 +237,7 @@ static unsigned long resolve_patch_sym(struct upatch_elf *uelf,
 
 static unsigned long resolve_symbol(struct upatch_elf *uelf,
                     struct object_file *obj, const char *name,
-                    GElf_Sym patch_sym)
+                    GElf_Sym patch_sym, struct upatch_plan_entry *entry)
 {
     unsigned long elf_addr = 0;
     /*
@@ -256,26 +255,26 @@ static unsigned long resolve_symbol(struct upatch_elf *uelf,
      */
 
 	/* resolve from got */
-    elf_addr = resolve_rela_dyn(uelf, obj, name, &patch_sym);
+    elf_addr = resolve_rela_dyn(uelf, obj, name, &patch_sym, entry);
 
 	/* resolve from plt */
     if (!elf_addr) {
-        elf_addr = resolve_rela_plt(uelf, obj, name, &patch_sym);
+        elf_addr = resolve_rela_plt(uelf, obj, name, &patch_sym, entry);
     }
 
 	/* resolve from dynsym */
     if (!elf_addr) {
-        elf_addr = resolve_dynsym(uelf, obj, name, &patch_sym);
+        elf_addr = resolve_dynsym(uelf, obj, name, &patch_sym, entry);
     }
 
 	/* resolve from sym */
     if (!elf_addr) {
-        elf_addr = resolve_sym(uelf, obj, name, &patch_sym);
+        elf_addr = resolve_sym(uelf, obj, name, &patch_sym, entry);
     }
 
 	/* resolve from patch sym */
     if (!elf_addr) {
-        elf_addr = resolve_patch_sym(uelf, obj, name, &patch_sym);
+        elf_addr = resolve_patch_sym(uelf, obj, name, &patch_sym, entry);
     }
 
     if (!elf_addr) {
@@ -284,14 +283,116 @@ static unsigned long resolve_symbol(struct upatch_elf *uelf,
     return elf_addr;
 }
 
+/* Same as resolve_symbol(), without any lookup, 0 if the plan is not usable */
+static unsigned long resolve_plan_symbol(struct upatch_elf *uelf,
+    struct object_file *obj, const struct upatch_plan_entry *entry)
+{
+    unsigned long addr = uelf->relf->load_bias + entry->value;
+
+    switch (entry->kind) {
+    case PLAN_BIAS:
+        return addr;
+    case PLAN_GOT:
+        return insert_got_table(uelf, obj, entry->r_type, addr);
+    case PLAN_PLT:
+        return insert_plt_table(uelf, obj, entry->r_type, addr);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Apart from GOT & PLT slots, which are read from the process, undefined
+ * symbols resolve to a fixed offset from the load bias of the target.
+ * The first process records them as a plan, thus later processes of the
+ * same target resolve each symbol by an addition instead of lookups.
+ */
+static struct upatch_plan_entry *get_resolve_plan(struct upatch_elf *uelf,
+    bool *valid)
+{
+    struct upatch_plan *plan = &uelf->plan;
+
+    if (plan->entries != NULL && plan->inode == uelf->relf->info.inode &&
+        plan->valid) {
+        *valid = true;
+        return plan->entries;
+    }
+
+    free(plan->entries);
+    memset(plan, 0, sizeof(struct upatch_plan));
+    plan->entries = calloc(uelf->num_syms, sizeof(struct upatch_plan_entry));
+    plan->inode = uelf->relf->info.inode;
+    *valid = false;
+    return plan->entries;
+}
+
+/*
+ * Record remote GOT & PLT slots to be read while resolving symbols, thus
+ * they are fetched together instead of one read per slot. A plan knows the
+ * exact slots, otherwise whole '.got' & '.got.plt' of the target are taken.
+ * Slots missed here are still read from the process.
+ */
+static void prefetch_got_slots(struct upatch_elf *uelf,
+    struct upatch_mem_cache *cache, const struct upatch_plan_entry *entries,
+    bool planned)
+{
+    struct running_elf *relf = uelf->relf;
+    unsigned long i;
+    int ret = 0;
+
+    if (planned) {
+        for (i = 1; (i < uelf->num_syms) && (ret == 0); i++) {
+            if (entries[i].kind != PLAN_GOT && entries[i].kind != PLAN_PLT) {
+                continue;
+            }
+            /* tls pairs take two slots */
+            ret = upatch_mem_cache_add(cache,
+                relf->load_bias + entries[i].value, 2 * sizeof(unsigned long));
+        }
+    } else {
+        for (i = 1; (i < relf->info.hdr->e_shnum) && (ret == 0); i++) {
+            GElf_Shdr *shdr = &relf->info.shdrs[i];
+            const char *name = relf->info.shstrtab + shdr->sh_name;
+
+            if (strcmp(name, GOT_NAME) != 0 &&
+                strcmp(name, GOT_PLT_NAME) != 0) {
+                continue;
+            }
+            ret = upatch_mem_cache_add(cache,
+                relf->load_bias + shdr->sh_addr, shdr->sh_size);
+        }
+    }
+
+    if (ret == 0) {
+        ret = upatch_mem_cache_fetch(cache);
+    }
+    if (ret != 0) {
+        log_warn("Failed to prefetch got slots, ret=%d\n", ret);
+    }
+}
+
 int simplify_symbols(struct upatch_elf *uelf, struct object_file *obj)
 {
     GElf_Sym *sym = (void *)uelf->info.shdrs[uelf->index.sym].sh_addr;
+    struct upatch_plan_entry dummy;
+    struct upatch_plan_entry *entries;
+    struct upatch_mem_cache cache;
+    bool planned = false;
     unsigned long secbase;
     unsigned int i;
     int ret = 0;
     unsigned long elf_addr;
 
+    entries = get_resolve_plan(uelf, &planned);
+    if (planned) {
+        log_debug("Resolve symbols by plan of inode %lu\n",
+            (unsigned long)uelf->plan.inode);
+    }
+
+    upatch_mem_cache_init(&cache, obj->proc);
+    prefetch_got_slots(uelf, &cache, entries, planned);
+    obj->proc->mem_cache = &cache;
+
     for (i = 1; i < uelf->num_syms; i++) {
         const char *name;
 
@@ -309,7 +410,12 @@ int simplify_symbols(struct upatch_elf *uelf, struct object_file *obj)
         case SHN_ABS:
             break;
         case SHN_UNDEF:
-            elf_addr = resolve_symbol(uelf, obj, name, sym[i]);
+            elf_addr = planned ?
+                resolve_plan_symbol(uelf, obj, &entries[i]) : 0;
+            if (!elf_addr) {
+                elf_addr = resolve_symbol(uelf, obj, name, sym[i],
+                    (entries != NULL) ? &entries[i] : &dummy);
+            }
             if (!elf_addr) {
                 ret = -ENOEXEC;
             }
@@ -332,5 +438,10 @@ int simplify_symbols(struct upatch_elf *uelf, struct object_file *obj)
         }
     }
 
+    obj->proc->mem_cache = NULL;
+    upatch_mem_cache_destroy(&cache);
+
+    /* Plan is kept only if every symbol is resolved */
+    uelf->plan.valid = (entries != NULL) && (ret == 0);
     return ret;
 }
@@ -39,6 +39,17 @@ unsigned long insert_got_table(struct upatch_elf *, struct object_file *,
 unsigned long search_insert_plt_table(struct upatch_elf *, unsigned long,
 				      unsigned long);
 
+/* Final target of a jmp table entry, 0 if it has none known */
+unsigned long get_jmp_table_target(struct upatch_elf *, unsigned long);
+
+void upatch_resolve_set_direct_bind(bool enable);
+
+/*
+ * Target to call directly instead of the jmp table entry at addr,
+ * 0 if direct binding is disabled or the entry has to be used.
+ */
+unsigned long resolve_direct_target(struct upatch_elf *, unsigned long);
+
 int simplify_symbols(struct upatch_elf *, struct object_file *);
 
 #endif
\ No newline at end of file
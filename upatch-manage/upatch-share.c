@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <asm/unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "log.h"
+#include "upatch-ptrace.h"
+#include "upatch-share.h"
+
+struct upatch_share_image {
+	struct list_head list;
+	struct upatch_elf *uelf;
+	unsigned long base;
+	size_t len;
+	void *data;
+	/* Identity of the written file, checked against what targets open */
+	dev_t dev;
+	ino_t ino;
+	char name[NAME_MAX];
+	char path[PATH_MAX];
+};
+
+static const char *share_dir;
+static int share_dir_fd = -1;
+static LIST_HEAD(share_images);
+
+void upatch_share_set_dir(const char *dir)
+{
+	share_dir = dir;
+}
+
+/*
+ * Targets map the image files executable, so nobody but root may be able
+ * to replace them. The directory is created 0711 if missing, an existing
+ * one must be owned by root and writable by nobody else. Targets of any
+ * user open images by name, while nobody else can list them.
+ */
+static int share_dir_open(void)
+{
+	bool created = true;
+	struct stat st;
+	int ret;
+	int fd;
+
+	if (mkdir(share_dir, 0711) != 0) {
+		if (errno != EEXIST) {
+			ret = -errno;
+			log_warn("Failed to create share directory '%s', %s\n",
+				 share_dir, strerror(-ret));
+			return ret;
+		}
+		created = false;
+	}
+	fd = open(share_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		log_warn("Failed to open share directory '%s', %s\n",
+			 share_dir, strerror(-ret));
+		return ret;
+	}
+	if (fstat(fd, &st) != 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if ((st.st_uid != 0) || ((st.st_mode & (S_IWGRP | S_IWOTH)) != 0)) {
+		log_warn("Share directory '%s' is not private to root, "
+			 "patch text is not shared\n", share_dir);
+		close(fd);
+		return -EPERM;
+	}
+	/* Mode of mkdir() is masked by umask */
+	if (created && (fchmod(fd, 0711) != 0)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	share_dir_fd = fd;
+
+	return 0;
+}
+
+static void share_image_free(struct upatch_share_image *image)
+{
+	list_del(&image->list);
+	unlinkat(share_dir_fd, image->name, 0);
+	free(image->data);
+	free(image);
+}
+
+static int share_image_write(struct upatch_share_image *image)
+{
+	size_t written = 0;
+	struct stat st;
+	int ret = 0;
+	int fd;
+
+	fd = openat(share_dir_fd, image->name,
+		    O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0444);
+	if (fd < 0) {
+		return -errno;
+	}
+	/* Mode of openat() is masked by umask, targets of any user read it */
+	if (fchmod(fd, 0444) != 0) {
+		ret = -errno;
+		goto out;
+	}
+	while (written < image->len) {
+		ssize_t len = write(fd, image->data + written,
+				    image->len - written);
+		if (len < 0) {
+			ret = -errno;
+			goto out;
+		}
+		written += len;
+	}
+	if (fstat(fd, &st) != 0) {
+		ret = -errno;
+		goto out;
+	}
+	image->dev = st.st_dev;
+	image->ino = st.st_ino;
+
+out:
+	close(fd);
+	if (ret) {
+		unlinkat(share_dir_fd, image->name, 0);
+	}
+	return ret;
+}
+
+/* The path may resolve to another file in the target, eg. another mount ns */
+static bool share_image_opened(struct object_file *obj,
+			       struct upatch_share_image *image,
+			       unsigned long fd)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd/%lu", obj->proc->pid, fd);
+	if (stat(path, &st) != 0) {
+		return false;
+	}
+
+	return (st.st_dev == image->dev) && (st.st_ino == image->ino);
+}
+
+/*
+ * Images hold addresses of their targets, names are random so that they
+ * are only known to whoever can read maps of the targets anyway.
+ */
+static int share_image_name(char *name, size_t len)
+{
+	unsigned char bytes[16];
+	char hex[sizeof(bytes) * 2 + 1];
+	int ret;
+
+	if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+		return -1;
+	}
+	for (size_t i = 0; i < sizeof(bytes); i++) {
+		snprintf(hex + i * 2, 3, "%02x", bytes[i]);
+	}
+
+	ret = snprintf(name, len, "upatch-%s.img", hex);
+	return ((ret < 0) || ((size_t)ret >= len)) ? -1 : 0;
+}
+
+static struct upatch_share_image *share_image_get(struct upatch_elf *uelf,
+						  size_t len)
+{
+	unsigned long base = (unsigned long)uelf->core_layout.base;
+	struct upatch_share_image *image;
+	int ret;
+
+	list_for_each_entry(image, &share_images, list) {
+		if ((image->uelf != uelf) || (image->base != base)) {
+			continue;
+		}
+		/* Same address, but relocated against another load bias */
+		if ((image->len != len) ||
+		    memcmp(image->data, uelf->core_layout.kbase, len) != 0) {
+			return NULL;
+		}
+		return image;
+	}
+
+	if ((share_dir_fd < 0) && share_dir_open()) {
+		share_dir = NULL;
+		return NULL;
+	}
+
+	image = calloc(1, sizeof(struct upatch_share_image));
+	if (image == NULL) {
+		return NULL;
+	}
+	image->data = malloc(len);
+	if (image->data == NULL) {
+		free(image);
+		return NULL;
+	}
+	memcpy(image->data, uelf->core_layout.kbase, len);
+	image->uelf = uelf;
+	image->base = base;
+	image->len = len;
+	if (share_image_name(image->name, NAME_MAX)) {
+		free(image->data);
+		free(image);
+		return NULL;
+	}
+	ret = snprintf(image->path, PATH_MAX, "%s/%s", share_dir, image->name);
+	if ((ret < 0) || (ret >= PATH_MAX) || share_image_write(image)) {
+		log_warn("Failed to write shared image '%s'\n", image->path);
+		free(image->data);
+		free(image);
+		return NULL;
+	}
+	list_add(&image->list, &share_images);
+	log_debug("Shared image '%s' for 0x%lx(0x%lx)\n", image->path,
+		  base, len);
+
+	return image;
+}
+
+static void share_add_syscall(struct upatch_remote_syscall *call,
+			      unsigned long nr, unsigned long arg1,
+			      unsigned long arg2, unsigned long arg3,
+			      unsigned long arg4, unsigned long arg5,
+			      unsigned long arg6)
+{
+	call->nr = nr;
+	call->args[0] = arg1;
+	call->args[1] = arg2;
+	call->args[2] = arg3;
+	call->args[3] = arg4;
+	call->args[4] = arg5;
+	call->args[5] = arg6;
+}
+
+long upatch_share_map(struct upatch_elf *uelf, struct object_file *obj)
+{
+	struct upatch_layout *layout = &uelf->core_layout;
+	unsigned long base = (unsigned long)layout->base;
+	size_t len = layout->ro_after_init_size;
+	struct upatch_share_image *image;
+	struct upatch_remote_syscall calls[3];
+	struct upatch_remote_syscall close_call;
+	size_t num = 0;
+	int ret;
+
+	/* Info region must stay anonymous, patches are found by its header */
+	if ((share_dir == NULL) || (len == 0) || (len > layout->info_size)) {
+		return 0;
+	}
+	image = share_image_get(uelf, len);
+	if ((image == NULL) || (strlen(image->path) >= len)) {
+		return 0;
+	}
+
+	/* Path is passed in patch memory, which is rewritten anyway */
+	ret = upatch_process_mem_write(obj->proc, image->path, base,
+				       strlen(image->path) + 1);
+	if (ret) {
+		return 0;
+	}
+	share_add_syscall(&calls[0], __NR_openat, (unsigned long)AT_FDCWD,
+			  base, O_RDONLY | O_CLOEXEC, 0, 0, 0);
+	ret = upatch_syscall_remote_batch(proc2pctx(obj->proc), calls, 1);
+	if (ret) {
+		log_debug("Process %d cannot open '%s'\n", obj->proc->pid,
+			  image->path);
+		return 0;
+	}
+	share_add_syscall(&close_call, __NR_close, calls[0].res, 0, 0, 0, 0, 0);
+	if (!share_image_opened(obj, image, calls[0].res)) {
+		log_warn("Process %d opened another file than '%s'\n",
+			 obj->proc->pid, image->path);
+		upatch_syscall_remote_batch(proc2pctx(obj->proc), &close_call, 1);
+		return 0;
+	}
+
+	share_add_syscall(&calls[num++], __NR_mmap, base, len,
+			  PROT_READ | PROT_EXEC, MAP_FIXED | MAP_SHARED,
+			  calls[0].res, 0);
+	if (layout->text_size < len) {
+		share_add_syscall(&calls[num++], __NR_mprotect,
+				  base + layout->text_size,
+				  len - layout->text_size, PROT_READ, 0, 0, 0);
+	}
+	ret = upatch_syscall_remote_batch(proc2pctx(obj->proc), calls, num);
+	upatch_syscall_remote_batch(proc2pctx(obj->proc), &close_call, 1);
+	if (ret == 0) {
+		log_debug("Mapped shared image '%s' at 0x%lx\n", image->path,
+			  base);
+		return (long)len;
+	}
+
+	/* Failed mmap may leave a hole, bring back the private mapping */
+	log_warn("Failed to map shared image at 0x%lx\n", base);
+	num = 0;
+	share_add_syscall(&calls[num++], __NR_mmap, base, len,
+			  PROT_READ | PROT_WRITE | PROT_EXEC,
+			  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
+			  (unsigned long)-1, 0);
+	share_add_syscall(&calls[num++], __NR_mprotect, base,
+			  layout->text_size, PROT_READ | PROT_EXEC, 0, 0, 0);
+	if (layout->text_size < len) {
+		share_add_syscall(&calls[num++], __NR_mprotect,
+				  base + layout->text_size,
+				  len - layout->text_size, PROT_READ, 0, 0, 0);
+	}
+	ret = upatch_syscall_remote_batch(proc2pctx(obj->proc), calls, num);
+	if (ret) {
+		log_error("Failed to restore patch memory at 0x%lx\n", base);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+void upatch_share_release(void)
+{
+	struct upatch_share_image *image, *tmp;
+
+	list_for_each_entry_safe(image, tmp, &share_images, list) {
+		share_image_free(image);
+	}
+	if (share_dir_fd >= 0) {
+		close(share_dir_fd);
+		share_dir_fd = -1;
+	}
+}
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UPATCH_SHARE__
+#define __UPATCH_SHARE__
+
+#include "upatch-elf.h"
+#include "upatch-process.h"
+
+/*
+ * Share patch text across processes of identical layout, eg. prefork
+ * workers. The first process writes its relocated text & rodata into a
+ * read-only file under the directory, processes having the same bytes at
+ * the same address map it shared instead of holding a private copy.
+ * Disabled if the directory is NULL.
+ */
+void upatch_share_set_dir(const char *dir);
+
+/*
+ * Called once the patch memory is mapped, returns the length of the
+ * shared head of the patch image, which must not be written anymore.
+ * Returns 0 if the image is kept private, negative on fatal error.
+ */
+long upatch_share_map(struct upatch_elf *uelf, struct object_file *obj);
+
+/* Remove image files, mappings of processes are not affected */
+void upatch_share_release(void);
+
+#endif
@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/param.h>
+
+#include "log.h"
+#include "upatch-coro.h"
+#include "upatch-stack.h"
+#include "upatch-timing.h"
+
+#define STACK_CHECK_ATTEMPTS 10
+#define STACK_BACKOFF_MIN_US 1000UL
+#define STACK_BACKOFF_MAX_US 64000UL
+
+/* Bytes checked above sp of each thread, which bounds each attempt */
+#define STACK_SCAN_SIZE 0x10000UL
+
+static bool stack_check_enabled;
+
+void upatch_stack_set_check(bool enable)
+{
+	stack_check_enabled = enable;
+}
+
+static int stack_range_cmp(const void *a, const void *b)
+{
+	const struct upatch_stack_range *ra = a;
+	const struct upatch_stack_range *rb = b;
+
+	if (ra->start != rb->start) {
+		return (ra->start < rb->start) ? -1 : 1;
+	}
+	return 0;
+}
+
+size_t upatch_stack_sort_ranges(struct upatch_stack_range *ranges, size_t num)
+{
+	size_t merged = 0;
+
+	if (num == 0) {
+		return 0;
+	}
+
+	qsort(ranges, num, sizeof(struct upatch_stack_range), stack_range_cmp);
+	for (size_t i = 1; i < num; i++) {
+		/* Ranges exclude both ends, touching ones are kept apart */
+		if (ranges[i].start < ranges[merged].end) {
+			ranges[merged].end = MAX(ranges[merged].end, ranges[i].end);
+			continue;
+		}
+		ranges[++merged] = ranges[i];
+	}
+
+	return merged + 1;
+}
+
+/*
+ * Each word of each stack is looked up, the ranges are searched by halves,
+ * as a patch of many functions would make a linear walk dominate the stop.
+ */
+bool upatch_stack_addr_in_ranges(unsigned long addr,
+				 const struct upatch_stack_range *ranges,
+				 size_t num)
+{
+	size_t lo = 0;
+	size_t hi = num;
+
+	/* Find the last range starting below addr */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ranges[mid].start < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo > 0) && (addr < ranges[lo - 1].end);
+}
+
+/*
+ * Stopped thread reports "<nr> <args...> <sp> <pc>" if it is blocked in a
+ * syscall, or "-1 <sp> <pc>" otherwise, sp & pc are always the last two.
+ * Returns 1 if the thread has exited.
+ */
+static int stack_read_thread(int pid, int tid, unsigned long *sp,
+			     unsigned long *pc)
+{
+	char path[PATH_MAX];
+	char buf[256];
+	char *fields[2] = { NULL, NULL };
+	char *saveptr = NULL;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/syscall", pid, tid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return (errno == ENOENT) ? 1 : -1;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		return -1;
+	}
+	buf[len] = '\0';
+
+	for (char *token = strtok_r(buf, " \n", &saveptr); token != NULL;
+	     token = strtok_r(NULL, " \n", &saveptr)) {
+		fields[0] = fields[1];
+		fields[1] = token;
+	}
+	if (fields[0] == NULL) {
+		log_error("Thread %d is not stopped\n", tid);
+		return -1;
+	}
+
+	*sp = strtoul(fields[0], NULL, 16);
+	*pc = strtoul(fields[1], NULL, 16);
+	return 0;
+}
+
+/* Returns -EBUSY if the thread is inside the ranges */
+static int stack_check_thread(struct upatch_process *proc, int tid,
+			      const struct upatch_stack_range *ranges,
+			      size_t num, unsigned long *stack)
+{
+	unsigned long sp = 0;
+	unsigned long pc = 0;
+	ssize_t len;
+	int ret;
+
+	ret = stack_read_thread(proc->pid, tid, &sp, &pc);
+	if (ret != 0) {
+		return (ret > 0) ? 0 : -1;
+	}
+	if (upatch_stack_addr_in_ranges(pc, ranges, num)) {
+		log_debug("Thread %d is running at 0x%lx\n", tid, pc);
+		return -EBUSY;
+	}
+
+	/* Read stops at the end of the stack mapping */
+	len = pread(proc->memfd, stack, STACK_SCAN_SIZE, (off_t)sp);
+	for (ssize_t i = 0; i < len / (ssize_t)sizeof(unsigned long); i++) {
+		if (upatch_stack_addr_in_ranges(stack[i], ranges, num)) {
+			log_debug("Thread %d would return to 0x%lx\n", tid,
+				  stack[i]);
+			return -EBUSY;
+		}
+	}
+
+	return 0;
+}
+
+static int stack_check_threads(struct upatch_process *proc,
+			       const struct upatch_stack_range *ranges,
+			       size_t num, unsigned long *stack)
+{
+	int *pids = NULL;
+	size_t npids = 0;
+	size_t alloc = 0;
+	int ret = 0;
+
+	if (upatch_process_list_threads(proc, &pids, &npids, &alloc) < 0) {
+		return -1;
+	}
+	for (size_t i = 0; i < npids; i++) {
+		ret = stack_check_thread(proc, pids[i], ranges, num, stack);
+		if (ret != 0) {
+			break;
+		}
+	}
+	free(pids);
+
+	return ret;
+}
+
+void upatch_stack_prepare(struct upatch_process *proc,
+			  const struct upatch_stack_range *ranges, size_t num)
+{
+	int ret;
+
+	if (!stack_check_enabled || (num == 0) || !upatch_coro_enabled()) {
+		return;
+	}
+
+	upatch_timing_start(PHASE_CORO_SCAN);
+	ret = upatch_coro_prescan(proc, ranges, num);
+	upatch_timing_end(PHASE_CORO_SCAN);
+	if (ret != 0) {
+		log_warn("Failed to prescan coroutines of process %d, ret=%d\n",
+			 proc->pid, ret);
+	}
+}
+
+int upatch_stack_wait_safe(struct upatch_process *proc,
+			   const struct upatch_stack_range *ranges, size_t num)
+{
+	unsigned long backoff = STACK_BACKOFF_MIN_US;
+	unsigned long longest = 0;
+	unsigned long checked = 0;
+	unsigned long *stack = NULL;
+	int attempt;
+	int ret = 0;
+
+	if (!stack_check_enabled || (num == 0)) {
+		return 0;
+	}
+
+	stack = malloc(STACK_SCAN_SIZE);
+	if (stack == NULL) {
+		return -ENOMEM;
+	}
+	checked = upatch_timing_get(PHASE_STACK_CHECK);
+
+	for (attempt = 1; attempt <= STACK_CHECK_ATTEMPTS; attempt++) {
+		upatch_timing_start(PHASE_STACK_CHECK);
+		ret = stack_check_threads(proc, ranges, num, stack);
+		if ((ret == 0) && upatch_coro_enabled()) {
+			ret = upatch_coro_check(proc, ranges, num);
+		}
+		upatch_timing_end(PHASE_STACK_CHECK);
+
+		/* Time of this attempt only, as the phase accumulates */
+		longest = MAX(longest, upatch_timing_get(PHASE_STACK_CHECK) - checked);
+		checked = upatch_timing_get(PHASE_STACK_CHECK);
+		if ((ret != -EBUSY) || (attempt == STACK_CHECK_ATTEMPTS)) {
+			break;
+		}
+
+		log_debug("Process %d is running patched code, retry in %lu microsecond(s)\n",
+			  proc->pid, backoff);
+		upatch_process_release(proc);
+		upatch_timing_end(PHASE_STOPPED);
+		upatch_timing_count(COUNTER_RETRY, 1);
+		usleep(backoff);
+		backoff = MIN(backoff * 2, STACK_BACKOFF_MAX_US);
+
+		upatch_timing_start(PHASE_STOPPED);
+		ret = upatch_process_restop(proc);
+		if (ret != 0) {
+			log_error("Failed to stop process %d again\n", proc->pid);
+			break;
+		}
+	}
+	free(stack);
+
+	if (ret == -EBUSY) {
+		log_error("Process %d is still running patched code after %d attempt(s)\n",
+			  proc->pid, STACK_CHECK_ATTEMPTS);
+	}
+	log_debug("Process %d stack checked by %d attempt(s), longest %lu microsecond(s)\n",
+		  proc->pid, MIN(attempt, STACK_CHECK_ATTEMPTS), longest);
+	return ret;
+}
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UPATCH_STACK__
+#define __UPATCH_STACK__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "upatch-process.h"
+
+/* Code which no thread may run in, nor return to, while jumpers change */
+struct upatch_stack_range {
+	unsigned long start;
+	unsigned long end;
+};
+
+void upatch_stack_set_check(bool enable);
+
+/*
+ * Sort ranges by start and merge overlapping ones in place, returns the
+ * number of ranges left. Ranges must be sorted before they are checked.
+ */
+size_t upatch_stack_sort_ranges(struct upatch_stack_range *ranges, size_t num);
+
+/* A word equal to a range start is not inside, it is a function pointer */
+bool upatch_stack_addr_in_ranges(unsigned long addr,
+				 const struct upatch_stack_range *ranges,
+				 size_t num);
+
+/*
+ * Called before the process is frozen, stacks of parked coroutines are
+ * scanned meanwhile, then only changes of them are checked by
+ * upatch_stack_wait_safe(). Does nothing if no coroutine runtime is set.
+ */
+void upatch_stack_prepare(struct upatch_process *proc,
+			  const struct upatch_stack_range *ranges, size_t num);
+
+/*
+ * Called with the process stopped, returns once no thread is inside the
+ * ranges, with the process still stopped. The pc and the words above sp
+ * of each thread are checked, a word equal to a range start is taken as
+ * a function pointer. Threads are released for a short backoff between
+ * attempts, returns -EBUSY once all attempts failed. Parked coroutines
+ * are checked as well, see upatch-coro.h.
+ * Does nothing if the check is disabled.
+ */
+int upatch_stack_wait_safe(struct upatch_process *proc,
+			   const struct upatch_stack_range *ranges, size_t num);
+
+#endif
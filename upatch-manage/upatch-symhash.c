@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "upatch-symhash.h"
+
+#define SYMBOL_VERSION_SPLITTER '@'
+#define GNU_HASH_HEADER_SIZE (4 * sizeof(uint32_t))
+
+/* Same hash function of '.gnu.hash', stops at symbol version */
+uint32_t symbol_hash_name(const char *name)
+{
+	uint32_t h = 5381;
+
+	for (; *name != '\0' && *name != SYMBOL_VERSION_SPLITTER; name++) {
+		h = (h << 5) + h + (unsigned char)*name;
+	}
+	return h;
+}
+
+/* Compare symbol name, which may contain a version, with a plain name */
+bool symbol_name_eq(const char *sym_name, const char *name)
+{
+	size_t len = strcspn(sym_name, "@");
+
+	return strncmp(sym_name, name, len) == 0 && name[len] == '\0';
+}
+
+int symbol_hash_init(struct symbol_hash *hash, unsigned int nentry)
+{
+	memset(hash, 0, sizeof(struct symbol_hash));
+
+	/* Keep the load factor below 1 */
+	hash->nbucket = nentry | 1;
+	hash->buckets = calloc(hash->nbucket, sizeof(unsigned int));
+	hash->chains = calloc(nentry + 1, sizeof(unsigned int));
+	hash->names = calloc(nentry + 1, sizeof(const char *));
+	if (!hash->buckets || !hash->chains || !hash->names) {
+		symbol_hash_destroy(hash);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void symbol_hash_add(struct symbol_hash *hash, unsigned int entry,
+		     const char *name)
+{
+	unsigned int bucket = symbol_hash_name(name) % hash->nbucket;
+
+	hash->names[entry] = name;
+	hash->chains[entry] = hash->buckets[bucket];
+	hash->buckets[bucket] = entry + 1;
+}
+
+long symbol_hash_find(struct symbol_hash *hash, const char *name)
+{
+	unsigned int entry;
+
+	if (hash->buckets == NULL) {
+		return -1;
+	}
+
+	entry = hash->buckets[symbol_hash_name(name) % hash->nbucket];
+	while (entry != 0) {
+		if (symbol_name_eq(hash->names[entry - 1], name)) {
+			return entry - 1;
+		}
+		entry = hash->chains[entry - 1];
+	}
+
+	return -1;
+}
+
+void symbol_hash_destroy(struct symbol_hash *hash)
+{
+	free(hash->buckets);
+	free(hash->chains);
+	free(hash->names);
+	memset(hash, 0, sizeof(struct symbol_hash));
+}
+
+int gnu_hash_init(struct gnu_hash *hash, const void *data, size_t size)
+{
+	const uint32_t *header = data;
+	size_t table_size;
+
+	memset(hash, 0, sizeof(struct gnu_hash));
+	if (size < GNU_HASH_HEADER_SIZE) {
+		return -ENOEXEC;
+	}
+
+	hash->nbucket = header[0];
+	hash->symoffset = header[1];
+	hash->bloom_size = header[2];
+	hash->bloom_shift = header[3];
+
+	table_size = GNU_HASH_HEADER_SIZE +
+		     hash->bloom_size * sizeof(uint64_t) +
+		     hash->nbucket * sizeof(uint32_t);
+	if (hash->nbucket == 0 || hash->bloom_size == 0 || table_size > size) {
+		memset(hash, 0, sizeof(struct gnu_hash));
+		return -ENOEXEC;
+	}
+
+	hash->bloom = (const void *)header + GNU_HASH_HEADER_SIZE;
+	hash->buckets = (const void *)(hash->bloom + hash->bloom_size);
+	hash->chains = hash->buckets + hash->nbucket;
+
+	return 0;
+}
+
+long gnu_hash_find(struct gnu_hash *hash, const GElf_Sym *dynsym,
+		   const char *dynstr, const char *name)
+{
+	uint32_t h1 = symbol_hash_name(name);
+	uint32_t h2 = h1 >> hash->bloom_shift;
+	uint64_t word = hash->bloom[(h1 / 64) % hash->bloom_size];
+	uint64_t mask = (1ULL << (h1 % 64)) | (1ULL << (h2 % 64));
+	uint32_t index;
+
+	if ((word & mask) != mask) {
+		return -1;
+	}
+
+	index = hash->buckets[h1 % hash->nbucket];
+	if (index < hash->symoffset) {
+		return -1;
+	}
+
+	while (1) {
+		uint32_t chain_hash = hash->chains[index - hash->symoffset];
+
+		/* Skip undefined entries, same as scanning '.dynsym' */
+		if (((chain_hash | 1) == (h1 | 1)) &&
+		    dynsym[index].st_value != 0 &&
+		    symbol_name_eq(dynstr + dynsym[index].st_name, name)) {
+			return index;
+		}
+		if (chain_hash & 1) {
+			break;
+		}
+		index++;
+	}
+
+	return -1;
+}
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UPATCH_SYMHASH__
+#define __UPATCH_SYMHASH__
+
+#include <gelf.h>
+#include <stdbool.h>
+
+/*
+ * Name to entry index of a symbol / relocation table.
+ * Names are compared without symbol version ("name@VER"),
+ * so the string table is never modified.
+ */
+struct symbol_hash {
+	unsigned int nbucket;
+	unsigned int *buckets; /* entry + 1, 0 means empty */
+	unsigned int *chains; /* next entry + 1 */
+	const char **names;
+};
+
+/* Lookup context of a '.gnu.hash' section */
+struct gnu_hash {
+	uint32_t nbucket;
+	uint32_t symoffset;
+	uint32_t bloom_size;
+	uint32_t bloom_shift;
+	const uint64_t *bloom;
+	const uint32_t *buckets;
+	const uint32_t *chains;
+};
+
+uint32_t symbol_hash_name(const char *);
+
+bool symbol_name_eq(const char *, const char *);
+
+int symbol_hash_init(struct symbol_hash *, unsigned int);
+
+/* Entries must be added in descending order to find the first one */
+void symbol_hash_add(struct symbol_hash *, unsigned int, const char *);
+
+long symbol_hash_find(struct symbol_hash *, const char *);
+
+void symbol_hash_destroy(struct symbol_hash *);
+
+int gnu_hash_init(struct gnu_hash *, const void *, size_t);
+
+long gnu_hash_find(struct gnu_hash *, const GElf_Sym *, const char *,
+		   const char *);
+
+#endif
@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "upatch-timing.h"
+
+#define NSEC_PER_USEC 1000UL
+#define NSEC_PER_SEC 1000000000UL
+
+struct upatch_phase_timer {
+	unsigned long start;
+	unsigned long elapsed;
+	bool used;
+};
+
+static const char *phase_name[PHASE_NUM] = {
+	[PHASE_ELF_LOAD] = "elf_load",
+	[PHASE_MAPS_PARSE] = "maps_parse",
+	[PHASE_ATTACH] = "attach",
+	[PHASE_LAYOUT] = "layout",
+	[PHASE_RESOLVE] = "resolve",
+	[PHASE_RELOCATE] = "relocate",
+	[PHASE_MAP] = "map",
+	[PHASE_MEM_WRITE] = "mem_write",
+	[PHASE_JMP_WRITE] = "jmp_write",
+	[PHASE_CORO_SCAN] = "coro_scan",
+	[PHASE_FREEZE] = "freeze",
+	[PHASE_STACK_CHECK] = "stack_check",
+	[PHASE_STOPPED] = "stopped",
+	[PHASE_DETACH] = "detach",
+	[PHASE_TOTAL] = "total",
+};
+
+static const char *counter_name[COUNTER_NUM] = {
+	[COUNTER_MEM_WRITTEN] = "mem_written",
+	[COUNTER_REMOTE_SYSCALL] = "remote_syscalls",
+	[COUNTER_RETRY] = "retries",
+};
+
+static bool timing_enabled;
+static struct upatch_phase_timer timers[PHASE_NUM];
+static unsigned long counters[COUNTER_NUM];
+
+void upatch_timing_set_enabled(bool enabled)
+{
+	timing_enabled = enabled;
+}
+
+static unsigned long timing_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void upatch_timing_start(enum upatch_phase phase)
+{
+	timers[phase].start = timing_now();
+}
+
+bool upatch_timing_end(enum upatch_phase phase)
+{
+	struct upatch_phase_timer *timer = &timers[phase];
+
+	if (timer->start == 0) {
+		return false;
+	}
+	timer->elapsed += timing_now() - timer->start;
+	timer->start = 0;
+	timer->used = true;
+
+	return true;
+}
+
+unsigned long upatch_timing_get(enum upatch_phase phase)
+{
+	return timers[phase].elapsed / NSEC_PER_USEC;
+}
+
+void upatch_timing_count(enum upatch_counter counter, unsigned long value)
+{
+	counters[counter] += value;
+}
+
+void upatch_timing_report(int pid, const char **uuids, size_t uuid_num,
+			  const char *cmd)
+{
+	bool first = true;
+
+	if (timing_enabled) {
+		printf("%s {\"pid\":%d,\"uuid\":\"", TIMING_PREFIX, pid);
+		for (size_t i = 0; i < uuid_num; i++) {
+			printf("%s%s", (i == 0) ? "" : ",", uuids[i]);
+		}
+		printf("\",\"cmd\":\"%s\",\"phases\":{", cmd);
+		for (int i = 0; i < PHASE_NUM; i++) {
+			if (!timers[i].used) {
+				continue;
+			}
+			printf("%s\"%s\":%lu", first ? "" : ",", phase_name[i],
+			       upatch_timing_get(i));
+			first = false;
+		}
+		printf("},\"counters\":{");
+		for (int i = 0; i < COUNTER_NUM; i++) {
+			printf("%s\"%s\":%lu", (i == 0) ? "" : ",",
+			       counter_name[i], counters[i]);
+		}
+		printf("}}\n");
+	}
+
+	memset(timers, 0, sizeof(timers));
+	memset(counters, 0, sizeof(counters));
+}
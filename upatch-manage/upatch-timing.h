@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * upatch-manage
+ * Copyright (C) 2024 Huawei Technologies Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UPATCH_TIMING__
+#define __UPATCH_TIMING__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TIMING_PREFIX "UPATCH_TIMING"
+
+/*
+ * Phases of a process operation, a phase may be entered more than once,
+ * its time is accumulated until the result is reported, in microseconds.
+ */
+enum upatch_phase {
+	PHASE_ELF_LOAD,
+	PHASE_MAPS_PARSE,
+	PHASE_ATTACH,
+	PHASE_LAYOUT,
+	PHASE_RESOLVE,
+	PHASE_RELOCATE,
+	PHASE_MAP,
+	PHASE_MEM_WRITE,
+	PHASE_JMP_WRITE,
+	PHASE_CORO_SCAN,
+	PHASE_FREEZE,
+	PHASE_STACK_CHECK,
+	PHASE_STOPPED,
+	PHASE_DETACH,
+	PHASE_TOTAL,
+	PHASE_NUM,
+};
+
+/* Costs of a process operation, accumulated along with the phases */
+enum upatch_counter {
+	COUNTER_MEM_WRITTEN, /* bytes written into the process */
+	COUNTER_REMOTE_SYSCALL, /* syscalls executed by the process */
+	COUNTER_RETRY, /* times the process was released to try again */
+	COUNTER_NUM,
+};
+
+void upatch_timing_set_enabled(bool enabled);
+
+void upatch_timing_start(enum upatch_phase phase);
+
+/* Returns false if the phase is not started */
+bool upatch_timing_end(enum upatch_phase phase);
+
+unsigned long upatch_timing_get(enum upatch_phase phase);
+
+void upatch_timing_count(enum upatch_counter counter, unsigned long value);
+
+/*
+ * Report timing & counters of one process as a json line, then reset them.
+ * Phases shared by several processes (eg. elf load) are reported only
+ * by the first one. Patches of one session are joined by ','.
+ */
+void upatch_timing_report(int pid, const char **uuids, size_t uuid_num,
+			  const char *cmd);
+
+#endif
@@ -14,8 +14,8 @@
 
 use std::{fs::File, io::Write, os::unix::io::AsRawFd, path::Path};
 
-use anyhow::{anyhow, Result};
-use nix::{ioctl_none, ioctl_write_ptr, libc::PATH_MAX};
+use anyhow::{anyhow, bail, Result};
+use nix::{ioctl_none, ioctl_read, ioctl_write_ptr, libc::PATH_MAX};
 use syscare_common::{ffi::OsStrExt, fs};
 
 const KMOD_IOCTL_MAGIC: u16 = 0xE5;
@@ -39,6 +39,28 @@ ioctl_write_ptr!(
     0x4,
     UpatchRegisterRequest
 );
+ioctl_read!(ioctl_get_hijacker_stats, KMOD_IOCTL_MAGIC, 0x5, UpatchStats);
+ioctl_write_ptr!(
+    ioctl_register_hijackers,
+    KMOD_IOCTL_MAGIC,
+    0x6,
+    UpatchRegisterBatch
+);
+ioctl_write_ptr!(
+    ioctl_unregister_hijackers,
+    KMOD_IOCTL_MAGIC,
+    0x7,
+    UpatchRegisterBatch
+);
+ioctl_read!(
+    ioctl_get_uprobe_stats,
+    KMOD_IOCTL_MAGIC,
+    0x8,
+    UpatchUprobeStats
+);
+
+/// Max requests of a batch, bigger ones are split and committed one by one
+const KMOD_BATCH_MAX: usize = 64;
 
 #[repr(C)]
 pub struct UpatchEnableRequest {
@@ -46,11 +68,76 @@ pub struct UpatchEnableRequest {
     offset: u64,
 }
 
+#[repr(C)]
 pub struct UpatchRegisterRequest {
     exec_path: [u8; PATH_MAX as usize],
     jump_path: [u8; PATH_MAX as usize],
 }
 
+impl UpatchRegisterRequest {
+    fn new<P, Q>(exec_path: P, jump_path: Q) -> Result<Self>
+    where
+        P: AsRef<Path>,
+        Q: AsRef<Path>,
+    {
+        let mut msg = Self {
+            exec_path: [0; PATH_MAX as usize],
+            jump_path: [0; PATH_MAX as usize],
+        };
+
+        msg.exec_path
+            .as_mut()
+            .write_all(exec_path.as_ref().to_cstring()?.to_bytes_with_nul())?;
+        msg.jump_path
+            .as_mut()
+            .write_all(jump_path.as_ref().to_cstring()?.to_bytes_with_nul())?;
+
+        Ok(msg)
+    }
+}
+
+#[repr(C)]
+pub struct UpatchRegisterBatch {
+    count: u64,
+    requests: u64,
+}
+
+impl UpatchRegisterBatch {
+    fn new(requests: &[UpatchRegisterRequest]) -> Self {
+        Self {
+            count: requests.len() as u64,
+            requests: requests.as_ptr() as u64,
+        }
+    }
+}
+
+/// Path buffer statistics of the kernel module
+#[repr(C)]
+#[derive(Debug, Default)]
+pub struct UpatchStats {
+    pub path_buf_hit: u64,
+    pub path_buf_miss: u64,
+}
+
+/// Number of latency buckets, corresponds to `UPATCH_HIJACKER_LATENCY_NUM`
+pub const UPROBE_LATENCY_NUM: usize = 16;
+
+/// Uprobe statistics of the kernel module.
+///
+/// Latency bucket 0 counts calls below 1us, bucket i counts [2^(i-1), 2^i) us,
+/// the last one counts all slower calls.
+#[repr(C)]
+#[derive(Debug, Default)]
+pub struct UpatchUprobeStats {
+    pub hits: u64,
+    pub hijacks: u64,
+    pub miss_no_record: u64,
+    pub miss_read_path: u64,
+    pub miss_no_inode: u64,
+    pub miss_error: u64,
+    pub latency: [u64; UPROBE_LATENCY_NUM],
+}
+
 pub struct HijackerIoctl {
     dev: File,
 }
@@ -95,17 +182,7 @@ impl HijackerIoctl {
         P: AsRef<Path>,
         Q: AsRef<Path>,
     {
-        let mut msg = UpatchRegisterRequest {
-            exec_path: [0; PATH_MAX as usize],
-            jump_path: [0; PATH_MAX as usize],
-        };
-
-        msg.exec_path
-            .as_mut()
-            .write_all(exec_path.as_ref().to_cstring()?.to_bytes_with_nul())?;
-        msg.jump_path
-            .as_mut()
-            .write_all(jump_path.as_ref().to_cstring()?.to_bytes_with_nul())?;
+        let msg = UpatchRegisterRequest::new(exec_path, jump_path)?;
 
         unsafe {
             ioctl_register_hijacker(self.dev.as_raw_fd(), &msg)
@@ -120,17 +197,7 @@ impl HijackerIoctl {
         P: AsRef<Path>,
         Q: AsRef<Path>,
     {
-        let mut msg = UpatchRegisterRequest {
-            exec_path: [0; PATH_MAX as usize],
-            jump_path: [0; PATH_MAX as usize],
-        };
-
-        msg.exec_path
-            .as_mut()
-            .write_all(exec_path.as_ref().to_cstring()?.to_bytes_with_nul())?;
-        msg.jump_path
-            .as_mut()
-            .write_all(jump_path.as_ref().to_cstring()?.to_bytes_with_nul())?;
+        let msg = UpatchRegisterRequest::new(exec_path, jump_path)?;
 
         unsafe {
             ioctl_unregister_hijacker(self.dev.as_raw_fd(), &msg)
@@ -139,4 +206,82 @@ impl HijackerIoctl {
 
         Ok(())
     }
+
+    fn new_batch<I, P, Q>(hijackers: I) -> Result<Vec<UpatchRegisterRequest>>
+    where
+        I: IntoIterator<Item = (P, Q)>,
+        P: AsRef<Path>,
+        Q: AsRef<Path>,
+    {
+        hijackers
+            .into_iter()
+            .map(|(exec_path, jump_path)| UpatchRegisterRequest::new(exec_path, jump_path))
+            .collect()
+    }
+
+    /// Register all hijackers, each batch of them is committed atomically
+    pub fn register_hijackers<I, P, Q>(&self, hijackers: I) -> Result<()>
+    where
+        I: IntoIterator<Item = (P, Q)>,
+        P: AsRef<Path>,
+        Q: AsRef<Path>,
+    {
+        let requests = Self::new_batch(hijackers)?;
+
+        for (index, chunk) in requests.chunks(KMOD_BATCH_MAX).enumerate() {
+            let msg = UpatchRegisterBatch::new(chunk);
+            let result = unsafe { ioctl_register_hijackers(self.dev.as_raw_fd(), &msg) };
+            if let Err(e) = result {
+                // Roll back committed batches, thus nothing is left registered
+                for chunk in requests.chunks(KMOD_BATCH_MAX).take(index) {
+                    let msg = UpatchRegisterBatch::new(chunk);
+                    unsafe { ioctl_unregister_hijackers(self.dev.as_raw_fd(), &msg).ok() };
+                }
+                bail!("Ioctl error, {}", e.desc());
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Unregister all hijackers, each batch of them is committed atomically
+    pub fn unregister_hijackers<I, P, Q>(&self, hijackers: I) -> Result<()>
+    where
+        I: IntoIterator<Item = (P, Q)>,
+        P: AsRef<Path>,
+        Q: AsRef<Path>,
+    {
+        let requests = Self::new_batch(hijackers)?;
+
+        for chunk in requests.chunks(KMOD_BATCH_MAX) {
+            let msg = UpatchRegisterBatch::new(chunk);
+            unsafe {
+                ioctl_unregister_hijackers(self.dev.as_raw_fd(), &msg)
+                    .map_err(|e| anyhow!("Ioctl error, {}", e.desc()))?
+            };
+        }
+
+        Ok(())
+    }
+
+    pub fn get_stats(&self) -> Result<UpatchStats> {
+        let mut stats = UpatchStats::default();
+
+        unsafe {
+            ioctl_get_hijacker_stats(self.dev.as_raw_fd(), &mut stats)
+                .map_err(|e| anyhow!("Ioctl error, {}", e.desc()))?
+        };
+
+        Ok(stats)
+    }
+    pub fn get_uprobe_stats(&self) -> Result<UpatchUprobeStats> {
+        let mut stats = UpatchUprobeStats::default();
+
+        unsafe {
+            ioctl_get_uprobe_stats(self.dev.as_raw_fd(), &mut stats)
+                .map_err(|e| anyhow!("Ioctl error, {}", e.desc()))?
+        };
+
+        Ok(stats)
+    }
 }
@@ -27,7 +27,7 @@ mod kmod;
 
 use config::HijackerConfig;
 use elf_resolver::ElfResolver;
-use ioctl::HijackerIoctl;
+use ioctl::{HijackerIoctl, UPROBE_LATENCY_NUM};
 use kmod::HijackerKmodGuard;
 
 const KMOD_NAME: &str = "upatch_hijacker";
@@ -144,10 +144,85 @@ impl Hijacker {
 
         self.ioctl.unregister_hijacker(exec_path, jump_path)
     }
+
+    fn get_hijackers<I, P>(&self, elf_paths: I) -> Result<Vec<(PathBuf, &Path)>>
+    where
+        I: IntoIterator<Item = P>,
+        P: AsRef<Path>,
+    {
+        elf_paths
+            .into_iter()
+            .map(|elf_path| {
+                let exec_path = elf_path.as_ref().to_path_buf();
+                let jump_path = self.get_hijacker(&exec_path)?;
+                Ok((exec_path, jump_path))
+            })
+            .collect()
+    }
+
+    pub fn register_all<I, P>(&self, elf_paths: I) -> Result<()>
+    where
+        I: IntoIterator<Item = P>,
+        P: AsRef<Path>,
+    {
+        let hijackers = self.get_hijackers(elf_paths)?;
+        self.ioctl.register_hijackers(hijackers)
+    }
+
+    pub fn unregister_all<I, P>(&self, elf_paths: I) -> Result<()>
+    where
+        I: IntoIterator<Item = P>,
+        P: AsRef<Path>,
+    {
+        let hijackers = self.get_hijackers(elf_paths)?;
+        self.ioctl.unregister_hijackers(hijackers)
+    }
+}
+
+impl Hijacker {
+    /// Logs counters of the kernel module, which are kept since it is loaded
+    pub fn log_stats(&self) {
+        match self.ioctl.get_stats() {
+            Ok(stats) => debug!(
+                "Hijacker path buffer hit: {}, miss: {}",
+                stats.path_buf_hit, stats.path_buf_miss
+            ),
+            Err(e) => debug!("Failed to get hijacker stats, {:?}", e),
+        }
+        match self.ioctl.get_uprobe_stats() {
+            Ok(stats) => {
+                debug!(
+                    "Hijacker uprobe hit: {}, hijack: {}, miss: {} no record, {} path read failure, {} no inode, {} error",
+                    stats.hits,
+                    stats.hijacks,
+                    stats.miss_no_record,
+                    stats.miss_read_path,
+                    stats.miss_no_inode,
+                    stats.miss_error
+                );
+                let latency = stats
+                    .latency
+                    .iter()
+                    .enumerate()
+                    .filter(|(_, count)| **count != 0)
+                    .map(|(index, count)| match index {
+                        0 => format!("<1us: {}", count),
+                        i if i == UPROBE_LATENCY_NUM - 1 => {
+                            format!(">={}us: {}", 1u64 << (i - 1), count)
+                        }
+                        i => format!("<{}us: {}", 1u64 << i, count),
+                    })
+                    .collect::<Vec<_>>();
+                debug!("Hijacker uprobe latency: {}", latency.join(", "));
+            }
+            Err(e) => debug!("Failed to get hijacker uprobe stats, {:?}", e),
+        }
+    }
 }
 
 impl Drop for Hijacker {
     fn drop(&mut self) {
+        self.log_stats();
         if let Err(e) = self.ioctl.disable_hijacker() {
             error!("{:?}", e);
         }
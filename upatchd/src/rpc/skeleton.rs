@@ -23,4 +23,10 @@ pub trait Skeleton {
 
     #[rpc(name = "disable_hijack")]
     fn disable_hijack(&self, exec_path: PathBuf) -> RpcResult<()>;
+
+    #[rpc(name = "enable_hijacks")]
+    fn enable_hijacks(&self, exec_paths: Vec<PathBuf>) -> RpcResult<()>;
+
+    #[rpc(name = "disable_hijacks")]
+    fn disable_hijacks(&self, exec_paths: Vec<PathBuf>) -> RpcResult<()>;
 }
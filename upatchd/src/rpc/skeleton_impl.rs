@@ -55,4 +55,29 @@ impl Skeleton for SkeletonImpl {
                 .with_context(|| format!("Failed to unregister hijack {}", elf_path.display()))
         })
     }
+
+    fn enable_hijacks(&self, elf_paths: Vec<PathBuf>) -> RpcResult<()> {
+        RpcFunction::call(|| {
+            for elf_path in &elf_paths {
+                info!("Enable hijack: {}", elf_path.display());
+            }
+            self.hijacker
+                .register_all(&elf_paths)
+                .context("Failed to register hijacks")
+        })
+    }
+
+    fn disable_hijacks(&self, elf_paths: Vec<PathBuf>) -> RpcResult<()> {
+        RpcFunction::call(|| {
+            for elf_path in &elf_paths {
+                info!("Disable hijack: {}", elf_path.display());
+            }
+            self.hijacker
+                .unregister_all(&elf_paths)
+                .context("Failed to unregister hijacks")?;
+            self.hijacker.log_stats();
+
+            Ok(())
+        })
+    }
 }